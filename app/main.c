@@ -6,6 +6,9 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
 #include <pulse/simple.h>
 #include <pulse/error.h>
 
@@ -354,6 +357,41 @@ static void handle_events ()
 	}
 }
 
+// file the trace is dumped to, -1 if it is not traced
+static int trace_fd = -1;
+
+// dump the trace on SIGUSR1 or a crash, in which case the signal is raised again to end the program
+static void dump_trace (int sig)
+{
+	int err = errno;
+	lseek (trace_fd, 0, SEEK_SET);
+	nes_trace_dump (trace_fd);
+	errno = err;
+	if (sig != SIGUSR1)
+	{
+		signal (sig, SIG_DFL);
+		raise (sig);
+	}
+}
+
+// trace the game to be dumped to file
+static void trace_init (const char* file)
+{
+	trace_fd = open (file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace_fd < 0)
+	{
+		perror (file);
+		return;
+	}
+	nes_trace_set_enabled (1);
+	signal (SIGUSR1, dump_trace);
+	signal (SIGSEGV, dump_trace);
+	signal (SIGBUS, dump_trace);
+	signal (SIGILL, dump_trace);
+	signal (SIGFPE, dump_trace);
+	signal (SIGABRT, dump_trace);
+}
+
 #define SAMPLE_RATE 44100
 
 int main (int argc, char** argv)
@@ -371,6 +409,18 @@ int main (int argc, char** argv)
 		return 1;
 	}
 
+	// NES_TRACE names the file the trace is dumped to
+	if (getenv ("NES_TRACE") != NULL)
+		trace_init (getenv ("NES_TRACE"));
+
+	// NES_PROFILE names the file the folded call stacks of the game are written to on exit
+	const char* profile = getenv ("NES_PROFILE");
+	if (profile != NULL && nes_profile_start (0) != 0)
+	{
+		fprintf (stderr, "profiling needs the library built with PROFILE\n");
+		profile = NULL;
+	}
+
 	// run game
 	running = 1;
 	while (running)
@@ -382,6 +432,8 @@ int main (int argc, char** argv)
 	}
 
 	// deinit
+	if (profile != NULL && nes_profile_write_stacks (profile) != 0)
+		perror (profile);
 	nes_stop ();
 	quit_opengl ();
 	audio_quit ();
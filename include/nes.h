@@ -29,15 +29,31 @@ nes_controller_key;
 /**
  * nes_start resets the hardware components and loads the game @ filepath
  * but will not start execution.
+ * The file is either an iNES ROM or a zip/7z archive containing one.
  * Returns non-zero error code in case there was an error reading the file.
  */
 int nes_start (const char* /* file */) ;
 
+/**
+ * nes_start_from_memory works as nes_start but loads the game from an iNES image, or a zip/7z
+ * archive containing one, of size bytes in memory. An iNES image is used in place and not copied,
+ * so it must stay valid and unmodified until nes_stop is called. This allows several processes
+ * to share one read-only image.
+ * Returns non-zero error code in case the image could not be loaded.
+ */
+int nes_start_from_memory (const void* /* data */, size_t /* size */) ;
+
 /**
  * nes_step_frame executes until an entire frame is rendered and then waits.
  */
 void nes_step_frame () ;
 
+/**
+ *  nes_reset presses the reset button of the console. The game is restarted through its reset
+ *  vector while memory and the cartridge keep their state.
+ */
+void nes_reset () ;
+
 /**
  *  Stop the current NES game running.
  */
@@ -72,6 +88,102 @@ const uint8_t* nes_screen_buffer () ;
  * nes_audio_set_sample_rate sets the desired sample rate for audio playback */
 void nes_audio_set_sample_rate (int /* rate */) ;
 
+/**
+ * nes_audio_set_enabled turns audio synthesis on or off, it is on by default.
+ * While off only what the CPU can observe is emulated: the length counters read through $4015,
+ * the frame counter IRQ and DMC sample fetches with their CPU stalls and IRQ. No samples are
+ * produced, for when audio is never played such as when running headless.
+ */
+void nes_audio_set_enabled (int /* enabled */) ;
+
+/**
+ * nes_trace_set_enabled turns the trace on or off, it is off by default.
+ * The trace records the state of the CPU, and the scanline and dot of the PPU, before each
+ * instruction in a ring buffer of the last 65536 instructions. While off it costs a test per
+ * instruction.
+ */
+void nes_trace_set_enabled (int /* enabled */) ;
+
+/**
+ * nes_trace_dump writes the trace to the file descriptor fd, to be turned into text by
+ * tools/nestrace. Only write is called, so it can be used in a signal handler on a crash.
+ * Returns non-zero if the trace could not be written.
+ */
+int nes_trace_dump (int /* fd */) ;
+
+/**
+ * nes_profile_start starts profiling the cycles the CPU spends on the code of the game, forgetting
+ * any previous profile. Every instruction is counted if sample_period is 0, otherwise the
+ * instruction running every sample_period cycles is counted for all of them.
+ * The CPU only feeds the profiler when the library is built with PROFILE, so it costs nothing
+ * otherwise. Returns non-zero if it was not.
+ */
+int nes_profile_start (int /* sample_period */) ;
+
+/**
+ * nes_profile_stop stops profiling, the profile is kept until it is started again.
+ */
+void nes_profile_stop () ;
+
+/**
+ * nes_profile_write_stacks writes the cycles spent in each call stack to file as folded stacks,
+ * one "reset;caller;callee cycles" line per stack, for flame graph tools.
+ * Subroutines are entered by JSR and interrupts and left by RTS and RTI. Code in PRG ROM is
+ * named bank:address, with the bank in 8KB, and other code by its address.
+ * Returns non-zero if the file could not be written.
+ */
+int nes_profile_write_stacks (const char* /* file */) ;
+
+/**
+ * nes_profile_write_histogram writes the cycles spent on each instruction to file, one
+ * "location cycles" line each ordered by location.
+ * Returns non-zero if the file could not be written.
+ */
+int nes_profile_write_histogram (const char* /* file */) ;
+
+/**
+ * Regions of the CPU address space counted by nes_stats.
+ */
+enum nes_stats_region
+{
+	NES_STATS_RAM,       // $0000-$1FFF
+	NES_STATS_PPU,       // $2000-$3FFF
+	NES_STATS_IO,        // $4000-$401F, APU and controllers
+	NES_STATS_EXPANSION, // $4020-$5FFF
+	NES_STATS_PRG_RAM,   // $6000-$7FFF
+	NES_STATS_PRG_ROM,   // $8000-$FFFF
+	NES_STATS_REGIONS
+};
+
+/**
+ * nes_stats is the work done by the emulator to run a frame.
+ * Ticks are of the time stamp counter of the host, or nanoseconds on hosts without one.
+ */
+struct nes_stats
+{
+	uint64_t frame;                     // number of the frame, counted from 1
+	uint64_t reads[NES_STATS_REGIONS];  // reads of the CPU outside of fetching cached instructions
+	uint64_t writes[NES_STATS_REGIONS]; // writes of the CPU
+	uint64_t read_handler_hits;         // reads taken by a handler of the CPU instead of memory
+	uint64_t write_handler_hits;        // writes taken by a handler of the CPU instead of memory
+	uint64_t rendering_dots;            // PPU dots run with rendering on
+	uint64_t sprite_checks;             // sprites checked for rendering a pixel
+	uint64_t samples;                   // audio samples rendered
+	uint64_t prg_switches;              // PRG ROM banks mapped by the mapper
+	uint64_t chr_switches;              // CHR banks mapped by the mapper
+	uint64_t cpu_ticks;                 // time spent in the CPU
+	uint64_t ppu_ticks;                 // time spent in the PPU
+	uint64_t apu_ticks;                 // time spent in the APU
+	uint64_t event_ticks;               // time spent in scheduled events of mappers
+	uint64_t frame_ticks;               // time spent in nes_step_frame
+};
+
+/**
+ * nes_stats sets stats to the work done for the last frame run by nes_step_frame.
+ * The work is only counted when the library is built with STATS, returns non-zero if it was not.
+ */
+int nes_stats (struct nes_stats* /* stats */) ;
+
 /**
  * nes_audio_samples fills buf with samples and sets size to the size in bytes
  * of the samples.
@@ -43,4 +43,38 @@ void nes_apu_step () ;
  */
 //float nes_apu_render () ;
 
+struct nes_region;
+
+/**
+ *  nes_apu_set_region sets the CPU clock rate used for sampling and the rate tables of the region.
+ */
+void nes_apu_set_region (const struct nes_region* /* region */) ;
+
+/**
+ *  nes_apu_expansion renders the sound channels of a mapper.
+ *  Instead of being stepped each CPU cycle the channels are rendered in blocks, adding their output
+ *  for n samples to the samples of the APU before these are filtered. Samples are taken each cycles
+ *  CPU cycles, and output is at the scale of the APU where a pulse channel at full volume is about
+ *  0.15.
+ */
+typedef void (*nes_apu_expansion) (float* /* samples */, int /* n */, float /* cycles */) ;
+
+/**
+ *  nes_apu_set_expansion sets the expansion sound of the mapper, NULL if it has none.
+ */
+void nes_apu_set_expansion (nes_apu_expansion /* expansion */) ;
+
+/**
+ *  nes_apu_expansion_sync renders the expansion sound up to the current sample. Mappers call it
+ *  before a write to their sound registers so the samples before the write use the old state.
+ *  Nothing is rendered while there is no audio output.
+ */
+void nes_apu_expansion_sync () ;
+
+/**
+ *  nes_apu_set_simd selects whether the channels are mixed with AVX2 when the CPU has it, which is
+ *  the default. It returns 1 if the AVX2 mixer is used.
+ */
+int nes_apu_set_simd (int /* enabled */) ;
+
 #endif // NES_APU_H_
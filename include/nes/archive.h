@@ -0,0 +1,47 @@
+/** -------------------------------------------------------------------------------------
+ *  File: archive.h
+ *  Author: ximon
+ *  Description: Extraction of iNES images from zip and 7z archives held in memory.
+ ---------------------------------------------------------------------------------------- */
+#ifndef NES_ARCHIVE_H_
+#define NES_ARCHIVE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ *  NES_ARCHIVE_MAX_SIZE is the largest entry extracted from an archive, which is well beyond the
+ *  largest iNES image. Larger entries are skipped without allocating anything for them.
+ */
+#define NES_ARCHIVE_MAX_SIZE (16 << 20)
+
+/**
+ *  nes_zip_is_archive returns non-zero if data starts with a zip local file header.
+ */
+int nes_zip_is_archive (const uint8_t* /* data */, size_t /* size */) ;
+
+/**
+ *  nes_zip_extract_rom finds the first iNES image within the zip archive in data and decompresses
+ *  it to a newly allocated buffer which is returned through rom and rom_size.
+ *  Stored and deflated entries are supported.
+ *  The caller is responsible for freeing the buffer.
+ *  Returns non-zero if no iNES image could be extracted.
+ */
+int nes_zip_extract_rom (const uint8_t* /* data */, size_t /* size */, uint8_t** /* rom */, size_t* /* rom_size */) ;
+
+/**
+ *  nes_7z_is_archive returns non-zero if data starts with the 7z signature header.
+ */
+int nes_7z_is_archive (const uint8_t* /* data */, size_t /* size */) ;
+
+/**
+ *  nes_7z_extract_rom finds the first iNES image within the 7z archive in data and decompresses
+ *  it to a newly allocated buffer which is returned through rom and rom_size.
+ *  Folders with a single LZMA, LZMA2 or copy coder are supported. Solid folders are only decoded
+ *  up to the end of the image.
+ *  The caller is responsible for freeing the buffer.
+ *  Returns non-zero if no iNES image could be extracted.
+ */
+int nes_7z_extract_rom (const uint8_t* /* data */, size_t /* size */, uint8_t** /* rom */, size_t* /* rom_size */) ;
+
+#endif // NES_ARCHIVE_H_
@@ -7,6 +7,7 @@
 #define NES_CPU_H_
 
 #include <stdint.h>
+#include <stdlib.h>
 
 #define NES_PRG_ROM_SIZE        0x8000
 #define NES_PRG_ROM_BANK_SIZE   0x4000
@@ -36,28 +37,114 @@ void nes_cpu_reset () ;
 int nes_cpu_step () ;
 
 /**
-*  Load entire PRG ROM from data source.
+ *  nes_cpu_set_clock sets the function running the rest of the hardware for a number of CPU cycles.
+ *  It is only called by the accurate core (built with ACCURATE), which runs the cycles of an
+ *  instruction as it reads and writes, otherwise the caller of nes_cpu_step runs them.
+ */
+void nes_cpu_set_clock (void (*clock) (int /* cycles */)) ;
+
+/**
+ *  Number of 8KB windows PRG ROM is mapped through at $8000-$FFFF.
+ */
+#define NES_CPU_PRG_WINDOWS 4
+
+/**
+ *  nes_cpu_set_prg_rom sets the PRG ROM of the cartridge, of size bytes. Instructions in banks of it
+ *  mapped through nes_cpu_map_prg are decoded once and cached. NULL removes the PRG ROM.
+ */
+void nes_cpu_set_prg_rom (const uint8_t* /* data */, size_t /* size */) ;
+
+/**
+ *  nes_cpu_map_prg maps the 8KB bank of PRG ROM at data in window # ($8000 + window * $2000).
+ *  Reads are made straight from the bank so it needs to stay valid while it is mapped.
+ */
+void nes_cpu_map_prg (int /* window */, const uint8_t* /* bank */) ;
+
+/**
+*  Map entire PRG ROM from data source.
 *  It expects that the data points to a memory location
 *  sufficiently large to fill PRG ROM.
 */
-void nes_cpu_load_prg_rom (void* /* data */) ;
+void nes_cpu_load_prg_rom (const void* /* data */) ;
 
 /**
- *  Load a bank of memory into PRG ROM.
+ *  Map a 16KB bank of memory into PRG ROM.
  *  Bank # is either 0 or 1;
  */
-void nes_cpu_load_prg_rom_bank (void* /* data */, int /* bank */) ;
+void nes_cpu_load_prg_rom_bank (const void* /* data */, int /* bank */) ;
+
+/**
+ *  nes_cpu_set_prg_ram sets the PRG RAM of the cartridge, of size bytes in whole 8KB banks, and maps
+ *  its first bank at $6000. It needs to stay valid until it is replaced. NULL puts back the 8KB
+ *  the CPU has of its own.
+ */
+void nes_cpu_set_prg_ram (uint8_t* /* data */, size_t /* size */) ;
+
+/* nes_cpu_map_prg_ram maps 8KB bank # of PRG RAM at $6000, banks past its size are mirrored */
+void nes_cpu_map_prg_ram (int /* bank */) ;
 
 /**
- *  nes_cpu_load_prg_ram loads data from source in PRG RAM
+ *  nes_cpu_map_prg_ram_window maps 8KB bank # of PRG RAM in window # in place of PRG ROM, where
+ *  writes the mapper does not handle are stored to it. Mapping PRG ROM in the window unmaps it.
  */
-void nes_cpu_load_prg_ram (void* /* data */) ;
+void nes_cpu_map_prg_ram_window (int /* window */, int /* bank */) ;
+
+/**
+ *  nes_cpu_load_prg_ram loads size bytes of data from the start of PRG RAM, at most as many as
+ *  PRG RAM holds.
+ */
+void nes_cpu_load_prg_ram (const void* /* data */, size_t /* size */) ;
+
+/**
+ *  nes_cpu_prg_ram returns a pointer to the start of PRG RAM, of which the bank at $6000 is the first
+ *  until the mapper switches it.
+ */
+const uint8_t* nes_cpu_prg_ram () ;
+
+/* nes_cpu_prg_ram_size returns the size of PRG RAM in bytes */
+size_t nes_cpu_prg_ram_size () ;
+
+/**
+ *  nes_cpu_prg_ram_dirty returns non-zero if PRG RAM has been written since it was last called,
+ *  in which case the written range is returned as offsets [first, last) into PRG RAM.
+ *  Calling it marks PRG RAM as clean.
+ */
+int nes_cpu_prg_ram_dirty (int* /* first */, int* /* last */) ;
 
 /**
  *  Send CPU signal.
  */
 void nes_cpu_signal (enum nes_cpu_signal sig) ;
 
+/**
+ *  Sources driving the IRQ line of the CPU.
+ *  Unlike a signal the line stays asserted until the source releases it, so an IRQ is taken as
+ *  soon as the I flag is cleared.
+ */
+enum nes_cpu_irq_source
+{
+	NES_CPU_IRQ_MAPPER        = 0x01,
+	NES_CPU_IRQ_FRAME_COUNTER = 0x02,
+};
+
+/**
+ *  nes_cpu_set_irq asserts (level != 0) or releases the IRQ line from source.
+ */
+void nes_cpu_set_irq (enum nes_cpu_irq_source /* source */, int /* level */) ;
+
+/**
+ *  nes_cpu_set_idle_skip turns detection of idle loops on or off, it is on by default.
+ *  A loop that only reads RAM or PPUSTATUS, and leaves the CPU as it found it, is stepped over
+ *  without being executed until an interrupt or the value it reads ends it.
+ */
+void nes_cpu_set_idle_skip (int /* enabled */) ;
+
+/**
+ *  nes_cpu_set_trace turns recording of executed instructions through nes_trace_record on or off.
+ *  Instructions of idle loops that are stepped over are not recorded.
+ */
+void nes_cpu_set_trace (int /* enabled */) ;
+
 /**
  * nes_cpu_stall stalls the CPU for the supplied number of cycles.
  */
@@ -76,10 +163,6 @@ uint8_t nes_cpu_read_ram (uint16_t /* address */) ;
 // TODO rename
 typedef int (*store_handler) (uint16_t address, uint8_t value) ;
 
-/**
- *  nes_cpu_add_store_handler adds a store_handler called when storing to RAM.
- */
-void nes_cpu_add_store_handler (store_handler /* handler */) ;
 
 /**
  *  typedef for read event handler.
@@ -89,10 +172,13 @@ void nes_cpu_add_store_handler (store_handler /* handler */) ;
 // TODO rename
 typedef int (*read_handler) (uint16_t address, uint8_t *value) ;
 
+struct nes_mapper;
+
 /**
- *  nes_cpu_add_read_handler adds a store_handler called when reading from RAM.
+ *  nes_cpu_set_mapper sets the mapper to handle reads and writes to the cartridge space.
+ *  NULL removes the current mapper.
  */
-void nes_cpu_add_read_handler (read_handler /* handler */) ;
+void nes_cpu_set_mapper (const struct nes_mapper* /* mapper */) ;
 
 /**
  *  Set the parameter p to a specific location in NES memory.
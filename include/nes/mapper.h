@@ -1,36 +1,113 @@
+/** -------------------------------------------------------------------------------------
+ *  File: mapper.h
+ *  Author: ximon
+ *  Description: Interface implemented by the cartridge mappers.
+ ---------------------------------------------------------------------------------------- */
 #ifndef NES_MAPPER_H_
 #define NES_MAPPER_H_
+
+#include <nes/apu.h>
 #include <stdint.h>
+#include <stdlib.h>
+
+/**
+ *  nes_mapper is the set of functions through which the CPU, PPU and the NES module talk to
+ *  the mapper of the cartridge. Exactly one mapper is active at a time and it is replaced as a
+ *  whole when another game is loaded, so nothing is left registered from the previous one.
+ *  Any function that a mapper does not need may be NULL.
+ */
+struct nes_mapper
+{
+	/* name of the mapper for printing */
+	const char* name;
+
+	/**
+	 *  load hands the mapper the PRG ROM in # of 16KB banks and CHR in # of 8KB banks.
+	 *  Returns non-zero if the mapper does not support the cartridge.
+	 */
+	int (*load) (int /* # prg banks */, uint8_t* /* prg */, int /* # chr banks */, uint8_t* /* chr */) ;
+
+	/* reset puts the mapper in its power up state and maps its initial banks */
+	void (*reset) () ;
+
+	/**
+	 *  cpu_read is called on CPU reads from the cartridge space $4020-$7FFF.
+	 *  Returns non-zero if the mapper set value, otherwise RAM is read.
+	 */
+	int (*cpu_read) (uint16_t /* address */, uint8_t* /* value */) ;
+
+	/**
+	 *  cpu_write is called on CPU writes to the cartridge space $4020-$FFFF.
+	 *  Returns non-zero if the mapper handled the write, otherwise it is stored in RAM.
+	 */
+	int (*cpu_write) (uint16_t /* address */, uint8_t /* value */) ;
+
+	/* ppu_read is called when the PPU fetches from the pattern tables at $0000-$1FFF */
+	void (*ppu_read) (uint16_t /* address */) ;
+
+	/* ppu_write is called when the CPU writes to PPU memory at $0000-$3EFF through PPUDATA */
+	void (*ppu_write) (uint16_t /* address */, uint8_t /* value */) ;
+
+	/* ppu_a12 is called when PPU address line A12 rises */
+	void (*ppu_a12) () ;
+
+	/**
+	 *  ppu_scanline is called at the start of each visible scanline while rendering is enabled
+	 *  and at the start of scanline 240 when the picture is done.
+	 */
+	void (*ppu_scanline) (int /* scanline */) ;
+
+	/* ppu_register_write is called when the CPU writes to one of the PPU registers */
+	void (*ppu_register_write) (int /* register */, uint8_t /* value */) ;
+
+	/* audio renders the expansion sound of the cartridge, see nes_apu_expansion */
+	nes_apu_expansion audio;
+
+	/* destroy releases anything the mapper holds on to */
+	void (*destroy) () ;
+};
 
 // Mapper 01
-void nes_mmc1_load (
-	int /* # prg bank */, uint8_t* /* prg */,
-	int /* # chr bank */, uint8_t* /* chr */
-) ;
+extern const struct nes_mapper nes_mmc1;
 
 // Mapper 02
-void nes_uxrom_load (
-	int /* # prg bank */, uint8_t* /* prg */,
-	int /* # chr bank */, uint8_t* /* chr */
-) ;
+extern const struct nes_mapper nes_uxrom;
 
 // Mapper 03
-void nes_cnrom_load (
-	int /* # prg bank */, uint8_t* /* prg */,
-	int /* # chr bank */, uint8_t* /* chr */
-) ;
+extern const struct nes_mapper nes_cnrom;
 
 // Mapper 04
-void nes_mmc3_load (
-	int /* # prg bank */, uint8_t* /* prg */,
-	int /* # chr bank */, uint8_t* /* chr */
-) ;
+extern const struct nes_mapper nes_mmc3;
+
+// Mapper 05
+extern const struct nes_mapper nes_mmc5;
+
+// Mapper 07
+extern const struct nes_mapper nes_axrom;
 
 // Mapper 09
-void nes_mmc2_load (
-	int /* # prg bank */, uint8_t* /* prg */,
-	int /* # chr bank */, uint8_t* /* chr */
-) ;
+extern const struct nes_mapper nes_mmc2;
 
-#endif // NES_MAPPER_H_
+// Mapper 11
+extern const struct nes_mapper nes_color_dreams;
+
+// Mapper 19
+extern const struct nes_mapper nes_n163;
 
+// Mappers 21, 22, 23 and 25
+extern const struct nes_mapper nes_vrc4_21;
+extern const struct nes_mapper nes_vrc2_22;
+extern const struct nes_mapper nes_vrc4_23;
+extern const struct nes_mapper nes_vrc4_25;
+
+// Mappers 24 and 26
+extern const struct nes_mapper nes_vrc6a;
+extern const struct nes_mapper nes_vrc6b;
+
+// Mapper 66
+extern const struct nes_mapper nes_gxrom;
+
+// Mapper 69
+extern const struct nes_mapper nes_fme7;
+
+#endif // NES_MAPPER_H_
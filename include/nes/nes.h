@@ -1,10 +1,38 @@
 #ifndef _NES_H_
 #define _NES_H_
 
+#include <stdint.h>
+
+struct nes_region;
+
+/**
+ * nes_cycles returns the number of CPU cycles run since the game was started.
+ */
+uint64_t nes_cycles () ;
+
+/**
+ * nes_current_region returns the timing of the console the game is run on, which is selected
+ * before the mapper is loaded.
+ */
+const struct nes_region* nes_current_region () ;
+
+/**
+ * nes_event is a function called by the scheduler when an event is due.
+ */
+typedef void (*nes_event) () ;
+
+/**
+ * nes_schedule schedules event to be called once cycles CPU cycles from now. An event is
+ * identified by its function, scheduling it again replaces the previous time.
+ * Events are run between CPU instructions, so they might be late by the cycles of one instruction.
+ * This lets hardware such as mapper IRQ counters compute when they are due instead of being
+ * stepped each cycle.
+ */
+void nes_schedule (nes_event /* event */, int /* cycles */) ;
+
 /**
- * nes_step_callback registers a callback to be called each time we step the CPU.
- * This can be used to step the mapper if needed.
+ * nes_unschedule removes event from the scheduler if it is scheduled.
  */
-void nes_step_callback (void (*cb) ()) ;
+void nes_unschedule (nes_event /* event */) ;
 
 #endif /* _NES_H_ */
@@ -74,14 +74,59 @@ void nes_ppu_reset ();
 void nes_ppu_load_vram (void* /* data */) ;
 
 /**
- *  nes_ppu_load_chr_rom will copy data to the PPU CHR ROM.
+ *  Number of 1KB windows CHR is mapped through at $0000-$1FFF.
+ */
+#define NES_PPU_CHR_WINDOWS 8
+
+/**
+ *  nes_ppu_map_chr maps the 1KB bank of CHR at data in window # ($0000 + window * $400).
+ *  Pattern fetches are made straight from the bank so it needs to stay valid while it is mapped.
+ */
+void nes_ppu_map_chr (int /* window */, uint8_t* /* bank */) ;
+
+struct nes_mapper;
+
+/**
+ *  nes_ppu_set_mapper sets the mapper to notify of accesses to PPU memory.
+ *  NULL removes the current mapper.
+ */
+void nes_ppu_set_mapper (const struct nes_mapper* /* mapper */) ;
+
+/**
+ *  nes_ppu_map_sprite_chr maps the 1KB bank of CHR at data in window # for sprite patterns only,
+ *  for mappers that keep separate banks for sprites. nes_ppu_map_chr maps both.
+ */
+void nes_ppu_map_sprite_chr (int /* window */, uint8_t* /* bank */) ;
+
+struct nes_region;
+
+/**
+ *  nes_ppu_set_region sets the frame timing, scanlines per frame and start of vertical blank.
+ */
+void nes_ppu_set_region (const struct nes_region* /* region */) ;
+
+/**
+ *  nes_ppu_map_nametable maps the 1KB page at nametable # ($2000 + nametable * $400).
+ *  Writes to the nametable are dropped unless it is writable.
+ */
+void nes_ppu_map_nametable (int /* nametable */, uint8_t* /* page */, int /* writable */) ;
+
+/**
+ *  nes_ppu_ciram returns a pointer to the 1KB page # of nametable RAM, where pages 2 and 3 are
+ *  used for four screen mirroring.
+ */
+uint8_t* nes_ppu_ciram (int /* page */) ;
+
+/**
+ *  nes_ppu_load_chr_rom maps 8KB of CHR at data over the pattern tables.
  */
 void nes_ppu_load_chr_rom (void* /* data */) ;
 
 /**
- *  nes_ppu_switch_chr_rom_bank switches which CHR ROM bank is loaded @ bank 0/1.
+ *  nes_ppu_set_chr_ram flags whether the cartridge has writable CHR RAM. When it does not,
+ *  writes to the pattern tables are dropped, as they would be by CHR ROM.
  */
-void nes_ppu_switch_chr_rom_bank (int /* bank */, int /* chr_bank */) ;
+void nes_ppu_set_chr_ram (int /* enabled */) ;
 
 /**
  *  nes_ppu_set_mirroring sets the mirroring mode in the nametables.
@@ -103,38 +148,24 @@ void nes_ppu_register_write (nes_ppu_register /* reg */, uint8_t /* value */) ;
 uint8_t nes_ppu_register_read (nes_ppu_register /* reg */) ;
 
 /**
- *  Load data into the PPUs OAM data.
- */
-void nes_ppu_load_oam_data (void* /* data */);
-
-/**
- * nes_ppu_chr_reader defines a function type that takes an address and returns it's corresponding
- * value within the CHR ROM.
+ *  nes_ppu_status returns the value a read from PPUSTATUS would return, without the side effects
+ *  of reading it.
  */
-typedef uint8_t (*nes_ppu_chr_reader) (uint16_t /* address */) ;
+uint8_t nes_ppu_status () ;
 
 /**
- * nes_ppu_set_chr_read is used to override default functionality reading CHR ROM which would be loaded
- * data into VRAM.
- * Mappers are to use this to make sure the PPU gets correct CHR data.
- */
-void nes_ppu_set_chr_read (nes_ppu_chr_reader /* reader */) ;
-
-/**
- * nes_ppu_chr_writer defines a function type that takes an address, a value and stores it to CHR ROM.
+ *  Load data into the PPUs OAM data.
  */
-typedef void (*nes_ppu_chr_writer) (uint16_t /* address */, uint8_t /* value */) ;
+void nes_ppu_load_oam_data (void* /* data */);
 
 /**
- * nes_ppu_set_chr_writer is used to override the default functionality of writing CHR data to the VRAM and
- * instead to custom locations.
- * Mappers are to use this to better handle CHR data for the PPU.
+ * nes_ppu_loopy_v returns the value of loopy V register.
  */
-void nes_ppu_set_chr_writer (nes_ppu_chr_writer /* writer */) ;
+uint16_t nes_ppu_loopy_v () ;
 
 /**
- * nes_ppu_loopy_v returns the value of loopy V register.
+ * nes_ppu_position returns the scanline and dot the PPU is at, where the pre-render scanline is -1.
  */
-uint16_t nes_ppu_loopy_v () ;
+void nes_ppu_position (int* /* scanline */, int* /* dot */) ;
 
 #endif
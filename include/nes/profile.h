@@ -0,0 +1,33 @@
+/** -------------------------------------------------------------------------------------
+ *  File: profile.h
+ *  Author: ximon
+ *  Description: Profiler of the cycles the CPU spends on the code of the game. It is only fed by
+ *               the CPU when built with PROFILE.
+ ---------------------------------------------------------------------------------------- */
+#ifndef NES_PROFILE_H_
+#define NES_PROFILE_H_
+
+#include <stdint.h>
+
+/**
+ *  Code is located by its CPU address in the low 16 bits. Code in PRG ROM also has the number of
+ *  its 8KB bank plus one in the high 16 bits, to tell apart banks mapped at the same address.
+ */
+#define NES_PROFILE_LOCATION(bank, address) ((uint32_t) ((bank) + 1) << 16 | (address))
+
+/**
+ *  nes_profile_cycles adds cycles run by the instruction at location.
+ */
+void nes_profile_cycles (uint32_t /* location */, int /* cycles */) ;
+
+/**
+ *  nes_profile_call enters the subroutine or interrupt handler at location.
+ */
+void nes_profile_call (uint32_t /* location */) ;
+
+/**
+ *  nes_profile_return returns from the current subroutine or interrupt handler.
+ */
+void nes_profile_return () ;
+
+#endif // NES_PROFILE_H_
@@ -0,0 +1,29 @@
+/** -------------------------------------------------------------------------------------
+ *  File: region.h
+ *  Author: ximon
+ *  Description: Timing of the TV systems the NES was made for.
+ ---------------------------------------------------------------------------------------- */
+#ifndef NES_REGION_H_
+#define NES_REGION_H_
+
+/**
+ *  nes_region describes the timing of a console model. The region is selected when a game is
+ *  loaded and handed to the modules, which keep the NTSC values as their defaults.
+ */
+struct nes_region
+{
+	const char* name;
+	int cpu_freq;            // CPU cycles per second
+	int ppu_cc_per_5_cpu_cc; // PPU cycles per 5 CPU cycles, 15 for 3:1 and 16 for 3.2:1
+	int scanlines;           // scanlines per frame, the last one is the pre-render scanline
+	int vblank_scanline;     // scanline at which vertical blank starts
+	int odd_frame_skip;      // odd frames are one dot shorter while rendering
+	int pal_apu;             // the APU uses the PAL rate tables
+	int quarter_frame;       // CPU cycles to the first quarter frame of the APU frame counter
+};
+
+extern const struct nes_region nes_region_ntsc;
+extern const struct nes_region nes_region_pal;
+extern const struct nes_region nes_region_dendy;
+
+#endif // NES_REGION_H_
@@ -0,0 +1,29 @@
+/** -------------------------------------------------------------------------------------
+ *  File: sram.h
+ *  Author: ximon
+ *  Description: Persistence of battery backed PRG RAM to a save file next to the ROM.
+ ---------------------------------------------------------------------------------------- */
+#ifndef NES_SRAM_H_
+#define NES_SRAM_H_
+
+/**
+ *  nes_sram_open loads PRG RAM from the save file at path, if it exists, and starts the
+ *  background thread writing changes back to it.
+ *  Returns non-zero if the save file could not be opened for writing.
+ */
+int nes_sram_open (const char* /* path */) ;
+
+/**
+ *  nes_sram_frame is called once per frame and hands PRG RAM written since the last flush to
+ *  the background thread. Flushes are rate limited so that games writing SRAM every frame do
+ *  not cause constant I/O.
+ */
+void nes_sram_frame () ;
+
+/**
+ *  nes_sram_close stops the background thread and writes any remaining changes to the save
+ *  file before closing it.
+ */
+void nes_sram_close () ;
+
+#endif // NES_SRAM_H_
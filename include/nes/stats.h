@@ -0,0 +1,71 @@
+/** -------------------------------------------------------------------------------------
+ *  File: stats.h
+ *  Author: ximon
+ *  Description: Counters of the work done by the emulator on the hot paths, compiled in when
+ *               built with STATS and otherwise empty.
+ ---------------------------------------------------------------------------------------- */
+#ifndef NES_STATS_H_
+#define NES_STATS_H_
+
+#include <nes.h>
+
+#ifdef STATS
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+/* nes_stats_current holds the counters of the frame being run */
+extern struct nes_stats nes_stats_current;
+
+/* nes_stats_ticks returns the time stamp counter of the host, or nanoseconds where there is none */
+static inline uint64_t nes_stats_ticks ()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc ();
+#else
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
+#endif
+}
+
+/**
+ *  nes_stats_end_frame keeps the counters of the frame that was run and starts on the next one.
+ */
+void nes_stats_end_frame () ;
+
+#define NES_STATS_REGION(address) \
+	((address) < 0x2000 ? NES_STATS_RAM :       \
+	 (address) < 0x4000 ? NES_STATS_PPU :       \
+	 (address) < 0x4020 ? NES_STATS_IO :        \
+	 (address) < 0x6000 ? NES_STATS_EXPANSION : \
+	 (address) < 0x8000 ? NES_STATS_PRG_RAM : NES_STATS_PRG_ROM)
+
+#define NES_STATS_COUNT(counter) (nes_stats_current.counter ++)
+
+/* NES_STATS_TIMER starts timer t, which NES_STATS_LAP adds the time since to counter and restarts */
+#define NES_STATS_TIMER(t) uint64_t t = nes_stats_ticks ()
+#define NES_STATS_LAP(counter, t)                    \
+	do                                               \
+	{                                                \
+		uint64_t now_ = nes_stats_ticks ();          \
+		nes_stats_current.counter += now_ - (t);     \
+		(t) = now_;                                  \
+	}                                                \
+	while (0)
+
+#define NES_STATS_END_FRAME() nes_stats_end_frame ()
+
+#else
+
+#define NES_STATS_COUNT(counter)
+#define NES_STATS_TIMER(t)
+#define NES_STATS_LAP(counter, t)
+#define NES_STATS_END_FRAME()
+
+#endif // STATS
+
+#endif // NES_STATS_H_
@@ -0,0 +1,49 @@
+/** -------------------------------------------------------------------------------------
+ *  File: trace.h
+ *  Author: ximon
+ *  Description: Binary trace of the instructions executed by the CPU.
+ ---------------------------------------------------------------------------------------- */
+#ifndef NES_TRACE_H_
+#define NES_TRACE_H_
+
+#include <stdint.h>
+
+/**
+ *  nes_trace_entry is the state of the CPU and PPU as an instruction is about to be executed.
+ */
+struct nes_trace_entry
+{
+	uint32_t cycle;    // CPU cycles run since the game was started, wraps
+	uint16_t pc;
+	uint8_t  opcode;
+	uint8_t  a;
+	uint8_t  x;
+	uint8_t  y;
+	uint8_t  p;
+	uint8_t  sp;
+	int16_t  scanline; // -1 is the pre-render scanline
+	uint16_t dot;
+};
+
+#define NES_TRACE_MAGIC   "NESTRACE"
+#define NES_TRACE_VERSION 1
+
+/**
+ *  nes_trace_header starts a dump of the trace. It is followed by entries, oldest first.
+ *  Everything is in the byte order of the machine that made the dump.
+ */
+struct nes_trace_header
+{
+	char     magic[8];
+	uint32_t version;
+	uint32_t entries;
+};
+
+/**
+ *  nes_trace_record is called by the CPU before each instruction it executes while tracing.
+ *  It returns the entry of the instruction with the cycle and PPU position set, for the CPU
+ *  to fill in the rest.
+ */
+struct nes_trace_entry* nes_trace_record () ;
+
+#endif // NES_TRACE_H_
@@ -0,0 +1,32 @@
+/** -------------------------------------------------------------------------------------
+ *  File: vrc.h
+ *  Author: ximon
+ *  Description: IRQ counter shared by the Konami VRC4, VRC6 and VRC7 mappers.
+ ---------------------------------------------------------------------------------------- */
+#ifndef NES_VRC_H_
+#define NES_VRC_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ *  nes_vrc_irq_reset puts the IRQ counter in its power up state.
+ */
+void nes_vrc_irq_reset () ;
+
+/**
+ *  nes_vrc_irq_write_latch sets the value the counter is reloaded with.
+ */
+void nes_vrc_irq_write_latch (uint8_t /* value */) ;
+
+/**
+ *  nes_vrc_irq_write_control writes the IRQ control register, which acknowledges a pending IRQ.
+ */
+void nes_vrc_irq_write_control (uint8_t /* value */) ;
+
+/**
+ *  nes_vrc_irq_acknowledge acknowledges a pending IRQ.
+ */
+void nes_vrc_irq_acknowledge () ;
+
+#endif // NES_VRC_H_
@@ -0,0 +1,934 @@
+#include "nes/archive.h"
+#include <stdio.h>
+#include <string.h>
+
+/* iNES file magic number */
+static const uint8_t ines_magic[4] = { 'N', 'E', 'S', 0x1A };
+
+/*
+ *  LZMA ------------------------------------------------------------------------------------------
+ */
+
+#define LZMA_PROPS_SIZE      5
+#define LZMA_NUM_STATES     12
+#define LZMA_POS_BITS_MAX    4
+#define LZMA_LEN_TO_POS      4  // number of length to position states
+#define LZMA_ALIGN_BITS      4
+#define LZMA_END_POS_MODEL  14
+#define LZMA_FULL_DISTANCES 128
+#define LZMA_MATCH_MIN_LEN   2
+#define LZMA_PROB_INIT      (1 << 10)
+
+#define RC_TOP_VALUE   (1 << 24)
+#define RC_MODEL_BITS  11
+#define RC_MOVE_BITS   5
+
+typedef uint16_t prob;
+
+/* lzma_len_decoder decodes match lengths */
+struct lzma_len_decoder
+{
+	prob choice;
+	prob choice2;
+	prob low[1 << LZMA_POS_BITS_MAX][1 << 3];
+	prob mid[1 << LZMA_POS_BITS_MAX][1 << 3];
+	prob high[1 << 8];
+};
+
+/* lzma_dec is the state of an LZMA decoder writing into a flat buffer, which also acts as the dictionary */
+struct lzma_dec
+{
+	// range decoder
+	const uint8_t* in;
+	size_t         in_size;
+	size_t         in_pos;
+	uint32_t       range;
+	uint32_t       code;
+
+	// output
+	uint8_t*       out;
+	size_t         out_size;
+	size_t         out_pos;
+
+	// properties
+	int            lc, lp, pb;
+
+	// model
+	uint32_t       state;
+	uint32_t       rep[4];
+	prob*          literal;
+	prob           is_match[LZMA_NUM_STATES << LZMA_POS_BITS_MAX];
+	prob           is_rep[LZMA_NUM_STATES];
+	prob           is_rep_g0[LZMA_NUM_STATES];
+	prob           is_rep_g1[LZMA_NUM_STATES];
+	prob           is_rep_g2[LZMA_NUM_STATES];
+	prob           is_rep0_long[LZMA_NUM_STATES << LZMA_POS_BITS_MAX];
+	prob           pos_slot[LZMA_LEN_TO_POS][1 << 6];
+	prob           pos[1 + LZMA_FULL_DISTANCES - LZMA_END_POS_MODEL];
+	prob           align[1 << LZMA_ALIGN_BITS];
+	struct lzma_len_decoder len;
+	struct lzma_len_decoder rep_len;
+
+	int            error;
+};
+
+/* rc_byte returns the next input byte of the range decoder */
+static inline uint8_t rc_byte (struct lzma_dec* d)
+{
+	if (d->in_pos == d->in_size)
+	{
+		d->error = 1;
+		return 0;
+	}
+	return d->in[d->in_pos ++];
+}
+
+/* rc_init initializes the range decoder from the next five input bytes */
+static void rc_init (struct lzma_dec* d)
+{
+	if (rc_byte (d) != 0)
+		d->error = 1;
+	d->range = 0xFFFFFFFF;
+	d->code = 0;
+	for (int i = 0; i < 4; i ++)
+		d->code = (d->code << 8) | rc_byte (d);
+	if (d->code == d->range)
+		d->error = 1;
+}
+
+static inline void rc_normalize (struct lzma_dec* d)
+{
+	if (d->range < RC_TOP_VALUE)
+	{
+		d->range <<= 8;
+		d->code = (d->code << 8) | rc_byte (d);
+	}
+}
+
+/* rc_bit decodes one bit using the adaptive probability p */
+static inline int rc_bit (struct lzma_dec* d, prob* p)
+{
+	int bit;
+	uint32_t bound = (d->range >> RC_MODEL_BITS) * *p;
+	if (d->code < bound)
+	{
+		*p += ((1 << RC_MODEL_BITS) - *p) >> RC_MOVE_BITS;
+		d->range = bound;
+		bit = 0;
+	}
+	else
+	{
+		*p -= *p >> RC_MOVE_BITS;
+		d->code -= bound;
+		d->range -= bound;
+		bit = 1;
+	}
+	rc_normalize (d);
+	return bit;
+}
+
+/* rc_direct decodes n bits with fixed probability */
+static uint32_t rc_direct (struct lzma_dec* d, int n)
+{
+	uint32_t res = 0;
+	while (n --)
+	{
+		d->range >>= 1;
+		d->code -= d->range;
+		uint32_t t = 0 - (d->code >> 31);
+		d->code += d->range & t;
+		rc_normalize (d);
+		res = (res << 1) + (t + 1);
+	}
+	return res;
+}
+
+/* bit_tree decodes an n bit symbol MSB first */
+static uint32_t bit_tree (struct lzma_dec* d, prob* probs, int n)
+{
+	uint32_t m = 1;
+	for (int i = 0; i < n; i ++)
+		m = (m << 1) + rc_bit (d, probs + m);
+	return m - (1 << n);
+}
+
+/* bit_tree_reverse decodes an n bit symbol LSB first */
+static uint32_t bit_tree_reverse (struct lzma_dec* d, prob* probs, int n)
+{
+	uint32_t m = 1, symbol = 0;
+	for (int i = 0; i < n; i ++)
+	{
+		int bit = rc_bit (d, probs + m);
+		m = (m << 1) + bit;
+		symbol |= bit << i;
+	}
+	return symbol;
+}
+
+static void prob_init (prob* p, size_t n)
+{
+	while (n --)
+		*p ++ = LZMA_PROB_INIT;
+}
+
+static void len_decoder_init (struct lzma_len_decoder* len)
+{
+	prob_init ((prob*) len, sizeof (*len) / sizeof (prob));
+}
+
+static uint32_t len_decode (struct lzma_dec* d, struct lzma_len_decoder* len, int pos_state)
+{
+	if (rc_bit (d, &len->choice) == 0)
+		return bit_tree (d, len->low[pos_state], 3);
+	if (rc_bit (d, &len->choice2) == 0)
+		return 8 + bit_tree (d, len->mid[pos_state], 3);
+	return 16 + bit_tree (d, len->high, 8);
+}
+
+/* lzma_set_props sets lc, lp and pb from the properties byte */
+static int lzma_set_props (struct lzma_dec* d, uint8_t props)
+{
+	if (props >= 9 * 5 * 5)
+		return 1;
+	d->lc = props % 9;
+	props /= 9;
+	d->lp = props % 5;
+	d->pb = props / 5;
+
+	free (d->literal);
+	d->literal = malloc ((0x300 << (d->lc + d->lp)) * sizeof (prob));
+	return d->literal == NULL;
+}
+
+/* lzma_reset_state resets the model's probabilities and state */
+static void lzma_reset_state (struct lzma_dec* d)
+{
+	prob_init (d->literal, 0x300 << (d->lc + d->lp));
+	prob_init (d->is_match, sizeof (d->is_match) / sizeof (prob));
+	prob_init (d->is_rep, LZMA_NUM_STATES);
+	prob_init (d->is_rep_g0, LZMA_NUM_STATES);
+	prob_init (d->is_rep_g1, LZMA_NUM_STATES);
+	prob_init (d->is_rep_g2, LZMA_NUM_STATES);
+	prob_init (d->is_rep0_long, sizeof (d->is_rep0_long) / sizeof (prob));
+	prob_init ((prob*) d->pos_slot, sizeof (d->pos_slot) / sizeof (prob));
+	prob_init (d->pos, sizeof (d->pos) / sizeof (prob));
+	prob_init (d->align, sizeof (d->align) / sizeof (prob));
+	len_decoder_init (&d->len);
+	len_decoder_init (&d->rep_len);
+	d->state = 0;
+	d->rep[0] = d->rep[1] = d->rep[2] = d->rep[3] = 0;
+}
+
+/* lzma_literal decodes the next literal byte */
+static void lzma_literal (struct lzma_dec* d)
+{
+	uint8_t prev = d->out_pos ? d->out[d->out_pos - 1] : 0;
+	uint32_t lit_state = ((d->out_pos & ((1 << d->lp) - 1)) << d->lc) + (prev >> (8 - d->lc));
+	prob* probs = d->literal + 0x300 * lit_state;
+
+	uint32_t symbol = 1;
+	if (d->state >= 7)
+	{
+		// decode using the byte at the last match distance
+		uint32_t match = d->out[d->out_pos - d->rep[0] - 1];
+		do
+		{
+			uint32_t match_bit = (match >> 7) & 1;
+			match <<= 1;
+			int bit = rc_bit (d, probs + ((1 + match_bit) << 8) + symbol);
+			symbol = (symbol << 1) | bit;
+			if (match_bit != bit)
+				break;
+		}
+		while (symbol < 0x100);
+	}
+	while (symbol < 0x100)
+		symbol = (symbol << 1) | rc_bit (d, probs + symbol);
+	d->out[d->out_pos ++] = symbol;
+}
+
+/* lzma_distance decodes a match distance for a match of length len */
+static uint32_t lzma_distance (struct lzma_dec* d, uint32_t len)
+{
+	uint32_t len_state = len < LZMA_LEN_TO_POS - 1 ? len : LZMA_LEN_TO_POS - 1;
+	uint32_t slot = bit_tree (d, d->pos_slot[len_state], 6);
+	if (slot < 4)
+		return slot;
+
+	int direct = (slot >> 1) - 1;
+	uint32_t dist = (2 | (slot & 1)) << direct;
+	if (slot < LZMA_END_POS_MODEL)
+		dist += bit_tree_reverse (d, d->pos + dist - slot, direct);
+	else
+	{
+		dist += rc_direct (d, direct - LZMA_ALIGN_BITS) << LZMA_ALIGN_BITS;
+		dist += bit_tree_reverse (d, d->align, LZMA_ALIGN_BITS);
+	}
+	return dist;
+}
+
+/**
+ *  lzma_decode decodes until limit bytes have been written to the output or the end marker is found.
+ *  Returns non-zero on corrupt data.
+ */
+static int lzma_decode (struct lzma_dec* d, size_t limit)
+{
+	int pb_mask = (1 << d->pb) - 1;
+	while (d->out_pos < limit && !d->error)
+	{
+		int pos_state = d->out_pos & pb_mask;
+		uint32_t state = d->state;
+
+		if (rc_bit (d, d->is_match + (state << LZMA_POS_BITS_MAX) + pos_state) == 0)
+		{
+			lzma_literal (d);
+			d->state = state < 4 ? 0 : (state < 10 ? state - 3 : state - 6);
+			continue;
+		}
+
+		uint32_t len;
+		if (rc_bit (d, d->is_rep + state))
+		{
+			if (d->out_pos == 0)
+				return 1;
+			if (rc_bit (d, d->is_rep_g0 + state) == 0)
+			{
+				if (rc_bit (d, d->is_rep0_long + (state << LZMA_POS_BITS_MAX) + pos_state) == 0)
+				{
+					// short rep - a single byte at the last distance
+					d->state = state < 7 ? 9 : 11;
+					d->out[d->out_pos] = d->out[d->out_pos - d->rep[0] - 1];
+					d->out_pos ++;
+					continue;
+				}
+			}
+			else
+			{
+				uint32_t dist;
+				if (rc_bit (d, d->is_rep_g1 + state) == 0)
+					dist = d->rep[1];
+				else
+				{
+					if (rc_bit (d, d->is_rep_g2 + state) == 0)
+						dist = d->rep[2];
+					else
+					{
+						dist = d->rep[3];
+						d->rep[3] = d->rep[2];
+					}
+					d->rep[2] = d->rep[1];
+				}
+				d->rep[1] = d->rep[0];
+				d->rep[0] = dist;
+			}
+			len = len_decode (d, &d->rep_len, pos_state);
+			d->state = state < 7 ? 8 : 11;
+		}
+		else
+		{
+			d->rep[3] = d->rep[2];
+			d->rep[2] = d->rep[1];
+			d->rep[1] = d->rep[0];
+			len = len_decode (d, &d->len, pos_state);
+			d->state = state < 7 ? 7 : 10;
+			d->rep[0] = lzma_distance (d, len);
+			if (d->rep[0] == 0xFFFFFFFF) // end marker
+				return d->error;
+		}
+
+		len += LZMA_MATCH_MIN_LEN;
+		if (d->rep[0] >= d->out_pos || d->out_pos + len > d->out_size)
+			return 1;
+		for (; len; len --, d->out_pos ++)
+			d->out[d->out_pos] = d->out[d->out_pos - d->rep[0] - 1];
+	}
+	return d->error;
+}
+
+/* lzma_decoder_init prepares d to decode the stream in into out */
+static void lzma_decoder_init (struct lzma_dec* d, const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size)
+{
+	memset (d, 0, sizeof (*d));
+	d->in = in;
+	d->in_size = in_size;
+	d->out = out;
+	d->out_size = out_size;
+}
+
+/*
+ *  LZMA2 -----------------------------------------------------------------------------------------
+ */
+
+/* lzma2_decode decodes LZMA2 chunks until limit bytes have been written or the end of stream is found. */
+static int lzma2_decode (struct lzma_dec* d, size_t limit)
+{
+	while (d->out_pos < limit)
+	{
+		if (d->in_pos == d->in_size)
+			return 1;
+		uint8_t control = d->in[d->in_pos ++];
+		if (control == 0) // end of stream
+			return d->out_pos != limit;
+
+		if (control < 0x80) // uncompressed chunk
+		{
+			if (control > 2 || d->in_pos + 2 > d->in_size)
+				return 1;
+			size_t n = ((d->in[d->in_pos] << 8) | d->in[d->in_pos + 1]) + 1;
+			d->in_pos += 2;
+			if (d->in_pos + n > d->in_size || d->out_pos + n > d->out_size)
+				return 1;
+			memcpy (d->out + d->out_pos, d->in + d->in_pos, n);
+			d->in_pos += n;
+			d->out_pos += n;
+			continue;
+		}
+
+		// LZMA chunk
+		if (d->in_pos + 4 > d->in_size)
+			return 1;
+		size_t unpacked = (((control & 0x1F) << 16) | (d->in[d->in_pos] << 8) | d->in[d->in_pos + 1]) + 1;
+		size_t packed = ((d->in[d->in_pos + 2] << 8) | d->in[d->in_pos + 3]) + 1;
+		d->in_pos += 4;
+
+		int reset = (control >> 5) & 3;
+		if (reset >= 2) // new properties
+		{
+			if (d->in_pos == d->in_size || lzma_set_props (d, d->in[d->in_pos ++]) != 0)
+				return 1;
+			if (d->lc + d->lp > 4)
+				return 1;
+		}
+		else if (!d->literal)
+			return 1;
+		if (reset >= 1)
+			lzma_reset_state (d);
+
+		// the range decoder is restarted for each chunk and reads exactly packed bytes
+		if (d->in_pos + packed > d->in_size || d->out_pos + unpacked > d->out_size)
+			return 1;
+		const uint8_t* in = d->in;
+		size_t in_size = d->in_size;
+		size_t end = d->in_pos + packed;
+		d->in_size = end;
+		rc_init (d);
+		int err = lzma_decode (d, d->out_pos + unpacked);
+		d->in = in;
+		d->in_size = in_size;
+		d->in_pos = end;
+		if (err)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ *  7Z --------------------------------------------------------------------------------------------
+ */
+
+#define SIGNATURE_HEADER_SIZE 32
+
+/* property IDs */
+enum
+{
+	k_end                = 0x00,
+	k_header             = 0x01,
+	k_archive_properties = 0x02,
+	k_additional_streams = 0x03,
+	k_main_streams_info  = 0x04,
+	k_files_info         = 0x05,
+	k_pack_info          = 0x06,
+	k_unpack_info        = 0x07,
+	k_substreams_info    = 0x08,
+	k_size               = 0x09,
+	k_crc                = 0x0A,
+	k_folder             = 0x0B,
+	k_coders_unpack_size = 0x0C,
+	k_num_unpack_stream  = 0x0D,
+	k_encoded_header     = 0x17,
+};
+
+/* coder methods */
+#define METHOD_COPY  0x00
+#define METHOD_LZMA2 0x21
+#define METHOD_LZMA  0x030101
+
+#define MAX_FOLDERS  256
+#define MAX_PROPS      8
+
+/* folder is a single coder solid block of one or more files */
+struct folder
+{
+	uint32_t method;
+	uint8_t  props[MAX_PROPS];
+	int      n_props;
+	uint64_t pack_offset;   // offset of the packed stream in the archive
+	uint64_t pack_size;
+	uint64_t unpack_size;
+	uint64_t n_substreams;
+};
+
+/* streams_info contains the parsed description of the streams within an archive */
+struct streams_info
+{
+	uint64_t      pack_pos;
+	int           n_pack_streams;
+	int           n_folders;
+	struct folder folders[MAX_FOLDERS];
+	uint64_t*     substream_sizes; // size of each substream over all folders
+	size_t        n_substreams;
+};
+
+/* reader reads through the archive's header */
+struct reader
+{
+	const uint8_t* p;
+	const uint8_t* end;
+	int            error;
+};
+
+static uint8_t read_byte (struct reader* r)
+{
+	if (r->p >= r->end)
+	{
+		r->error = 1;
+		return 0;
+	}
+	return *r->p ++;
+}
+
+/* read_number reads a 7z variable length encoded number */
+static uint64_t read_number (struct reader* r)
+{
+	uint8_t first = read_byte (r);
+	uint8_t mask = 0x80;
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i ++)
+	{
+		if ((first & mask) == 0)
+		{
+			uint64_t high = first & (mask - 1);
+			return value | (high << (8 * i));
+		}
+		value |= (uint64_t) read_byte (r) << (8 * i);
+		mask >>= 1;
+	}
+	return value;
+}
+
+static void skip (struct reader* r, uint64_t n)
+{
+	if (n > (uint64_t) (r->end - r->p))
+	{
+		r->error = 1;
+		r->p = r->end;
+	}
+	else
+		r->p += n;
+}
+
+/* skip_digests skips over a list of n CRC digests */
+static void skip_digests (struct reader* r, uint64_t n)
+{
+	uint64_t defined = n;
+	if (read_byte (r) == 0) // not all are defined, count the bits that are
+	{
+		defined = 0;
+		uint8_t byte = 0;
+		for (uint64_t i = 0; i < n; i ++)
+		{
+			if ((i & 7) == 0)
+				byte = read_byte (r);
+			defined += (byte >> (7 - (i & 7))) & 1;
+		}
+	}
+	skip (r, defined * 4);
+}
+
+static int read_pack_info (struct reader* r, struct streams_info* si)
+{
+	si->pack_pos = read_number (r);
+	si->n_pack_streams = read_number (r);
+	if (si->n_pack_streams > MAX_FOLDERS)
+		return 1;
+
+	uint8_t id;
+	while ((id = read_byte (r)) != k_end && !r->error)
+	{
+		if (id == k_size)
+		{
+			uint64_t offset = si->pack_pos;
+			for (int i = 0; i < si->n_pack_streams; i ++)
+			{
+				si->folders[i].pack_offset = SIGNATURE_HEADER_SIZE + offset;
+				si->folders[i].pack_size = read_number (r);
+				offset += si->folders[i].pack_size;
+			}
+		}
+		else if (id == k_crc)
+			skip_digests (r, si->n_pack_streams);
+		else
+			return 1;
+	}
+	return r->error;
+}
+
+static int read_folder (struct reader* r, struct folder* f)
+{
+	if (read_number (r) != 1) // number of coders
+	{
+		fprintf (stderr, "7z: only single coder folders are supported\n");
+		return 1;
+	}
+
+	uint8_t flags = read_byte (r);
+	int id_size = flags & 0xF;
+	if ((flags & 0x10) || (flags & 0x80) || id_size > 4) // complex coder or alternative methods
+		return 1;
+	f->method = 0;
+	for (int i = 0; i < id_size; i ++)
+		f->method = (f->method << 8) | read_byte (r);
+
+	f->n_props = 0;
+	if (flags & 0x20)
+	{
+		uint64_t n = read_number (r);
+		if (n > MAX_PROPS)
+			return 1;
+		f->n_props = n;
+		for (int i = 0; i < f->n_props; i ++)
+			f->props[i] = read_byte (r);
+	}
+	f->n_substreams = 1;
+	return r->error;
+}
+
+static int read_unpack_info (struct reader* r, struct streams_info* si)
+{
+	if (read_byte (r) != k_folder)
+		return 1;
+	si->n_folders = read_number (r);
+	if (si->n_folders > si->n_pack_streams || read_byte (r) != 0) // external
+		return 1;
+
+	for (int i = 0; i < si->n_folders; i ++)
+		if (read_folder (r, si->folders + i) != 0)
+			return 1;
+
+	if (read_byte (r) != k_coders_unpack_size)
+		return 1;
+	for (int i = 0; i < si->n_folders; i ++)
+		si->folders[i].unpack_size = read_number (r);
+
+	uint8_t id;
+	while ((id = read_byte (r)) != k_end && !r->error)
+	{
+		if (id == k_crc)
+			skip_digests (r, si->n_folders);
+		else
+			return 1;
+	}
+	return r->error;
+}
+
+static int read_substreams_info (struct reader* r, struct streams_info* si)
+{
+	uint8_t id = read_byte (r);
+	if (id == k_num_unpack_stream)
+	{
+		for (int i = 0; i < si->n_folders; i ++)
+			si->folders[i].n_substreams = read_number (r);
+		id = read_byte (r);
+	}
+
+	si->n_substreams = 0;
+	for (int i = 0; i < si->n_folders; i ++)
+		si->n_substreams += si->folders[i].n_substreams;
+	if (r->error || si->n_substreams > (size_t) (r->end - r->p) + si->n_folders)
+		return 1;
+	si->substream_sizes = calloc (si->n_substreams + 1, sizeof (uint64_t));
+
+	// all but the last size of each folder are listed, the last is the remainder of the folder
+	size_t k = 0;
+	for (int i = 0; i < si->n_folders; i ++)
+	{
+		struct folder* f = si->folders + i;
+		if (f->n_substreams == 0)
+			continue;
+		uint64_t sum = 0;
+		for (uint64_t j = 1; j < f->n_substreams; j ++)
+		{
+			uint64_t size = id == k_size ? read_number (r) : 0;
+			si->substream_sizes[k ++] = size;
+			sum += size;
+		}
+		if (sum > f->unpack_size)
+			return 1;
+		si->substream_sizes[k ++] = f->unpack_size - sum;
+	}
+	if (id == k_size)
+		id = read_byte (r);
+
+	while (id != k_end && !r->error)
+	{
+		if (id == k_crc)
+		{
+			// CRCs are listed for substreams of folders with more than one substream
+			uint64_t n = 0;
+			for (int i = 0; i < si->n_folders; i ++)
+				if (si->folders[i].n_substreams != 1)
+					n += si->folders[i].n_substreams;
+			skip_digests (r, n);
+		}
+		else
+			return 1;
+		id = read_byte (r);
+	}
+	return r->error;
+}
+
+static int read_streams_info (struct reader* r, struct streams_info* si)
+{
+	memset (si, 0, sizeof (*si));
+	uint8_t id = read_byte (r);
+	if (id == k_pack_info)
+	{
+		if (read_pack_info (r, si) != 0)
+			return 1;
+		id = read_byte (r);
+	}
+	if (id == k_unpack_info)
+	{
+		if (read_unpack_info (r, si) != 0)
+			return 1;
+		id = read_byte (r);
+	}
+	if (id == k_substreams_info)
+	{
+		if (read_substreams_info (r, si) != 0)
+			return 1;
+		id = read_byte (r);
+	}
+	else if (si->n_folders)
+	{
+		// each folder holds exactly one stream
+		si->n_substreams = si->n_folders;
+		si->substream_sizes = calloc (si->n_substreams, sizeof (uint64_t));
+		for (int i = 0; i < si->n_folders; i ++)
+			si->substream_sizes[i] = si->folders[i].unpack_size;
+	}
+	return id != k_end || r->error;
+}
+
+/**
+ *  folder_dec decodes a folder incrementally so that a solid folder can be decoded
+ *  just as far as needed.
+ */
+struct folder_dec
+{
+	const struct folder* folder;
+	struct lzma_dec      lzma;
+	size_t               capacity; // allocated size of the output
+};
+
+/* LZMA2 decodes whole chunks, which can run this far past the limit */
+#define LZMA2_MAX_CHUNK (1 << 21)
+
+static int folder_dec_init (struct folder_dec* fd, const struct folder* f, const uint8_t* data, size_t size)
+{
+	if (f->pack_offset + f->pack_size > size || f->unpack_size > (1u << 31))
+		return 1;
+	fd->folder = f;
+	// the output is allocated as it is decoded, the unpack size can not be trusted
+	lzma_decoder_init (&fd->lzma, data + f->pack_offset, f->pack_size, NULL, f->unpack_size);
+	fd->capacity = 0;
+
+	switch (f->method)
+	{
+	case METHOD_COPY:
+		return f->pack_size != f->unpack_size;
+	case METHOD_LZMA:
+		// properties byte followed by the dictionary size which is implied by the output buffer
+		if (f->n_props != LZMA_PROPS_SIZE || lzma_set_props (&fd->lzma, f->props[0]) != 0)
+			return 1;
+		lzma_reset_state (&fd->lzma);
+		rc_init (&fd->lzma);
+		return fd->lzma.error;
+	case METHOD_LZMA2:
+		return f->n_props != 1;
+	default:
+		fprintf (stderr, "7z: unsupported coder %06X\n", f->method);
+		return 1;
+	}
+}
+
+/* folder_dec_run decodes the folder up to limit bytes */
+static int folder_dec_run (struct folder_dec* fd, size_t limit)
+{
+	struct lzma_dec* d = &fd->lzma;
+	if (limit <= d->out_pos)
+		return 0;
+	if (limit > d->out_size)
+		return 1;
+
+	size_t capacity = d->out_size - limit > LZMA2_MAX_CHUNK ? limit + LZMA2_MAX_CHUNK : d->out_size;
+	if (capacity > fd->capacity)
+	{
+		uint8_t* out = realloc (d->out, capacity ? capacity : 1);
+		if (!out)
+			return 1;
+		d->out = out;
+		fd->capacity = capacity;
+	}
+
+	switch (fd->folder->method)
+	{
+	case METHOD_COPY:
+		memcpy (d->out + d->out_pos, d->in + d->out_pos, limit - d->out_pos);
+		d->out_pos = limit;
+		return 0;
+	case METHOD_LZMA:
+		return lzma_decode (d, limit) || d->out_pos < limit;
+	case METHOD_LZMA2:
+		return lzma2_decode (d, limit) || d->out_pos < limit;
+	}
+	return 1;
+}
+
+static void folder_dec_free (struct folder_dec* fd)
+{
+	free (fd->lzma.out);
+	free (fd->lzma.literal);
+}
+
+/* decode_header decodes an encoded header, which is stored as the first stream of a folder */
+static uint8_t* decode_header (struct reader* r, const uint8_t* data, size_t size, size_t* header_size)
+{
+	struct streams_info si;
+	struct folder_dec fd = { 0 };
+	uint8_t* out = NULL;
+
+	if (read_streams_info (r, &si) != 0 || si.n_folders < 1 ||
+		si.folders[0].unpack_size > NES_ARCHIVE_MAX_SIZE)
+		goto end;
+	if (folder_dec_init (&fd, si.folders, data, size) != 0 ||
+		folder_dec_run (&fd, si.folders[0].unpack_size) != 0)
+	{
+		folder_dec_free (&fd);
+		goto end;
+	}
+	free (fd.lzma.literal);
+	out = fd.lzma.out;
+	*header_size = si.folders[0].unpack_size;
+end:
+	free (si.substream_sizes);
+	return out;
+}
+
+int nes_7z_is_archive (const uint8_t* data, size_t size)
+{
+	static const uint8_t signature[6] = { '7', 'z', 0xBC, 0xAF, 0x27, 0x1C };
+	return size >= SIGNATURE_HEADER_SIZE && memcmp (data, signature, sizeof (signature)) == 0;
+}
+
+/* read little endian 64 bit value */
+static uint64_t le64 (const uint8_t* p)
+{
+	uint64_t v = 0;
+	for (int i = 7; i >= 0; i --)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+int nes_7z_extract_rom (const uint8_t* data, size_t size, uint8_t** rom, size_t* rom_size)
+{
+	int ret = 1;
+	if (size < SIGNATURE_HEADER_SIZE)
+	{
+		fprintf (stderr, "7z: truncated archive\n");
+		return 1;
+	}
+	uint64_t next_offset = le64 (data + 12);
+	uint64_t next_size = le64 (data + 20);
+	if (next_offset > size - SIGNATURE_HEADER_SIZE ||
+		next_size > size - SIGNATURE_HEADER_SIZE - next_offset)
+	{
+		fprintf (stderr, "7z: truncated archive\n");
+		return 1;
+	}
+
+	struct reader r = { data + SIGNATURE_HEADER_SIZE + next_offset };
+	r.end = r.p + next_size;
+	uint8_t* header = NULL;
+	struct streams_info si = { 0 };
+
+	// the header might be compressed, possibly more than once
+	uint8_t id = read_byte (&r);
+	while (id == k_encoded_header)
+	{
+		size_t n;
+		uint8_t* decoded = decode_header (&r, data, size, &n);
+		free (header);
+		if (!(header = decoded))
+			goto end;
+		r.p = header;
+		r.end = header + n;
+		r.error = 0;
+		id = read_byte (&r);
+	}
+	if (id != k_header)
+		goto end;
+
+	id = read_byte (&r);
+	if (id == k_archive_properties || id == k_additional_streams)
+	{
+		fprintf (stderr, "7z: unsupported header properties\n");
+		goto end;
+	}
+	if (id != k_main_streams_info || read_streams_info (&r, &si) != 0)
+		goto end;
+
+	// walk through the substreams of each folder in order until an iNES image is found
+	size_t k = 0;
+	for (int i = 0; i < si.n_folders && ret; i ++)
+	{
+		struct folder* f = si.folders + i;
+		struct folder_dec fd = { 0 };
+		if (folder_dec_init (&fd, f, data, size) != 0)
+		{
+			folder_dec_free (&fd);
+			break;
+		}
+
+		uint64_t offset = 0;
+		for (uint64_t j = 0; j < f->n_substreams; j ++, k ++)
+		{
+			uint64_t n = si.substream_sizes[k];
+			if (n >= sizeof (ines_magic) && n <= NES_ARCHIVE_MAX_SIZE)
+			{
+				// check the magic before decoding the rest of the stream
+				if (folder_dec_run (&fd, offset + sizeof (ines_magic)) != 0)
+					break;
+				if (memcmp (fd.lzma.out + offset, ines_magic, sizeof (ines_magic)) == 0)
+				{
+					if (folder_dec_run (&fd, offset + n) != 0)
+						break;
+					if (!(*rom = malloc (n)))
+						break;
+					memcpy (*rom, fd.lzma.out + offset, n);
+					*rom_size = n;
+					ret = 0;
+					break;
+				}
+			}
+			offset += n;
+		}
+		folder_dec_free (&fd);
+	}
+	if (ret)
+		fprintf (stderr, "7z: no iNES image found in archive\n");
+end:
+	free (header);
+	free (si.substream_sizes);
+	return ret;
+}
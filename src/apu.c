@@ -1,16 +1,31 @@
 #include "nes/apu.h"
 #include "nes/cpu.h"
+#include "nes/region.h"
+#include "nes/stats.h"
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MIX_AVX2
+#endif
 
-/* apucc represents the APU clock cycles */
+/* apucc is the parity of the CPU cycle, the APU is clocked on even cycles */
 static int apucc;
 
 /* frame contains which frame in the frame counter we are currently at */
 static int frame;
 
+/* frame_cycle is the number of CPU cycles since the frame counter sequence started */
+static int frame_cycle;
+
+/* frame_irq is the frame interrupt flag */
+static int frame_irq;
+
+/* audio_enabled is cleared when only what is observable by the CPU is emulated */
+static int audio_enabled = 1;
+
 /* APU registers */
 static uint8_t* registers;
 
@@ -378,11 +393,16 @@ static void noise_clock_lfsr (struct noise* noise)
 	noise->shift_register = ((sh >> 1) & 0x3FFF) | (feedback << 14);
 }
 
-/* noise_periods periods to load into the noise channel */
-static uint16_t noise_periods[16] =
+/* noise_periods periods to load into the noise channel, for NTSC and PAL */
+static const uint16_t noise_periods_ntsc[16] =
 {
 	4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
 };
+static const uint16_t noise_periods_pal[16] =
+{
+	4, 8, 14, 30, 60, 88, 118, 148, 188, 236, 354, 472, 708, 944, 1890, 3778
+};
+static const uint16_t* noise_periods = noise_periods_ntsc;
 
 /* noise_clock_timer clocks the noise channel's timer */
 static void noise_clock_timer (struct noise* noise)
@@ -559,11 +579,16 @@ static void dmc_clock_output (struct dmc* dmc)
 		dmc_reload_output (dmc);
 }
 
-/* dmc_rate_index contains rates for the DMC */
-static uint16_t dmc_rate_index[16] =
+/* dmc_rate_index contains rates for the DMC, for NTSC and PAL */
+static const uint16_t dmc_rate_index_ntsc[16] =
 {
 	428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106,  84,  72,  54
 };
+static const uint16_t dmc_rate_index_pal[16] =
+{
+	398, 354, 316, 298, 276, 236, 210, 198, 176, 148, 132, 118,  98,  78,  66,  50
+};
+static const uint16_t* dmc_rate_index = dmc_rate_index_ntsc;
 
 /* dmc_clock_timer clock the DMC units timer */
 static void dmc_clock_timer (struct dmc* dmc)
@@ -601,6 +626,8 @@ static struct dmc dmc;
  * as the triangle channel's linear counter. */
 static void clock_envelopes ()
 {
+	if (!audio_enabled)
+		return;
 	envelope_clock (&pulse_1.env);
 	envelope_clock (&pulse_2.env);
 	envelope_clock (&noise.env);
@@ -610,6 +637,8 @@ static void clock_envelopes ()
 /* clock_sweeps clocks the pulse channels' sweep units */
 static void clock_sweeps ()
 {
+	if (!audio_enabled)
+		return;
 	pulse_clock_sweep (&pulse_1);
 	pulse_clock_sweep (&pulse_2);
 }
@@ -630,6 +659,26 @@ static void clock_all ()
 	clock_length_counters ();
 }
 
+/**
+ * frame_steps are the CPU cycles since the start of the sequence at which the frame counter steps,
+ * in 4 and 5 step mode, followed by the cycle at which the sequence restarts. They are the APU
+ * cycles 3728.5, 7456.5, ... doubled, for NTSC and PAL.
+ */
+static const int frame_steps_ntsc[2][6] =
+{
+	{ 7457, 14913, 22371, 29829, 29830 },
+	{ 7457, 14913, 22371, 29829, 37281, 37282 },
+};
+static const int frame_steps_pal[2][6] =
+{
+	{ 8313, 16627, 24939, 33252, 33253 },
+	{ 8313, 16627, 24939, 33252, 41565, 41566 },
+};
+static const int (*frame_steps)[6] = frame_steps_ntsc;
+
+/* frame_n_steps is the number of steps in 4 and 5 step mode */
+static const int frame_n_steps[2] = { 4, 5 };
+
 // step_frame_counter_4 steps the frame counter in 4 step mode.
 static void inline step_frame_counter_4 ()
 {
@@ -640,17 +689,17 @@ static void inline step_frame_counter_4 ()
 			clock_envelopes();
 			break;
 		case 1:
+			clock_all();
+			break;
 		case 3:
 			clock_all();
 			if (~FRAMECOUNTER & 0x40) // frame IRQ inhibit flag clear
-				nes_cpu_signal (IRQ);
+			{
+				frame_irq = 1;
+				nes_cpu_set_irq (NES_CPU_IRQ_FRAME_COUNTER, 1);
+			}
 			break;
 	}
-	//if (frame == 3)
-	//{
-		//if (~FRAMECOUNTER & 0x40) // frame IRQ inhibit flag clear
-			//nes_cpu_signal (IRQ);
-	//}
 }
 
 // step_frame_counter_5 steps the frame counter in 5 step mode.
@@ -675,22 +724,25 @@ static void inline step_frame_counter_5 ()
  * mode 0:    mode 1:       function
  * ---------  -----------  -----------------------------
  *   - - - f    - - - - -    IRQ (if bit 6 is clear)
- *   - l - l    l - l - -    Length counter and sweep
- *   e e e e    e e e e -    Envelope and linear counter
+ *   - l - l    - l - - l    Length counter and sweep
+ *   e e e e    e e e - e    Envelope and linear counter
+ * It is called on the cycles in frame_steps, and restarts the sequence after the last one.
  */
 static void step_frame_counter ()
 {
-	frame ++;
-	if (FRAMECOUNTER & 0x80) // 5 step
+	int mode = (FRAMECOUNTER & 0x80) != 0;
+	if (frame == frame_n_steps[mode])
 	{
-		frame %= 5;
-		step_frame_counter_5 ();
+		frame_cycle = 0;
+		frame = 0;
+		return;
 	}
+
+	if (mode) // 5 step
+		step_frame_counter_5 ();
 	else // 4 step
-	{
-		frame %= 4;
 		step_frame_counter_4 ();
-	}
+	frame ++;
 }
 
 /* APU Register Writers --------------------------------------------------------------------------------------------- */
@@ -803,11 +855,18 @@ static void status_write (uint8_t value)
 	registers[0x10] &= 0x7F; // clear the DMC interrupt flag
 }
 
-/* write to frame counter register */
+/* write to frame counter register, which restarts the sequence */
 static void frame_counter_write (uint8_t value)
 {
+	frame_cycle = 0;
+	frame = 0;
 	if (value & 0x80)
 		clock_all ();
+	if (value & 0x40) // IRQ inhibit clears the flag
+	{
+		frame_irq = 0;
+		nes_cpu_set_irq (NES_CPU_IRQ_FRAME_COUNTER, 0);
+	}
 }
 
 /* End APU Register Writers ------------------------------------------------------------------- */
@@ -872,14 +931,16 @@ static uint8_t status_read ()
 	uint8_t ret =
 		0                        |
 		(registers[0x10] & 0x80) |
-		(registers[0x17] & 0x40) |
+		(frame_irq        << 6)  |
 		(dmc_enabled      << 4)  |
 		(noise_enabled    << 3)  |
 		(triangle_enabled << 2)  |
 		(pulse_2_enabled  << 1)  |
 		pulse_1_enabled;
 
-	FRAMECOUNTER &= 0xD0; // clear frame interrupt flag
+	// clear frame interrupt flag
+	frame_irq = 0;
+	nes_cpu_set_irq (NES_CPU_IRQ_FRAME_COUNTER, 0);
 	return ret;
 }
 
@@ -903,6 +964,9 @@ void nes_apu_reset ()
 	__memory__ ((void**) &registers, 0x4000);
 	readers[0x15] = &status_read; // TODO this is not needed to be called on each reset
 
+	// the channel registers at $4000-$4013 power up cleared, not as the game run before left them
+	memset (registers, 0, 0x14);
+
 	// initialize audio channels
 	pulse_init    (&pulse_1,  registers,      1);
 	pulse_init    (&pulse_2,  registers +  4, 2);
@@ -912,6 +976,9 @@ void nes_apu_reset ()
 
 	apucc = 0; // reset clock cycles
 	frame = 0; // reset frame
+	frame_cycle = 0;
+	frame_irq = 0;
+	nes_cpu_set_irq (NES_CPU_IRQ_FRAME_COUNTER, 0);
 
 	status_write (0); // silence all channels
 }
@@ -921,15 +988,43 @@ void nes_apu_reset ()
 /* audio_sample_rate is the playback sample rate of the application. */
 static int audio_sample_rate = DEFAULT_SAMPLE_RATE;
 
+/* cpu_freq is the CPU clock rate of the region */
+static int cpu_freq = NES_CPU_FREQ;
+
 /* sample_freq is the number of CPU cycles between sampling. */
 static float sample_freq = NES_CPU_FREQ / DEFAULT_SAMPLE_RATE;
 
+/**
+ * sample_period is sample_freq in 16.16 fixed point, and sample_countdown the fixed point
+ * CPU cycles left until the next sample is taken.
+ */
+#define SAMPLE_ONE 0x10000
+static int32_t sample_period = (int64_t) NES_CPU_FREQ * SAMPLE_ONE / DEFAULT_SAMPLE_RATE;
+static int32_t sample_countdown = (int64_t) NES_CPU_FREQ * SAMPLE_ONE / DEFAULT_SAMPLE_RATE;
+
 /* nsamples is the number samples in the render buffer. */
 static size_t nsamples = 0;
 
 /* samples points to the rendered samples */
 static float* samples = 0;
 
+/**
+ * pulse_levels and tnd_levels hold the combined output level of the pulse channels and of the
+ * triangle, noise and DMC channels for each sample in the render buffer. They are indices into the
+ * mixer tables.
+ */
+static int32_t* pulse_levels = 0;
+static int32_t* tnd_levels = 0;
+
+/**
+ * pulse_table and tnd_table are the non-linear output of the mixer, indexed by
+ * pulse1 + pulse2 and 3 * triangle + 2 * noise + dmc.
+ */
+#define PULSE_TABLE_SIZE 31
+#define TND_TABLE_SIZE 203
+static float pulse_table[PULSE_TABLE_SIZE];
+static float tnd_table[TND_TABLE_SIZE];
+
 /* struct high_pass_filter is a first order high pass filter. */
 struct filter
 {
@@ -984,11 +1079,25 @@ static struct filter filter_3;
 void nes_audio_set_sample_rate (int rate)
 {
 	audio_sample_rate = rate;
-	sample_freq = NES_CPU_FREQ / (float) audio_sample_rate;
+	sample_freq = cpu_freq / (float) audio_sample_rate;
+	sample_period = (int64_t) cpu_freq * SAMPLE_ONE / audio_sample_rate;
+	sample_countdown = sample_period;
 
 	// allocate buffer for samples
 	if (samples) free (samples);
+	if (pulse_levels) free (pulse_levels);
+	if (tnd_levels) free (tnd_levels);
 	samples = malloc (rate * sizeof (float));
+	pulse_levels = malloc (rate * sizeof (int32_t));
+	tnd_levels = malloc (rate * sizeof (int32_t));
+	nsamples = 0;
+
+	// build mixer tables
+	pulse_table[0] = tnd_table[0] = 0;
+	for (int i = 1; i < PULSE_TABLE_SIZE; i ++)
+		pulse_table[i] = 95.52 / (8128.0 / i + 100);
+	for (int i = 1; i < TND_TABLE_SIZE; i ++)
+		tnd_table[i] = 163.67 / (24329.0 / i + 100);
 
 	// reinitialize filters
 	high_pass_filter_init (&filter_1,    90);
@@ -996,73 +1105,156 @@ void nes_audio_set_sample_rate (int rate)
 	low_pass_filter_init  (&filter_3, 14000);
 }
 
-/* mix will take output from all channels and return the resulting mix. */
-static inline float mix ()
+/**
+ * mix_scalar adds the output of the channels for n samples to out, looking up the levels in the
+ * mixer tables.
+ */
+static void mix_scalar (float* out, const int32_t* pulse, const int32_t* tnd, size_t n)
 {
+	for (size_t i = 0; i < n; i ++)
+		out[i] += pulse_table[pulse[i]] + tnd_table[tnd[i]];
+}
+
+#ifdef MIX_AVX2
+/**
+ * mix_avx2 is mix_scalar gathering 8 levels at a time. It is compiled for AVX2 whatever the
+ * flags of the build and only called when the CPU has it, the sums are the same as mix_scalar.
+ */
+__attribute__((target ("avx2")))
+static void mix_avx2 (float* out, const int32_t* pulse, const int32_t* tnd, size_t n)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 p = _mm256_i32gather_ps (pulse_table, _mm256_loadu_si256 ((const __m256i*) (pulse + i)), 4);
+		__m256 t = _mm256_i32gather_ps (tnd_table, _mm256_loadu_si256 ((const __m256i*) (tnd + i)), 4);
+		_mm256_storeu_ps (out + i, _mm256_add_ps (_mm256_loadu_ps (out + i), _mm256_add_ps (p, t)));
+	}
+	mix_scalar (out + i, pulse + i, tnd + i, n - i);
+}
+#endif
+
+/* mix is the mixer used, mix_avx2 when the CPU has AVX2 */
+static void (*mix) (float*, const int32_t*, const int32_t*, size_t) = NULL;
+
+int nes_apu_set_simd (int enabled)
+{
+	mix = mix_scalar;
+#ifdef MIX_AVX2
+	if (enabled && __builtin_cpu_supports ("avx2"))
+		mix = mix_avx2;
+#endif
+	return mix != mix_scalar;
+}
+
+/**
+ * render takes the current output of all channels and stores their levels to be mixed
+ * with the rest of the block. Mixing and filtering is done on the whole block once the
+ * expansion sound of the mapper has been added.
+ */
+static void render ()
+{
+	if (samples == NULL || nsamples >= audio_sample_rate)
+		return;
+
 	uint8_t p1 = pulse_output (&pulse_1);
 	uint8_t p2 = pulse_output (&pulse_2);
 	uint8_t tr = triangle_output (&triangle);
 	uint8_t n  = noise_output (&noise);
 	uint8_t d  = dmc_output (&dmc);
 
-	// we are using the less precise linear approximation
-	float pulse_out = 0.00752 * (p1 + p2);
-	float tnd_out = 0.00851 * tr + 0.00494 * n + 0.00335 * d;
-	float output = pulse_out + tnd_out;
+	pulse_levels[nsamples] = p1 + p2;
+	tnd_levels[nsamples] = 3 * tr + 2 * n + d;
+	samples[nsamples] = 0;
+	nsamples ++;
+	NES_STATS_COUNT (samples);
+}
+
+/* expansion is the sound of the mapper */
+static nes_apu_expansion expansion = NULL;
+
+/* expansion_rendered is the number of samples in the buffer the expansion sound has been added to */
+static size_t expansion_rendered = 0;
 
-	return output;
+void nes_apu_set_expansion (nes_apu_expansion e)
+{
+	expansion = e;
+	expansion_rendered = nsamples;
 }
 
-/**
- * render takes the current output of all channels, mixes them and sends them
- * to a buffer of samples.
- */
-static void render ()
+void nes_apu_expansion_sync ()
 {
-	// get value from mixer
-	float s = mix ();
-	// apply filtering
-	s = high_pass_filter_pass (&filter_1, s);
-	s = high_pass_filter_pass (&filter_2, s);
-	s = low_pass_filter_pass (&filter_3, s);
-	*(samples + nsamples) = s;
-	nsamples ++;
+	if (audio_enabled && expansion != NULL && nsamples > expansion_rendered)
+		expansion (samples + expansion_rendered, nsamples - expansion_rendered, sample_freq);
+	expansion_rendered = nsamples;
+}
+
+void nes_apu_set_region (const struct nes_region* region)
+{
+	noise_periods = region->pal_apu ? noise_periods_pal : noise_periods_ntsc;
+	dmc_rate_index = region->pal_apu ? dmc_rate_index_pal : dmc_rate_index_ntsc;
+	frame_steps = region->pal_apu ? frame_steps_pal : frame_steps_ntsc;
+
+	cpu_freq = region->cpu_freq;
+	sample_freq = cpu_freq / (float) audio_sample_rate;
+	sample_period = (int64_t) cpu_freq * SAMPLE_ONE / audio_sample_rate;
+	sample_countdown = sample_period;
+}
+
+void nes_audio_set_enabled (int enabled)
+{
+	audio_enabled = enabled;
+	nsamples = expansion_rendered = 0;
 }
 
 void nes_audio_samples (float* smpls, size_t* size)
 {
+	nes_apu_expansion_sync ();
+	if (mix == NULL)
+		nes_apu_set_simd (1);
+	mix (samples, pulse_levels, tnd_levels, nsamples);
+	// apply filtering
+	for (size_t i = 0; i < nsamples; i ++)
+	{
+		float s = samples[i];
+		s = high_pass_filter_pass (&filter_1, s);
+		s = high_pass_filter_pass (&filter_2, s);
+		s = low_pass_filter_pass (&filter_3, s);
+		smpls[i] = s;
+	}
 	*size = nsamples * sizeof (float);
-	memcpy (smpls, samples, *size);
-	nsamples = 0;
+	nsamples = expansion_rendered = 0;
 }
 
-#define FRAME_COUNTER_RATE 240.0
-static const float frame_rate = NES_CPU_FREQ / FRAME_COUNTER_RATE;
-
 void nes_apu_step ()
 {
-	int f1 = apucc / frame_rate;
-	int s1 = apucc / sample_freq;
-	apucc ++;
-	int f2 = apucc / frame_rate;
-	int s2 = apucc / sample_freq;
+	apucc ^= 1;
 
-	if ((apucc & 1) == 0) // even cycle
+	if (apucc == 0) // even cycle
 	{
 		// clock channels
-		pulse_clock_timer (&pulse_1);
-		pulse_clock_timer (&pulse_2);
-		noise_clock_timer (&noise);
+		if (audio_enabled)
+		{
+			pulse_clock_timer (&pulse_1);
+			pulse_clock_timer (&pulse_2);
+			noise_clock_timer (&noise);
+		}
+		// the DMC fetches samples from memory which stalls the CPU and can signal an IRQ
 		dmc_clock_timer (&dmc);
 	}
+
 	// clock triangle
-	triangle_clock_timer (&triangle);
+	if (audio_enabled)
+		triangle_clock_timer (&triangle);
 
 	// step frame counter
-	if (f1 != f2)
+	if (++ frame_cycle == frame_steps[(FRAMECOUNTER & 0x80) != 0][frame])
 		step_frame_counter ();
+
 	// render
-	if (s1 != s2)
+	if (audio_enabled && (sample_countdown -= SAMPLE_ONE) <= 0)
+	{
+		sample_countdown += sample_period;
 		render ();
+	}
 }
-
@@ -0,0 +1,65 @@
+#include <nes/cpu.h>
+#include <nes/ppu.h>
+#include <nes/mapper.h>
+#include <string.h>
+
+/**
+ *  AxROM switches 32KB of PRG ROM and selects which page of nametable RAM is used for single
+ *  screen mirroring. CHR is 8KB of RAM.
+ */
+#define PRG_BANK_SIZE 0x8000
+static uint8_t* prg;
+static int n_prg_banks;
+
+/* bank register */
+static uint8_t bank;
+
+/* switch_banks maps the selected 32KB PRG bank and nametable page */
+static void switch_banks ()
+{
+	const uint8_t* data = prg + ((bank & 7) % n_prg_banks) * PRG_BANK_SIZE;
+	for (int i = 0; i < NES_CPU_PRG_WINDOWS; i ++)
+		nes_cpu_map_prg (i, data + i * 0x2000);
+
+	nes_ppu_set_mirroring (bank & 0x10 ? NES_PPU_MIRROR_SINGLE1 : NES_PPU_MIRROR_SINGLE0);
+}
+
+static int write (uint16_t address, uint8_t v)
+{
+	if (address >= 0x8000)
+	{
+		bank = v;
+		switch_banks ();
+		return 1;
+	}
+	return 0;
+}
+
+static int load (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	if (_n_prg_banks < 2)
+		return 1;
+	prg = _prg;
+	n_prg_banks = _n_prg_banks >> 1; // n banks passed are in 16KB but the mapper switches 32KB
+	return 0;
+}
+
+static void reset ()
+{
+	bank = 0;
+	switch_banks ();
+}
+
+static void destroy ()
+{
+	prg = NULL;
+}
+
+const struct nes_mapper nes_axrom =
+{
+	.name       = "AxROM",
+	.load       = load,
+	.reset      = reset,
+	.cpu_write  = write,
+	.destroy    = destroy,
+};
@@ -1,15 +1,61 @@
 #include <nes/cpu.h>
 #include <nes/ppu.h>
+#include <nes/mapper.h>
+#include <string.h>
 
-uint8_t* prg;
-int n_prg_banks;
-uint8_t* chr;
-int n_chr_banks;
+static uint8_t* prg;
+static int n_prg_banks;
+static uint8_t* chr;
+static int n_chr_banks;
 
-void nes_cnrom_load (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+/* chr_bank is the 8KB CHR bank selected */
+static uint8_t chr_bank;
+
+/* switch_chr_bank maps the selected 8KB CHR bank */
+static void switch_chr_bank ()
+{
+	nes_ppu_load_chr_rom (chr + (chr_bank % n_chr_banks) * 0x2000);
+}
+
+static int write (uint16_t address, uint8_t v)
+{
+	if (address >= 0x8000)
+	{
+		chr_bank = v;
+		switch_chr_bank ();
+		return 1;
+	}
+	return 0;
+}
+
+static int load (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
 {
 	prg = _prg;
 	n_prg_banks = _n_prg_banks;
 	chr = _chr;
 	n_chr_banks = _n_chr_banks;
+	return 0;
 }
+
+static void reset ()
+{
+	// 16KB of PRG ROM is mirrored at $C000
+	nes_cpu_load_prg_rom_bank (prg, 0);
+	nes_cpu_load_prg_rom_bank (prg + (n_prg_banks - 1) * NES_PRG_ROM_BANK_SIZE, 1);
+	chr_bank = 0;
+	switch_chr_bank ();
+}
+
+static void destroy ()
+{
+	prg = chr = NULL;
+}
+
+const struct nes_mapper nes_cnrom =
+{
+	.name       = "CNROM",
+	.load       = load,
+	.reset      = reset,
+	.cpu_write  = write,
+	.destroy    = destroy,
+};
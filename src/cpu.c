@@ -2,12 +2,16 @@
 #include "nes/ppu.h"
 #include "nes/apu.h"
 #include "nes/io.h"
+#include "nes/mapper.h"
+#include "nes/nes.h"
+#include "nes/trace.h"
+#include "nes/profile.h"
+#include "nes/stats.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 
-#define MAX_EVENT_HANDLERS 16
-
 /* Controllers port memory locations */
 #define CTRL_ONE_MEM_LOC    0x4016
 #define CTRL_TWO_MEM_LOC    0x4017
@@ -24,8 +28,8 @@ enum processor_status_flags
 	ZERO        = 0x02,
 	INTERRUPT   = 0x04,
 	DECIMAL     = 0x08,
-	// unused   = 0x10
-	BREAK       = 0x20,
+	BREAK       = 0x10, // only exists on the stack
+	UNUSED      = 0x20, // always set
 	OVERFLOW    = 0x40,
 	NEGATIVE    = 0x80
 };
@@ -54,7 +58,7 @@ addressing_mode;
 enum status_flags
 {
 	PAGE_CROSS  = 0x01,
-	STOP        = 0x02,
+	STOP        = 0x02, // jammed until reset
 	PAUSE       = 0x04,
 };
 static int flags = STOP;
@@ -62,6 +66,9 @@ static int flags = STOP;
 // CPU signals
 static int signals;
 
+// sources currently asserting the IRQ line
+static int irq_line;
+
 /**
  *  CPU registers
  */
@@ -94,31 +101,161 @@ void __memory__ (void **p, int location)
 
 #define PRG_RAM_LOCATION 0x6000
 #define PRG_ROM_LOCATION 0x8000
-/* Load PRG ROM data to bank. */
-void nes_cpu_load_prg_rom_bank (void *data, int bank)
+#define PRG_RAM_SIZE     0x2000
+
+/* PRG ROM is read through four 8KB windows at $8000, $A000, $C000 and $E000 */
+#define PRG_WINDOW_SIZE 0x2000
+#define PRG_WINDOW(address) prg_windows[(address >> 13) & 3][address & (PRG_WINDOW_SIZE - 1)]
+
+/* prg_windows point to the banks currently mapped in each window, defaults to open memory */
+static const uint8_t* prg_windows[NES_CPU_PRG_WINDOWS] =
+{
+	memory + PRG_ROM_LOCATION,
+	memory + PRG_ROM_LOCATION + PRG_WINDOW_SIZE,
+	memory + PRG_ROM_LOCATION + PRG_WINDOW_SIZE * 2,
+	memory + PRG_ROM_LOCATION + PRG_WINDOW_SIZE * 3,
+};
+
+/**
+ *  Instructions in PRG ROM are decoded once into a cache with an entry per byte of PRG ROM. As the
+ *  cache is keyed by the offset in PRG ROM a bank switch only changes which part of it a window
+ *  looks at, and nothing decoded needs to be thrown away.
+ */
+struct predecoded
+{
+	uint16_t operand; // operand bytes following the opcode
+	uint8_t  opcode;
+	uint8_t  decoded; // non-zero once the entry has been filled
+};
+
+static const uint8_t* prg_rom;
+static size_t prg_rom_size;
+static struct predecoded* predecode_cache;
+
+/* predecode_windows point to the cache entries of the banks mapped in each window, NULL if not PRG ROM */
+static struct predecoded* predecode_windows[NES_CPU_PRG_WINDOWS];
+
+/* map_predecode_window points the cache of the window to the bank mapped in it */
+static void map_predecode_window (int window)
+{
+	const uint8_t* bank = prg_windows[window];
+	if (predecode_cache != NULL && bank >= prg_rom && bank + PRG_WINDOW_SIZE <= prg_rom + prg_rom_size)
+		predecode_windows[window] = predecode_cache + (bank - prg_rom);
+	else
+		predecode_windows[window] = NULL;
+}
+
+void nes_cpu_set_prg_rom (const uint8_t* data, size_t size)
+{
+	free (predecode_cache);
+	predecode_cache = NULL;
+	prg_rom = data;
+	prg_rom_size = size;
+	if (data != NULL)
+		predecode_cache = calloc (size, sizeof (struct predecoded));
+
+	for (int i = 0; i < NES_CPU_PRG_WINDOWS; i ++)
+		map_predecode_window (i);
+}
+
+#ifdef PROFILE
+/* profile_location returns the location of the code @ address for the profiler */
+static uint32_t profile_location (uint16_t address)
+{
+	const uint8_t* bank = prg_windows[(address >> 13) & 3];
+	if (address >= PRG_ROM_LOCATION && bank >= prg_rom && bank < prg_rom + prg_rom_size)
+		return NES_PROFILE_LOCATION ((bank - prg_rom) / PRG_WINDOW_SIZE, address);
+	return address;
+}
+#endif
+
+/**
+ *  PRG RAM of the cartridge, in banks of 8KB. Until a cartridge hands its own it is the 8KB at $6000
+ *  in memory. prg_ram_bank is the bank mapped at $6000 and prg_ram_windows the banks mapped in the
+ *  PRG windows, NULL where PRG ROM is mapped.
+ */
+static uint8_t* prg_ram = memory + PRG_RAM_LOCATION;
+static size_t prg_ram_size = PRG_RAM_SIZE;
+static uint8_t* prg_ram_bank = memory + PRG_RAM_LOCATION;
+static uint8_t* prg_ram_windows[NES_CPU_PRG_WINDOWS];
+
+/* range of PRG RAM, as offsets from its start, that has been written since last asked for */
+static int prg_ram_dirty_first = PRG_RAM_SIZE;
+static int prg_ram_dirty_last = 0;
+
+void nes_cpu_map_prg (int window, const uint8_t* bank)
+{
+	NES_STATS_COUNT (prg_switches);
+	prg_windows[window] = bank;
+	prg_ram_windows[window] = NULL;
+	map_predecode_window (window);
+}
+
+void nes_cpu_set_prg_ram (uint8_t* data, size_t size)
+{
+	prg_ram = data != NULL ? data : memory + PRG_RAM_LOCATION;
+	prg_ram_size = data != NULL ? size : PRG_RAM_SIZE;
+	prg_ram_bank = prg_ram;
+	prg_ram_dirty_first = prg_ram_size;
+	prg_ram_dirty_last = 0;
+}
+
+/* prg_ram_bank_at returns 8KB bank # of PRG RAM, mirrored over its size */
+static uint8_t* prg_ram_bank_at (int bank)
+{
+	return prg_ram + ((size_t) bank * PRG_RAM_SIZE) % prg_ram_size;
+}
+
+void nes_cpu_map_prg_ram (int bank)
+{
+	prg_ram_bank = prg_ram_bank_at (bank);
+}
+
+void nes_cpu_map_prg_ram_window (int window, int bank)
+{
+	nes_cpu_map_prg (window, prg_ram_bank_at (bank));
+	prg_ram_windows[window] = prg_ram_bank_at (bank);
+}
+
+/* Map a 16KB bank of PRG ROM at $8000 or $C000. */
+void nes_cpu_load_prg_rom_bank (const void *data, int bank)
+{
+	nes_cpu_map_prg (bank * 2, data);
+	nes_cpu_map_prg (bank * 2 + 1, (const uint8_t*) data + PRG_WINDOW_SIZE);
+}
+
+/* Map 32KB of PRG ROM at $8000. */
+void nes_cpu_load_prg_rom (const void *data)
+{
+	for (int i = 0; i < NES_CPU_PRG_WINDOWS; i ++)
+		nes_cpu_map_prg (i, (const uint8_t*) data + i * PRG_WINDOW_SIZE);
+}
+
+void nes_cpu_load_prg_ram (const void* data, size_t size)
 {
-	memcpy
-	(
-		memory + PRG_ROM_LOCATION + bank * NES_PRG_ROM_BANK_SIZE,
-		data,
-		NES_PRG_ROM_BANK_SIZE
-	);
+	memcpy (prg_ram, data, size < prg_ram_size ? size : prg_ram_size);
 }
 
-/* Load data to PRG ROM. */
-void nes_cpu_load_prg_rom (void *data)
+int nes_cpu_prg_ram_dirty (int* first, int* last)
 {
-	memcpy
-	(
-		memory + PRG_ROM_LOCATION,
-		data,
-		NES_PRG_ROM_SIZE
-	);
+	if (prg_ram_dirty_first >= prg_ram_dirty_last)
+		return 0;
+
+	*first = prg_ram_dirty_first;
+	*last = prg_ram_dirty_last;
+	prg_ram_dirty_first = prg_ram_size;
+	prg_ram_dirty_last = 0;
+	return 1;
 }
 
-void nes_cpu_load_prg_ram (void* data)
+const uint8_t* nes_cpu_prg_ram ()
 {
-	memcpy (memory + PRG_RAM_LOCATION, data, 0x2000);
+	return prg_ram;
+}
+
+size_t nes_cpu_prg_ram_size ()
+{
+	return prg_ram_size;
 }
 
 /* Store Handlers ----------------------------------------------------------------------------- */
@@ -142,12 +279,32 @@ static int on_ppu_register_write (uint16_t address, uint8_t value)
  *  Stops propagation as it is not needed to be stored in RAM.
  */
 #define OAM_DMA_REGISTER 0x4014
+static uint8_t bus_read (uint16_t address);
+#ifdef ACCURATE
+static void mem_store (uint8_t value, uint16_t address);
+static inline uint8_t mem_read (uint16_t address);
+static inline void cycle ();
+#endif
 static int on_dma_write (uint16_t address, uint8_t value)
 {
 	if (address == OAM_DMA_REGISTER)
 	{
-		nes_ppu_load_oam_data (memory + value * 0x100);
+#ifdef ACCURATE
+		// the CPU halts for a cycle, and for one more when the next one is odd so that reads are
+		// on even cycles, then copies the page through OAMDATA a read and a write at a time
+		cycle ();
+		if (nes_cycles () & 1)
+			cycle ();
+		for (int i = 0; i < 0x100; i ++)
+			mem_store (mem_read (value << 8 | i), PPU_REGISTER_MEM_LOC | OAMDATA);
+#else
+		// the page is read over the bus, it can be anywhere from RAM to PRG ROM
+		uint8_t page[0x100];
+		for (int i = 0; i < 0x100; i ++)
+			page[i] = bus_read (value << 8 | i);
+		nes_ppu_load_oam_data (page);
 		cpucc += 513 + (cpucc & 1);
+#endif
 		return 1;
 	}
 	return 0;
@@ -183,7 +340,7 @@ static int on_apu_register_write (uint16_t address, uint8_t value)
 /* End Store Handlers ------------------------------------------------------------------------- */
 
 /* store_handlers are the handlers to be called when storing to RAM. */
-static store_handler store_handlers[MAX_EVENT_HANDLERS] =
+static const store_handler store_handlers[] =
 {
 	&on_ppu_register_write,
 	&on_dma_write,
@@ -191,36 +348,96 @@ static store_handler store_handlers[MAX_EVENT_HANDLERS] =
 	&on_apu_register_write,
 	NULL
 };
-static int n_store_handlers = 4; // number of store_handlers that are registered.
 
-void nes_cpu_add_store_handler (store_handler h)
+/**
+ *  The accurate core (ACCURATE) runs the rest of the hardware one cycle before each read and write
+ *  the CPU makes, so registers are accessed on the cycle they are on the console. Cycles of an
+ *  instruction without an access are run when it is done. The default core runs all cycles of an
+ *  instruction after it.
+ */
+static void (*clock_hardware) (int) = NULL;
+
+void nes_cpu_set_clock (void (*clock) (int))
 {
-	store_handlers[n_store_handlers] = h;
-	n_store_handlers ++;
-	store_handlers[n_store_handlers] = NULL;
+	clock_hardware = clock;
+}
+
+#ifdef ACCURATE
+/* cycles run by accesses during the current step */
+static int clocked;
+
+static inline void cycle ()
+{
+	clocked ++;
+	if (clock_hardware != NULL)
+		clock_hardware (1);
+}
+#define CYCLE() cycle ()
+
+/* read-modify-write instructions write the value back unmodified before writing the result */
+#define DUMMY_WRITE(value, address) mem_store (value, address)
+#else
+#define CYCLE()
+#define DUMMY_WRITE(value, address)
+#endif
+
+/* start of the cartridge space handled by the mapper */
+#define CARTRIDGE_MEM_LOC 0x4020
+
+/* mapper of the cartridge, NULL if there is none */
+static const struct nes_mapper* mapper = NULL;
+
+void nes_cpu_set_mapper (const struct nes_mapper* m)
+{
+	mapper = m;
 }
 
 /**
  *  Store value to memory.
- *  Loop through and call all registered store event handlers.
+ *  Loop through and call all store event handlers and then the mapper.
  */
 static void mem_store (uint8_t value, uint16_t address)
 {
+	CYCLE ();
+	NES_STATS_COUNT (writes[NES_STATS_REGION (address)]);
+	// internal RAM is never handled by anyone, it is mirrored up to the PPU registers
+	if (address < PPU_REGISTER_MEM_LOC)
+	{
+		for (int i = address % 0x800; i < PPU_REGISTER_MEM_LOC; i += 0x800)
+			memory[i] = value;
+		return;
+	}
 	// loop through store event handlers
 	// any non-zero return value means we stop propagation and return
-	for (store_handler* handle = store_handlers; *handle != NULL; handle ++)
+	for (const store_handler* handle = store_handlers; *handle != NULL; handle ++)
+	{
 		if ((*handle) (address, value) != 0)
+		{
+			NES_STATS_COUNT (write_handler_hits);
+			return;
+		}
+	}
+	if (address >= CARTRIDGE_MEM_LOC && mapper != NULL && mapper->cpu_write != NULL)
+		if (mapper->cpu_write (address, value) != 0)
 			return;
 
-	// if we arrive here it is alright to store to memory
-	memory[address] = value;
-	// Apply memory mirroring
-	if (address < 0x2000)
+	// PRG RAM is stored to the bank mapped where it is written
+	uint8_t* bank = address >= PRG_ROM_LOCATION ? prg_ram_windows[(address >> 13) & 3] :
+	                address >= PRG_RAM_LOCATION ? prg_ram_bank : NULL;
+	if (bank != NULL)
 	{
-		// internal RAM
-		for (int i = address % 0x800; i < 0x2000; i += 0x800)
-			memory[i] = value;
+		bank[address & (PRG_RAM_SIZE - 1)] = value;
+		// keep track of what needs to be written back to battery backed RAM
+		int offset = bank - prg_ram + (address & (PRG_RAM_SIZE - 1));
+		if (offset < prg_ram_dirty_first)
+			prg_ram_dirty_first = offset;
+		if (offset >= prg_ram_dirty_last)
+			prg_ram_dirty_last = offset + 1;
+		return;
 	}
+
+	// if we arrive here it is alright to store to memory
+	memory[address] = value;
 }
 
 
@@ -268,40 +485,53 @@ static int on_apu_register_read (uint16_t address, uint8_t* value)
 }
 
 /* read_handlers contains the list of handlers to call when reading from RAM. */
-static read_handler read_handlers[MAX_EVENT_HANDLERS] =
+static const read_handler read_handlers[] =
 {
 	&on_ppu_register_read,
 	&on_controller_port_read,
 	&on_apu_register_read,
 	NULL
 };
-static int n_read_handlers = 3; // number of read handlers registered.
-
-void nes_cpu_add_read_handler (read_handler h)
-{
-	read_handlers[n_read_handlers] = h;
-	n_read_handlers ++;
-	read_handlers[n_read_handlers] = NULL;
-}
 
 /**
  *  Read a value from the memory.
- *  Loop through all read event handlers before returning the value.
+ *  Loop through all read event handlers and then the mapper before returning the value.
  */
-static uint8_t mem_read (uint16_t address)
+static uint8_t bus_read (uint16_t address)
 {
-	uint8_t b = memory[address];
+	// PRG ROM and internal RAM are never handled by anyone
+	if (address >= PRG_ROM_LOCATION)
+		return PRG_WINDOW (address);
+	else if (address < PPU_REGISTER_MEM_LOC)
+		return memory[address];
+
+	uint8_t b = address >= PRG_RAM_LOCATION ? prg_ram_bank[address & (PRG_RAM_SIZE - 1)] : memory[address];
 	// loop through read event handlers
-	for (read_handler* handle = read_handlers; *handle != NULL; handle ++)
+	for (const read_handler* handle = read_handlers; *handle != NULL; handle ++)
+	{
 		if ((*handle)(address, &b) != 0)
-			break;
+		{
+			NES_STATS_COUNT (read_handler_hits);
+			return b;
+		}
+	}
+	if (address >= CARTRIDGE_MEM_LOC && mapper != NULL && mapper->cpu_read != NULL)
+		mapper->cpu_read (address, &b);
 	return b;
 }
+
+/* mem_read reads a value from memory as part of an instruction, which takes a cycle */
+static inline uint8_t mem_read (uint16_t address)
+{
+	CYCLE ();
+	NES_STATS_COUNT (reads[NES_STATS_REGION (address)]);
+	return bus_read (address);
+}
 #define MEM(address) mem_read(address)
 
 uint8_t nes_cpu_read_ram (uint16_t address)
 {
-	return mem_read (address);
+	return bus_read (address);
 }
 
 
@@ -309,39 +539,61 @@ uint8_t nes_cpu_read_ram (uint16_t address)
  *  ADDRESSING FUNCTIONS
  *  -------------------------------------------------------------------------------------------- */
 
+/* operand holds the bytes following the opcode of the current instruction, read when it is fetched */
+static uint16_t operand;
+#define OPERAND_LOW  ((uint8_t) operand)
+#define OPERAND_HIGH ((uint8_t) (operand >> 8))
+
+#ifdef ACCURATE
+/* indexed_write is set while running an instruction that writes to the address it calculates */
+static int indexed_write;
+
+/**
+ *  dummy_read reads the address formed before the carry of adding the index reaches the high
+ *  byte. Reading instructions only do so when a page is crossed, writing ones always do.
+ */
+static void dummy_read (uint16_t base, uint16_t address)
+{
+	if (DIFF_PAGE (base, address) || indexed_write)
+		mem_read ((base & 0xFF00) | (address & 0xFF));
+}
+#define DUMMY_READ(base, address) dummy_read (base, address)
+#else
+#define DUMMY_READ(base, address)
+#endif
+
 /* Zero Page - $00 */
 static uint16_t zero_page ()
 {
-	return MEM (pc);
+	return OPERAND_LOW;
 }
 
 /* Zero Page,X - $10,X */
 static uint16_t zero_page_x ()
 {
-	uint8_t ret = MEM (pc) + x;
+	uint8_t ret = OPERAND_LOW + x;
 	return ret;
 }
 
 /* Zero Page,Y - $10,Y */
 static uint16_t zero_page_y ()
 {
-	uint8_t ret = MEM (pc) + y;
+	uint8_t ret = OPERAND_LOW + y;
 	return ret;
 }
 
 /* Absolute - $1234 */
 static uint16_t absolute ()
 {
-	uint16_t addr = MEM (pc + 1);
-	addr = (addr << 8) | MEM (pc);
-	return addr;
+	return operand;
 }
 
 /* Absolute,X - $1234,X */
 static uint16_t absolute_x ()
 {
 	uint16_t addr = absolute () + x;
-	if (DIFF_PAGE (addr, pc))
+	DUMMY_READ (operand, addr);
+	if (DIFF_PAGE (addr, operand))
 		flags |= PAGE_CROSS;
 	return addr;
 }
@@ -350,7 +602,8 @@ static uint16_t absolute_x ()
 static uint16_t absolute_y ()
 {
 	uint16_t addr = absolute () + y;
-	if (DIFF_PAGE (addr, pc))
+	DUMMY_READ (operand, addr);
+	if (DIFF_PAGE (addr, operand))
 		flags |= PAGE_CROSS;
 	return addr;
 }
@@ -358,9 +611,8 @@ static uint16_t absolute_y ()
 /* Indirect - ($FFFC) */
 static uint16_t indirect ()
 {
-	uint8_t l = MEM (pc);
-	uint16_t h = MEM (pc + 1);
-	h <<= 8;
+	uint8_t l = OPERAND_LOW;
+	uint16_t h = operand & 0xFF00;
 
 	uint16_t low = h | l;
 	l ++;
@@ -375,7 +627,7 @@ static uint16_t indirect ()
 /* Indexed Indirect - $(40,X) */
 static uint16_t indexed_indirect ()
 {
-	uint8_t l = MEM (pc) + x;
+	uint8_t l = OPERAND_LOW + x;
 	uint8_t h = l + 1;
 	uint16_t addr = MEM (h);
 	addr = (addr << 8) | MEM (l);
@@ -385,13 +637,15 @@ static uint16_t indexed_indirect ()
 /* Indirect Indexed - ($40),Y */
 static uint16_t indirect_indexed ()
 {
-	uint8_t l = MEM (pc);
+	uint8_t l = OPERAND_LOW;
 	uint8_t h = l + 1;
 
-	uint16_t addr = MEM (h);
-	addr = ((addr << 8) | MEM (l)) + y;
+	uint16_t base = MEM (h);
+	base = (base << 8) | MEM (l);
+	uint16_t addr = base + y;
+	DUMMY_READ (base, addr);
 
-	if (DIFF_PAGE (addr, pc))
+	if (DIFF_PAGE (addr, base))
 		flags |= PAGE_CROSS;
 
 	return addr;
@@ -432,95 +686,6 @@ static uint16_t (*address_calculators[12])() =
 	&indirect_indexed
 };
 
-#ifdef VERBOSE
-static void accumulator_string (char *s)
-{
-	*s = 'A';
-}
-
-static void zero_page_string (char *s)
-{
-	sprintf (s, "$%.2X = %.2X", MEM(pc), MEM(zero_page()));
-}
-
-static void zero_page_x_string (char *s)
-{
-	sprintf (s, "$%.2X,X = %.2X", MEM(pc), MEM(zero_page_x()));
-}
-
-static void zero_page_y_string (char *s)
-{
-	sprintf (s, "$%.2X,Y = %.2X", MEM(pc), MEM(zero_page_y()));
-}
-
-static void absolute_string (char *s)
-{
-	uint16_t m = absolute();
-	sprintf (s, "$%.4X = %.2X", m, MEM(m));
-}
-
-static void absolute_x_string (char *s)
-{
-	uint16_t m = absolute_x();
-	sprintf (s, "$%.4X,X = %.2X", m, MEM(m));
-}
-
-static void absolute_y_string (char *s)
-{
-	uint16_t m = absolute_y();
-	sprintf (s, "$%.4X,Y = %.2X", m, MEM(m));
-}
-
-static void indirect_string (char *s)
-{
-	uint16_t m = MEM(pc), n = MEM(pc + 1);
-	m = (n << 8) | m;
-	sprintf (s, "($%.4X) = %.4X", m, indirect());
-}
-
-static void indexed_indirect_string (char *s)
-{
-	uint8_t  m = MEM(pc);
-	uint16_t a = indexed_indirect();
-	sprintf (s, "($%.2X,X) @ %.2X = %.4X = %.2X", m, m + x, a, MEM(a));
-}
-
-static void indirect_indexed_string (char *s)
-{
-	sprintf (s, "($%.2X),Y", MEM(pc));
-}
-
-static void immediate_string (char *s)
-{
-	sprintf (s, "#%.2X", MEM(pc));
-}
-
-static void implicit_string (char *s)
-{
-	// nada
-}
-
-// Array to address calculating function indexed by their mode.
-static void (*address_calculators_string[13])(char *) =
-{
-	&accumulator_string,
-	&immediate_string,
-	&immediate_string,
-	&zero_page_string,
-	&zero_page_x_string,
-	&zero_page_y_string,
-	&absolute_string,
-	&absolute_x_string,
-	&absolute_y_string,
-	&indirect_string,
-	&indexed_indirect_string,
-	&indirect_indexed_string,
-	&implicit_string
-};
-
-#endif // VERBOSE
-
-
 /**
  *  Calculate new address, number of bytes to progress and if a page cross occurred given
  *  an addressing mode.
@@ -542,6 +707,8 @@ static uint8_t get_value (addressing_mode mode)
 {
 	if (mode == ACCUMULATOR)
 		return a;
+	else if (mode == IMMEDIATE || mode == RELATIVE)
+		return OPERAND_LOW;
 	else
 	{
 		uint16_t address = calculate_address (mode);
@@ -552,10 +719,10 @@ static uint8_t get_value (addressing_mode mode)
 /* Stack location in memory */
 #define STACK_LOCATION 0x0100
 
-/* Push a value on to the stack. */
+/* Push a value on to the stack, which is a write that takes a cycle as any other. */
 static void push (uint8_t value)
 {
-	memory[STACK_LOCATION | sp] = value;
+	mem_store (value, STACK_LOCATION | sp);
 	sp --;
 }
 
@@ -563,7 +730,7 @@ static void push (uint8_t value)
 static uint8_t pop ()
 {
 	sp ++;
-	return memory[STACK_LOCATION | sp];
+	return mem_read (STACK_LOCATION | sp);
 }
 
 /**
@@ -571,10 +738,12 @@ static uint8_t pop ()
  */
 static void branch (int8_t offset)
 {
-	uint16_t _pc = pc + offset;
-	if (DIFF_PAGE (pc, _pc))
+	// the offset is from the next instruction, pc is moved past the operand after
+	uint16_t next = pc + 1;
+	uint16_t _pc = next + offset;
+	if (DIFF_PAGE (next, _pc))
 		cpucc ++;
-	pc = _pc;
+	pc = _pc - 1;
 }
 
 /* stalled containes the number of cycles to stall the CPU */
@@ -585,6 +754,53 @@ void nes_cpu_stall (int cycles)
 	stalled += cycles;
 }
 
+/* tracing is set if executed instructions are recorded in the trace */
+static int tracing;
+
+void nes_cpu_set_trace (int enabled)
+{
+	tracing = enabled;
+}
+
+/**
+ *  Idle loops are short loops in PRG ROM that only read RAM or PPUSTATUS, typically waiting for
+ *  the NMI handler to set a flag or for VBLANK. Once an iteration has left the CPU and the value
+ *  read as they were the loop is stepped over an instruction at a time, with the cycles of the
+ *  last iteration, until an interrupt comes or the value read changes.
+ */
+#define IDLE_LOOP_MAX_INSTRUCTIONS 4
+#define IDLE_LOOP_MAX_BYTES        8
+static int idle_skip = 1;
+static struct
+{
+	uint16_t start;    // address the loop jumps back to, 0 if there is no loop
+	uint16_t end;      // address of the jump back
+	int      polls;    // the loop reads the value at poll
+	uint16_t poll;
+	uint8_t  value;    // value at poll when the last iteration started
+	uint8_t  a, x, y, ps;
+	int      n;        // number of instructions in the loop
+	uint16_t pcs[IDLE_LOOP_MAX_INSTRUCTIONS];    // address of each instruction
+	int      cycles[IDLE_LOOP_MAX_INSTRUCTIONS]; // cycles each instruction took in the last iteration
+	int      recorded; // number of instructions of the current iteration run through the loop
+	int      skipping; // the loop is being stepped over
+	int      at;       // instruction of the loop stepped over next
+}
+idle;
+
+void nes_cpu_set_idle_skip (int enabled)
+{
+	idle_skip = enabled;
+	memset (&idle, 0, sizeof (idle));
+}
+
+/* reset_idle forgets the loop the CPU was in */
+static inline void reset_idle ()
+{
+	idle.start = 0;
+	idle.skipping = 0;
+}
+
 #define RST_VECTOR 0xFFFC
 /* Init the CPU to its startup state. */
 void nes_cpu_reset ()
@@ -599,10 +815,12 @@ void nes_cpu_reset ()
 	flags = 0;
 	cpucc = 0;
 	stalled = 0;
+	irq_line = 0;
+	reset_idle ();
 
-	// load program counter
-	pc = MEM (RST_VECTOR + 1);
-	pc = pc << 8 | MEM (RST_VECTOR);
+	// load program counter, the hardware is not running yet
+	pc = bus_read (RST_VECTOR + 1);
+	pc = pc << 8 | bus_read (RST_VECTOR);
 
 	// TODO reset store and read handlers
 }
@@ -616,22 +834,35 @@ void nes_cpu_signal (enum nes_cpu_signal sig)
 	signals |= sig;
 }
 
+void nes_cpu_set_irq (enum nes_cpu_irq_source source, int level)
+{
+	if (level)
+		irq_line |= source;
+	else
+		irq_line &= ~source;
+}
+
 /**
  *  Handle interrupt.
  *  Does the necessary pushing to stack and jump to the new program counter.
+ *  The processor status is pushed with the flags in status set.
  *  An interrupt takes 7 cycles to perform.
  */
-static inline void interrupt (uint16_t _pc)
+static inline void interrupt (uint16_t _pc, uint8_t status)
 {
+	reset_idle ();
 	// push PC
 	push (pc >> 8); // high
 	push (pc);      // low
 	// push PS
-	push (ps | BREAK | 0x10); // push processor status with B and unused flag set
+	push (ps | status);
 	ps |= INTERRUPT;          // disable interrupts
 	// set new PC
 	pc = _pc;
 	cpucc += 7;
+#ifdef PROFILE
+	nes_profile_call (profile_location (pc));
+#endif
 }
 
 
@@ -641,7 +872,7 @@ static void nmi ()
 {
 	uint16_t nmi_vector = MEM (NMI_VECTOR + 1);
 	nmi_vector = (nmi_vector << 8) | MEM (NMI_VECTOR);
-	interrupt (nmi_vector);
+	interrupt (nmi_vector, UNUSED);
 }
 
 
@@ -653,10 +884,25 @@ static void irq ()
 	{
 		uint16_t irq_vector = MEM (IRQ_VECTOR + 1);
 		irq_vector = (irq_vector << 8) | MEM (IRQ_VECTOR);
-		interrupt (irq_vector);
+		interrupt (irq_vector, UNUSED);
 	}
 }
 
+/**
+ *  reset loads the reset vector when the reset button is pressed. Unlike at power up the registers
+ *  keep their values, the stack pointer is moved as if three bytes were pushed.
+ */
+static void reset ()
+{
+	reset_idle ();
+	flags &= ~STOP;
+	sp -= 3;
+	ps |= INTERRUPT;
+	pc = MEM (RST_VECTOR + 1);
+	pc = (pc << 8) | MEM (RST_VECTOR);
+	cpucc += 7;
+}
+
 /**
  *  Convenience function for setting flags depending of the value of value parameter.
  */
@@ -685,10 +931,9 @@ typedef struct instruction
 }
 instruction;
 
-// Add With Carry
-static void adc (addressing_mode mode)
+/* add adds b and the carry to A */
+static void add (uint8_t b)
 {
-	uint16_t b = get_value (mode);
 	uint16_t v = b + a + (ps & CARRY);
 	uint8_t  c = v;
 
@@ -702,6 +947,12 @@ static void adc (addressing_mode mode)
 
 	a = c;
 }
+
+// Add With Carry
+static void adc (addressing_mode mode)
+{
+	add (get_value (mode));
+}
 static const instruction ADC = { "ADC", &adc };
 
 
@@ -722,7 +973,10 @@ static void asl (addressing_mode mode) {
 	if (mode == ACCUMULATOR)
 		v = a;
 	else
+	{
 		v = MEM (adr);
+		DUMMY_WRITE (v, adr);
+	}
 
 	ps &= ~CARRY;
 	// set carry flag to bit 7 of value (indicates overflow)
@@ -836,10 +1090,9 @@ static const instruction BPL = { "BPL", &bpl };
 // Force interrupt
 static void brk (addressing_mode mode)
 {
-	ps |= BREAK;
-	uint16_t irq_vector = memory[IRQ_VECTOR + 1];
-	irq_vector = irq_vector << 8 | memory[IRQ_VECTOR];
-	interrupt (irq_vector);
+	uint16_t irq_vector = MEM (IRQ_VECTOR + 1);
+	irq_vector = (irq_vector << 8) | MEM (IRQ_VECTOR);
+	interrupt (irq_vector, UNUSED | BREAK);
 }
 static const instruction BRK = { "BRK", &brk };
 
@@ -902,13 +1155,18 @@ static void clv (addressing_mode mode)
 static const instruction CLV = { "CLV", &clv };
 
 
+/* compare sets the flags of comparing register r to v */
+static void compare (uint8_t r, uint8_t v)
+{
+	set_flags (r - v, ZERO | NEGATIVE | CARRY);
+	if (r >= v)
+		ps |= CARRY;
+}
+
 // Compare
 static void cmp (addressing_mode mode)
 {
-	uint8_t v = get_value (mode);
-	set_flags (a - v, ZERO | NEGATIVE | CARRY);
-	if (a >= v)
-		ps |= CARRY;
+	compare (a, get_value (mode));
 }
 static const instruction CMP = { "CMP", &cmp };
 
@@ -939,7 +1197,9 @@ static const instruction CPY = { "CPY", &cpy };
 static void dec (addressing_mode mode)
 {
 	uint16_t adr  = calculate_address (mode);
-	uint8_t value = mem_read (adr) - 1;
+	uint8_t value = mem_read (adr);
+	DUMMY_WRITE (value, adr);
+	value --;
 	set_flags (value, ZERO | NEGATIVE);
 	mem_store (value, adr);
 }
@@ -978,7 +1238,9 @@ static const instruction EOR = { "EOR", &eor };
 static void inc (addressing_mode mode)
 {
 	uint16_t adr = calculate_address (mode);
-	uint8_t value = mem_read (adr) + 1;
+	uint8_t value = mem_read (adr);
+	DUMMY_WRITE (value, adr);
+	value ++;
 	set_flags (value, ZERO | NEGATIVE);
 	mem_store (value, adr);
 }
@@ -1058,7 +1320,10 @@ static void lsr (addressing_mode mode)
 	if (mode == ACCUMULATOR)
 		b = a;
 	else
+	{
 		b = mem_read (adr);
+		DUMMY_WRITE (b, adr);
+	}
 
 	ps  &= ~CARRY;
 	ps  |= b & 1;
@@ -1098,7 +1363,7 @@ static const instruction PHA = { "PHA", &pha };
 // Push processor status
 static void php (addressing_mode mode)
 {
-	push (ps | 0x30);
+	push (ps | UNUSED | BREAK);
 }
 static const instruction PHP = { "PHP", &php };
 
@@ -1115,7 +1380,7 @@ static const instruction PLA = { "PLA", &pla };
 // Pull processor status
 static void plp (addressing_mode mode)
 {
-	ps = pop ();
+	ps = (pop () & ~BREAK) | UNUSED;
 }
 static const instruction PLP = { "PLP", &plp };
 
@@ -1129,7 +1394,10 @@ static void rol (addressing_mode mode)
 	if (mode == ACCUMULATOR)
 		b = a;
 	else
+	{
 		b = mem_read (adr);
+		DUMMY_WRITE (b, adr);
+	}
 
 	uint8_t c = b >> 7 & 1;
 	b  <<= 1;
@@ -1156,7 +1424,10 @@ static void ror (addressing_mode mode)
 	if (mode == ACCUMULATOR)
 		b = a;
 	else
+	{
 		b = mem_read (adr);
+		DUMMY_WRITE (b, adr);
+	}
 
 	uint8_t c = b & 1;
 	b  >>= 1;
@@ -1177,7 +1448,7 @@ static const instruction ROR = { "ROR", &ror };
 // Return from interrupt
 static void rti (addressing_mode mode)
 {
-	ps = pop ();
+	ps = (pop () & ~BREAK) | UNUSED;
 	pc = pop ();
 	uint16_t b = pop ();
 	pc |= b << 8;
@@ -1196,10 +1467,10 @@ static void rts (addressing_mode mode)
 static const instruction RTS = { "RTS", &rts };
 
 
-// Subtract with carry
-static void sbc (addressing_mode mode)
+/* subtract subtracts b and the borrow from A */
+static void subtract (uint8_t value)
 {
-	int16_t b = get_value (mode);
+	int16_t b = value;
 	int16_t c = a - b - (1 - (ps & CARRY));
 
 	ps &= ~(CARRY | OVERFLOW); // reset CARRY and OVERFLOW
@@ -1213,6 +1484,12 @@ static void sbc (addressing_mode mode)
 	a = c; // store to A and set ZERO and NEGATIVE flag
 	set_flags (a, ZERO | NEGATIVE);
 }
+
+// Subtract with carry
+static void sbc (addressing_mode mode)
+{
+	subtract (get_value (mode));
+}
 static const instruction SBC = { "SBC", &sbc };
 
 
@@ -1320,8 +1597,266 @@ static void tya (addressing_mode mode)
 static const instruction TYA = { "TYA", &tya };
 
 
-// Illegal operation
-static const instruction unknown_instruction = { "[*]", &nop };
+/**
+ *  Unofficial instructions.
+ */
+
+// NOP that reads its operand
+static void nop_read (addressing_mode mode)
+{
+	get_value (mode);
+}
+static const instruction NOP_READ = { "NOP", &nop_read };
+
+
+// Load A and X
+static void lax (addressing_mode mode)
+{
+	a = x = get_value (mode);
+	set_flags (a, ZERO | NEGATIVE);
+}
+static const instruction LAX = { "LAX", &lax };
+
+
+// Store A AND X
+static void sax (addressing_mode mode)
+{
+	uint16_t adr = calculate_address (mode);
+	mem_store (a & x, adr);
+}
+static const instruction SAX = { "SAX", &sax };
+
+
+// Decrement memory and compare with A
+static void dcp (addressing_mode mode)
+{
+	uint16_t adr  = calculate_address (mode);
+	uint8_t value = mem_read (adr);
+	DUMMY_WRITE (value, adr);
+	value --;
+	mem_store (value, adr);
+	compare (a, value);
+}
+static const instruction DCP = { "DCP", &dcp };
+
+
+// Increment memory and subtract from A
+static void isb (addressing_mode mode)
+{
+	uint16_t adr  = calculate_address (mode);
+	uint8_t value = mem_read (adr);
+	DUMMY_WRITE (value, adr);
+	value ++;
+	mem_store (value, adr);
+	subtract (value);
+}
+static const instruction ISB = { "ISB", &isb };
+
+
+// Shift memory left and OR with A
+static void slo (addressing_mode mode)
+{
+	uint16_t adr = calculate_address (mode);
+	uint8_t  b   = mem_read (adr);
+	DUMMY_WRITE (b, adr);
+	ps  &= ~CARRY;
+	ps  |= b >> 7;
+	b  <<= 1;
+	mem_store (b, adr);
+	a |= b;
+	set_flags (a, ZERO | NEGATIVE);
+}
+static const instruction SLO = { "SLO", &slo };
+
+
+// Rotate memory left and AND with A
+static void rla (addressing_mode mode)
+{
+	uint16_t adr = calculate_address (mode);
+	uint8_t  b   = mem_read (adr);
+	DUMMY_WRITE (b, adr);
+	uint8_t  c   = b >> 7;
+	b  <<= 1;
+	b   |= ps & CARRY;
+	ps  &= ~CARRY;
+	ps  |= c;
+	mem_store (b, adr);
+	a &= b;
+	set_flags (a, ZERO | NEGATIVE);
+}
+static const instruction RLA = { "RLA", &rla };
+
+
+// Shift memory right and EOR with A
+static void sre (addressing_mode mode)
+{
+	uint16_t adr = calculate_address (mode);
+	uint8_t  b   = mem_read (adr);
+	DUMMY_WRITE (b, adr);
+	ps  &= ~CARRY;
+	ps  |= b & 1;
+	b  >>= 1;
+	mem_store (b, adr);
+	a ^= b;
+	set_flags (a, ZERO | NEGATIVE);
+}
+static const instruction SRE = { "SRE", &sre };
+
+
+// Rotate memory right and add to A
+static void rra (addressing_mode mode)
+{
+	uint16_t adr = calculate_address (mode);
+	uint8_t  b   = mem_read (adr);
+	DUMMY_WRITE (b, adr);
+	uint8_t  c   = b & 1;
+	b  >>= 1;
+	b   |= (ps & CARRY) << 7;
+	ps  &= ~CARRY;
+	ps  |= c;
+	mem_store (b, adr);
+	add (b);
+}
+static const instruction RRA = { "RRA", &rra };
+
+
+// AND with A and copy bit 7 to carry
+static void anc (addressing_mode mode)
+{
+	a &= get_value (mode);
+	set_flags (a, ZERO | NEGATIVE | CARRY);
+	ps |= a >> 7;
+}
+static const instruction ANC = { "ANC", &anc };
+
+
+// AND with A and shift A right
+static void alr (addressing_mode mode)
+{
+	a &= get_value (mode);
+	set_flags (a >> 1, ZERO | NEGATIVE | CARRY);
+	ps |= a & 1;
+	a >>= 1;
+}
+static const instruction ALR = { "ALR", &alr };
+
+
+// AND with A and rotate A right, carry and overflow come from bits 6 and 5 of the result
+static void arr (addressing_mode mode)
+{
+	a &= get_value (mode);
+	a = (a >> 1) | (ps & CARRY) << 7;
+	set_flags (a, ZERO | NEGATIVE | CARRY | OVERFLOW);
+	ps |= a >> 6 & 1;
+	if (((a >> 6) ^ (a >> 5)) & 1)
+		ps |= OVERFLOW;
+}
+static const instruction ARR = { "ARR", &arr };
+
+
+// Set X to A AND X minus value, without borrow
+static void axs (addressing_mode mode)
+{
+	uint8_t v = get_value (mode);
+	compare (a & x, v);
+	x = (a & x) - v;
+}
+static const instruction AXS = { "AXS", &axs };
+
+
+/**
+ *  Unstable unofficial instructions, which do not behave the same on all consoles. They are
+ *  implemented as on most of them.
+ */
+
+/* UNSTABLE_MAGIC is ORed into A by XAA and LAX #i, it depends on the console */
+#define UNSTABLE_MAGIC 0xEE
+
+/**
+ *  store_high stores value ANDed with the high byte of the base address plus one. When the index
+ *  crosses a page the high byte of the address is replaced by the value stored.
+ */
+static void store_high (addressing_mode mode, uint8_t index, uint8_t value)
+{
+	uint16_t adr  = calculate_address (mode);
+	uint16_t base = adr - index;
+	value &= (base >> 8) + 1;
+	if (DIFF_PAGE (adr, base))
+		adr = value << 8 | (adr & 0xFF);
+	mem_store (value, adr);
+}
+
+
+// AND X with A and the value
+static void xaa (addressing_mode mode)
+{
+	a = (a | UNSTABLE_MAGIC) & x & get_value (mode);
+	set_flags (a, ZERO | NEGATIVE);
+}
+static const instruction XAA = { "XAA", &xaa };
+
+
+// Load A and X with A AND the value
+static void lxa (addressing_mode mode)
+{
+	a = x = (a | UNSTABLE_MAGIC) & get_value (mode);
+	set_flags (a, ZERO | NEGATIVE);
+}
+static const instruction LXA = { "LAX", &lxa };
+
+
+// Store A AND X AND the high byte of the address plus one
+static void ahx (addressing_mode mode)
+{
+	store_high (mode, y, a & x);
+}
+static const instruction AHX = { "AHX", &ahx };
+
+
+// Store Y AND the high byte of the address plus one
+static void shy (addressing_mode mode)
+{
+	store_high (mode, x, y);
+}
+static const instruction SHY = { "SHY", &shy };
+
+
+// Store X AND the high byte of the address plus one
+static void shx (addressing_mode mode)
+{
+	store_high (mode, y, x);
+}
+static const instruction SHX = { "SHX", &shx };
+
+
+// Set the stack pointer to A AND X, and store it AND the high byte of the address plus one
+static void tas (addressing_mode mode)
+{
+	sp = a & x;
+	store_high (mode, y, sp);
+}
+static const instruction TAS = { "TAS", &tas };
+
+
+// Load A, X and the stack pointer with the value AND the stack pointer
+static void las (addressing_mode mode)
+{
+	a = x = sp = get_value (mode) & sp;
+	set_flags (a, ZERO | NEGATIVE);
+}
+static const instruction LAS = { "LAS", &las };
+
+
+/**
+ *  Halt the CPU. It stops fetching instructions until it is reset, while the rest of the
+ *  hardware keeps running. PC stays on the opcode.
+ */
+static void kil (addressing_mode mode)
+{
+	flags |= STOP;
+	pc --;
+}
+static const instruction KIL = { "KIL", &kil };
 
 
 /**
@@ -1344,6 +1879,10 @@ operation;
 */
 static void operation_exec (operation *op)
 {
+#ifdef ACCURATE
+	// instructions writing to indexed addresses do not have extra cycles for page crosses
+	indexed_write = op->cc_page_cross == 0;
+#endif
 	// execute instruction
 	op->instr->exec (op->mode);
 	// increment PC and CPUCC
@@ -1356,155 +1895,325 @@ static void operation_exec (operation *op)
 	flags &= ~PAGE_CROSS; // reset page cross flag
 }
 
-#ifdef VERBOSE
-	static void operation_to_string (operation *op, char *dest)
-	{
-		pc ++;
-		sprintf (dest, "%s ", op->instr->name);
-		address_calculators_string[op->mode](dest + 4);
-		pc --;
-	}
-#endif
-
-#define illegal_operation \
-{\
-	&unknown_instruction,\
-	IMPLICIT,\
-	0,\
-	0,\
-	0\
-}
+#define jam {&KIL, IMPLICIT, 0, 2, 0}
 // opcode to operation map
 static operation operations[16][16] =
 {
-	{{&BRK, IMPLICIT, 0, 7, 0},    {&ORA, INDEXED_INDIRECT, 1, 6, 0},  illegal_operation,           illegal_operation,
-	 illegal_operation,            {&ORA, ZERO_PAGE,        1, 3, 0}, {&ASL, ZERO_PAGE,   1, 5, 0}, illegal_operation,
-	 {&PHP, IMPLICIT, 0, 3, 0},    {&ORA, IMMEDIATE,        1, 2, 0}, {&ASL, ACCUMULATOR, 0, 2, 0}, illegal_operation,
-	 illegal_operation,            {&ORA, ABSOLUTE,         2, 4, 0}, {&ASL, ABSOLUTE,    2, 6, 0}, illegal_operation},
+	{{&BRK, IMPLICIT, 0, 7, 0},    {&ORA, INDEXED_INDIRECT, 1, 6, 0},  jam,                         {&SLO, INDEXED_INDIRECT, 1, 8, 0},
+	 {&NOP_READ, ZERO_PAGE, 1, 3, 0}, {&ORA, ZERO_PAGE,        1, 3, 0}, {&ASL, ZERO_PAGE,   1, 5, 0}, {&SLO, ZERO_PAGE, 1, 5, 0},
+	 {&PHP, IMPLICIT, 0, 3, 0},    {&ORA, IMMEDIATE,        1, 2, 0}, {&ASL, ACCUMULATOR, 0, 2, 0}, {&ANC, IMMEDIATE, 1, 2, 0},
+	 {&NOP_READ, ABSOLUTE, 2, 4, 0}, {&ORA, ABSOLUTE,         2, 4, 0}, {&ASL, ABSOLUTE,    2, 6, 0}, {&SLO, ABSOLUTE, 2, 6, 0}},
 	// 0x1
-	{{&BPL, RELATIVE, 1, 2, 0},    {&ORA, INDIRECT_INDEXED, 1, 5, 1}, illegal_operation,            illegal_operation,
-	 illegal_operation,            {&ORA, ZERO_PAGE_X,      1, 4, 0}, {&ASL, ZERO_PAGE_X, 1, 6, 0}, illegal_operation,
-	 {&CLC, IMPLICIT, 0, 2, 0},    {&ORA, ABSOLUTE_Y,       2, 4, 1}, illegal_operation,            illegal_operation,
-	 illegal_operation,            {&ORA, ABSOLUTE_X,       2, 4, 1}, {&ASL, ABSOLUTE_X,  2, 7, 0}, illegal_operation},
+	{{&BPL, RELATIVE, 1, 2, 0},    {&ORA, INDIRECT_INDEXED, 1, 5, 1}, jam,                          {&SLO, INDIRECT_INDEXED, 1, 8, 0},
+	 {&NOP_READ, ZERO_PAGE_X, 1, 4, 0}, {&ORA, ZERO_PAGE_X,      1, 4, 0}, {&ASL, ZERO_PAGE_X, 1, 6, 0}, {&SLO, ZERO_PAGE_X, 1, 6, 0},
+	 {&CLC, IMPLICIT, 0, 2, 0},    {&ORA, ABSOLUTE_Y,       2, 4, 1}, {&NOP, IMPLICIT, 0, 2, 0}, {&SLO, ABSOLUTE_Y, 2, 7, 0},
+	 {&NOP_READ, ABSOLUTE_X, 2, 4, 1}, {&ORA, ABSOLUTE_X,       2, 4, 1}, {&ASL, ABSOLUTE_X,  2, 7, 0}, {&SLO, ABSOLUTE_X, 2, 7, 0}},
 	// 0x2
-	{{&JSR, ABSOLUTE,  0, 6, 0},   {&AND, INDEXED_INDIRECT, 1, 6, 0}, illegal_operation,            illegal_operation,
-	 {&BIT, ZERO_PAGE, 1, 3, 0},   {&AND, ZERO_PAGE,        1, 3, 0}, {&ROL, ZERO_PAGE,   1, 5, 0}, illegal_operation,
-	 {&PLP, IMPLICIT,  0, 4, 0},   {&AND, IMMEDIATE,        1, 2, 0}, {&ROL, ACCUMULATOR, 0, 2, 0}, illegal_operation,
-	 {&BIT, ABSOLUTE,  2, 4, 0},   {&AND, ABSOLUTE,         2, 4, 0}, {&ROL, ABSOLUTE,    2, 6, 0}, illegal_operation},
+	{{&JSR, ABSOLUTE,  0, 6, 0},   {&AND, INDEXED_INDIRECT, 1, 6, 0}, jam,                          {&RLA, INDEXED_INDIRECT, 1, 8, 0},
+	 {&BIT, ZERO_PAGE, 1, 3, 0},   {&AND, ZERO_PAGE,        1, 3, 0}, {&ROL, ZERO_PAGE,   1, 5, 0}, {&RLA, ZERO_PAGE, 1, 5, 0},
+	 {&PLP, IMPLICIT,  0, 4, 0},   {&AND, IMMEDIATE,        1, 2, 0}, {&ROL, ACCUMULATOR, 0, 2, 0}, {&ANC, IMMEDIATE, 1, 2, 0},
+	 {&BIT, ABSOLUTE,  2, 4, 0},   {&AND, ABSOLUTE,         2, 4, 0}, {&ROL, ABSOLUTE,    2, 6, 0}, {&RLA, ABSOLUTE, 2, 6, 0}},
 	// 0x3
-	{{&BMI, RELATIVE, 1, 2, 0},    {&AND, INDIRECT_INDEXED, 1, 5, 1}, illegal_operation,            illegal_operation,
-	 illegal_operation,            {&AND, ZERO_PAGE_X,      1, 4, 0}, {&ROL, ZERO_PAGE_X, 1, 6, 0}, illegal_operation,
-	 {&SEC, IMPLICIT, 0, 2, 0},    {&AND, ABSOLUTE_Y,       2, 4, 1}, illegal_operation,            illegal_operation,
-	 illegal_operation,            {&AND, ABSOLUTE_X,       2, 4, 1}, {&ROL, ABSOLUTE_X,  2, 7, 0}, illegal_operation},
+	{{&BMI, RELATIVE, 1, 2, 0},    {&AND, INDIRECT_INDEXED, 1, 5, 1}, jam,                          {&RLA, INDIRECT_INDEXED, 1, 8, 0},
+	 {&NOP_READ, ZERO_PAGE_X, 1, 4, 0}, {&AND, ZERO_PAGE_X,      1, 4, 0}, {&ROL, ZERO_PAGE_X, 1, 6, 0}, {&RLA, ZERO_PAGE_X, 1, 6, 0},
+	 {&SEC, IMPLICIT, 0, 2, 0},    {&AND, ABSOLUTE_Y,       2, 4, 1}, {&NOP, IMPLICIT, 0, 2, 0}, {&RLA, ABSOLUTE_Y, 2, 7, 0},
+	 {&NOP_READ, ABSOLUTE_X, 2, 4, 1}, {&AND, ABSOLUTE_X,       2, 4, 1}, {&ROL, ABSOLUTE_X,  2, 7, 0}, {&RLA, ABSOLUTE_X, 2, 7, 0}},
 	// 0x4
-	{{&RTI, IMPLICIT, 0, 6, 0},    {&EOR, INDEXED_INDIRECT, 1, 6, 0}, illegal_operation,            illegal_operation,
-	 illegal_operation,            {&EOR, ZERO_PAGE,        1, 3, 0}, {&LSR, ZERO_PAGE,   1, 5, 0}, illegal_operation,
-	 {&PHA, IMPLICIT, 0, 3, 0},    {&EOR, IMMEDIATE,        1, 2, 0}, {&LSR, ACCUMULATOR, 0, 2, 0}, illegal_operation,
-	 {&JMP, ABSOLUTE, 0, 3, 0},    {&EOR, ABSOLUTE,         2, 4, 0}, {&LSR, ABSOLUTE,    2, 6, 0}, illegal_operation},
+	{{&RTI, IMPLICIT, 0, 6, 0},    {&EOR, INDEXED_INDIRECT, 1, 6, 0}, jam,                          {&SRE, INDEXED_INDIRECT, 1, 8, 0},
+	 {&NOP_READ, ZERO_PAGE, 1, 3, 0}, {&EOR, ZERO_PAGE,        1, 3, 0}, {&LSR, ZERO_PAGE,   1, 5, 0}, {&SRE, ZERO_PAGE, 1, 5, 0},
+	 {&PHA, IMPLICIT, 0, 3, 0},    {&EOR, IMMEDIATE,        1, 2, 0}, {&LSR, ACCUMULATOR, 0, 2, 0}, {&ALR, IMMEDIATE, 1, 2, 0},
+	 {&JMP, ABSOLUTE, 0, 3, 0},    {&EOR, ABSOLUTE,         2, 4, 0}, {&LSR, ABSOLUTE,    2, 6, 0}, {&SRE, ABSOLUTE, 2, 6, 0}},
 	// 0x5
-	{{&BVC, RELATIVE, 1, 2, 0},    {&EOR, INDIRECT_INDEXED, 1, 5, 1}, illegal_operation,            illegal_operation,
-	 illegal_operation,            {&EOR, ZERO_PAGE_X,      1, 4, 0}, {&LSR, ZERO_PAGE_X, 1, 6, 0}, illegal_operation,
-	 {&CLI, IMPLICIT, 0, 2, 0},    {&EOR, ABSOLUTE_Y,       2, 4, 1}, illegal_operation,            illegal_operation,
-	 illegal_operation,            {&EOR, ABSOLUTE_X,       2, 4, 1}, {&LSR, ABSOLUTE_X,  2, 7, 0}, illegal_operation},
+	{{&BVC, RELATIVE, 1, 2, 0},    {&EOR, INDIRECT_INDEXED, 1, 5, 1}, jam,                          {&SRE, INDIRECT_INDEXED, 1, 8, 0},
+	 {&NOP_READ, ZERO_PAGE_X, 1, 4, 0}, {&EOR, ZERO_PAGE_X,      1, 4, 0}, {&LSR, ZERO_PAGE_X, 1, 6, 0}, {&SRE, ZERO_PAGE_X, 1, 6, 0},
+	 {&CLI, IMPLICIT, 0, 2, 0},    {&EOR, ABSOLUTE_Y,       2, 4, 1}, {&NOP, IMPLICIT, 0, 2, 0}, {&SRE, ABSOLUTE_Y, 2, 7, 0},
+	 {&NOP_READ, ABSOLUTE_X, 2, 4, 1}, {&EOR, ABSOLUTE_X,       2, 4, 1}, {&LSR, ABSOLUTE_X,  2, 7, 0}, {&SRE, ABSOLUTE_X, 2, 7, 0}},
 	// 0x6
-	{{&RTS, IMPLICIT, 0, 6, 0},    {&ADC, INDEXED_INDIRECT, 1, 5, 0}, illegal_operation,            illegal_operation,
-	 illegal_operation,            {&ADC, ZERO_PAGE,        1, 3, 0}, {&ROR, ZERO_PAGE,   1, 5, 0}, illegal_operation,
-	 {&PLA, IMPLICIT, 0, 4, 0},    {&ADC, IMMEDIATE,        1, 2, 0}, {&ROR, ACCUMULATOR, 0, 2, 0}, illegal_operation,
-	 {&JMP, INDIRECT, 0, 5, 0},    {&ADC, ABSOLUTE,         2, 4, 0}, {&ROR, ABSOLUTE,    2, 6, 0}, illegal_operation},
+	{{&RTS, IMPLICIT, 0, 6, 0},    {&ADC, INDEXED_INDIRECT, 1, 6, 0}, jam,                          {&RRA, INDEXED_INDIRECT, 1, 8, 0},
+	 {&NOP_READ, ZERO_PAGE, 1, 3, 0}, {&ADC, ZERO_PAGE,        1, 3, 0}, {&ROR, ZERO_PAGE,   1, 5, 0}, {&RRA, ZERO_PAGE, 1, 5, 0},
+	 {&PLA, IMPLICIT, 0, 4, 0},    {&ADC, IMMEDIATE,        1, 2, 0}, {&ROR, ACCUMULATOR, 0, 2, 0}, {&ARR, IMMEDIATE, 1, 2, 0},
+	 {&JMP, INDIRECT, 0, 5, 0},    {&ADC, ABSOLUTE,         2, 4, 0}, {&ROR, ABSOLUTE,    2, 6, 0}, {&RRA, ABSOLUTE, 2, 6, 0}},
 	// 0x7
-	{{&BVS, RELATIVE, 1, 2, 0},    {&ADC, INDIRECT_INDEXED, 1, 4, 1}, illegal_operation,            illegal_operation,
-	 illegal_operation,            {&ADC, ZERO_PAGE_X,      1, 4, 0}, {&ROR, ZERO_PAGE_X, 1, 6, 0}, illegal_operation,
-	 {&SEI, IMPLICIT, 0, 2, 0},    {&ADC, ABSOLUTE_Y,       2, 4, 1}, illegal_operation,            illegal_operation,
-	 illegal_operation,            {&ADC, ABSOLUTE_X,       2, 4, 1}, {&ROR, ABSOLUTE_X,  2, 7, 0}, illegal_operation},
+	{{&BVS, RELATIVE, 1, 2, 0},    {&ADC, INDIRECT_INDEXED, 1, 5, 1}, jam,                          {&RRA, INDIRECT_INDEXED, 1, 8, 0},
+	 {&NOP_READ, ZERO_PAGE_X, 1, 4, 0}, {&ADC, ZERO_PAGE_X,      1, 4, 0}, {&ROR, ZERO_PAGE_X, 1, 6, 0}, {&RRA, ZERO_PAGE_X, 1, 6, 0},
+	 {&SEI, IMPLICIT, 0, 2, 0},    {&ADC, ABSOLUTE_Y,       2, 4, 1}, {&NOP, IMPLICIT, 0, 2, 0}, {&RRA, ABSOLUTE_Y, 2, 7, 0},
+	 {&NOP_READ, ABSOLUTE_X, 2, 4, 1}, {&ADC, ABSOLUTE_X,       2, 4, 1}, {&ROR, ABSOLUTE_X,  2, 7, 0}, {&RRA, ABSOLUTE_X, 2, 7, 0}},
 	// 0x8
-	{illegal_operation,            {&STA, INDEXED_INDIRECT, 1, 6, 0}, illegal_operation,            illegal_operation,
-	 {&STY, ZERO_PAGE, 1, 3, 0},   {&STA, ZERO_PAGE,        1, 3, 0}, {&STX, ZERO_PAGE,   1, 3, 0}, illegal_operation,
-	 {&DEY, IMPLICIT,  0, 2, 0},    illegal_operation,                {&TXA, IMPLICIT,    0, 2, 0}, illegal_operation,
-	 {&STY, ABSOLUTE,  2, 4, 0},   {&STA, ABSOLUTE,         2, 4, 0}, {&STX, ABSOLUTE,    2, 4, 0}, illegal_operation},
+	{{&NOP_READ, IMMEDIATE, 1, 2, 0}, {&STA, INDEXED_INDIRECT, 1, 6, 0}, {&NOP_READ, IMMEDIATE, 1, 2, 0}, {&SAX, INDEXED_INDIRECT, 1, 6, 0},
+	 {&STY, ZERO_PAGE, 1, 3, 0},   {&STA, ZERO_PAGE,        1, 3, 0}, {&STX, ZERO_PAGE,   1, 3, 0}, {&SAX, ZERO_PAGE, 1, 3, 0},
+	 {&DEY, IMPLICIT,  0, 2, 0},    {&NOP_READ, IMMEDIATE, 1, 2, 0}, {&TXA, IMPLICIT,    0, 2, 0}, {&XAA, IMMEDIATE, 1, 2, 0},
+	 {&STY, ABSOLUTE,  2, 4, 0},   {&STA, ABSOLUTE,         2, 4, 0}, {&STX, ABSOLUTE,    2, 4, 0}, {&SAX, ABSOLUTE, 2, 4, 0}},
 	// 0x9
-	{{&BCC, RELATIVE,    1, 2, 0}, {&STA, INDIRECT_INDEXED, 1, 6, 0}, illegal_operation,            illegal_operation,
-	 {&STY, ZERO_PAGE_X, 1, 4, 0}, {&STA, ZERO_PAGE_X,      1, 4, 0}, {&STX, ZERO_PAGE_Y, 1, 4, 0}, illegal_operation,
-	 {&TYA, IMPLICIT,    0, 2, 0}, {&STA, ABSOLUTE_Y,       2, 5, 0}, {&TXS, IMPLICIT,    0, 2, 0}, illegal_operation,
-	 illegal_operation,            {&STA, ABSOLUTE_X,       2, 5, 0}, illegal_operation,            illegal_operation},
+	{{&BCC, RELATIVE,    1, 2, 0}, {&STA, INDIRECT_INDEXED, 1, 6, 0}, jam,                          {&AHX, INDIRECT_INDEXED, 1, 6, 0},
+	 {&STY, ZERO_PAGE_X, 1, 4, 0}, {&STA, ZERO_PAGE_X,      1, 4, 0}, {&STX, ZERO_PAGE_Y, 1, 4, 0}, {&SAX, ZERO_PAGE_Y, 1, 4, 0},
+	 {&TYA, IMPLICIT,    0, 2, 0}, {&STA, ABSOLUTE_Y,       2, 5, 0}, {&TXS, IMPLICIT,    0, 2, 0}, {&TAS, ABSOLUTE_Y, 2, 5, 0},
+	 {&SHY, ABSOLUTE_X,  2, 5, 0}, {&STA, ABSOLUTE_X,       2, 5, 0}, {&SHX, ABSOLUTE_Y,  2, 5, 0}, {&AHX, ABSOLUTE_Y, 2, 5, 0}},
 	// 0xa
-	{{&LDY, IMMEDIATE, 1, 2, 0},   {&LDA, INDEXED_INDIRECT, 1, 6, 0}, {&LDX, IMMEDIATE,   1, 2, 0}, illegal_operation,
-	 {&LDY, ZERO_PAGE, 1, 3, 0},   {&LDA, ZERO_PAGE,        1, 3, 0}, {&LDX, ZERO_PAGE,   1, 3, 0}, illegal_operation,
-	 {&TAY, IMPLICIT,  0, 2, 0},   {&LDA, IMMEDIATE,        1, 2, 0}, {&TAX, IMPLICIT,    0, 2, 0}, illegal_operation,
-	 {&LDY, ABSOLUTE,  2, 4, 0},   {&LDA, ABSOLUTE,         2, 4, 0}, {&LDX, ABSOLUTE,    2, 4, 0}, illegal_operation},
+	{{&LDY, IMMEDIATE, 1, 2, 0},   {&LDA, INDEXED_INDIRECT, 1, 6, 0}, {&LDX, IMMEDIATE,   1, 2, 0}, {&LAX, INDEXED_INDIRECT, 1, 6, 0},
+	 {&LDY, ZERO_PAGE, 1, 3, 0},   {&LDA, ZERO_PAGE,        1, 3, 0}, {&LDX, ZERO_PAGE,   1, 3, 0}, {&LAX, ZERO_PAGE, 1, 3, 0},
+	 {&TAY, IMPLICIT,  0, 2, 0},   {&LDA, IMMEDIATE,        1, 2, 0}, {&TAX, IMPLICIT,    0, 2, 0}, {&LXA, IMMEDIATE, 1, 2, 0},
+	 {&LDY, ABSOLUTE,  2, 4, 0},   {&LDA, ABSOLUTE,         2, 4, 0}, {&LDX, ABSOLUTE,    2, 4, 0}, {&LAX, ABSOLUTE, 2, 4, 0}},
 	// 0xb
-	{{&BCS, RELATIVE,    1, 2, 0}, {&LDA, INDIRECT_INDEXED, 1, 5, 1}, illegal_operation,            illegal_operation,
-	 {&LDY, ZERO_PAGE_X, 1, 4, 0}, {&LDA, ZERO_PAGE_X,      1, 4, 0}, {&LDX, ZERO_PAGE_Y, 1, 4, 0}, illegal_operation,
-	 {&CLV, IMPLICIT,    0, 2, 0}, {&LDA, ABSOLUTE_Y,       2, 4, 1}, {&TSX, IMPLICIT,    0, 2, 0}, illegal_operation,
-	 {&LDY, ABSOLUTE_X,  2, 4, 1}, {&LDA, ABSOLUTE_X,       2, 4, 1}, {&LDX, ABSOLUTE_Y,  2, 4, 1}, illegal_operation},
+	{{&BCS, RELATIVE,    1, 2, 0}, {&LDA, INDIRECT_INDEXED, 1, 5, 1}, jam,                          {&LAX, INDIRECT_INDEXED, 1, 5, 1},
+	 {&LDY, ZERO_PAGE_X, 1, 4, 0}, {&LDA, ZERO_PAGE_X,      1, 4, 0}, {&LDX, ZERO_PAGE_Y, 1, 4, 0}, {&LAX, ZERO_PAGE_Y, 1, 4, 0},
+	 {&CLV, IMPLICIT,    0, 2, 0}, {&LDA, ABSOLUTE_Y,       2, 4, 1}, {&TSX, IMPLICIT,    0, 2, 0}, {&LAS, ABSOLUTE_Y, 2, 4, 1},
+	 {&LDY, ABSOLUTE_X,  2, 4, 1}, {&LDA, ABSOLUTE_X,       2, 4, 1}, {&LDX, ABSOLUTE_Y,  2, 4, 1}, {&LAX, ABSOLUTE_Y, 2, 4, 1}},
 	// 0xc
-	{{&CPY, IMMEDIATE, 1, 2, 0},   {&CMP, INDEXED_INDIRECT, 1, 6, 0}, illegal_operation,            illegal_operation,
-	 {&CPY, ZERO_PAGE, 1, 3, 0},   {&CMP, ZERO_PAGE,        1, 3, 0}, {&DEC, ZERO_PAGE,   1, 5, 0}, illegal_operation,
-	 {&INY, IMPLICIT,  0, 2, 0},   {&CMP, IMMEDIATE,        1, 2, 0}, {&DEX, IMPLICIT,    0, 2, 0}, illegal_operation,
-	 {&CPY, ABSOLUTE,  2, 4, 0},   {&CMP, ABSOLUTE,         2, 4, 0}, {&DEC, ABSOLUTE,    2, 6, 0}, illegal_operation},
+	{{&CPY, IMMEDIATE, 1, 2, 0},   {&CMP, INDEXED_INDIRECT, 1, 6, 0}, {&NOP_READ, IMMEDIATE, 1, 2, 0}, {&DCP, INDEXED_INDIRECT, 1, 8, 0},
+	 {&CPY, ZERO_PAGE, 1, 3, 0},   {&CMP, ZERO_PAGE,        1, 3, 0}, {&DEC, ZERO_PAGE,   1, 5, 0}, {&DCP, ZERO_PAGE, 1, 5, 0},
+	 {&INY, IMPLICIT,  0, 2, 0},   {&CMP, IMMEDIATE,        1, 2, 0}, {&DEX, IMPLICIT,    0, 2, 0}, {&AXS, IMMEDIATE, 1, 2, 0},
+	 {&CPY, ABSOLUTE,  2, 4, 0},   {&CMP, ABSOLUTE,         2, 4, 0}, {&DEC, ABSOLUTE,    2, 6, 0}, {&DCP, ABSOLUTE, 2, 6, 0}},
 	// 0xd
-	{{&BNE, RELATIVE,  1, 2, 0},   {&CMP, INDIRECT_INDEXED, 1, 5, 1}, illegal_operation,            illegal_operation,
-	 illegal_operation,            {&CMP, ZERO_PAGE_X,      1, 4, 0}, {&DEC, ZERO_PAGE_X, 1, 6, 0}, illegal_operation,
-	 {&CLD, IMPLICIT,  0, 2, 0},   {&CMP, ABSOLUTE_Y,       2, 4, 1}, illegal_operation,            illegal_operation,
-	 illegal_operation,            {&CMP, ABSOLUTE_X,       2, 4, 1}, {&DEC, ABSOLUTE_X,  2, 7, 0}, illegal_operation},
+	{{&BNE, RELATIVE,  1, 2, 0},   {&CMP, INDIRECT_INDEXED, 1, 5, 1}, jam,                          {&DCP, INDIRECT_INDEXED, 1, 8, 0},
+	 {&NOP_READ, ZERO_PAGE_X, 1, 4, 0}, {&CMP, ZERO_PAGE_X,      1, 4, 0}, {&DEC, ZERO_PAGE_X, 1, 6, 0}, {&DCP, ZERO_PAGE_X, 1, 6, 0},
+	 {&CLD, IMPLICIT,  0, 2, 0},   {&CMP, ABSOLUTE_Y,       2, 4, 1}, {&NOP, IMPLICIT, 0, 2, 0}, {&DCP, ABSOLUTE_Y, 2, 7, 0},
+	 {&NOP_READ, ABSOLUTE_X, 2, 4, 1}, {&CMP, ABSOLUTE_X,       2, 4, 1}, {&DEC, ABSOLUTE_X,  2, 7, 0}, {&DCP, ABSOLUTE_X, 2, 7, 0}},
 	// 0xe
-	{{&CPX, IMMEDIATE, 1, 2, 0},   {&SBC, INDEXED_INDIRECT, 1, 6, 0}, illegal_operation,            illegal_operation,
-	 {&CPX, ZERO_PAGE, 1, 3, 0},   {&SBC, ZERO_PAGE,        1, 3, 0}, {&INC, ZERO_PAGE,   1, 5, 0}, illegal_operation,
-	 {&INX, IMPLICIT,  0, 2, 0},   {&SBC, IMMEDIATE,        1, 2, 0}, {&NOP, IMPLICIT,    0, 2, 0}, illegal_operation,
-	 {&CPX, ABSOLUTE,  2, 4, 0},   {&SBC, ABSOLUTE,         2, 4, 0}, {&INC, ABSOLUTE,    2, 6, 0}, illegal_operation},
+	{{&CPX, IMMEDIATE, 1, 2, 0},   {&SBC, INDEXED_INDIRECT, 1, 6, 0}, {&NOP_READ, IMMEDIATE, 1, 2, 0}, {&ISB, INDEXED_INDIRECT, 1, 8, 0},
+	 {&CPX, ZERO_PAGE, 1, 3, 0},   {&SBC, ZERO_PAGE,        1, 3, 0}, {&INC, ZERO_PAGE,   1, 5, 0}, {&ISB, ZERO_PAGE, 1, 5, 0},
+	 {&INX, IMPLICIT,  0, 2, 0},   {&SBC, IMMEDIATE,        1, 2, 0}, {&NOP, IMPLICIT,    0, 2, 0}, {&SBC, IMMEDIATE, 1, 2, 0},
+	 {&CPX, ABSOLUTE,  2, 4, 0},   {&SBC, ABSOLUTE,         2, 4, 0}, {&INC, ABSOLUTE,    2, 6, 0}, {&ISB, ABSOLUTE, 2, 6, 0}},
 	// 0xf
-	{{&BEQ, RELATIVE,  1, 2, 0},   {&SBC, INDIRECT_INDEXED, 1, 5, 1}, illegal_operation,            illegal_operation,
-	 illegal_operation,            {&SBC, ZERO_PAGE_X,      1, 4, 0}, {&INC, ZERO_PAGE_X, 1, 6, 0}, illegal_operation,
-	 {&SED, IMPLICIT,  0, 2, 0},   {&SBC, ABSOLUTE_Y,       2, 4, 1}, illegal_operation,            illegal_operation,
-	 illegal_operation,            {&SBC, ABSOLUTE_X,       2, 4, 1}, {&INC, ABSOLUTE_X,  2, 7, 0}, illegal_operation}
+	{{&BEQ, RELATIVE,  1, 2, 0},   {&SBC, INDIRECT_INDEXED, 1, 5, 1}, jam,                          {&ISB, INDIRECT_INDEXED, 1, 8, 0},
+	 {&NOP_READ, ZERO_PAGE_X, 1, 4, 0}, {&SBC, ZERO_PAGE_X,      1, 4, 0}, {&INC, ZERO_PAGE_X, 1, 6, 0}, {&ISB, ZERO_PAGE_X, 1, 6, 0},
+	 {&SED, IMPLICIT,  0, 2, 0},   {&SBC, ABSOLUTE_Y,       2, 4, 1}, {&NOP, IMPLICIT, 0, 2, 0}, {&ISB, ABSOLUTE_Y, 2, 7, 0},
+	 {&NOP_READ, ABSOLUTE_X, 2, 4, 1}, {&SBC, ABSOLUTE_X,       2, 4, 1}, {&INC, ABSOLUTE_X,  2, 7, 0}, {&ISB, ABSOLUTE_X, 2, 7, 0}}
 };
 
-#undef illegal_operation
+#undef jam
 
 /* end CPU INSTRUCTIONS --------------------------------------------------------------- */
 
 
-#ifdef VERBOSE
-void print_operation (operation* op) {
-	char reg_string[128] = {0};
-	char op_string[128] = {0};
+/* operand_sizes are the number of operand bytes of each addressing mode */
+static const int operand_sizes[13] =
+{
+	0, // ACCUMULATOR
+	1, // IMMEDIATE
+	1, // RELATIVE
+	1, // ZERO_PAGE
+	1, // ZERO_PAGE_X
+	1, // ZERO_PAGE_Y
+	2, // ABSOLUTE
+	2, // ABSOLUTE_X
+	2, // ABSOLUTE_Y
+	2, // INDIRECT
+	1, // INDEXED_INDIRECT
+	1, // INDIRECT_INDEXED
+	0, // IMPLICIT
+};
 
-	sprintf (reg_string, "A:%.2X X:%.2X Y:%.2X PS:%.2X SP:%.2X ", a, x, y, ps, sp);
-	operation_to_string (op, op_string);
-	printf ("%.4X  ", pc);
-	for (int i = 0; i < op->bytes + 1; i ++)
-		printf ("%.2X ", memory[pc + i]);
-	for (int i = 0; i < 3 - op->bytes - 1; i ++)
-		printf ("   ");
-	printf (" %-32s %s", op_string, reg_string);
-}
+/**
+ *  fetch returns the operation at PC and reads its operand.
+ *  Instructions in PRG ROM come from the predecode cache unless they cross into the next window,
+ *  anything else is read through memory.
+ */
+static operation* fetch ()
+{
+	int offset = pc & (PRG_WINDOW_SIZE - 1);
+	struct predecoded* cached = pc >= PRG_ROM_LOCATION ? predecode_windows[(pc >> 13) & 3] : NULL;
+
+	if (cached != NULL && offset < PRG_WINDOW_SIZE - 2)
+	{
+		cached += offset;
+		if (!cached->decoded)
+		{
+			const uint8_t* bank = prg_windows[(pc >> 13) & 3];
+			cached->opcode = bank[offset];
+			cached->operand = bank[offset + 1] | bank[offset + 2] << 8;
+			cached->decoded = 1;
+		}
+		operand = cached->operand;
+		operation* op = &operations[cached->opcode >> 4][cached->opcode & 0xF];
+#ifdef ACCURATE
+		// opcode and operand are read a cycle each
+		for (int i = 0; i <= operand_sizes[op->mode]; i ++)
+			cycle ();
 #endif
+		return op;
+	}
 
+	uint8_t opcode = MEM (pc);
+	operation* op = &operations[opcode >> 4 & 0xF][opcode & 0xF];
+	// only read the bytes that are part of the instruction, they could be registers
+	operand = 0;
+	if (operand_sizes[op->mode] > 0)
+		operand = MEM (pc + 1);
+	if (operand_sizes[op->mode] > 1)
+		operand |= MEM (pc + 2) << 8;
+	return op;
+}
 
-int nes_cpu_step ()
+/* idle_value returns the value the idle loop reads */
+static uint8_t idle_value ()
+{
+	if (!idle.polls)
+		return 0;
+	if (idle.poll == PPU_REGISTER_MEM_LOC + PPUSTATUS)
+		return nes_ppu_status ();
+	return memory[idle.poll];
+}
+
+/**
+ *  idle_loop_body checks that the loop from start to the jump back at end only reads RAM or
+ *  PPUSTATUS and sets up idle for it. PPUSTATUS changes on its own so it has to be read by the
+ *  first instruction, where it is checked before each iteration.
+ *  Returns non-zero if the loop is not an idle loop.
+ */
+static int idle_loop_body (uint16_t start, uint16_t end)
+{
+	idle.polls = 0;
+	idle.n = 0;
+	for (uint16_t address = start; address <= end;)
+	{
+		if (idle.n == IDLE_LOOP_MAX_INSTRUCTIONS)
+			return 1;
+
+		uint8_t opcode = PRG_WINDOW (address);
+		const operation* op = &operations[opcode >> 4][opcode & 0xF];
+		const instruction* instr = op->instr;
+		idle.pcs[idle.n ++] = address;
+		if (op->mode == RELATIVE || (instr == &JMP && op->mode == ABSOLUTE && address == end))
+			; // branches either leave the loop or go back to its start
+		else if (instr != &LDA && instr != &LDX && instr != &LDY && instr != &BIT &&
+				 instr != &CMP && instr != &CPX && instr != &CPY && instr != &AND)
+			return 1;
+		else if (op->mode == ZERO_PAGE || op->mode == ABSOLUTE)
+		{
+			uint16_t poll = PRG_WINDOW ((uint16_t) (address + 1));
+			if (op->mode == ABSOLUTE)
+				poll |= PRG_WINDOW ((uint16_t) (address + 2)) << 8;
+
+			if (poll >= PPU_REGISTER_MEM_LOC && (poll != PPU_REGISTER_MEM_LOC + PPUSTATUS || address != start))
+				return 1;
+			if (idle.polls && poll != idle.poll)
+				return 1;
+			idle.polls = 1;
+			idle.poll = poll;
+		}
+		else if (op->mode != IMMEDIATE)
+			return 1;
+
+		if (address == end)
+			return !(op->mode == RELATIVE || instr == &JMP);
+		address += 1 + operand_sizes[op->mode];
+	}
+	return 1;
+}
+
+/**
+ *  detect_idle follows the instruction at address, which ran for cc cycles, to find idle loops.
+ *  A backward jump makes a loop a candidate, if the next iteration ends with the CPU and the value
+ *  read as they were it is stepped over from then on.
+ */
+static void detect_idle (uint16_t address, int cc)
+{
+	// follow the iteration through the loop, anything else and it does not match
+	if (idle.start != 0 && idle.recorded < idle.n && idle.pcs[idle.recorded] == address)
+		idle.cycles[idle.recorded ++] = cc;
+	else
+		idle.recorded = IDLE_LOOP_MAX_INSTRUCTIONS + 1;
+
+	if (pc > address || address - pc > IDLE_LOOP_MAX_BYTES || pc < PRG_ROM_LOCATION)
+		return;
+
+	// jumped back to the start of a loop
+	if (pc == idle.start && address == idle.end && idle.recorded == idle.n &&
+		a == idle.a && x == idle.x && y == idle.y && ps == idle.ps && idle_value () == idle.value)
+	{
+		idle.skipping = 1;
+		idle.at = 0;
+		return;
+	}
+
+	idle.start = 0;
+	if (idle_loop_body (pc, address) != 0)
+		return;
+	idle.start = pc;
+	idle.end = address;
+	idle.a = a;
+	idle.x = x;
+	idle.y = y;
+	idle.ps = ps;
+	idle.value = idle_value ();
+	idle.recorded = 0;
+}
+
+/**
+ *  skip_idle steps over the next instruction of the idle loop.
+ *  Returns the cycles of the instruction or 0 if the loop has ended and needs to be executed.
+ */
+static int skip_idle ()
+{
+	if (signals || (irq_line && (~ps & INTERRUPT)) || (idle.at == 0 && idle_value () != idle.value))
+	{
+		reset_idle ();
+		return 0;
+	}
+	int cc = idle.cycles[idle.at];
+#ifdef PROFILE
+	nes_profile_cycles (profile_location (pc), cc);
+#endif
+	idle.at = (idle.at + 1) % idle.n;
+	pc = idle.pcs[idle.at];
+	return cc;
+}
+
+static int step ()
 {
 	if (stalled)
 	{
 		// cpu is stalled
 		stalled --;
+#ifdef PROFILE
+		nes_profile_cycles (profile_location (pc), 1);
+#endif
 		return 1;
 	}
+	if ((flags & STOP) && (~signals & RST))
+	{
+		// jammed, the hardware keeps being clocked until a reset
+		signals = 0;
+#ifdef PROFILE
+		nes_profile_cycles (profile_location (pc), 1);
+#endif
+		return 1;
+	}
+	if (idle.skipping)
+	{
+		int skipped = skip_idle ();
+		if (skipped)
+			return skipped;
+	}
 	int cc = cpucc;
 
 	// check interrupts
-	if (signals & NMI)
+	if (signals & RST)
+		reset ();
+	else if (signals & NMI)
 		nmi ();
-	else if (signals & IRQ)
+	else if ((signals & IRQ) || irq_line)
 		irq ();
 	signals = 0;
 
-	// get operation
-	uint8_t opcode = MEM (pc);
-	operation* op = &operations[opcode >> 4 & 0xF][opcode & 0xF];
+	// record the state before fetching, which runs the hardware in the accurate core
+	struct nes_trace_entry* traced = NULL;
+	if (tracing)
+	{
+		traced = nes_trace_record ();
+		traced->pc = pc;
+		traced->a = a;
+		traced->x = x;
+		traced->y = y;
+		traced->p = ps;
+		traced->sp = sp;
+	}
 
-	#ifdef VERBOSE
-		print_operation (op);
-		printf ("\n");
-	#endif
+	// get operation
+	uint16_t address = pc;
+	operation* op = fetch ();
+	if (traced != NULL)
+		traced->opcode = op - operations[0];
 
 	// execute operation and step forward
 	pc ++;
@@ -1512,5 +2221,30 @@ int nes_cpu_step ()
 	cc = cpucc - cc;
 	cpucc = 0;
 
+#ifdef PROFILE
+	nes_profile_cycles (profile_location (address), cc);
+	if (op->instr == &JSR)
+		nes_profile_call (profile_location (pc));
+	else if (op->instr == &RTS || op->instr == &RTI)
+		nes_profile_return ();
+#endif
+
+	if (idle_skip)
+		detect_idle (address, cc);
+
 	return cc;
 }
+
+int nes_cpu_step ()
+{
+#ifdef ACCURATE
+	clocked = 0;
+	int cc = step ();
+	// run the cycles of the instruction in which nothing was read or written
+	if (cc > clocked && clock_hardware != NULL)
+		clock_hardware (cc - clocked);
+	return cc > clocked ? cc : clocked;
+#else
+	return step ();
+#endif
+}
@@ -0,0 +1,250 @@
+#include <nes/cpu.h>
+#include <nes/ppu.h>
+#include <nes/nes.h>
+#include <nes/mapper.h>
+#include <string.h>
+
+/**
+ *  Sunsoft FME-7 (mapper 69).
+ *  A command is selected by writing to $8000-$9FFF and its parameter written to $A000-$BFFF.
+ *  The IRQ counter counts down each CPU cycle and raises the IRQ when it wraps from 0.
+ *  The Sunsoft 5B variant adds three square channels of an AY-3-8910, whose registers are selected
+ *  by writing to $C000-$DFFF and written at $E000-$FFFF. Its noise and envelope are not emulated.
+ */
+
+#define PRG_ROM_BANK_SIZE 0x2000
+static uint8_t* prg;
+static int n_prg_banks;
+
+#define N_CHR_BANKS 8
+#define CHR_BANK_SIZE 0x0400
+static uint8_t* chr;
+static int n_chr_banks;
+
+#define PRG_RAM_SELECT 0x40
+#define PRG_RAM_ENABLE 0x80
+
+#define IRQ_ENABLE     0x01
+#define COUNTER_ENABLE 0x80
+
+/* square channel state */
+struct channel
+{
+	uint8_t output;  // high or low
+	float   timer;   // CPU cycles until the output toggles
+};
+
+/* volumes are logarithmic with 3dB steps */
+static const float volumes[16] =
+{
+	0.0,   0.008, 0.011, 0.016, 0.022, 0.032, 0.045, 0.063,
+	0.089, 0.126, 0.178, 0.251, 0.355, 0.501, 0.708, 1.0,
+};
+
+/* SOUND_LEVEL is the output of a channel at full volume */
+#define SOUND_LEVEL 0.11
+
+/* registers */
+static struct
+{
+	uint8_t  command;
+	uint8_t  chr_banks[N_CHR_BANKS];
+	uint8_t  prg_banks[4];          // $6000, $8000, $A000 and $C000
+	uint8_t  mirroring;
+	uint8_t  irq_control;
+	uint16_t counter;
+	uint8_t  sound_address;          // $C000
+	uint8_t  sound[16];              // sound registers
+	struct channel channels[3];
+}
+fme7;
+
+/* updated is the CPU cycle the counter was last caught up to */
+static uint64_t updated;
+
+static void map_chr_bank (int window)
+{
+	nes_ppu_map_chr (window, chr + (fme7.chr_banks[window] % n_chr_banks) * CHR_BANK_SIZE);
+}
+
+static const uint8_t* prg_bank (int bank)
+{
+	return prg + ((bank & 0x3F) % n_prg_banks) * PRG_ROM_BANK_SIZE;
+}
+
+static void update_prg_banks ()
+{
+	for (int i = 0; i < 3; i ++)
+		nes_cpu_map_prg (i, prg_bank (fme7.prg_banks[i + 1]));
+	nes_cpu_map_prg (3, prg_bank (n_prg_banks - 1));
+}
+
+static const nes_ppu_mirroring_mode mirrorings[4] =
+{
+	NES_PPU_MIRROR_VERTICAL,
+	NES_PPU_MIRROR_HORIZONTAL,
+	NES_PPU_MIRROR_SINGLE0,
+	NES_PPU_MIRROR_SINGLE1,
+};
+
+/* catch_up counts the counter down for the CPU cycles since it was last updated */
+static void catch_up ()
+{
+	uint64_t now = nes_cycles ();
+	uint64_t n = now - updated;
+	updated = now;
+
+	if (!(fme7.irq_control & COUNTER_ENABLE))
+		return;
+	if ((fme7.irq_control & IRQ_ENABLE) && n > fme7.counter)
+		nes_cpu_set_irq (NES_CPU_IRQ_MAPPER, 1);
+	fme7.counter -= n;
+}
+
+static void on_irq ();
+
+/* schedule schedules the next time the counter wraps */
+static void schedule ()
+{
+	if ((fme7.irq_control & (COUNTER_ENABLE | IRQ_ENABLE)) == (COUNTER_ENABLE | IRQ_ENABLE))
+		nes_schedule (on_irq, fme7.counter + 1);
+	else
+		nes_unschedule (on_irq);
+}
+
+static void on_irq ()
+{
+	catch_up ();
+	schedule ();
+}
+
+static void write_parameter (uint8_t v)
+{
+	uint8_t command = fme7.command & 0xF;
+	switch (command)
+	{
+	case 0x0: case 0x1: case 0x2: case 0x3: case 0x4: case 0x5: case 0x6: case 0x7: // CHR banks
+		fme7.chr_banks[command] = v;
+		map_chr_bank (command);
+		break;
+	case 0x8: // PRG bank at $6000, ROM or RAM
+		fme7.prg_banks[0] = v;
+		break;
+	case 0x9: case 0xA: case 0xB: // PRG banks at $8000-$DFFF
+		fme7.prg_banks[command - 8] = v;
+		update_prg_banks ();
+		break;
+	case 0xC: // mirroring
+		fme7.mirroring = v & 3;
+		nes_ppu_set_mirroring (mirrorings[fme7.mirroring]);
+		break;
+	case 0xD: // IRQ control, acknowledges the IRQ
+		catch_up ();
+		fme7.irq_control = v;
+		nes_cpu_set_irq (NES_CPU_IRQ_MAPPER, 0);
+		schedule ();
+		break;
+	case 0xE: // counter low byte
+		catch_up ();
+		fme7.counter = (fme7.counter & 0xFF00) | v;
+		schedule ();
+		break;
+	case 0xF: // counter high byte
+		catch_up ();
+		fme7.counter = (fme7.counter & 0x00FF) | (v << 8);
+		schedule ();
+		break;
+	}
+}
+
+/* audio renders the square channels, which toggle every 16 * period CPU cycles */
+static void audio (float* samples, int n, float cycles)
+{
+	for (int i = 0; i < n; i ++)
+	{
+		float out = 0;
+		for (int c = 0; c < 3; c ++)
+		{
+			struct channel* ch = fme7.channels + c;
+			int period = (((fme7.sound[c * 2 + 1] & 0x0F) << 8) | fme7.sound[c * 2]) * 16;
+			if (period == 0)
+				period = 16;
+			for (ch->timer -= cycles; ch->timer <= 0; ch->timer += period)
+				ch->output ^= 1;
+
+			// the mixer register disables tones when bits are set
+			if (ch->output && !(fme7.sound[7] & (1 << c)))
+				out += volumes[fme7.sound[8 + c] & 0x0F];
+		}
+		samples[i] += SOUND_LEVEL * out;
+	}
+}
+
+static int write (uint16_t address, uint8_t v)
+{
+	if (address < 0x6000)
+		return 0;
+	else if (address < 0x8000) // PRG RAM if it is mapped
+		return (fme7.prg_banks[0] & (PRG_RAM_SELECT | PRG_RAM_ENABLE)) != (PRG_RAM_SELECT | PRG_RAM_ENABLE);
+	else if (address < 0xA000)
+		fme7.command = v;
+	else if (address < 0xC000)
+		write_parameter (v);
+	else if (address < 0xE000)
+		fme7.sound_address = v;
+	else if (fme7.sound_address < 16)
+	{
+		nes_apu_expansion_sync ();
+		fme7.sound[fme7.sound_address] = v;
+	}
+	return 1;
+}
+
+/* read serves PRG ROM at $6000-$7FFF when it is selected instead of RAM */
+static int read (uint16_t address, uint8_t* v)
+{
+	if (address < 0x6000 || (fme7.prg_banks[0] & PRG_RAM_SELECT))
+		return 0;
+	*v = prg_bank (fme7.prg_banks[0])[address & 0x1FFF];
+	return 1;
+}
+
+static int load (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	n_prg_banks = _n_prg_banks << 1; // n banks passed are in 16KB but the mapper switches 8KB
+	prg         = _prg;
+	n_chr_banks = _n_chr_banks << 3; // n banks passed are in 8KB but the mapper switches 1KB
+	chr         = _chr;
+	return 0;
+}
+
+static void reset ()
+{
+	memset (&fme7, 0, sizeof (fme7));
+	for (int i = 0; i < N_CHR_BANKS; i ++)
+	{
+		fme7.chr_banks[i] = i;
+		map_chr_bank (i);
+	}
+	for (int i = 1; i < 4; i ++)
+		fme7.prg_banks[i] = i - 1;
+	update_prg_banks ();
+	updated = nes_cycles ();
+	nes_unschedule (on_irq);
+}
+
+static void destroy ()
+{
+	prg = chr = NULL;
+}
+
+const struct nes_mapper nes_fme7 =
+{
+	.name       = "FME-7",
+	.load       = load,
+	.reset      = reset,
+	.cpu_read   = read,
+	.cpu_write  = write,
+	.audio      = audio,
+	.destroy    = destroy,
+};
@@ -0,0 +1,102 @@
+#include <nes/cpu.h>
+#include <nes/ppu.h>
+#include <nes/mapper.h>
+#include <string.h>
+
+/**
+ *  GxROM (mapper 66) and Color Dreams (mapper 11) both switch 32KB of PRG ROM and 8KB of CHR ROM
+ *  through a single register, they only differ in which bits select what.
+ */
+#define PRG_BANK_SIZE 0x8000
+#define CHR_BANK_SIZE 0x2000
+static uint8_t* prg;
+static int n_prg_banks;
+static uint8_t* chr;
+static int n_chr_banks;
+
+/* bank register */
+static uint8_t bank;
+
+/* shift and mask of the PRG and CHR bank in the register */
+static int prg_shift, prg_mask, chr_shift, chr_mask;
+
+/* switch_banks maps the selected PRG and CHR banks */
+static void switch_banks ()
+{
+	int prg_bank = (bank >> prg_shift) & prg_mask;
+	int chr_bank = (bank >> chr_shift) & chr_mask;
+
+	const uint8_t* data = prg + (prg_bank % n_prg_banks) * PRG_BANK_SIZE;
+	for (int i = 0; i < NES_CPU_PRG_WINDOWS; i ++)
+		nes_cpu_map_prg (i, data + i * 0x2000);
+	nes_ppu_load_chr_rom (chr + (chr_bank % n_chr_banks) * CHR_BANK_SIZE);
+}
+
+static int write (uint16_t address, uint8_t v)
+{
+	if (address >= 0x8000)
+	{
+		bank = v;
+		switch_banks ();
+		return 1;
+	}
+	return 0;
+}
+
+static int load (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	if (_n_prg_banks < 2)
+		return 1;
+	prg = _prg;
+	n_prg_banks = _n_prg_banks >> 1; // n banks passed are in 16KB but the mapper switches 32KB
+	chr = _chr;
+	n_chr_banks = _n_chr_banks;
+	return 0;
+}
+
+static int load_gxrom (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	prg_shift = 4;
+	prg_mask  = 3;
+	chr_shift = 0;
+	chr_mask  = 3;
+	return load (_n_prg_banks, _prg, _n_chr_banks, _chr);
+}
+
+static int load_color_dreams (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	prg_shift = 0;
+	prg_mask  = 3;
+	chr_shift = 4;
+	chr_mask  = 0xF;
+	return load (_n_prg_banks, _prg, _n_chr_banks, _chr);
+}
+
+static void reset ()
+{
+	bank = 0;
+	switch_banks ();
+}
+
+static void destroy ()
+{
+	prg = chr = NULL;
+}
+
+const struct nes_mapper nes_gxrom =
+{
+	.name       = "GxROM",
+	.load       = load_gxrom,
+	.reset      = reset,
+	.cpu_write  = write,
+	.destroy    = destroy,
+};
+
+const struct nes_mapper nes_color_dreams =
+{
+	.name       = "Color Dreams",
+	.load       = load_color_dreams,
+	.reset      = reset,
+	.cpu_write  = write,
+	.destroy    = destroy,
+};
@@ -1,5 +1,6 @@
 #include "nes/cpu.h"
 #include "nes/ppu.h"
+#include "nes/mapper.h"
 #include <stdio.h>
 
 
@@ -19,45 +20,44 @@ static uint8_t* chr;
 static int n_prg_banks;
 static int n_chr_banks;
 
+/* define CHR bank size, each bank covers four of the PPU windows */
+#define CHR_BANK_SIZE 0x1000
+
+/* map_chr_bank maps the 4KB CHR bank at $0000 or $1000 */
+static void map_chr_bank (int half, int bank)
+{
+	uint8_t* data = chr + (bank % n_chr_banks) * CHR_BANK_SIZE;
+	for (int i = 0; i < 4; i ++)
+		nes_ppu_map_chr (half * 4 + i, data + i * 0x400);
+}
+
 /**
  *  Reload CHR Banks.
  */
-static int chr_banks[2];
-static int chr0, chr1;
+static uint8_t chr0, chr1;
 static inline void switch_chr_bank ()
 {
 	if ((mmc1_ctrl & 0x10) != 0x10) // 8KB mode
 	{
-		chr_banks[0] = chr0 & 0x1E;
-		chr_banks[1] = chr0 | 1;
+		map_chr_bank (0, chr0 & 0x1E);
+		map_chr_bank (1, chr0 | 1);
 	}
 	else
 	{
-		chr_banks[0] = chr0;
-		chr_banks[1] = chr1;
+		map_chr_bank (0, chr0);
+		map_chr_bank (1, chr1);
 	}
 }
 
-/* define CHR bank size and macro to calculate address within CHR */
-#define CHR_BANK_SIZE 0x1000
-#define CHR(address) chr + chr_banks[address / CHR_BANK_SIZE] * CHR_BANK_SIZE + address % CHR_BANK_SIZE
-
-/* write_chr_rom is used for the PPU to write to CHR */
-static void write_chr_rom (uint16_t address, uint8_t v)
-{
-	*(CHR (address)) = v;
-}
-
-/* read_chr_rom is used for the PPU to read from CHR */
-static uint8_t read_chr_rom (uint16_t address)
+/* map_prg_bank maps the 16KB PRG bank at $8000 or $C000 */
+static void map_prg_bank (int half, int bank)
 {
-	return *(CHR (address));
+	nes_cpu_load_prg_rom_bank (prg + (bank % n_prg_banks) * NES_PRG_ROM_BANK_SIZE, half);
 }
 
 /**
  *  Reload PRG Banks.
  */
-static int prg_banks[2];
 static inline void switch_prg_bank ()
 {
 	uint8_t mode = (mmc1_ctrl >> 2) & 3;
@@ -65,34 +65,20 @@ static inline void switch_prg_bank ()
 	{
 	case 0: // switch 32 KB at $8000, ignoring low bit of bank number
 	case 1:
-		prg_banks[0] = prg_bank & 0xE;
-		prg_banks[1] = prg_bank | 1;
+		map_prg_bank (0, prg_bank & 0xE);
+		map_prg_bank (1, prg_bank | 1);
 		break;
 	case 2: // fix first bank at $8000 and switch 16 KB bank at $C000
-		prg_banks[0] = 0;
-		prg_banks[1] = prg_bank;
+		map_prg_bank (0, 0);
+		map_prg_bank (1, prg_bank);
 		break;
 	case 3: // fix last bank at $C000 and switch 16 KB bank at $8000
-		prg_banks[0] = prg_bank;
-		prg_banks[1] = n_prg_banks - 1;
+		map_prg_bank (0, prg_bank);
+		map_prg_bank (1, n_prg_banks - 1);
 		break;
 	}
 }
 
-/* read_prg_rom defines a read event handler for PRG ROM making sure value from the correct bank is returned */
-static int read_prg_rom (uint16_t address, uint8_t* v)
-{
-	if (address >= 0x8000)
-	{
-		address &= 0x7FFF;
-		int bank = (address >> 14) & 1; // by looking @ bit 14 we can see which bank it is
-		int offset = address & (NES_PRG_ROM_BANK_SIZE - 1);
-		*v = prg[prg_banks[bank] * NES_PRG_ROM_BANK_SIZE + offset];
-		return 1;
-	}
-	return 0;
-}
-
 /**
  *  Write to control register the value mmc1_sr.
  */
@@ -166,22 +152,36 @@ static int write_prg_rom (uint16_t addr, uint8_t v)
 	return 0;
 }
 
-void nes_mmc1_load (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+static int load (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
 {
 	chr = _chr;
 	prg = _prg;
 	n_prg_banks = _n_prg_banks;
 	n_chr_banks = _n_chr_banks << 1;
+	return 0;
+}
 
-	nes_cpu_add_store_handler (&write_prg_rom);
-	nes_cpu_add_read_handler (&read_prg_rom);
-
-	nes_ppu_set_chr_writer (write_chr_rom);
-	nes_ppu_set_chr_read (read_chr_rom);
-
+static void reset ()
+{
+	// mirroring is left as given by the cartridge header until the game sets it
 	RESET_SR;
+	mmc1_ctrl = 0x0C;
 	prg_bank = 0;
-	prg_banks[0] = prg_bank;
-	prg_banks[1] = n_prg_banks - 1;
-	chr_banks[0] = chr_banks[1] = 0;
+	chr0 = chr1 = 0;
+	switch_prg_bank ();
+	switch_chr_bank ();
+}
+
+static void destroy ()
+{
+	prg = chr = NULL;
 }
+
+const struct nes_mapper nes_mmc1 =
+{
+	.name       = "MMC1",
+	.load       = load,
+	.reset      = reset,
+	.cpu_write  = write_prg_rom,
+	.destroy    = destroy,
+};
@@ -1,95 +1,154 @@
 #include <nes/cpu.h>
 #include <nes/ppu.h>
+#include <nes/mapper.h>
+#include <string.h>
 
-//static uint8_t latch = 0;
-
+/**
+ *  CHR is switched in two 4KB halves. Each half has two bank registers and a latch selecting
+ *  which one is used, the latch is flipped when the PPU fetches tile $FD or $FE from the half.
+ */
 #define CHR_BANK_SIZE 0x1000
 #define N_CHR_BANKS 2
-//static int chr_banks[N_CHR_BANKS][2];
+#define LATCH_FD 0
+#define LATCH_FE 1
 static int n_chr_banks;
 static uint8_t* chr;
 
-static uint8_t chr_read (uint16_t address)
-{
-	return 0;
-}
-
-static void chr_write (uint16_t address, uint8_t v)
-{
-
-}
-
 #define N_PRG_BANKS 4
-static int prg_banks[N_PRG_BANKS];
+#define PRG_ROM_BANK_SIZE 0x2000
 static int n_prg_banks;
 static uint8_t* prg;
 
-static void prg_write (uint16_t address, uint8_t v)
+/* registers */
+static struct
 {
-	if (address < 0xB000) // PRG ROM bank select ($A000-$AFFF)
-	{
-		prg_banks[0] = v;
-	}
-	else if (address < 0xC000) // $FD/0000 bank select ($B000-$BFFF)
-	{
-
-	}
-	else if (address < 0xD000) // $FE/0000 bank select ($C000-$CFFF)
-	{
+	uint8_t prg_bank;                    // 8KB bank selected at $8000
+	uint8_t chr_banks[N_CHR_BANKS][2];   // 4KB bank for each half and latch value
+	uint8_t latches[N_CHR_BANKS];        // current latch of each half
+	uint8_t mirroring;
+}
+mmc2;
 
-	}
-	else if (address < 0xE000) // $FD/1000 bank select ($D000-$DFFF)
-	{
+/* map_prg_bank maps the 8KB PRG bank in one of the CPU windows */
+static void map_prg_bank (int window, int bank)
+{
+	nes_cpu_map_prg (window, prg + (bank % n_prg_banks) * PRG_ROM_BANK_SIZE);
+}
 
-	}
-	else if (address < 0xF000) // $FE/1000 bank select ($E000-$EFFF)
-	{
+/* map_chr_bank maps the bank selected by the latch of the half of the pattern tables */
+static void map_chr_bank (int half)
+{
+	int bank = mmc2.chr_banks[half][mmc2.latches[half]];
+	uint8_t* data = chr + (bank % n_chr_banks) * CHR_BANK_SIZE;
+	for (int i = 0; i < 4; i ++)
+		nes_ppu_map_chr (half * 4 + i, data + i * 0x400);
+}
 
-	}
-	else // Mirroring ($F000-$FFFF)
-	{
-		if ((v & 1) == 0)
-			nes_ppu_set_mirroring (NES_PPU_MIRROR_VERTICAL);
-		else
-			nes_ppu_set_mirroring (NES_PPU_MIRROR_HORIZONTAL);
-	}
+static void update_mirroring ()
+{
+	if ((mmc2.mirroring & 1) == 0)
+		nes_ppu_set_mirroring (NES_PPU_MIRROR_VERTICAL);
+	else
+		nes_ppu_set_mirroring (NES_PPU_MIRROR_HORIZONTAL);
 }
 
-#define PRG_ROM_BANK_SIZE 0x2000
-#define PRG(address) prg + prg_banks[address / PRG_ROM_BANK_SIZE] * PRG_ROM_BANK_SIZE + address % PRG_ROM_BANK_SIZE
-static int prg_read (uint16_t address, uint8_t* v)
+/* write_chr_bank sets the bank register of the half for the latch value */
+static void write_chr_bank (int half, int latch, uint8_t v)
 {
-	if (address >= 0x8000)
-	{
-		address &= 0x7FFF;
-		*v = *(PRG (address));
-		return 1;
-	}
-	return 0;
+	mmc2.chr_banks[half][latch] = v & 0x1F;
+	if (mmc2.latches[half] == latch)
+		map_chr_bank (half);
 }
 
 static int write (uint16_t address, uint8_t v)
 {
-	if (address >= 0x8000)
+	switch (address >> 12)
 	{
-		prg_write (address, v);
-		return 1;
+	case 0xA: // PRG ROM bank select ($A000-$AFFF)
+		mmc2.prg_bank = v & 0xF;
+		map_prg_bank (0, mmc2.prg_bank);
+		break;
+	case 0xB: // $FD/0000 bank select ($B000-$BFFF)
+		write_chr_bank (0, LATCH_FD, v);
+		break;
+	case 0xC: // $FE/0000 bank select ($C000-$CFFF)
+		write_chr_bank (0, LATCH_FE, v);
+		break;
+	case 0xD: // $FD/1000 bank select ($D000-$DFFF)
+		write_chr_bank (1, LATCH_FD, v);
+		break;
+	case 0xE: // $FE/1000 bank select ($E000-$EFFF)
+		write_chr_bank (1, LATCH_FE, v);
+		break;
+	case 0xF: // Mirroring ($F000-$FFFF)
+		mmc2.mirroring = v & 1;
+		update_mirroring ();
+		break;
+	default: // $4020-$9FFF
+		return address >= 0x8000;
 	}
-	return 0;
+	return 1;
 }
 
-void nes_mmc2_load (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+/**
+ *  ppu_read flips the latch of a half after the PPU has fetched from $0FD8, $0FE8, $1FD8-$1FDF
+ *  or $1FE8-$1FEF. The new bank is used from the next fetch.
+ */
+static void ppu_read (uint16_t address)
 {
-	n_prg_banks = _n_prg_banks;
+	int half = address >> 12;
+	uint16_t tile = address & 0x0FF8;
+	int latch;
+
+	if (tile == 0x0FD8)
+		latch = LATCH_FD;
+	else if (tile == 0x0FE8)
+		latch = LATCH_FE;
+	else
+		return;
+
+	// the lower half only reacts to the first row of the tile
+	if (half == 0 && (address & 7) != 0)
+		return;
+	if (mmc2.latches[half] == latch)
+		return;
+
+	mmc2.latches[half] = latch;
+	map_chr_bank (half);
+}
+
+static int load (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	n_prg_banks = _n_prg_banks << 1; // n banks passed are in 16KB but the mapper switches 8KB
 	prg         = _prg;
-	n_chr_banks = _n_chr_banks;
+	n_chr_banks = _n_chr_banks << 1; // n banks passed are in 8KB but the mapper switches 4KB
 	chr         = _chr;
+	return 0;
+}
 
-	nes_cpu_add_store_handler (&write);
-	nes_cpu_add_read_handler (&prg_read);
-	nes_ppu_set_chr_writer (chr_write);
-	nes_ppu_set_chr_read (chr_read);
+static void reset ()
+{
+	memset (&mmc2, 0, sizeof (mmc2));
+	mmc2.latches[0] = mmc2.latches[1] = LATCH_FE;
+	map_chr_bank (0);
+	map_chr_bank (1);
 
+	map_prg_bank (0, mmc2.prg_bank);
 	for (int i = 0; i < 3; i ++) // fix last 3 banks
-		prg_banks[N_PRG_BANKS - (1 + i)] = n_prg_banks - (1 + i);
+		map_prg_bank (N_PRG_BANKS - (1 + i), n_prg_banks - (1 + i));
 }
+
+static void destroy ()
+{
+	prg = chr = NULL;
+}
+
+const struct nes_mapper nes_mmc2 =
+{
+	.name       = "MMC2",
+	.load       = load,
+	.reset      = reset,
+	.cpu_write  = write,
+	.ppu_read   = ppu_read,
+	.destroy    = destroy,
+};
@@ -1,6 +1,6 @@
 #include "nes/cpu.h"
 #include "nes/ppu.h"
-#include "nes/nes.h"
+#include "nes/mapper.h"
 #include <string.h>
 #include <stdio.h>
 
@@ -19,6 +19,9 @@ static uint8_t mmc3_registers[8];
 /* IRQ counter */
 static uint8_t mmc3_counter = 0;
 
+/* mmc3_irq_reload flags that the IRQ counter is to be reloaded at the next clock */
+static uint8_t mmc3_irq_reload;
+
 /**
  * PRG
  */
@@ -32,44 +35,31 @@ static uint8_t* prg;
 /* Number of PRG ROM banks (= len(PRG) / PRG_ROM_BANK_SIZE) */
 static int n_prg_banks;
 
-/* Offsets to currently loaded banks in PRG memory space ($8000 - $FFFF) */
-static int prg_banks[N_PRG_BANKS];
+/* map_prg_bank maps the PRG ROM bank in one of the CPU windows ($8000 - $FFFF) */
+static void map_prg_bank (int window, int bank)
+{
+	nes_cpu_map_prg (window, prg + (bank % n_prg_banks) * PRG_ROM_BANK_SIZE);
+}
 
-/* update_prg_banks updates the offsets pointing to the correct banks for when reading. */
+/* update_prg_banks maps the banks selected by the registers. */
 static void update_prg_banks ()
 {
 	if (mmc3_bank_select & 0x40)
 	{
-		prg_banks[0] = n_prg_banks - 2;   // $8000 - $9FFF = -2
-		prg_banks[1] = REG(7);            // $A000 - $BFFF = R7
-		prg_banks[2] = REG(6);            // $C000 - $DFFF = R6
-		prg_banks[3] = n_prg_banks - 1;   // $E000 - $FFFF = -1
+		map_prg_bank (0, n_prg_banks - 2);   // $8000 - $9FFF = -2
+		map_prg_bank (1, REG(7));            // $A000 - $BFFF = R7
+		map_prg_bank (2, REG(6));            // $C000 - $DFFF = R6
+		map_prg_bank (3, n_prg_banks - 1);   // $E000 - $FFFF = -1
 	}
 	else
 	{
-		prg_banks[0] = REG(6);            // $8000 - $9FFF = R6
-		prg_banks[1] = REG(7);            // $A000 - $BFFF = R7
-		prg_banks[2] = n_prg_banks - 2;   // $C000 - $DFFF = -2
-		prg_banks[3] = n_prg_banks - 1;   // $E000 - $FFFF = -1
+		map_prg_bank (0, REG(6));            // $8000 - $9FFF = R6
+		map_prg_bank (1, REG(7));            // $A000 - $BFFF = R7
+		map_prg_bank (2, n_prg_banks - 2);   // $C000 - $DFFF = -2
+		map_prg_bank (3, n_prg_banks - 1);   // $E000 - $FFFF = -1
 	}
 }
 
-/* prg_read reads from the correct bank within PRG ROM */
-static int prg_read (uint16_t address, uint8_t* v)
-{
-	if (address >= 0x8000)
-	{
-		address &= 0x7FFF;
-		*v = prg[
-			prg_banks[address / PRG_ROM_BANK_SIZE] // bank index
-				* PRG_ROM_BANK_SIZE
-			 + address % PRG_ROM_BANK_SIZE // offset
-		];
-		return 1;
-	}
-	return 0;
-}
-
 /**
  * CHR
  */
@@ -82,46 +72,51 @@ static uint8_t* chr;
 /* Number of CHR ROM banks in total (= len(CHR) / CHR_ROM_BANK_SIZE) */
 static int n_chr_banks;
 
-/* Offsets pointing to correct bank when reading from CHR */
-static int chr_banks[N_CHR_BANKS];
+/* map_chr_bank maps the CHR bank in one of the PPU windows */
+static void map_chr_bank (int window, int bank)
+{
+	nes_ppu_map_chr (window, chr + (bank % n_chr_banks) * CHR_BANK_SIZE);
+}
 
-/* update_chr_banks updates offset depending on current status of registers */
+/* update_chr_banks maps the banks depending on current status of registers */
 static void update_chr_banks ()
 {
 	if (mmc3_bank_select & 0x80)
 	{
-		chr_banks[0] = REG(2);        // $0000-$03FF 	R2
-		chr_banks[1] = REG(3);        // $0400-$07FF 	R3
-		chr_banks[2] = REG(4);        // $0800-$0BFF 	R4
-		chr_banks[3] = REG(5);        // $0C00-$0FFF 	R5
-		chr_banks[4] = REG(0) & 0xFE; // $1000-$13FF 	R0 AND $FE
-		chr_banks[5] = REG(0) | 1;    // $1400-$17FF 	R0 OR 1
-		chr_banks[6] = REG(1) & 0xFE; // $1800-$1BFF 	R1 AND $FE
-		chr_banks[7] = REG(1) | 1;    // $1C00-$1FFF 	R1 OR 1
+		map_chr_bank (0, REG(2));        // $0000-$03FF 	R2
+		map_chr_bank (1, REG(3));        // $0400-$07FF 	R3
+		map_chr_bank (2, REG(4));        // $0800-$0BFF 	R4
+		map_chr_bank (3, REG(5));        // $0C00-$0FFF 	R5
+		map_chr_bank (4, REG(0) & 0xFE); // $1000-$13FF 	R0 AND $FE
+		map_chr_bank (5, REG(0) | 1);    // $1400-$17FF 	R0 OR 1
+		map_chr_bank (6, REG(1) & 0xFE); // $1800-$1BFF 	R1 AND $FE
+		map_chr_bank (7, REG(1) | 1);    // $1C00-$1FFF 	R1 OR 1
 	}
 	else
 	{
-		chr_banks[0] = REG(0) & 0xFE; // $0000-$03FF 	R0 AND $FE
-		chr_banks[1] = REG(0) | 1;    // $0400-$07FF 	R0 OR 1
-		chr_banks[2] = REG(1) & 0xFE; // $0800-$0BFF 	R1 AND $FE
-		chr_banks[3] = REG(1) | 1;    // $0C00-$0FFF 	R1 OR 1
-		chr_banks[4] = REG(2);        // $1000-$13FF 	R2
-		chr_banks[5] = REG(3);        // $1400-$17FF 	R3
-		chr_banks[6] = REG(4);        // $1800-$1BFF 	R4
-		chr_banks[7] = REG(5);        // $1C00-$1FFF 	R5
+		map_chr_bank (0, REG(0) & 0xFE); // $0000-$03FF 	R0 AND $FE
+		map_chr_bank (1, REG(0) | 1);    // $0400-$07FF 	R0 OR 1
+		map_chr_bank (2, REG(1) & 0xFE); // $0800-$0BFF 	R1 AND $FE
+		map_chr_bank (3, REG(1) | 1);    // $0C00-$0FFF 	R1 OR 1
+		map_chr_bank (4, REG(2));        // $1000-$13FF 	R2
+		map_chr_bank (5, REG(3));        // $1400-$17FF 	R3
+		map_chr_bank (6, REG(4));        // $1800-$1BFF 	R4
+		map_chr_bank (7, REG(5));        // $1C00-$1FFF 	R5
 	}
 }
 
-#define CHR(adr) chr + chr_banks[adr / CHR_BANK_SIZE] * CHR_BANK_SIZE + adr % CHR_BANK_SIZE
+/* MIRRORING_HEADER flags that the game has not yet set mirroring, so it is as given by the header */
+#define MIRRORING_HEADER 0x80
 
-uint8_t chr_read (uint16_t address)
+/* update_mirroring sets the mirroring mode in the PPU */
+static void update_mirroring ()
 {
-	return *(CHR (address));
-}
-
-void chr_write (uint16_t address, uint8_t v)
-{
-	*(CHR (address)) = v;
+	if (mmc3_mirroring == MIRRORING_HEADER)
+		return;
+	else if (mmc3_mirroring & 1)
+		nes_ppu_set_mirroring (NES_PPU_MIRROR_HORIZONTAL);
+	else
+		nes_ppu_set_mirroring (NES_PPU_MIRROR_VERTICAL);
 }
 
 /* write_bank_data writes to the MMC Bank Data register */
@@ -160,10 +155,8 @@ static void prg_write (uint16_t address, uint8_t value)
 	{
 		if (even) // even - set PPU mirroring mode
 		{
-			if (value & 1)
-				nes_ppu_set_mirroring (NES_PPU_MIRROR_HORIZONTAL);
-			else
-				nes_ppu_set_mirroring (NES_PPU_MIRROR_VERTICAL);
+			mmc3_mirroring = value & 1;
+			update_mirroring ();
 		}
 		else // odd - we do not implement this
 			; // http://wiki.nesdev.com/w/index.php/MMC3#PRG_RAM_protect_.28.24A001-.24BFFF.2C_odd.29
@@ -174,19 +167,16 @@ static void prg_write (uint16_t address, uint8_t value)
 			mmc3_irq_latch = value;
 		else // odd - reload IRQ counter
 		{
-			// printf ("MMC3: reloading when counter = %d\n", mmc3_counter);
 			mmc3_counter = 0;
+			mmc3_irq_reload = 1;
 		}
 	}
 	else // $E000 - $FFFF
 	{
+		// even disables and acknowledges the IRQ, odd enables it
 		mmc3_irq_disable = even;
-		/*
-		   if (even) // even
-		   mmc3_irq_disable = 1; // disable IRQ
-		   else // odd
-		   mmc3_irq_disable = 0; // enable IRQ
-	    */
+		if (even)
+			nes_cpu_set_irq (NES_CPU_IRQ_MAPPER, 0);
 	}
 }
 
@@ -201,67 +191,68 @@ static int write (uint16_t address, uint8_t value)
 	return 0;
 }
 
-static uint8_t ppu_a12 = 1;
-/* nes_mmc3_step steps the MMC3 counter and signals an IRQ when counter is zero */
-static void step ()
+/**
+ *  clock_counter clocks the IRQ counter on a rise of PPU A12 and signals an IRQ when it reaches
+ *  zero. With the usual pattern table setup this happens once per scanline.
+ */
+static void clock_counter ()
 {
-	// check loop V
-	uint16_t v = nes_ppu_loopy_v ();
-	uint8_t a12 = (v >> 12) & 1;
-
-	// TODO this is not correct but it makes games playable
-	// Another solution really needs to be found though, because ther are a lot of glitches
-	// in all games
-	if (a12 != ppu_a12) // change in PPU A12 ?
+	if (mmc3_counter == 0 || mmc3_irq_reload)
 	{
-		ppu_a12 = a12;
-		// if (a12 == 0) // A12 is low, we are only interrested in 0 -> 1 events
-			// return;
-	}
-	else
-		return;
-
-	if (mmc3_counter == 0) // reload IRQ
 		mmc3_counter = mmc3_irq_latch;
+		mmc3_irq_reload = 0;
+	}
 	else
-	{
-		// decrement counter and trigger IRQ if counter == 0 and not disabled
-		// printf ("MMC3: step counter (%d, IRQ disabled: %d)\n", mmc3_counter, mmc3_irq_disable);
 		mmc3_counter --;
-		if (mmc3_counter == 0 && !mmc3_irq_disable)
-			nes_cpu_signal (IRQ);
-	}
+
+	// trigger IRQ if counter == 0 and not disabled
+	if (mmc3_counter == 0 && !mmc3_irq_disable)
+		nes_cpu_set_irq (NES_CPU_IRQ_MAPPER, 1);
 }
 
 
-void nes_mmc3_load (int n_prg_banks_, uint8_t* prg_, int n_chr_banks_, uint8_t* chr_)
+static int load (int n_prg_banks_, uint8_t* prg_, int n_chr_banks_, uint8_t* chr_)
 {
 	prg = prg_;
 	chr = chr_;
 	n_prg_banks = n_prg_banks_ << 1; // n banks passed are in 16KB but the mapper treats them as 8KB
 	n_chr_banks = n_chr_banks_ << 3; // n chr banks passed are in 8KB but the mapper divides into 1KB banks.
+	return 0;
+}
 
+static void reset ()
+{
 	mmc3_bank_select     = 0;
 	mmc3_bank_data       = 0;
-	mmc3_mirroring       = 0;
+	mmc3_mirroring       = MIRRORING_HEADER;
 	mmc3_prg_ram_protect = 0;
 	mmc3_irq_latch       = 0;
 	mmc3_irq_disable     = 0;
 	mmc3_counter         = 0;
+	mmc3_irq_reload      = 0;
 
 	memset (mmc3_registers, 0, 8 * sizeof (uint8_t));
 
-	prg_banks[0] = 0;
-	prg_banks[1] = 1;
-	prg_banks[2] = n_prg_banks - 2;
-	prg_banks[3] = n_prg_banks - 1;
-
-	memset (chr_banks, 0, N_CHR_BANKS * sizeof (int));
+	map_prg_bank (0, 0);
+	map_prg_bank (1, 1);
+	map_prg_bank (2, n_prg_banks - 2);
+	map_prg_bank (3, n_prg_banks - 1);
 
-	nes_cpu_add_store_handler (write);
-	nes_cpu_add_read_handler (prg_read);
+	for (int i = 0; i < N_CHR_BANKS; i ++)
+		map_chr_bank (i, 0);
+}
 
-	nes_ppu_set_chr_writer (chr_write);
-	nes_ppu_set_chr_read (chr_read);
-	nes_step_callback (step);
+static void destroy ()
+{
+	prg = chr = NULL;
 }
+
+const struct nes_mapper nes_mmc3 =
+{
+	.name       = "MMC3",
+	.load       = load,
+	.reset      = reset,
+	.cpu_write  = write,
+	.ppu_a12    = clock_counter,
+	.destroy    = destroy,
+};
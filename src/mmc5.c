@@ -0,0 +1,540 @@
+#include <nes/cpu.h>
+#include <nes/ppu.h>
+#include <nes/nes.h>
+#include <nes/mapper.h>
+#include <nes/region.h>
+#include <string.h>
+
+/**
+ *  Nintendo MMC5 (mapper 5).
+ *  Supported are the PRG and CHR banking modes, PRG RAM banking and its write protection, separate
+ *  sprite and background CHR banks for 8x16 sprites, nametable mapping with ExRAM and fill mode, the
+ *  scanline IRQ, the multiplier and sound. The extended attribute mode of ExRAM and the vertical
+ *  split are not.
+ */
+
+#define PRG_ROM_BANK_SIZE 0x2000
+static uint8_t* prg;
+static int n_prg_banks;
+
+#define N_CHR_BANKS 8
+#define CHR_BANK_SIZE 0x0400
+static uint8_t* chr;
+static int n_chr_banks;
+
+#define EXRAM_SIZE 0x400
+
+/* sets of CHR bank registers */
+#define CHR_SET_A 0
+#define CHR_SET_B 1
+
+/**
+ *  Sound
+ *  Two pulse channels as those of the APU but without sweep, and a raw PCM channel. The envelopes
+ *  and length counters are both clocked each quarter frame of the APU of the region, 240Hz on NTSC,
+ *  by a scheduled event, so that the length counters read through $5015 keep running while no
+ *  sound is rendered.
+ */
+struct pulse
+{
+	uint8_t regs[4];
+	uint8_t length_counter;
+	uint8_t envelope_start;
+	uint8_t envelope_divider;
+	uint8_t envelope_decay;
+	uint8_t step;
+	float   timer;            // CPU cycles until the next step
+};
+
+/* PULSE_LEVEL and PCM_LEVEL are the output of one step of volume */
+#define PULSE_LEVEL 0.00752
+#define PCM_LEVEL   0.0017
+
+static const uint8_t length_counter_table[32] =
+{
+	10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+	12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+static const uint8_t duty_sequence[4][8] =
+{
+	{ 0, 1, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 1, 0, 0, 0, 0, 0 },
+	{ 0, 1, 1, 1, 1, 0, 0, 0 },
+	{ 1, 0, 0, 1, 1, 1, 1, 1 }
+};
+
+#define IRQ_ENABLE  0x80
+#define IRQ_PENDING 0x80
+#define IN_FRAME    0x40
+
+/* background and sprite enable bits of PPUMASK, the PPU fetches nothing while both are clear */
+#define RENDERING   0x18
+
+/* registers */
+static struct
+{
+	uint8_t  prg_mode;                 // $5100
+	uint8_t  chr_mode;                 // $5101
+	uint8_t  prg_ram_protect[2];       // $5102-$5103
+	uint8_t  exram_mode;               // $5104
+	uint8_t  nametables;               // $5105
+	uint8_t  fill_tile;                // $5106
+	uint8_t  fill_attribute;           // $5107
+	uint8_t  prg_ram_bank;             // $5113
+	uint8_t  prg_banks[4];             // $5114-$5117
+	uint16_t chr_banks[2][8];          // set A $5120-$5127 and set B $5128-$512B
+	uint8_t  chr_upper;                // $5130
+	uint8_t  chr_last_set;             // set last written, used for everything with 8x8 sprites
+	uint8_t  sprites_8x16;             // PPUCTRL bit 5
+	uint8_t  irq_compare;              // $5203
+	uint8_t  irq_enable;               // $5204 write
+	uint8_t  irq_status;               // $5204 read
+	uint8_t  scanline;
+	uint8_t  multiplicand;             // $5205
+	uint8_t  multiplier;               // $5206
+	uint8_t  exram[EXRAM_SIZE];
+	struct pulse pulses[2];            // $5000-$5007
+	uint8_t  pcm_mode;                 // $5010
+	uint8_t  pcm;                      // $5011
+	uint8_t  sound_status;             // $5015
+}
+mmc5;
+
+/* fill is the nametable shown in fill mode, empty is shown in place of ExRAM when it is not a nametable */
+static uint8_t fill[EXRAM_SIZE];
+static uint8_t empty[EXRAM_SIZE];
+
+/* PRG_ROM_SELECT in a bank register selects PRG ROM, PRG RAM otherwise */
+#define PRG_ROM_SELECT 0x80
+
+/* ram_windows has a bit set for each PRG window PRG RAM is mapped in */
+static int ram_windows;
+
+/**
+ *  ram_bank returns the bank of PRG RAM selected by bank. Of 16KB there are two chips of 8KB, which
+ *  bit 2 selects between, otherwise the banks follow each other.
+ */
+static int ram_bank (int bank)
+{
+	return nes_cpu_prg_ram_size () == 0x4000 ? (bank >> 2) & 1 : bank & 7;
+}
+
+static void map_prg_bank (int window, int bank)
+{
+	if (bank & PRG_ROM_SELECT)
+	{
+		nes_cpu_map_prg (window, prg + ((bank & 0x7F) % n_prg_banks) * PRG_ROM_BANK_SIZE);
+		ram_windows &= ~(1 << window);
+	}
+	else
+	{
+		nes_cpu_map_prg_ram_window (window, ram_bank (bank));
+		ram_windows |= 1 << window;
+	}
+}
+
+/**
+ *  update_prg_banks maps the banks for the PRG mode, where the 16KB and 32KB modes ignore the lowest
+ *  bits. $5117 always selects PRG ROM.
+ */
+static void update_prg_banks ()
+{
+	uint8_t* r = mmc5.prg_banks;
+	uint8_t last = r[3] | PRG_ROM_SELECT;
+	switch (mmc5.prg_mode & 3)
+	{
+	case 0: // 32KB
+		for (int i = 0; i < 4; i ++)
+			map_prg_bank (i, (last & ~3) | i);
+		break;
+	case 1: // 16KB + 16KB
+		for (int i = 0; i < 2; i ++)
+		{
+			map_prg_bank (i, (r[1] & ~1) | i);
+			map_prg_bank (i + 2, (last & ~1) | i);
+		}
+		break;
+	case 2: // 16KB + 8KB + 8KB
+		map_prg_bank (0, r[1] & ~1);
+		map_prg_bank (1, r[1] | 1);
+		map_prg_bank (2, r[2]);
+		map_prg_bank (3, last);
+		break;
+	case 3: // 4 x 8KB
+		for (int i = 0; i < 3; i ++)
+			map_prg_bank (i, r[i]);
+		map_prg_bank (3, last);
+		break;
+	}
+}
+
+/* ram_writable returns non-zero if both registers of the write protection allow writes to PRG RAM */
+static int ram_writable ()
+{
+	return (mmc5.prg_ram_protect[0] & 3) == 2 && (mmc5.prg_ram_protect[1] & 3) == 1;
+}
+
+/**
+ *  chr_bank returns the 1KB bank of window # from a set of registers. Banks of 2KB and larger are
+ *  selected by the last register they cover, and set B only has four registers which are used for
+ *  both halves of the pattern tables.
+ */
+static uint8_t* chr_bank (int set, int window)
+{
+	int n = 8 >> (mmc5.chr_mode & 3); // 1KB banks per bank
+	int reg = window | (n - 1);
+	if (set == CHR_SET_B)
+		reg &= 3;
+	int bank = mmc5.chr_banks[set][reg] * n + (window & (n - 1));
+	return chr + (bank % n_chr_banks) * CHR_BANK_SIZE;
+}
+
+/* update_chr_banks maps background and sprite banks, which are from different sets with 8x16 sprites */
+static void update_chr_banks ()
+{
+	int set = mmc5.sprites_8x16 ? CHR_SET_B : mmc5.chr_last_set;
+	for (int i = 0; i < N_CHR_BANKS; i ++)
+		nes_ppu_map_chr (i, chr_bank (set, i));
+	if (mmc5.sprites_8x16)
+		for (int i = 0; i < N_CHR_BANKS; i ++)
+			nes_ppu_map_sprite_chr (i, chr_bank (CHR_SET_A, i));
+}
+
+/* update_fill builds the nametable shown in fill mode */
+static void update_fill ()
+{
+	memset (fill, mmc5.fill_tile, 960);
+	memset (fill + 960, (mmc5.fill_attribute & 3) * 0x55, EXRAM_SIZE - 960);
+}
+
+/* update_nametables maps each nametable to nametable RAM, ExRAM or the fill nametable */
+static void update_nametables ()
+{
+	for (int i = 0; i < 4; i ++)
+	{
+		switch ((mmc5.nametables >> (i * 2)) & 3)
+		{
+		case 0:
+		case 1:
+			nes_ppu_map_nametable (i, nes_ppu_ciram ((mmc5.nametables >> (i * 2)) & 1), 1);
+			break;
+		case 2:
+			if (mmc5.exram_mode < 2)
+				nes_ppu_map_nametable (i, mmc5.exram, 1);
+			else
+				nes_ppu_map_nametable (i, empty, 0);
+			break;
+		case 3:
+			nes_ppu_map_nametable (i, fill, 0);
+			break;
+		}
+	}
+}
+
+static void update_irq ()
+{
+	int level = (mmc5.irq_status & IRQ_PENDING) && (mmc5.irq_enable & IRQ_ENABLE);
+	nes_cpu_set_irq (NES_CPU_IRQ_MAPPER, level);
+}
+
+static void pulse_clock_frame (struct pulse* ch)
+{
+	// envelope
+	if (ch->envelope_start)
+	{
+		ch->envelope_start = 0;
+		ch->envelope_decay = 15;
+		ch->envelope_divider = ch->regs[0] & 0x0F;
+	}
+	else if (ch->envelope_divider == 0)
+	{
+		ch->envelope_divider = ch->regs[0] & 0x0F;
+		if (ch->envelope_decay > 0)
+			ch->envelope_decay --;
+		else if (ch->regs[0] & 0x20) // loop
+			ch->envelope_decay = 15;
+	}
+	else
+		ch->envelope_divider --;
+
+	// length counter, unless halted
+	if (!(ch->regs[0] & 0x20) && ch->length_counter > 0)
+		ch->length_counter --;
+}
+
+static int pulse_output (struct pulse* ch)
+{
+	if (ch->length_counter == 0 || !duty_sequence[ch->regs[0] >> 6][ch->step])
+		return 0;
+	return ch->regs[0] & 0x10 ? ch->regs[0] & 0x0F : ch->envelope_decay;
+}
+
+/* frame_at is the CPU cycle the envelopes and length counters are clocked next */
+static uint64_t frame_at;
+
+/* frame_cycles is the period of the frame timer, the quarter frame of the APU of the region */
+static int frame_cycles;
+
+/* on_frame clocks the envelopes and length counters after the sound up to now has been rendered */
+static void on_frame ()
+{
+	nes_apu_expansion_sync ();
+	pulse_clock_frame (mmc5.pulses);
+	pulse_clock_frame (mmc5.pulses + 1);
+
+	// events run late by up to an instruction, which is not carried over to the next one
+	frame_at += frame_cycles;
+	nes_schedule (on_frame, frame_at - nes_cycles ());
+}
+
+static void audio (float* samples, int n, float cycles)
+{
+	for (int i = 0; i < n; i ++)
+	{
+		int out = 0;
+		for (int c = 0; c < 2; c ++)
+		{
+			struct pulse* ch = mmc5.pulses + c;
+			int period = ((((ch->regs[3] & 7) << 8) | ch->regs[2]) + 1) * 2;
+			for (ch->timer -= cycles; ch->timer <= 0; ch->timer += period)
+				ch->step = (ch->step + 1) & 7;
+			out += pulse_output (ch);
+		}
+		samples[i] += PULSE_LEVEL * out + PCM_LEVEL * mmc5.pcm;
+	}
+}
+
+static void write_sound (uint16_t address, uint8_t v)
+{
+	nes_apu_expansion_sync ();
+	if (address < 0x5008) // pulse channels
+	{
+		struct pulse* ch = mmc5.pulses + ((address >> 2) & 1);
+		ch->regs[address & 3] = v;
+		if ((address & 3) == 3)
+		{
+			if (mmc5.sound_status & (1 << ((address >> 2) & 1)))
+				ch->length_counter = length_counter_table[v >> 3];
+			ch->envelope_start = 1;
+			ch->step = 0;
+		}
+	}
+	else if (address == 0x5010)
+		mmc5.pcm_mode = v;
+	else if (address == 0x5011)
+	{
+		// in write mode zero is ignored
+		if (!(mmc5.pcm_mode & 1) && v != 0)
+			mmc5.pcm = v;
+	}
+	else if (address == 0x5015)
+	{
+		mmc5.sound_status = v & 3;
+		for (int c = 0; c < 2; c ++)
+			if (!(v & (1 << c)))
+				mmc5.pulses[c].length_counter = 0;
+	}
+}
+
+static void write_chr_bank (int reg, uint8_t v)
+{
+	int set = reg < 8 ? CHR_SET_A : CHR_SET_B;
+	mmc5.chr_banks[set][reg & 7] = v | ((mmc5.chr_upper & 3) << 8);
+	mmc5.chr_last_set = set;
+	update_chr_banks ();
+}
+
+static int write (uint16_t address, uint8_t v)
+{
+	if (address >= 0x5C00 && address < 0x6000) // ExRAM
+	{
+		if (mmc5.exram_mode != 3)
+			mmc5.exram[address - 0x5C00] = v;
+		return 1;
+	}
+	else if (address >= 0x5000 && address < 0x5016)
+	{
+		write_sound (address, v);
+		return 1;
+	}
+	else if (address >= 0x5120 && address < 0x512C)
+	{
+		write_chr_bank (address - 0x5120, v);
+		return 1;
+	}
+	else if (address >= 0x5114 && address < 0x5118)
+	{
+		mmc5.prg_banks[address - 0x5114] = v;
+		update_prg_banks ();
+		return 1;
+	}
+
+	switch (address)
+	{
+	case 0x5100:
+		mmc5.prg_mode = v & 3;
+		update_prg_banks ();
+		break;
+	case 0x5101:
+		mmc5.chr_mode = v & 3;
+		update_chr_banks ();
+		break;
+	case 0x5102:
+	case 0x5103:
+		mmc5.prg_ram_protect[address - 0x5102] = v;
+		break;
+	case 0x5113:
+		mmc5.prg_ram_bank = v;
+		nes_cpu_map_prg_ram (ram_bank (v));
+		break;
+	case 0x5104:
+		mmc5.exram_mode = v & 3;
+		update_nametables ();
+		break;
+	case 0x5105:
+		mmc5.nametables = v;
+		update_nametables ();
+		break;
+	case 0x5106:
+		mmc5.fill_tile = v;
+		update_fill ();
+		break;
+	case 0x5107:
+		mmc5.fill_attribute = v;
+		update_fill ();
+		break;
+	case 0x5130:
+		mmc5.chr_upper = v;
+		break;
+	case 0x5203:
+		mmc5.irq_compare = v;
+		break;
+	case 0x5204:
+		mmc5.irq_enable = v;
+		update_irq ();
+		break;
+	case 0x5205:
+		mmc5.multiplicand = v;
+		break;
+	case 0x5206:
+		mmc5.multiplier = v;
+		break;
+	default:
+		// PRG RAM takes the write, where it is mapped and only while it is not protected
+		if (address >= 0x6000)
+			return !ram_writable () || (address >= 0x8000 && !(ram_windows & (1 << ((address >> 13) & 3))));
+		return address >= 0x5000;
+	}
+	return 1;
+}
+
+static int read (uint16_t address, uint8_t* v)
+{
+	switch (address)
+	{
+	case 0x5204: // reading acknowledges the IRQ
+		*v = mmc5.irq_status;
+		mmc5.irq_status &= ~IRQ_PENDING;
+		update_irq ();
+		return 1;
+	case 0x5205:
+		*v = (mmc5.multiplicand * mmc5.multiplier) & 0xFF;
+		return 1;
+	case 0x5206:
+		*v = (mmc5.multiplicand * mmc5.multiplier) >> 8;
+		return 1;
+	case 0x5015: // length counter status
+		*v = (mmc5.pulses[0].length_counter > 0) | ((mmc5.pulses[1].length_counter > 0) << 1);
+		return 1;
+	}
+	if (address >= 0x5C00 && address < 0x6000 && mmc5.exram_mode >= 2)
+	{
+		*v = mmc5.exram[address - 0x5C00];
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ *  ppu_register_write follows the sprite size in PPUCTRL. Turning rendering off in PPUMASK ends
+ *  the frame as the PPU stops fetching, the next rendered scanline starts a new one.
+ */
+static void ppu_register_write (int reg, uint8_t v)
+{
+	if (reg == PPUMASK && !(v & RENDERING))
+		mmc5.irq_status &= ~IN_FRAME;
+	if (reg != PPUCTRL || ((v & 0x20) != 0) == mmc5.sprites_8x16)
+		return;
+	mmc5.sprites_8x16 = (v & 0x20) != 0;
+	update_chr_banks ();
+}
+
+/**
+ *  ppu_scanline counts the scanlines of the picture. The first one starts the frame and the IRQ is
+ *  raised when the count equals the compare value. Scanline 240 ends the frame whether rendering
+ *  is enabled or not.
+ */
+static void ppu_scanline (int scanline)
+{
+	if (scanline == 240)
+	{
+		mmc5.irq_status &= ~IN_FRAME;
+		return;
+	}
+
+	if (!(mmc5.irq_status & IN_FRAME))
+	{
+		mmc5.irq_status = IN_FRAME;
+		mmc5.scanline = 0;
+	}
+	else if (++ mmc5.scanline == mmc5.irq_compare)
+		mmc5.irq_status |= IRQ_PENDING;
+	update_irq ();
+}
+
+static int load (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	n_prg_banks = _n_prg_banks << 1; // n banks passed are in 16KB but the mapper switches 8KB
+	prg         = _prg;
+	n_chr_banks = _n_chr_banks << 3; // n banks passed are in 8KB but the mapper switches 1KB
+	chr         = _chr;
+	return 0;
+}
+
+static void reset ()
+{
+	memset (&mmc5, 0, sizeof (mmc5));
+	mmc5.prg_mode = 3;
+	for (int i = 0; i < 3; i ++)
+		mmc5.prg_banks[i] = PRG_ROM_SELECT;
+	mmc5.prg_banks[3] = 0xFF;
+	nes_cpu_map_prg_ram (0);
+	mmc5.chr_mode = 3;
+	for (int i = 0; i < N_CHR_BANKS; i ++)
+		mmc5.chr_banks[CHR_SET_A][i] = i;
+	update_prg_banks ();
+	update_chr_banks ();
+	update_fill ();
+	frame_cycles = nes_current_region ()->quarter_frame;
+	frame_at = nes_cycles () + frame_cycles;
+	nes_schedule (on_frame, frame_cycles);
+}
+
+static void destroy ()
+{
+	prg = chr = NULL;
+}
+
+const struct nes_mapper nes_mmc5 =
+{
+	.name               = "MMC5",
+	.load               = load,
+	.reset              = reset,
+	.cpu_read           = read,
+	.cpu_write          = write,
+	.ppu_register_write = ppu_register_write,
+	.ppu_scanline       = ppu_scanline,
+	.audio              = audio,
+	.destroy            = destroy,
+};
@@ -0,0 +1,290 @@
+#include <nes/cpu.h>
+#include <nes/ppu.h>
+#include <nes/nes.h>
+#include <nes/mapper.h>
+#include <string.h>
+
+/**
+ *  Namco 163 (mapper 19).
+ *  CHR is switched in 1KB banks, and each nametable can be mapped to either page of nametable
+ *  RAM or to a 1KB bank of CHR ROM. The 15 bit IRQ counter counts up each CPU cycle and raises
+ *  the IRQ when it reaches $7FFF.
+ *  Sound is up to 8 wavetable channels whose registers and waveforms share 128 bytes of sound RAM,
+ *  accessed through $4800 at the address set at $F800.
+ */
+
+#define PRG_ROM_BANK_SIZE 0x2000
+static uint8_t* prg;
+static int n_prg_banks;
+
+#define N_CHR_BANKS 8
+#define CHR_BANK_SIZE 0x0400
+static uint8_t* chr;
+static int n_chr_banks;
+
+/* bank numbers from $E0 select nametable RAM instead of CHR ROM */
+#define CIRAM_BANK 0xE0
+
+#define COUNTER_ENABLE 0x8000
+#define COUNTER_MAX    0x7FFF
+
+#define SOUND_RAM_SIZE    0x80
+#define SOUND_CHANNELS    0x40   // channel registers in sound RAM, 8 bytes each
+#define SOUND_AUTO_INC    0x80
+#define SOUND_DISABLE     0x40   // in $E000
+#define CHANNEL_CYCLES    15     // CPU cycles to update one channel
+
+/* SOUND_LEVEL is the output of one step of (sample - 8) * volume */
+#define SOUND_LEVEL 0.0008
+
+/* registers */
+static struct
+{
+	uint8_t  chr_banks[N_CHR_BANKS];   // $8000-$BFFF
+	uint8_t  nametables[4];            // $C000-$DFFF
+	uint8_t  nametables_set;           // nametables written by the game, the rest are as by the header
+	uint8_t  prg_banks[3];             // $E000, $E800 and $F000
+	uint16_t counter;                  // counter and enable flag
+	uint8_t  sound_address;            // $F800
+	uint8_t  sound_ram[SOUND_RAM_SIZE];
+	uint8_t  channel;                  // next channel to update
+	int8_t   outputs[8];
+	float    timer;                    // CPU cycles until the next channel update
+}
+n163;
+
+/* updated is the CPU cycle the counter was last caught up to */
+static uint64_t updated;
+
+static void update_prg_banks ()
+{
+	for (int i = 0; i < 3; i ++)
+		nes_cpu_map_prg (i, prg + ((n163.prg_banks[i] & 0x3F) % n_prg_banks) * PRG_ROM_BANK_SIZE);
+	nes_cpu_map_prg (3, prg + (n_prg_banks - 1) * PRG_ROM_BANK_SIZE);
+}
+
+/**
+ *  map_chr_bank maps a pattern table bank. The RAM banks can be disabled for each half of the
+ *  pattern tables by the upper bits of $E800.
+ */
+static void map_chr_bank (int window)
+{
+	uint8_t bank = n163.chr_banks[window];
+	int ram_disabled = n163.prg_banks[1] & (window < 4 ? 0x40 : 0x80);
+	if (bank >= CIRAM_BANK && !ram_disabled)
+		nes_ppu_map_chr (window, nes_ppu_ciram (bank & 1));
+	else
+		nes_ppu_map_chr (window, chr + (bank % n_chr_banks) * CHR_BANK_SIZE);
+}
+
+static void map_nametable (int nt)
+{
+	uint8_t bank = n163.nametables[nt];
+	if (bank >= CIRAM_BANK)
+		nes_ppu_map_nametable (nt, nes_ppu_ciram (bank & 1), 1);
+	else
+		nes_ppu_map_nametable (nt, chr + (bank % n_chr_banks) * CHR_BANK_SIZE, 0);
+}
+
+/* catch_up counts the counter up for the CPU cycles since it was last updated */
+static void catch_up ()
+{
+	uint64_t now = nes_cycles ();
+	uint64_t n = now - updated;
+	updated = now;
+
+	if (!(n163.counter & COUNTER_ENABLE) || (n163.counter & COUNTER_MAX) == COUNTER_MAX)
+		return;
+	if (n >= COUNTER_MAX - (n163.counter & COUNTER_MAX))
+	{
+		n163.counter |= COUNTER_MAX;
+		nes_cpu_set_irq (NES_CPU_IRQ_MAPPER, 1);
+	}
+	else
+		n163.counter += n;
+}
+
+static void on_irq ()
+{
+	catch_up ();
+}
+
+/* schedule schedules the time the counter reaches $7FFF */
+static void schedule ()
+{
+	int count = n163.counter & COUNTER_MAX;
+	if ((n163.counter & COUNTER_ENABLE) && count != COUNTER_MAX)
+		nes_schedule (on_irq, COUNTER_MAX - count);
+	else
+		nes_unschedule (on_irq);
+}
+
+/* write_counter writes the lower or upper byte of the counter and acknowledges the IRQ */
+static void write_counter (int upper, uint8_t v)
+{
+	catch_up ();
+	if (upper)
+		n163.counter = (n163.counter & 0x00FF) | (v << 8);
+	else
+		n163.counter = (n163.counter & 0xFF00) | v;
+	nes_cpu_set_irq (NES_CPU_IRQ_MAPPER, 0);
+	schedule ();
+}
+
+/**
+ *  update_channel advances the phase of a channel in sound RAM by its frequency and samples the
+ *  4 bit waveform at the new position.
+ */
+static void update_channel (int c)
+{
+	uint8_t* r = n163.sound_ram + SOUND_CHANNELS + c * 8;
+	uint32_t frequency = r[0] | (r[2] << 8) | ((r[4] & 3) << 16);
+	uint32_t phase = r[1] | (r[3] << 8) | (r[5] << 16);
+	uint32_t length = 256 - (r[4] & 0xFC);
+
+	phase = (phase + frequency) % (length << 16);
+	r[1] = phase;
+	r[3] = phase >> 8;
+	r[5] = phase >> 16;
+
+	uint8_t sample = ((phase >> 16) + r[6]) & 0xFF;
+	int value = (n163.sound_ram[sample >> 1] >> ((sample & 1) * 4)) & 0x0F;
+	n163.outputs[c] = (value - 8) * (r[7] & 0x0F);
+}
+
+/**
+ *  audio renders the channels. The chip outputs one channel at a time, updating the next one
+ *  every 15 CPU cycles, here the enabled channels are averaged instead.
+ */
+static void audio (float* samples, int n, float cycles)
+{
+	if (n163.prg_banks[0] & SOUND_DISABLE)
+		return;
+
+	int first = 7 - ((n163.sound_ram[0x7F] >> 4) & 7);
+	for (int i = 0; i < n; i ++)
+	{
+		for (n163.timer -= cycles; n163.timer <= 0; n163.timer += CHANNEL_CYCLES)
+		{
+			if (n163.channel < first)
+				n163.channel = 7;
+			update_channel (n163.channel);
+			n163.channel = n163.channel > first ? n163.channel - 1 : 7;
+		}
+
+		int out = 0;
+		for (int c = first; c < 8; c ++)
+			out += n163.outputs[c];
+		samples[i] += SOUND_LEVEL * out / (8 - first);
+	}
+}
+
+/* sound_data returns the byte of sound RAM at the address and moves on if it auto increments */
+static uint8_t* sound_data ()
+{
+	uint8_t* data = n163.sound_ram + (n163.sound_address & 0x7F);
+	if (n163.sound_address & SOUND_AUTO_INC)
+		n163.sound_address = SOUND_AUTO_INC | ((n163.sound_address + 1) & 0x7F);
+	return data;
+}
+
+static int read (uint16_t address, uint8_t* v)
+{
+	if (address >= 0x4800 && address < 0x5000)
+	{
+		*v = *sound_data ();
+		return 1;
+	}
+	if (address >= 0x5000 && address < 0x6000)
+	{
+		catch_up ();
+		*v = address < 0x5800 ? n163.counter & 0xFF : n163.counter >> 8;
+		return 1;
+	}
+	return 0;
+}
+
+static int write (uint16_t address, uint8_t v)
+{
+	if (address < 0x4800)
+		return 0;
+	else if (address < 0x5000) // sound RAM ($4800-$4FFF)
+	{
+		nes_apu_expansion_sync ();
+		*sound_data () = v;
+		return 1;
+	}
+	else if (address < 0x6000) // IRQ counter ($5000-$5FFF)
+	{
+		write_counter (address >= 0x5800, v);
+		return 1;
+	}
+	else if (address < 0x8000)
+		return 0;
+
+	int reg = (address - 0x8000) >> 11;
+	if (reg < 8) // CHR banks ($8000-$BFFF)
+	{
+		n163.chr_banks[reg] = v;
+		map_chr_bank (reg);
+	}
+	else if (reg < 12) // nametables ($C000-$DFFF)
+	{
+		n163.nametables[reg - 8] = v;
+		n163.nametables_set |= 1 << (reg - 8);
+		map_nametable (reg - 8);
+	}
+	else if (reg < 15) // PRG banks ($E000-$F7FF)
+	{
+		if (reg == 12) // also disables sound
+			nes_apu_expansion_sync ();
+		n163.prg_banks[reg - 12] = v;
+		update_prg_banks ();
+		if (reg == 13) // also disables CHR RAM
+			for (int i = 0; i < N_CHR_BANKS; i ++)
+				map_chr_bank (i);
+	}
+	else // sound RAM address ($F800-$FFFF)
+		n163.sound_address = v;
+	return 1;
+}
+
+static int load (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	n_prg_banks = _n_prg_banks << 1; // n banks passed are in 16KB but the mapper switches 8KB
+	prg         = _prg;
+	n_chr_banks = _n_chr_banks << 3; // n banks passed are in 8KB but the mapper switches 1KB
+	chr         = _chr;
+	return 0;
+}
+
+static void reset ()
+{
+	memset (&n163, 0, sizeof (n163));
+	for (int i = 0; i < N_CHR_BANKS; i ++)
+	{
+		n163.chr_banks[i] = i;
+		map_chr_bank (i);
+	}
+	for (int i = 0; i < 3; i ++)
+		n163.prg_banks[i] = i;
+	update_prg_banks ();
+	updated = nes_cycles ();
+	nes_unschedule (on_irq);
+}
+
+static void destroy ()
+{
+	prg = chr = NULL;
+}
+
+const struct nes_mapper nes_n163 =
+{
+	.name       = "Namco 163",
+	.load       = load,
+	.reset      = reset,
+	.cpu_read   = read,
+	.cpu_write  = write,
+	.audio      = audio,
+	.destroy    = destroy,
+};
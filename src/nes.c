@@ -1,26 +1,88 @@
 #include "nes.h"
+#include "nes/nes.h"
 #include "nes/cpu.h"
 #include "nes/ppu.h"
 #include "nes/io.h"
 #include "nes/apu.h"
 #include "nes/mapper.h"
+#include "nes/archive.h"
+#include "nes/sram.h"
+#include "nes/region.h"
+#include "nes/stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+
+/* rom points to the raw iNES image the game is loaded from */
+static const uint8_t* rom = 0;
+static size_t rom_size = 0;
+
+/* rom_mapped flags that rom is a read-only mapping of the ROM file owned by us */
+static int rom_mapped = 0;
+
+/* rom_extracted holds the image decompressed from an archive, if the game was loaded from one */
+static uint8_t* rom_extracted = 0;
 
 /* PRG ROM */
-static uint8_t* prg_rom = 0;
-static uint8_t prg_rom_n_banks = 0;
+static const uint8_t* prg_rom = 0;
+static int prg_rom_n_banks = 0;
+
+/* PRG RAM, volatile and battery backed together */
+static uint8_t* prg_ram = 0;
 
 /* CHR ROM */
 static int chr_rom_n_banks;
 static uint8_t* chr_rom = 0;
 
+/* CHR RAM, allocated only for cartridges without CHR ROM */
+static uint8_t* chr_ram = 0;
+
 /* battery_backed flags if the cartridge contains battery packed SRAM */
 static int battery_backed = 0;
 
-static void load_nrom ()
+/* TV system timing of the cartridge as encoded in the NES 2.0 header */
+enum timing_mode
+{
+	TIMING_NTSC  = 0,
+	TIMING_PAL   = 1,
+	TIMING_MULTI = 2,
+	TIMING_DENDY = 3,
+};
+
+/* cartridge describes the loaded game as given by its iNES or NES 2.0 header */
+static struct cartridge
+{
+	int              nes2;           // header is in NES 2.0 format
+	int              mapper;         // mapper number, 12 bits in NES 2.0
+	int              submapper;
+	size_t           prg_rom_size;
+	size_t           chr_rom_size;
+	size_t           prg_ram_size;   // volatile PRG RAM
+	size_t           prg_nvram_size; // battery backed PRG RAM
+	size_t           chr_ram_size;   // volatile CHR RAM
+	size_t           chr_nvram_size; // battery backed CHR RAM
+	size_t           trainer_size;
+	int              battery;
+	int              four_screen;
+	int              vertical;       // vertical mirroring (horizontal arrangement)
+	enum timing_mode timing;
+}
+cartridge;
+
+/* mapper of the loaded game */
+static const struct nes_mapper* mapper = NULL;
+
+/* region is the timing of the console the game is run on */
+static const struct nes_region* region = &nes_region_ntsc;
+
+/* NROM has no registers, 16KB of PRG ROM is mirrored at $C000 */
+static void nrom_reset ()
 {
 	// load PRG ROM data to memory
 	if (prg_rom_n_banks == 1)
@@ -35,243 +97,607 @@ static void load_nrom ()
 	nes_ppu_load_chr_rom (chr_rom);
 }
 
-static int load_mapper (int mapper)
+static const struct nes_mapper nrom =
+{
+	.name  = "NROM",
+	.reset = nrom_reset,
+};
+
+/* mappers lists the supported mappers by their iNES number */
+static const struct
 {
-	switch (mapper)
+	int number;
+	const struct nes_mapper* mapper;
+}
+mappers[] =
+{
+	{ 0, &nrom },
+	{ 1, &nes_mmc1 },
+	{ 2, &nes_uxrom },
+	{ 3, &nes_cnrom },
+	{ 4, &nes_mmc3 },
+	{ 5, &nes_mmc5 },
+	{ 7, &nes_axrom },
+	{ 9, &nes_mmc2 },
+	{ 11, &nes_color_dreams },
+	{ 19, &nes_n163 },
+	{ 21, &nes_vrc4_21 },
+	{ 22, &nes_vrc2_22 },
+	{ 23, &nes_vrc4_23 },
+	{ 24, &nes_vrc6a },
+	{ 25, &nes_vrc4_25 },
+	{ 26, &nes_vrc6b },
+	{ 66, &nes_gxrom },
+	{ 69, &nes_fme7 },
+};
+
+#define N_MAPPERS (sizeof (mappers) / sizeof (mappers[0]))
+
+static int load_mapper (int number)
+{
+	for (int i = 0; i < N_MAPPERS; i ++)
 	{
-	case 0: // NROM
-		load_nrom ();
-		break;
-	case 1: // MMC1
-		nes_mmc1_load (prg_rom_n_banks, prg_rom, chr_rom_n_banks, chr_rom);
-		break;
-	case 2: // UxROM
-		nes_uxrom_load (prg_rom_n_banks, prg_rom, chr_rom_n_banks, chr_rom);
-		// UxROM doesn't handle CHR so load it to VRAM in PPU
+		if (mappers[i].number != number)
+			continue;
+
+		mapper = mappers[i].mapper;
+		if (mapper->load != NULL && mapper->load (prg_rom_n_banks, (uint8_t*) prg_rom, chr_rom_n_banks, chr_rom) != 0)
+		{
+			fprintf (stderr, "cartridge not supported by %s\n", mapper->name);
+			mapper = NULL;
+			return 1;
+		}
+		// mappers without CHR banking, like UxROM, see the first 8KB of CHR
 		nes_ppu_load_chr_rom (chr_rom);
-		break;
-	case 3: // CNROM
-		nes_cnrom_load (prg_rom_n_banks, prg_rom, chr_rom_n_banks, chr_rom);
-		break;
-	case 4: // MMC3
-		nes_mmc3_load (prg_rom_n_banks, prg_rom, chr_rom_n_banks, chr_rom);
-		break;
-	case 9: // MMC2
-		nes_mmc2_load (prg_rom_n_banks, prg_rom, chr_rom_n_banks, chr_rom);
-		break;
-	default:
-		fprintf (stderr, "mapper (%.3d) not supported\n", mapper);
-		return 1;
+		nes_cpu_set_mapper (mapper);
+		nes_ppu_set_mapper (mapper);
+		nes_apu_set_expansion (mapper->audio);
+		return 0;
 	}
-	return 0;
+	fprintf (stderr, "mapper (%.3d) not supported\n", number);
+	return 1;
 }
 
 /* size of iNES file header */
 #define INES_HEADER_SIZE 16
 
-/* Print data about the iNES header */
-static void print_ines_info (uint8_t header[INES_HEADER_SIZE])
-{
-	int mapper = (header[6] & 0xF0) >> 4 | (header[7] & 0xF0);
+/* iNES file magic number */
+static const uint8_t ines_magic[4] = { 'N', 'E', 'S', 0x1A };
 
-	printf ("%.3s\n", header);
-	printf (" TV System:    %s\n", header[9] & 1 ? "PAL" : "NTSC");
-	printf (" Mapper:       %.3d\n", mapper);
-	printf (" PRG ROM size:  %2d x 16KB (= %3dKB)\n", header[4], header[4] * 16);
-	printf (" PRG RAM size:  %2d x  8KB\n", header[8] == 0 ? 1 : header[8]);
-	if (header[5] != 0)
-		printf (" CHR ROM size:  %2d x  8KB (= %3dKB)\n", header[5], header[5] * 8);
-	else
-		printf (" CHR RAM is used instead of CHR ROM\n");
+/* timing_names are printable names of the timing modes */
+static const char* timing_names[4] = { "NTSC", "PAL", "Multi-region", "Dendy" };
 
-	// int trainer_size = ((header[6] & 0x04) >> 2) * 512;
-	// printf (" Trainer:       %d\n", trainer_size);
+/* Print data about the cartridge */
+static void print_ines_info (const struct cartridge* cart)
+{
+	printf ("%s\n", cart->nes2 ? "NES 2.0" : "iNES");
+	printf (" TV System:    %s\n", timing_names[cart->timing]);
+	printf (" Mapper:       %.3d", cart->mapper);
+	if (cart->nes2)
+		printf (" (submapper %d)", cart->submapper);
+	printf ("\n");
+	printf (" PRG ROM size:  %2zu x 16KB (= %3zuKB)\n", cart->prg_rom_size >> 14, cart->prg_rom_size >> 10);
+	printf (" PRG RAM size:  %zuB (+ %zuB battery backed)\n", cart->prg_ram_size, cart->prg_nvram_size);
+	if (cart->chr_rom_size != 0)
+		printf (" CHR ROM size:  %2zu x  8KB (= %3zuKB)\n", cart->chr_rom_size >> 13, cart->chr_rom_size >> 10);
+	else
+		printf (" CHR RAM size:  %zuB (+ %zuB battery backed)\n", cart->chr_ram_size, cart->chr_nvram_size);
 
-	if ((header[6] & 2) == 2)
+	if (cart->battery)
 		printf ("Battery backed SRAM\n");
 
 	printf (" Mirroring: ");
-	switch (header[6] & 0x9)
-	{
-	case 0:
-		printf ("HORIZONTAL\n");
-		break;
-	case 1:
-		printf ("VERTICAL\n");
-		break;
-	case 8:
-	case 9:
+	if (cart->four_screen)
 		printf ("FOUR SCREEN\n");
-		break;
+	else if (cart->vertical)
+		printf ("VERTICAL\n");
+	else
+		printf ("HORIZONTAL\n");
+}
+
+/**
+ *  nes2_rom_size computes the ROM size from the NES 2.0 LSB and MSB nibble in units of unit bytes.
+ *  In case the MSB nibble is $F the LSB is in exponent-multiplier notation.
+ */
+static size_t nes2_rom_size (uint8_t lsb, uint8_t msb, size_t unit)
+{
+	if (msb == 0xF)
+		return ((size_t) 1 << (lsb >> 2)) * ((lsb & 3) * 2 + 1);
+	return ((size_t) msb << 8 | lsb) * unit;
+}
+
+/* nes2_ram_size computes a RAM size from its NES 2.0 shift count */
+static size_t nes2_ram_size (uint8_t shift)
+{
+	return shift == 0 ? 0 : (size_t) 64 << shift;
+}
+
+/**
+ *  parse_header parses the iNES or NES 2.0 header into cart.
+ *  Returns non-zero if the header is not valid.
+ */
+static int parse_header (const uint8_t header[INES_HEADER_SIZE], struct cartridge* cart)
+{
+	if (memcmp (header, ines_magic, sizeof (ines_magic)) != 0)
+	{
+		fprintf (stderr, "not an iNES file\n");
+		return 1;
 	}
+	memset (cart, 0, sizeof (*cart));
+
+	cart->battery      = (header[6] & 2) == 2;
+	cart->trainer_size = ((header[6] & 0x04) >> 2) * 512;
+	cart->four_screen  = (header[6] & 8) == 8;
+	cart->vertical     = header[6] & 1;
+	cart->mapper       = (header[6] & 0xF0) >> 4 | (header[7] & 0xF0);
+	cart->nes2         = (header[7] & 0x0C) == 0x08;
+
+	if (cart->nes2)
+	{
+		cart->mapper        |= (header[8] & 0x0F) << 8;
+		cart->submapper      = header[8] >> 4;
+		cart->prg_rom_size   = nes2_rom_size (header[4], header[9] & 0x0F, 16 << 10);
+		cart->chr_rom_size   = nes2_rom_size (header[5], header[9] >> 4, 8 << 10);
+		cart->prg_ram_size   = nes2_ram_size (header[10] & 0x0F);
+		cart->prg_nvram_size = nes2_ram_size (header[10] >> 4);
+		cart->chr_ram_size   = nes2_ram_size (header[11] & 0x0F);
+		cart->chr_nvram_size = nes2_ram_size (header[11] >> 4);
+		cart->timing         = header[12] & 3;
+		return 0;
+	}
+
+	uint8_t zeroes[4] = { 0 };
+	if (memcmp (header + 12, zeroes, 4))
+	{
+		// not all zeroes in end of header, probably garbage written by an old dumping tool
+		// we mask the upper 4 bits of the map number in this case.
+		cart->mapper &= 0xF;
+	}
+	cart->prg_rom_size = header[4] * (16 << 10);
+	cart->chr_rom_size = header[5] * (8 << 10);
+	// iNES can not tell volatile from battery backed RAM, and sizes are largely unreliable
+	size_t prg_ram_size = (header[8] == 0 ? 1 : header[8]) * (8 << 10);
+	if (cart->battery)
+		cart->prg_nvram_size = prg_ram_size;
+	else
+		cart->prg_ram_size = prg_ram_size;
+	cart->chr_ram_size = cart->chr_rom_size == 0 ? 8 << 10 : 0;
+	cart->timing = header[9] & 1 ? TIMING_PAL : TIMING_NTSC;
+	return 0;
 }
 
 /**
- *  Parse an iNES type ROM file.
+ *  Parse an iNES type ROM image.
+ *  PRG and CHR ROM are referenced in place and never copied, so the image needs to stay valid
+ *  until the game is stopped. Only CHR RAM is allocated, sized as given by the header.
  */
-static int load_ines (FILE *fp)
+static int load_ines (const uint8_t* data, size_t size)
 {
-	int ret = 0;
-	unsigned char header[INES_HEADER_SIZE];
-	if (fread (header, 1, INES_HEADER_SIZE, fp) != INES_HEADER_SIZE)
+	struct cartridge* cart = &cartridge;
+	if (size < INES_HEADER_SIZE)
 	{
 		fprintf (stderr, "did not get all bytes for ines header\n");
 		return 1;
 	}
+	if (parse_header (data, cart) != 0)
+		return 1;
+	print_ines_info (cart);
 
-	// check trainer - jump over it if it exists
-	int trainer_size = ((header[6] & 0x04) >> 2) * 512;
-	if (trainer_size)
-		fseek (fp, trainer_size, SEEK_CUR);
+	// jump over the trainer if it exists
+	size_t offset = INES_HEADER_SIZE + cart->trainer_size;
 
-	// read PRG ROM --------------------------------------------------
-	prg_rom_n_banks = header[4];
-	int prg_rom_size = prg_rom_n_banks * 16 << 10;
-	prg_rom = calloc (prg_rom_size, 1);
-	if ((ret = fread (prg_rom, 1, prg_rom_size, fp)) != prg_rom_size)
+	// PRG ROM --------------------------------------------------
+	if (cart->prg_rom_size == 0 || (cart->prg_rom_size & (NES_PRG_ROM_BANK_SIZE - 1)))
+	{
+		fprintf (stderr, "PRG ROM of %zu bytes is not supported\n", cart->prg_rom_size);
+		return 1;
+	}
+	if (offset + cart->prg_rom_size > size)
 	{
 		fprintf (stderr, "did not get all bytes for PRG ROM\n");
 		return 1;
 	}
+	prg_rom = data + offset;
+	prg_rom_n_banks = cart->prg_rom_size / NES_PRG_ROM_BANK_SIZE;
+	offset += cart->prg_rom_size;
+	nes_cpu_set_prg_rom (prg_rom, cart->prg_rom_size);
+
+	// PRG RAM --------------------------------------------------
+	// in whole 8KB banks the mapper switches through, at least the one at $6000
+	size_t prg_ram_size = (cart->prg_ram_size + cart->prg_nvram_size + 0x1FFF) & ~(size_t) 0x1FFF;
+	if (prg_ram_size < 0x2000)
+		prg_ram_size = 0x2000;
+	prg_ram = calloc (prg_ram_size, 1);
+	if (prg_ram == NULL)
+	{
+		fprintf (stderr, "could not allocate %zuB of PRG RAM\n", prg_ram_size);
+		return 1;
+	}
+	nes_cpu_set_prg_ram (prg_ram, prg_ram_size);
 
 	// cartridge contains battery backed PRG RAM
-	battery_backed = (header[6] & 2) == 2;
+	battery_backed = cart->battery;
 
 	// CHR ROM --------------------------------------------------
-	chr_rom_n_banks = header[5];
-	int chr_rom_size = chr_rom_n_banks * 8 << 10;
-
-	if (chr_rom_size == 0) // CHR RAM
+	if (cart->chr_rom_size & 0x1FFF)
+	{
+		fprintf (stderr, "CHR ROM of %zu bytes is not supported\n", cart->chr_rom_size);
+		return 1;
+	}
+	if (cart->chr_rom_size == 0) // CHR RAM
 	{
-		chr_rom_n_banks = 2;
-		chr_rom = calloc (0x2000, 1);
+		// the PPU always addresses a full 8KB pattern table space
+		size_t chr_ram_size = cart->chr_ram_size + cart->chr_nvram_size;
+		if (chr_ram_size < 0x2000)
+			chr_ram_size = 0x2000;
+		chr_rom_n_banks = chr_ram_size >> 13;
+		chr_rom = chr_ram = calloc (chr_ram_size, 1);
 	}
 	else
 	{
-		chr_rom = malloc (chr_rom_size);
-		if ((ret = fread (chr_rom, 1, chr_rom_size, fp)) != chr_rom_size)
+		if (offset + cart->chr_rom_size > size)
 		{
 			fprintf (stderr, "did not get all bytes for CHR ROM\n");
 			return 1;
 		}
+		// the PPU drops writes to CHR ROM so the image is never modified
+		chr_rom_n_banks = cart->chr_rom_size >> 13;
+		chr_rom = (uint8_t*) data + offset;
 	}
+	nes_ppu_set_chr_ram (chr_ram != 0);
 
 	// PPU mirroring --------------------------------------------------
-	switch (header[6] & 0x9)
-	{
-	case 0: // horizontal mirroring
-		nes_ppu_set_mirroring (NES_PPU_MIRROR_HORIZONTAL);
-		break;
-	case 1: // vertical mirroring
-		nes_ppu_set_mirroring (NES_PPU_MIRROR_VERTICAL);
-		break;
-	case 8: // four screen mirroring
-	case 9:
+	if (cart->four_screen)
 		nes_ppu_set_mirroring (NES_PPU_MIRROR_FOUR_SCREEN);
-		break;
-	}
+	else if (cart->vertical)
+		nes_ppu_set_mirroring (NES_PPU_MIRROR_VERTICAL);
+	else
+		nes_ppu_set_mirroring (NES_PPU_MIRROR_HORIZONTAL);
+
+	// Region ---------------------------------------------------------
+	// multi-region games run as NTSC
+	if (cart->timing == TIMING_PAL)
+		region = &nes_region_pal;
+	else if (cart->timing == TIMING_DENDY)
+		region = &nes_region_dendy;
+	else
+		region = &nes_region_ntsc;
+	nes_ppu_set_region (region);
+	nes_apu_set_region (region);
+
+	// forget the idle loops of the game loaded before
+	nes_cpu_set_idle_skip (1);
 
 	// Mapper ---------------------------------------------------------
-	int mapper = (header[6] & 0xF0) >> 4 | (header[7] & 0xF0);
-	uint8_t zeroes[4] = { 0 };
-	if (memcmp (header + 11, zeroes, 4))
-	{
-		// not all zeroes in end of header
-		// we mask the upper 4 bits of the map number in this case.
-		mapper &= 0xF;
-	}
 	// load the mapper - return in case we do not support it
-	if (load_mapper (mapper) != 0)
+	if (load_mapper (cart->mapper) != 0)
 		return 1;
 
-	print_ines_info (header);
 	return 0;
 }
 
+/**
+ *  Load the game from an image in memory, which is either an iNES image or a zip/7z archive
+ *  containing one. Archives are decompressed straight from memory.
+ */
+static int load_image (const uint8_t* data, size_t size)
+{
+	size_t n = 0;
+	if (nes_zip_is_archive (data, size))
+	{
+		if (nes_zip_extract_rom (data, size, &rom_extracted, &n) != 0)
+			return 1;
+		return load_ines (rom_extracted, n);
+	}
+	else if (nes_7z_is_archive (data, size))
+	{
+		if (nes_7z_extract_rom (data, size, &rom_extracted, &n) != 0)
+			return 1;
+		return load_ines (rom_extracted, n);
+	}
+	return load_ines (data, size);
+}
+
 /**
  *  Open a NES ROM file.
+ *  The file is mapped read-only and private so that all processes running the same ROM share
+ *  the pages of PRG and CHR ROM through the page cache instead of each holding a heap copy.
  */
 static int load_game (const char* file)
 {
-	FILE* fp = fopen (file, "rb");
-	int ret = 0;
-	if (!fp)
-	{
-		ret = 1;
+	int ret = 1;
+	struct stat st;
+	void* data;
+	int fd = open (file, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	if (fstat (fd, &st) != 0 || st.st_size == 0)
 		goto end;
-	}
-	ret = load_ines (fp);
-	fclose (fp);
+
+	data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		goto end;
+
+	rom = data;
+	rom_size = st.st_size;
+	rom_mapped = 1;
+	ret = load_image (rom, rom_size);
 end:
+	close (fd);
 	return ret;
 }
 
-/*
- * cpu_step_callback points to a callback to be called each time we step the CPU.
- * it defaults to NULL
+/**
+ *  unload_game releases the ROM, PRG RAM and CHR RAM of the game, also when it only got partly loaded.
  */
-static void (*cpu_step_callback)() = NULL;
+static void unload_game ()
+{
+	nes_cpu_set_prg_rom (NULL, 0);
+	nes_cpu_set_prg_ram (NULL, 0);
+	if (rom_mapped)
+		munmap ((void*) rom, rom_size);
+	free (rom_extracted);
+	free (prg_ram);
+	free (chr_ram);
+	rom = 0;
+	rom_extracted = 0;
+	rom_size = 0;
+	rom_mapped = 0;
+	prg_rom = 0;
+	prg_ram = 0;
+	chr_rom = chr_ram = 0;
+	memset (&cartridge, 0, sizeof (cartridge));
+}
+
+/* Event scheduler ------------------------------------------------------------------------- */
+
+#define MAX_EVENTS 8
 
-void nes_step_callback (void (*cb) ())
+/* cpu_cycles counts the CPU cycles run since the game was started */
+static uint64_t cpu_cycles;
+
+/* events scheduled and the cycle they are due at */
+static struct
 {
-	cpu_step_callback = cb;
+	uint64_t  at;
+	nes_event event;
+}
+events[MAX_EVENTS];
+static int n_events;
+
+/* next_event is the cycle the first event is due at */
+static uint64_t next_event = UINT64_MAX;
+
+uint64_t nes_cycles ()
+{
+	return cpu_cycles;
+}
+
+const struct nes_region* nes_current_region ()
+{
+	return region;
+}
+
+/* update_next_event finds the cycle of the first event */
+static void update_next_event ()
+{
+	next_event = UINT64_MAX;
+	for (int i = 0; i < n_events; i ++)
+		if (events[i].at < next_event)
+			next_event = events[i].at;
+}
+
+void nes_unschedule (nes_event event)
+{
+	for (int i = 0; i < n_events; i ++)
+	{
+		if (events[i].event == event)
+		{
+			events[i] = events[-- n_events];
+			update_next_event ();
+			return;
+		}
+	}
+}
+
+void nes_schedule (nes_event event, int cycles)
+{
+	nes_unschedule (event);
+	if (n_events == MAX_EVENTS)
+	{
+		fprintf (stderr, "too many events scheduled\n");
+		return;
+	}
+	events[n_events].at = cpu_cycles + cycles;
+	events[n_events].event = event;
+	n_events ++;
+	update_next_event ();
+}
+
+/* run_events calls all events that are due, which may schedule new events themselves */
+static void run_events ()
+{
+	while (next_event <= cpu_cycles)
+	{
+		for (int i = 0; i < n_events; i ++)
+		{
+			if (events[i].at == next_event)
+			{
+				nes_event event = events[i].event;
+				events[i] = events[-- n_events];
+				update_next_event ();
+				event ();
+				break;
+			}
+		}
+	}
+}
+
+/* clear_events removes all scheduled events */
+static void clear_events ()
+{
+	n_events = 0;
+	next_event = UINT64_MAX;
+	cpu_cycles = 0;
+}
+
+void nes_reset ()
+{
+	// the CPU takes the reset vector before its next instruction, rendering and sound stop
+	nes_cpu_signal (RST);
+	nes_ppu_register_write (PPUCTRL, 0);
+	nes_ppu_register_write (PPUMASK, 0);
+	nes_apu_register_write (NES_APU_STATUS, 0);
 }
 
 void nes_stop ()
 {
 	// cleanup
-	free (prg_rom);
-	free (chr_rom);
-	prg_rom = 0;
-	cpu_step_callback = NULL;
+	nes_sram_close ();
+	if (mapper != NULL && mapper->destroy != NULL)
+		mapper->destroy ();
+	mapper = NULL;
+	nes_cpu_set_mapper (NULL);
+	nes_ppu_set_mapper (NULL);
+	nes_apu_set_expansion (NULL);
+	clear_events ();
+	unload_game ();
 }
 
 // keep track of PPU cycles to know when a frame is done
 static int ppucc;
 
-int nes_start (const char* file)
+/* ppucc_fraction is the fifths of a PPU cycle left over, for regions not running 3 PPU cycles per CPU cycle */
+static int ppucc_fraction;
+
+#define PPU_CC_PER_CPU_CC 3
+
+/* ppu_cycles returns the number of PPU cycles to run for cc CPU cycles */
+static inline int ppu_cycles (int cc)
 {
-	// load game
-	if (load_game (file) != 0)
-		return 1;
+	if (region->ppu_cc_per_5_cpu_cc == PPU_CC_PER_CPU_CC * 5) // NTSC and Dendy
+		return cc * PPU_CC_PER_CPU_CC;
+
+	ppucc_fraction += cc * region->ppu_cc_per_5_cpu_cc;
+	int n = ppucc_fraction / 5;
+	ppucc_fraction -= n * 5;
+	return n;
+}
+
+/* run_hardware runs the PPU, the APU and the events due for cc CPU cycles */
+static void run_hardware (int cc)
+{
+	int pc = ppu_cycles (cc);
+	NES_STATS_TIMER (t);
+
+	// render on PPU
+	for (int i = 0; i < pc; i ++)
+		nes_ppu_step ();
+	NES_STATS_LAP (ppu_ticks, t);
+
+	// render audio
+	for (int i = 0; i < cc; i ++)
+		nes_apu_step ();
+	NES_STATS_LAP (apu_ticks, t);
+
+	ppucc += pc;
 
-	// init hardware
+	cpu_cycles += cc;
+	if (cpu_cycles >= next_event)
+	{
+		run_events ();
+		NES_STATS_LAP (event_ticks, t);
+	}
+}
+
+
+/* reset_hardware resets all hardware components to their power up state. */
+static void reset_hardware ()
+{
+	clear_events ();
+	// the mapper goes first for the CPU to read the reset vector from the right bank
+	if (mapper->reset != NULL)
+		mapper->reset ();
+	nes_cpu_set_clock (run_hardware);
 	nes_cpu_reset();
 	nes_ppu_reset();
 	nes_apu_reset();
 	ppucc = 0;
-
-	return 0;
+	ppucc_fraction = 0;
 }
 
+/**
+ *  load_save loads battery backed PRG RAM from the save file next to the ROM file, named as the
+ *  ROM with its extension replaced by .sav.
+ */
+static void load_save (const char* file)
+{
+	char path[PATH_MAX];
+	const char* dot = strrchr (file, '.');
+	const char* slash = strrchr (file, '/');
+	int n = dot != NULL && (slash == NULL || dot > slash) ? dot - file : strlen (file);
 
-#define PPU_CC_PER_CPU_CC 3
+	if (snprintf (path, sizeof (path), "%.*s.sav", n, file) >= sizeof (path))
+	{
+		fprintf (stderr, "path to save file is too long\n");
+		return;
+	}
+	nes_sram_open (path);
+}
 
-void nes_step_frame ()
+int nes_start (const char* file)
 {
-	// number of CPU cycles run during one step
-	int cc;
-	// run until a frame has been fully rendered
-	while (ppucc < PPUCC_PER_SCANLINE * SCANLINES_PER_FRAME)
+	// load game
+	if (load_game (file) != 0)
 	{
-		cc = nes_cpu_step ();
+		unload_game ();
+		return 1;
+	}
+
+	reset_hardware ();
+	if (battery_backed)
+		load_save (file);
+	return 0;
+}
 
-		// render on PPU
-		for (int i = 0; i < cc * PPU_CC_PER_CPU_CC; i ++)
-			nes_ppu_step ();
+int nes_start_from_memory (const void* data, size_t size)
+{
+	rom = data;
+	rom_size = size;
+	rom_mapped = 0;
+	if (load_image (rom, rom_size) != 0)
+	{
+		unload_game ();
+		return 1;
+	}
 
-		// render audio
-		for (int i = 0; i < cc; i ++)
-			nes_apu_step ();
+	reset_hardware ();
+	return 0;
+}
 
-		ppucc += cc * PPU_CC_PER_CPU_CC;
 
-		if (cpu_step_callback != NULL)
-			cpu_step_callback();
+void nes_step_frame ()
+{
+	int ppucc_per_frame = PPUCC_PER_SCANLINE * region->scanlines;
+	NES_STATS_TIMER (t);
+	// run until a frame has been fully rendered
+	while (ppucc < ppucc_per_frame)
+	{
+#ifdef ACCURATE
+		// the CPU runs the hardware as it goes
+		nes_cpu_step ();
+#else
+		run_hardware (nes_cpu_step ());
+#endif
 
 		// TODO emulate Hz
 	}
-	ppucc %= PPUCC_PER_SCANLINE * SCANLINES_PER_FRAME;
+	ppucc %= ppucc_per_frame;
+
+	nes_sram_frame ();
+	NES_STATS_LAP (frame_ticks, t);
+	NES_STATS_END_FRAME ();
 }
 
 
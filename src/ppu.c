@@ -1,5 +1,8 @@
 #include "nes/ppu.h"
 #include "nes/cpu.h"
+#include "nes/mapper.h"
+#include "nes/region.h"
+#include "nes/stats.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -7,6 +10,14 @@
 // # of cycles the PPU runs per frame
 #define PPUCC_PER_FRAME PPUCC_PER_SCANLINE * SCANLINES_PER_FRAME
 
+/**
+ * Timing of the region, which defaults to NTSC.
+ */
+static int scanlines_per_frame = SCANLINES_PER_FRAME;
+static int ppucc_per_frame     = PPUCC_PER_FRAME;
+static int vblank_scanline     = 241;
+static int odd_frame_skip      = 1;
+
 // Screen and sprite sizes
 #define SCREEN_W      256
 #define SCREEN_H      240
@@ -69,6 +80,21 @@ uint16_t nes_ppu_loopy_v () { return v; }
 /* PPU clock cycles */
 static int ppucc;
 
+/* PPU clock cycles since reset, never wraps */
+static uint64_t total_ppucc;
+
+/* state of PPU address line A12 and the cycle it last went low */
+static int a12;
+static uint64_t a12_fall;
+
+void nes_ppu_position (int* scanline, int* dot)
+{
+	*scanline = ppucc / PPUCC_PER_SCANLINE;
+	*dot = ppucc % PPUCC_PER_SCANLINE;
+	if (*scanline == scanlines_per_frame - 1)
+		*scanline = -1;
+}
+
 
 // DEBUGGERS --------------------------------------------------------------------------------------
 void print_pattern_table (uint16_t addr)
@@ -108,6 +134,9 @@ void nes_ppu_reset ()
 	// reset flags
 	flags = 0;
 	ppucc = SCREEN_H * PPUCC_PER_SCANLINE - 1; // we start in vblank
+	total_ppucc = 0;
+	a12 = 0;
+	a12_fall = 0;
 
 	// reset scrolling and VRAM
 	t = v = x = 0;
@@ -124,58 +153,111 @@ void nes_ppu_load_vram (void* data)
 	memcpy (vram, data, VRAM_SIZE);
 }
 
-// TODO cleanup all code around reading/writing to CHR
-//	- remove functions allowing to switch banks
-//	- make default to just read from chr_rom
+/* CHR is read through eight 1KB windows covering the pattern tables at $0000-$1FFF */
+#define CHR_WINDOW_SIZE 0x400
+
+/* chr_windows point to the banks of CHR currently mapped in each window */
+static uint8_t* chr_windows[NES_PPU_CHR_WINDOWS];
 
-/* chr_rom points to all banks of CHR data */
-static uint8_t* chr_rom;
+/* sprite_chr_windows are the windows sprite patterns are read through */
+static uint8_t* sprite_chr_windows[NES_PPU_CHR_WINDOWS];
+
+void nes_ppu_map_chr (int window, uint8_t* bank)
+{
+	NES_STATS_COUNT (chr_switches);
+	chr_windows[window] = bank;
+	sprite_chr_windows[window] = bank;
+}
+
+void nes_ppu_map_sprite_chr (int window, uint8_t* bank)
+{
+	NES_STATS_COUNT (chr_switches);
+	sprite_chr_windows[window] = bank;
+}
 
 void nes_ppu_load_chr_rom (void* data)
 {
-	chr_rom = data;
+	for (int i = 0; i < NES_PPU_CHR_WINDOWS; i ++)
+		nes_ppu_map_chr (i, (uint8_t*) data + i * CHR_WINDOW_SIZE);
 }
 
-static uint8_t default_chr_read (uint16_t address)
+/* chr_ram flags if CHR is writable, writes to CHR ROM are ignored */
+static int chr_ram;
+
+void nes_ppu_set_chr_ram (int enabled)
 {
-	return chr_rom[address];
+	chr_ram = enabled;
 }
 
-/* chr_reader points to the current function to be used for reading from CHR */
-static nes_ppu_chr_reader chr_reader = default_chr_read;
+/* mapper of the cartridge, NULL if there is none */
+static const struct nes_mapper* mapper = NULL;
+
+/* pattern_hook is the pattern fetch hook of the mapper, kept apart to keep fetches cheap */
+static void (*pattern_hook) (uint16_t) = NULL;
+
+/* scanline_hook is the scanline hook of the mapper */
+static void (*scanline_hook) (int) = NULL;
 
-void nes_ppu_set_chr_read (nes_ppu_chr_reader r)
+void nes_ppu_set_mapper (const struct nes_mapper* m)
 {
-	chr_reader = r;
+	mapper = m;
+	pattern_hook = m != NULL ? m->ppu_read : NULL;
+	scanline_hook = m != NULL ? m->ppu_scanline : NULL;
 }
 
 /**
- *   read to CHR ROM making sure we read from the correct bank.
+ *   read from CHR through the window the address belongs to.
  */
 static inline uint8_t chr_read (uint16_t address)
 {
-	return chr_reader (address);
+	return chr_windows[address >> 10][address & (CHR_WINDOW_SIZE - 1)];
 }
 
-static void default_chr_write (uint16_t address, uint8_t value)
+/**
+ *  A12_FILTER is the number of PPU cycles A12 needs to have been low for a rise to be seen by the
+ *  mapper. The MMC3 only counts a rise if A12 was low for a few falling edges of the CPU M2 clock,
+ *  which keeps sprite fetches from clocking it more than once per scanline.
+ */
+#define A12_FILTER 10
+
+/**
+ *  address_bus is called with each address the PPU puts on its bus and notifies the mapper of
+ *  filtered rises of A12.
+ */
+static inline void address_bus (uint16_t address)
 {
-	chr_rom[address] = value;
+	if (address & 0x1000)
+	{
+		if (!a12 && total_ppucc - a12_fall >= A12_FILTER && mapper != NULL && mapper->ppu_a12 != NULL)
+			mapper->ppu_a12 ();
+		a12 = 1;
+	}
+	else if (a12)
+	{
+		a12 = 0;
+		a12_fall = total_ppucc;
+	}
 }
 
-/* chr_writer points to the current function for writing to CHR */
-static nes_ppu_chr_writer chr_writer = default_chr_write;
-
-void nes_ppu_set_chr_writer (nes_ppu_chr_writer w)
+/**
+ *  fetch_pattern reads from the pattern tables over the PPU bus, as done by rendering and PPUDATA
+ *  reads. The mapper is notified after the read as it might switch banks on it.
+ */
+static inline uint8_t fetch_pattern (uint16_t address)
 {
-	chr_writer = w;
+	address_bus (address);
+	uint8_t b = chr_read (address);
+	if (pattern_hook != NULL)
+		pattern_hook (address);
+	return b;
 }
 
 /**
- *   write to CHR ROM making sure we write to the correct bank.
+ *   write to CHR through the window the address belongs to.
  */
 static inline void write_chr (uint16_t address, uint8_t value)
 {
-	chr_writer (address, value);
+	chr_windows[address >> 10][address & (CHR_WINDOW_SIZE - 1)] = value;
 }
 
 
@@ -193,91 +275,54 @@ void nes_ppu_load_oam_data (void* data)
  *  Mirroring ----------------------------------------------------------------------------------
  */
 
-/**
- *  mirror_vertically mirrors the input address vertically
- *    AB
- *    AB
- */
-static uint16_t mirror_vertically (uint16_t address)
-{
-	return address &= 0x27FF;
-}
+/* nametables point to the 1KB pages mapped at $2000, $2400, $2800 and $2C00 */
+static uint8_t* nametables[4];
 
-/**
- *  mirror_horizontally mirrors the input address horizontally
- *    AA
- *    BB
- */
-static uint16_t mirror_horizontally (uint16_t address)
-{
-	if (address >= NAMETABLE_2)
-		address = NAMETABLE_1 + (address & 0x3FF);
-	else if (address >= NAMETABLE_1)
-		address -= 0x400;
-	return address;
-}
+/* nametables_writable has bit # set if nametable # can be written to */
+static int nametables_writable;
 
-/**
- *  mirror_four_screen mirrors the input address using four screen mirroring
- *    AB
- *    CD
- */
-static uint16_t mirror_four_screen (uint16_t address)
-{
-	return address;
-}
+/* NAMETABLE accesses the byte of address within nametable space, $3xxx mirrors $2xxx */
+#define NAMETABLE(address) nametables[((address) >> 10) & 3][(address) & 0x3FF]
 
 /**
- * mirror_single0 mirrors the address for single page upper bank.
+ *  mirrorings lists which of the four pages of VRAM each nametable uses, by mirroring mode.
+ *  Only four screen mirroring uses the upper two pages, which are on the cartridge.
  */
-static uint16_t mirror_single0 (uint16_t address)
+static const int mirrorings[5][4] =
 {
-	return NAMETABLE_0 + (address & 0x03FF);
-}
+	{ 0, 0, 1, 1 }, // horizontal
+	{ 0, 1, 0, 1 }, // vertical
+	{ 0, 0, 0, 0 }, // single page lower bank
+	{ 1, 1, 1, 1 }, // single page upper bank
+	{ 0, 1, 2, 3 }, // four screen
+};
 
-/**
- * mirror_single1 mirrors the address for single page lower bank.
- */
-static uint16_t mirror_single1 (uint16_t address)
+void nes_ppu_set_region (const struct nes_region* region)
 {
-	return NAMETABLE_1 + (address & 0x03FF);
+	scanlines_per_frame = region->scanlines;
+	ppucc_per_frame     = PPUCC_PER_SCANLINE * region->scanlines;
+	vblank_scanline     = region->vblank_scanline;
+	odd_frame_skip      = region->odd_frame_skip;
 }
 
-/* mirror function - takes an address and returns the respective one in VRAM respecting mirroring mode */
-typedef uint16_t (*address_mirrorer) (uint16_t) ;
-
-/* address_mirrorers lists mirroring functions, their index are their modes */
-static address_mirrorer address_mirrorers[5] =
+void nes_ppu_map_nametable (int nametable, uint8_t* page, int writable)
 {
-	mirror_horizontally,
-	mirror_vertically,
-	mirror_single0,
-	mirror_single1,
-	mirror_four_screen,
-};
-
-/* mirror_mode contains the current mirroring mode of the nametables */
-static nes_ppu_mirroring_mode mirror_mode;
-
-/* nametable_mirrorer is the current mirroring function set by the mapper */
-static address_mirrorer nametable_mirrorer;
+	nametables[nametable] = page;
+	if (writable)
+		nametables_writable |= 1 << nametable;
+	else
+		nametables_writable &= ~(1 << nametable);
+}
 
-/**
- *  mirror_address returns the mirrored location of address within VRAM.
- *  The function assumes the caller is asking for an address within nametable space,
- *  as it is the only part that is mirrored.
- */
-static uint16_t mirror_address (uint16_t address)
+uint8_t* nes_ppu_ciram (int page)
 {
-	// $3xxx -> $2xxxx
-	return nametable_mirrorer (address & 0x2FFF);
+	return vram + NAMETABLE_0 + page * 0x400;
 }
 
-
 void nes_ppu_set_mirroring (nes_ppu_mirroring_mode mode)
 {
-	mirror_mode = mode;
-	nametable_mirrorer = *address_mirrorers[mirror_mode];
+	for (int i = 0; i < 4; i ++)
+		nes_ppu_map_nametable (i, nes_ppu_ciram (mirrorings[mode][i]), 1);
 }
 
 
@@ -337,6 +382,7 @@ static void write_ppuaddr (uint8_t value)
 	else
 	{
 		v  = t = (t & 0xFF00) | value;
+		address_bus (v);
 	}
 	flags ^= w;
 }
@@ -344,6 +390,9 @@ static void write_ppuaddr (uint8_t value)
 /* Write > PPUDATA $(2007) */
 static void write_ppudata (uint8_t value)
 {
+	if (v < PALETTE_RAM && mapper != NULL && mapper->ppu_write != NULL)
+		mapper->ppu_write (v, value);
+
 	if (v >= PALETTE_RAM) // palettes
 	{
 		// make sure to mirror
@@ -354,9 +403,10 @@ static void write_ppudata (uint8_t value)
 	else if (v >= NAMETABLE_0) // nametables
 	{
 		// write to mirrored address
-		vram[mirror_address (v)] = value;
+		if (nametables_writable & (1 << ((v >> 10) & 3)))
+			NAMETABLE (v) = value;
 	}
-	else // patterns/CHR (no mirroring)
+	else if (chr_ram) // patterns/CHR (no mirroring)
 	{
 		write_chr (v, value);
 	}
@@ -386,6 +436,9 @@ static void (*register_writers[8])(uint8_t) =
 /* Write value to PPU register by calling the writer function associated to it. */
 void nes_ppu_register_write (nes_ppu_register reg, uint8_t value)
 {
+	if (mapper != NULL && mapper->ppu_register_write != NULL)
+		mapper->ppu_register_write (reg, value);
+
 	uint8_t *ppustatus = ppu_registers + PPUSTATUS;
 	*ppustatus = (*ppustatus & 0xE0) | (value & 0x1F);
 	if (*register_writers[reg])
@@ -397,13 +450,19 @@ void nes_ppu_register_write (nes_ppu_register reg, uint8_t value)
  *  Register Readers ------------------------------------------------------------------------------
  */
 
-/* Read < PPUSTATUS $(2002) */
-static uint8_t read_ppustatus ()
+uint8_t nes_ppu_status ()
 {
 	uint8_t ret = ppu_registers[PPUSTATUS] & 0x7F;
 	// set bit 7 to old status of NMI occurred
 	if (flags & nmi_occurred)
 		ret |= 1 << 7;
+	return ret;
+}
+
+/* Read < PPUSTATUS $(2002) */
+static uint8_t read_ppustatus ()
+{
+	uint8_t ret = nes_ppu_status ();
 	// reset address latch for PPUSCROLL and NMI occured.
 	flags &= ~(w | nmi_occurred);
 	// clear VBLANK flag
@@ -425,15 +484,15 @@ static uint8_t read_ppudata ()
 	if (v >= PALETTE_RAM) // palette read
 	{
 		ret = vram[v];
-		vram_buffer = vram[mirror_address (v - 0x1000)];
+		vram_buffer = NAMETABLE (v - 0x1000);
 	}
 	else if (v >= NAMETABLE_0) // nametable read
 	{
-		vram_buffer = vram[mirror_address (v)];
+		vram_buffer = NAMETABLE (v);
 	}
 	else // v < $2000: pattern read
 	{
-		vram_buffer = chr_read (v);
+		vram_buffer = fetch_pattern (v);
 	}
 	// increment and wrap
 	v += 1 + ((ppu_registers[PPUCTRL] & 0x04) >> 2) * 31;
@@ -509,7 +568,8 @@ static uint8_t nametable;
 /* load_nametable_byte loads the next nametable byte */
 static void load_nametable_byte ()
 {
-	nametable = vram[mirror_address (0x2000 | (v & 0x0FFF))];
+	address_bus (0x2000);
+	nametable = NAMETABLE (v);
 }
 
 /* next attribute byte */
@@ -517,7 +577,7 @@ static uint8_t attribute;
 /* load_attribute_byte loads the next attribute byte. */
 static void load_attribute_byte ()
 {
-	attribute = vram[mirror_address (0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07))];
+	attribute = NAMETABLE (0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
 }
 
 /* low byte of the next background tile */
@@ -531,7 +591,7 @@ static void load_tile_low ()
 	uint8_t table = (ppu_registers[PPUCTRL] & 0x10) >> 4;
 	// tile data
 	uint16_t tile = table * 0x1000 + nametable * 0x10 + y;
-	bg_tile_low = chr_read (tile);
+	bg_tile_low = fetch_pattern (tile);
 }
 
 /* high byte of the next background tile */
@@ -545,7 +605,7 @@ static void load_tile_high ()
 	uint8_t table = (ppu_registers[PPUCTRL] & 0x10) >> 4;
 	// tile data
 	uint16_t tile = table * 0x1000 + nametable * 0x10 + y;
-	bg_tile_high = chr_read (tile + 8);
+	bg_tile_high = fetch_pattern (tile + 8);
 }
 
 /**
@@ -596,21 +656,27 @@ static uint8_t background_color (int dot, uint8_t* pixel)
  *  The value set to pixel can be used to determin if the pixel is transparent or not, by
  *  making the check pixel == 0.
  */
-static uint8_t sprite_color (int index, int x, int y, uint8_t *pixel)
+/**
+ *  sprite_pattern returns the address of the pattern of tile for the row y within a sprite with
+ *  attributes attr, not taking flipping within the tile into account.
+ */
+static inline int sprite_pattern (uint8_t tile, uint8_t attr, int y)
 {
-	uint8_t *sprite = primary_oam + (index << 2);
 	int h = SPRITE_HEIGHT + ((ppu_registers[PPUCTRL] & 0x20) >> 2);
-
-	int pattern;
 	if (h == 8) // 8x8 mode
-		pattern = ((ppu_registers[PPUCTRL] & 0x08) << 9) + (sprite[1] << 4);
-	else // 8x16 mode
-	{
-		// rectify vertical flipping
-		if ((sprite[2] & 0x80) == 0x80)
-			y ^= 0x8;
-		pattern = ((sprite[1] & 1) << 12) + ((sprite[1] & 0xFE) << 4) + ((y << 1) & 0x10);
-	}
+		return ((ppu_registers[PPUCTRL] & 0x08) << 9) + (tile << 4);
+
+	// 8x16 mode
+	// rectify vertical flipping
+	if ((attr & 0x80) == 0x80)
+		y ^= 0x8;
+	return ((tile & 1) << 12) + ((tile & 0xFE) << 4) + ((y << 1) & 0x10);
+}
+
+static uint8_t sprite_color (int index, int x, int y, uint8_t *pixel)
+{
+	uint8_t *sprite = primary_oam + (index << 2);
+	int pattern = sprite_pattern (sprite[1], sprite[2], y);
 
 	// the formulas below solve flipping of sprites, but still keeps it correct if not flipped
 	y &= 7;
@@ -618,8 +684,10 @@ static uint8_t sprite_color (int index, int x, int y, uint8_t *pixel)
 	y += ((sprite[2] >> 7) & 1) * (7 - 2 * y);
 
 	// get pixel (0, 1 or 2?) (within palette?)
-	uint8_t low  = chr_read (pattern + y); //vram[pattern + y];
-	uint8_t high = chr_read (pattern + y + 8); //vram[pattern + y + 8];
+	pattern += y;
+	uint8_t low  = sprite_chr_windows[pattern >> 10][pattern & (CHR_WINDOW_SIZE - 1)];
+	pattern += 8;
+	uint8_t high = sprite_chr_windows[pattern >> 10][pattern & (CHR_WINDOW_SIZE - 1)];
 	*pixel = ((low >> (7 - x)) & 1) | (((high >> (7 - x)) << 1) & 2);
 	return vram[0x3F10 | (sprite[2] & 0x3) << 2 | (*pixel)];
 }
@@ -697,6 +765,7 @@ static void inline render_pixel (int x, int y)
 			// no more sprites in 2nd OAM
 			if ((sindex = secondary_oam[i]) == 0xFF)
 				break;
+			NES_STATS_COUNT (sprite_checks);
 
 			sprite = primary_oam + (sindex << 2);
 
@@ -781,6 +850,35 @@ static void sprite_evaluation ()
 	}
 }
 
+/**
+ *  fetch_sprite performs the pattern fetches of sprite slot # within secondary OAM during dots
+ *  257 - 320, with part being 0 for the garbage nametable fetch and 1 for the pattern fetches.
+ *  Sprite pixels are read when rendering, this only puts the addresses on the bus for the mapper.
+ *  Empty slots fetch tile $FF.
+ */
+static void fetch_sprite (int slot, int part, int scanln)
+{
+	if (part == 0)
+	{
+		address_bus (0x2000);
+		return;
+	}
+
+	int index = secondary_oam[slot];
+	uint8_t tile = 0xFF, attr = 0;
+	int y = 0;
+	if (index != 0xFF)
+	{
+		uint8_t* sprite = primary_oam + (index << 2);
+		tile = sprite[1];
+		attr = sprite[2];
+		y = scanln - sprite[0];
+	}
+	int pattern = sprite_pattern (tile, attr, y) + (y & 7);
+	fetch_pattern (pattern);
+	fetch_pattern (pattern + 8);
+}
+
 // RENDERING_ENABLED returns wether either background or sprites are to be rendered
 #define RENDERING_ENABLED (ppu_registers[PPUMASK] & 0x18)
 
@@ -794,8 +892,9 @@ static void inline tick ()
 	int scanln = ppucc / PPUCC_PER_SCANLINE;
 	int dot = ppucc % PPUCC_PER_SCANLINE;
 
-	if (RENDERING_ENABLED &&
-		scanln == SCANLINES_PER_FRAME - 1 &&
+	if (odd_frame_skip &&
+		RENDERING_ENABLED &&
+		scanln == scanlines_per_frame - 1 &&
 		dot == PPUCC_PER_SCANLINE - 2 &&
 		(flags & odd_frame))
 	{
@@ -805,9 +904,10 @@ static void inline tick ()
 	}
 	// tick PPU and update dot and scanline
 	ppucc ++;
-	ppucc %= PPUCC_PER_FRAME;
-	if (ppucc == 0)
+	total_ppucc ++;
+	if (ppucc >= ppucc_per_frame)
 	{
+		ppucc -= ppucc_per_frame;
 		// New frame
 		flags ^= odd_frame; // toggle odd frame flag
 		render ();
@@ -820,7 +920,7 @@ void nes_ppu_step ()
 	tick (); // go forward one cycle
 
 	int scanln = ppucc / PPUCC_PER_SCANLINE;              // line
-	int pre_scanln = scanln == (SCANLINES_PER_FRAME - 1); // line 261
+	int pre_scanln = scanln == (scanlines_per_frame - 1); // line 261 on NTSC
 	int visible_scanln = scanln < SCREEN_H;               // lines 0 -> 239
 
 	int dot = ppucc % PPUCC_PER_SCANLINE;     // dot
@@ -828,6 +928,7 @@ void nes_ppu_step ()
 
 	if (RENDERING_ENABLED)
 	{
+		NES_STATS_COUNT (rendering_dots);
 		if (visible_dot && visible_scanln)
 			render_pixel (dot - 1, scanln); // render pixel to screen
 
@@ -875,12 +976,19 @@ void nes_ppu_step ()
 				if (visible_scanln)
 					sprite_evaluation (); // evaluate sprites for next scanline
 			}
+
+			// sprite pattern fetches for the next scanline
+			if (dot >= 257 && dot <= 320 && (dot & 3) == 1)
+				fetch_sprite ((dot - 257) >> 3, ((dot - 257) >> 2) & 1, scanln);
 		}
 	}
 
 	if (dot == 1)
 	{
-		if (scanln == 241)
+		if (scanline_hook != NULL && ((visible_scanln && RENDERING_ENABLED) || scanln == SCREEN_H))
+			scanline_hook (scanln);
+
+		if (scanln == vblank_scanline)
 		{
 			// Set VBLANK and generate NMI
 			ppu_registers[PPUSTATUS] |= VBLANK;
@@ -0,0 +1,246 @@
+#include "nes.h"
+#include "nes/profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ *  table is a hash table of 64 bit keys to 64 bit values, with open addressing.
+ *  Key 0 marks an empty slot so keys are stored plus one.
+ */
+struct table
+{
+	struct slot
+	{
+		uint64_t key;
+		uint64_t value;
+	}
+	*slots;
+	size_t size; // power of two
+	size_t used;
+};
+
+static uint64_t* table_get (struct table* t, uint64_t key);
+
+/* table_grow doubles the size of the table, or allocates it */
+static void table_grow (struct table* t)
+{
+	struct table old = *t;
+	t->size = old.size ? old.size * 2 : 1024;
+	t->slots = calloc (t->size, sizeof (struct slot));
+	t->used = 0;
+	for (size_t i = 0; i < old.size; i ++)
+		if (old.slots[i].key != 0)
+			*table_get (t, old.slots[i].key - 1) = old.slots[i].value;
+	free (old.slots);
+}
+
+/**
+ *  table_get returns a pointer to the value of key, which is added with value 0 if it is missing.
+ */
+static uint64_t* table_get (struct table* t, uint64_t key)
+{
+	if (t->used * 2 >= t->size)
+		table_grow (t);
+
+	key ++;
+	size_t i = (key * 0x9E3779B97F4A7C15ull) >> 32 & (t->size - 1);
+	while (t->slots[i].key != key)
+	{
+		if (t->slots[i].key == 0)
+		{
+			t->slots[i].key = key;
+			t->used ++;
+			break;
+		}
+		i = (i + 1) & (t->size - 1);
+	}
+	return &t->slots[i].value;
+}
+
+static void table_free (struct table* t)
+{
+	free (t->slots);
+	memset (t, 0, sizeof (*t));
+}
+
+/**
+ *  Call stacks are kept as a tree of frames, each with the cycles spent in it and not in the
+ *  frames it called. Frame 0 is the root, code that was not called.
+ */
+struct frame
+{
+	uint32_t parent;
+	uint32_t location;
+	uint64_t cycles;
+};
+static struct frame* frames;
+static size_t frames_size;
+static size_t n_frames;
+
+/* frame_children maps a frame and the location it calls to the frame called */
+static struct table frame_children;
+
+/* histogram maps locations to the cycles spent on them */
+static struct table histogram;
+
+/* shadow of the stack of frames called, calls beyond it are only counted */
+#define MAX_DEPTH 256
+static uint32_t stack[MAX_DEPTH];
+static int depth;
+static int overflow;
+
+/* profiling is set while profiling, period is the number of cycles between samples or 0 */
+static int profiling;
+static int period;
+static int countdown;
+
+int nes_profile_start (int sample_period)
+{
+#ifndef PROFILE
+	// the CPU only feeds the profiler when built with PROFILE
+	return 1;
+#endif
+	nes_profile_stop ();
+	table_free (&frame_children);
+	table_free (&histogram);
+	free (frames);
+	frames_size = 1024;
+	frames = calloc (frames_size, sizeof (struct frame));
+	n_frames = 1;
+	depth = 0;
+	overflow = 0;
+
+	period = sample_period > 0 ? sample_period : 0;
+	countdown = period;
+	profiling = 1;
+	return 0;
+}
+
+void nes_profile_stop ()
+{
+	profiling = 0;
+}
+
+void nes_profile_cycles (uint32_t location, int cycles)
+{
+	if (!profiling)
+		return;
+	if (period)
+	{
+		// only the instruction running when a sample is due is counted, for all of the period
+		countdown -= cycles;
+		if (countdown > 0)
+			return;
+		int samples = -countdown / period + 1;
+		countdown += samples * period;
+		cycles = samples * period;
+	}
+
+	*table_get (&histogram, location) += cycles;
+	frames[depth > 0 ? stack[depth - 1] : 0].cycles += cycles;
+}
+
+void nes_profile_call (uint32_t location)
+{
+	if (!profiling)
+		return;
+	if (depth == MAX_DEPTH)
+	{
+		overflow ++;
+		return;
+	}
+
+	uint32_t parent = depth > 0 ? stack[depth - 1] : 0;
+	uint64_t* child = table_get (&frame_children, (uint64_t) parent << 32 | location);
+	if (*child == 0)
+	{
+		if (n_frames == frames_size)
+		{
+			frames_size *= 2;
+			frames = realloc (frames, frames_size * sizeof (struct frame));
+		}
+		frames[n_frames].parent = parent;
+		frames[n_frames].location = location;
+		frames[n_frames].cycles = 0;
+		*child = n_frames ++;
+	}
+	stack[depth ++] = *child;
+}
+
+void nes_profile_return ()
+{
+	if (!profiling)
+		return;
+	// games that return somewhere else than they were called from can pop more than they pushed
+	if (overflow > 0)
+		overflow --;
+	else if (depth > 0)
+		depth --;
+}
+
+/* print_location prints location as bank:address for PRG ROM and address otherwise */
+static void print_location (FILE* f, uint32_t location)
+{
+	if (location >> 16)
+		fprintf (f, "%02X:%04X", (location >> 16) - 1, location & 0xFFFF);
+	else
+		fprintf (f, "%04X", location);
+}
+
+/* print_stack prints the frames from the root down to frame, separated by ';' */
+static void print_stack (FILE* f, uint32_t frame)
+{
+	if (frame == 0)
+	{
+		fprintf (f, "reset");
+		return;
+	}
+	print_stack (f, frames[frame].parent);
+	fputc (';', f);
+	print_location (f, frames[frame].location);
+}
+
+int nes_profile_write_stacks (const char* file)
+{
+	FILE* f = fopen (file, "w");
+	if (f == NULL)
+		return 1;
+	for (size_t i = 0; i < n_frames; i ++)
+	{
+		if (frames[i].cycles == 0)
+			continue;
+		print_stack (f, i);
+		fprintf (f, " %llu\n", (unsigned long long) frames[i].cycles);
+	}
+	return fclose (f) != 0;
+}
+
+/* compare_slots orders slots of the histogram by location */
+static int compare_slots (const void* a, const void* b)
+{
+	uint64_t x = ((const struct slot*) a)->key, y = ((const struct slot*) b)->key;
+	return (x > y) - (x < y);
+}
+
+int nes_profile_write_histogram (const char* file)
+{
+	FILE* f = fopen (file, "w");
+	if (f == NULL)
+		return 1;
+
+	struct slot* slots = malloc ((histogram.used + 1) * sizeof (struct slot));
+	size_t n = 0;
+	for (size_t i = 0; i < histogram.size; i ++)
+		if (histogram.slots[i].key != 0)
+			slots[n ++] = histogram.slots[i];
+	qsort (slots, n, sizeof (struct slot), compare_slots);
+
+	for (size_t i = 0; i < n; i ++)
+	{
+		print_location (f, slots[i].key - 1);
+		fprintf (f, " %llu\n", (unsigned long long) slots[i].value);
+	}
+	free (slots);
+	return fclose (f) != 0;
+}
@@ -0,0 +1,39 @@
+#include "nes/region.h"
+#include "nes/cpu.h"
+
+const struct nes_region nes_region_ntsc =
+{
+	.name                = "NTSC",
+	.cpu_freq            = NES_CPU_FREQ,
+	.ppu_cc_per_5_cpu_cc = 15,
+	.scanlines           = 262,
+	.vblank_scanline     = 241,
+	.odd_frame_skip      = 1,
+	.pal_apu             = 0,
+	.quarter_frame       = 7457,
+};
+
+const struct nes_region nes_region_pal =
+{
+	.name                = "PAL",
+	.cpu_freq            = 1662607,
+	.ppu_cc_per_5_cpu_cc = 16,
+	.scanlines           = 312,
+	.vblank_scanline     = 241,
+	.odd_frame_skip      = 0,
+	.pal_apu             = 1,
+	.quarter_frame       = 8313,
+};
+
+// Dendy runs the PAL frame on a 3:1 clock with an NTSC like APU, and starts vblank late
+const struct nes_region nes_region_dendy =
+{
+	.name                = "Dendy",
+	.cpu_freq            = 1773448,
+	.ppu_cc_per_5_cpu_cc = 15,
+	.scanlines           = 312,
+	.vblank_scanline     = 291,
+	.odd_frame_skip      = 0,
+	.pal_apu             = 0,
+	.quarter_frame       = 7457,
+};
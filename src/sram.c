@@ -0,0 +1,194 @@
+#include "nes/sram.h"
+#include "nes/cpu.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* minimum number of frames between two flushes of the save file, about a second */
+#define FLUSH_INTERVAL 60
+
+/* fd is the open save file, -1 if there is none */
+static int fd = -1;
+
+/* frames counts frames since the last flush */
+static int frames;
+
+/* size of PRG RAM, all of which is saved */
+static size_t size;
+
+/**
+ *  pending holds a copy of PRG RAM of which [pending_first, pending_last) is waiting to be written,
+ *  written holds what is being written.
+ */
+static uint8_t* pending;
+static uint8_t* written;
+static int pending_first;
+static int pending_last;
+
+/* background writer thread */
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int running = 0;
+
+/* write_range writes the range [first, last) of buf to the save file at the same offset */
+static void write_range (const uint8_t* buf, int first, int last)
+{
+	while (first < last)
+	{
+		ssize_t n = pwrite (fd, buf + first, last - first, first);
+		if (n <= 0)
+		{
+			perror ("failed to write save file");
+			return;
+		}
+		first += n;
+	}
+}
+
+/* take_pending moves the pending range to buf and returns non-zero if there was anything */
+static int take_pending (uint8_t* buf, int* first, int* last)
+{
+	if (pending_first >= pending_last)
+		return 0;
+
+	*first = pending_first;
+	*last = pending_last;
+	memcpy (buf + *first, pending + *first, *last - *first);
+	pending_first = size;
+	pending_last = 0;
+	return 1;
+}
+
+/* run_writer waits for pending ranges and writes them to file outside the lock */
+static void* run_writer (void* arg)
+{
+	int first, last;
+
+	pthread_mutex_lock (&lock);
+	while (running)
+	{
+		if (!take_pending (written, &first, &last))
+		{
+			pthread_cond_wait (&cond, &lock);
+			continue;
+		}
+		pthread_mutex_unlock (&lock);
+		write_range (written, first, last);
+		pthread_mutex_lock (&lock);
+	}
+	pthread_mutex_unlock (&lock);
+	return NULL;
+}
+
+/* queue_dirty copies PRG RAM written since last time to the pending buffer */
+static int queue_dirty ()
+{
+	int first, last;
+	if (!nes_cpu_prg_ram_dirty (&first, &last))
+		return 0;
+
+	const uint8_t* ram = nes_cpu_prg_ram ();
+	memcpy (pending + first, ram + first, last - first);
+	// merge with what the writer has not yet picked up
+	if (first < pending_first)
+		pending_first = first;
+	if (last > pending_last)
+		pending_last = last;
+	return 1;
+}
+
+int nes_sram_open (const char* path)
+{
+	size = nes_cpu_prg_ram_size ();
+	pending = malloc (size);
+	written = malloc (size);
+	if (pending == NULL || written == NULL)
+	{
+		fprintf (stderr, "failed to allocate the save file buffers\n");
+		free (pending);
+		free (written);
+		pending = written = NULL;
+		return 1;
+	}
+
+	fd = open (path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		perror ("failed to open save file");
+		free (pending);
+		free (written);
+		pending = written = NULL;
+		return 1;
+	}
+
+	// save files larger than PRG RAM keep the rest untouched
+	ssize_t n = pread (fd, pending, size, 0);
+	if (n > 0)
+	{
+		printf ("Loaded %zdB from save file %s\n", n, path);
+		nes_cpu_load_prg_ram (pending, n);
+	}
+
+	int first, last;
+	nes_cpu_prg_ram_dirty (&first, &last);
+	pending_first = size;
+	pending_last = 0;
+	frames = 0;
+
+	running = 1;
+	if (pthread_create (&writer, NULL, run_writer, NULL) != 0)
+	{
+		// write synchronously on close instead
+		fprintf (stderr, "failed to start save file writer\n");
+		running = 0;
+	}
+	return 0;
+}
+
+void nes_sram_frame ()
+{
+	if (!running || ++ frames < FLUSH_INTERVAL)
+		return;
+
+	// the writer might be busy, in which case we simply try again next frame
+	if (pthread_mutex_trylock (&lock) != 0)
+		return;
+	if (queue_dirty ())
+	{
+		pthread_cond_signal (&cond);
+		frames = 0;
+	}
+	pthread_mutex_unlock (&lock);
+}
+
+void nes_sram_close ()
+{
+	int first, last;
+
+	if (fd < 0)
+		return;
+
+	if (running)
+	{
+		pthread_mutex_lock (&lock);
+		running = 0;
+		pthread_cond_signal (&cond);
+		pthread_mutex_unlock (&lock);
+		pthread_join (writer, NULL);
+	}
+
+	queue_dirty ();
+	if (take_pending (written, &first, &last))
+		write_range (written, first, last);
+
+	close (fd);
+	fd = -1;
+	free (pending);
+	free (written);
+	pending = written = NULL;
+}
@@ -0,0 +1,26 @@
+#include "nes/stats.h"
+#include <string.h>
+
+struct nes_stats nes_stats_current;
+
+/* last holds the counters of the last frame run */
+static struct nes_stats last;
+
+void nes_stats_end_frame ()
+{
+	struct nes_stats* s = &nes_stats_current;
+	// the CPU is what is left of the frame, it runs the rest of the hardware in the accurate core
+	s->cpu_ticks = s->frame_ticks - s->ppu_ticks - s->apu_ticks - s->event_ticks;
+	s->frame = last.frame + 1;
+	last = *s;
+	memset (s, 0, sizeof (*s));
+}
+
+int nes_stats (struct nes_stats* stats)
+{
+#ifndef STATS
+	return 1;
+#endif
+	*stats = last;
+	return 0;
+}
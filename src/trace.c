@@ -0,0 +1,77 @@
+#include "nes/trace.h"
+#include "nes/cpu.h"
+#include "nes/ppu.h"
+#include "nes/nes.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ *  The trace is a ring buffer of the last TRACE_ENTRIES instructions executed.
+ */
+#define TRACE_ENTRIES (1 << 16)
+static struct nes_trace_entry entries[TRACE_ENTRIES];
+
+/* recorded is the number of entries recorded since tracing was first enabled, it wraps */
+static volatile uint32_t recorded;
+
+/* full is set once the ring buffer has wrapped */
+static volatile int full;
+
+struct nes_trace_entry* nes_trace_record ()
+{
+	struct nes_trace_entry* e = &entries[recorded & (TRACE_ENTRIES - 1)];
+	int scanline, dot;
+
+	nes_ppu_position (&scanline, &dot);
+	e->cycle = (uint32_t) nes_cycles ();
+	e->scanline = scanline;
+	e->dot = dot;
+
+	recorded ++;
+	if ((recorded & (TRACE_ENTRIES - 1)) == 0)
+		full = 1;
+	return e;
+}
+
+void nes_trace_set_enabled (int enabled)
+{
+	nes_cpu_set_trace (enabled);
+}
+
+/* write_all writes size bytes of data to fd, it only uses functions that are safe in a signal handler */
+static int write_all (int fd, const void* data, size_t size)
+{
+	const char* p = data;
+	while (size > 0)
+	{
+		ssize_t n = write (fd, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+int nes_trace_dump (int fd)
+{
+	struct nes_trace_header header;
+	uint32_t next = recorded & (TRACE_ENTRIES - 1);
+	int ret;
+
+	memcpy (header.magic, NES_TRACE_MAGIC, sizeof (header.magic));
+	header.version = NES_TRACE_VERSION;
+	header.entries = full ? TRACE_ENTRIES : next;
+
+	// the oldest entry is the next to be overwritten once the buffer is full
+	ret = write_all (fd, &header, sizeof (header));
+	if (ret == 0 && full)
+		ret = write_all (fd, entries + next, (TRACE_ENTRIES - next) * sizeof (struct nes_trace_entry));
+	if (ret == 0)
+		ret = write_all (fd, entries, next * sizeof (struct nes_trace_entry));
+
+	return ret;
+}
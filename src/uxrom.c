@@ -1,37 +1,56 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include "nes/cpu.h"
+#include "nes/mapper.h"
 
 static uint8_t* prg;
 static int n_prg_banks;
-static int banks[2];
 
-static int read (uint16_t addr, uint8_t* v)
+/* bank is the 16KB bank selected at $8000 */
+static uint8_t bank;
+
+/* switch_bank maps the selected 16KB bank at $8000 */
+static void switch_bank ()
 {
-	if (addr >= 0x8000)
-	{
-		addr &= 0x7FFF;
-		*v = prg[banks[addr / 0x4000] * 0x4000 + addr % 0x4000];
-		return 1;
-	}
-	return 0;
+	nes_cpu_load_prg_rom_bank (prg + (bank % n_prg_banks) * NES_PRG_ROM_BANK_SIZE, 0);
 }
 
 static int write (uint16_t addr, uint8_t v)
 {
 	if (addr >= 0x8000)
 	{
-		banks[0] = v & 0xF;
+		bank = v & 0xF;
+		switch_bank ();
 		return 1;
 	}
 	return 0;
 }
 
-void nes_uxrom_load (int n, uint8_t* _prg, int m, uint8_t* chr)
+static int load (int n, uint8_t* _prg, int m, uint8_t* chr)
 {
 	n_prg_banks = n;
 	prg = _prg;
-	nes_cpu_add_store_handler (&write);
-	nes_cpu_add_read_handler (&read);
-	banks[0] = 0; banks[1] = n_prg_banks - 1;
+	return 0;
 }
+
+static void reset ()
+{
+	bank = 0;
+	switch_bank ();
+	nes_cpu_load_prg_rom_bank (prg + (n_prg_banks - 1) * NES_PRG_ROM_BANK_SIZE, 1);
+}
+
+static void destroy ()
+{
+	prg = NULL;
+}
+
+const struct nes_mapper nes_uxrom =
+{
+	.name       = "UxROM",
+	.load       = load,
+	.reset      = reset,
+	.cpu_write  = write,
+	.destroy    = destroy,
+};
@@ -0,0 +1,130 @@
+#include <nes/vrc.h>
+#include <nes/nes.h>
+#include <nes/cpu.h>
+#include <string.h>
+
+/**
+ *  The counter is clocked either each CPU cycle or, in scanline mode, by a prescaler which
+ *  divides the CPU clock by 113 2/3. When clocked at $FF it is reloaded from the latch and an
+ *  IRQ is raised.
+ *  Instead of stepping the counter it is caught up with the CPU when it is accessed, and the next
+ *  IRQ is scheduled ahead of time.
+ */
+
+#define CONTROL_ENABLE_AFTER_ACK 0x01
+#define CONTROL_ENABLE           0x02
+#define CONTROL_CYCLE_MODE       0x04
+
+#define PRESCALER_RELOAD 341
+
+static struct
+{
+	uint8_t  latch;
+	uint8_t  control;
+	uint8_t  counter;
+	int      prescaler;
+	uint64_t updated; // CPU cycle the counter was last caught up to
+}
+irq;
+
+/* clock_counter clocks the counter n times */
+static void clock_counter (int n)
+{
+	while (n > 0)
+	{
+		int to_reload = 0x100 - irq.counter;
+		if (n < to_reload)
+		{
+			irq.counter += n;
+			return;
+		}
+		n -= to_reload;
+		irq.counter = irq.latch;
+		nes_cpu_set_irq (NES_CPU_IRQ_MAPPER, 1);
+	}
+}
+
+/* catch_up runs the counter for the CPU cycles since it was last updated */
+static void catch_up ()
+{
+	uint64_t now = nes_cycles ();
+	int n = now - irq.updated;
+	irq.updated = now;
+
+	if (!(irq.control & CONTROL_ENABLE))
+		return;
+
+	if (irq.control & CONTROL_CYCLE_MODE)
+	{
+		clock_counter (n);
+		return;
+	}
+	irq.prescaler -= 3 * n;
+	if (irq.prescaler <= 0)
+	{
+		int clocks = -irq.prescaler / PRESCALER_RELOAD + 1;
+		irq.prescaler += PRESCALER_RELOAD * clocks;
+		clock_counter (clocks);
+	}
+}
+
+static void on_irq ();
+
+/* schedule schedules the next reload of the counter */
+static void schedule ()
+{
+	if (!(irq.control & CONTROL_ENABLE))
+	{
+		nes_unschedule (on_irq);
+		return;
+	}
+
+	int clocks = 0x100 - irq.counter, cycles;
+	if (irq.control & CONTROL_CYCLE_MODE)
+		cycles = clocks;
+	else
+		cycles = (irq.prescaler + PRESCALER_RELOAD * (clocks - 1) + 2) / 3;
+	nes_schedule (on_irq, cycles);
+}
+
+static void on_irq ()
+{
+	catch_up ();
+	schedule ();
+}
+
+void nes_vrc_irq_reset ()
+{
+	memset (&irq, 0, sizeof (irq));
+	irq.prescaler = PRESCALER_RELOAD;
+	nes_unschedule (on_irq);
+}
+
+void nes_vrc_irq_write_latch (uint8_t value)
+{
+	irq.latch = value;
+}
+
+void nes_vrc_irq_write_control (uint8_t value)
+{
+	catch_up ();
+	irq.control = value & 7;
+	if (irq.control & CONTROL_ENABLE)
+	{
+		irq.counter = irq.latch;
+		irq.prescaler = PRESCALER_RELOAD;
+	}
+	nes_cpu_set_irq (NES_CPU_IRQ_MAPPER, 0);
+	schedule ();
+}
+
+void nes_vrc_irq_acknowledge ()
+{
+	catch_up ();
+	if (irq.control & CONTROL_ENABLE_AFTER_ACK)
+		irq.control |= CONTROL_ENABLE;
+	else
+		irq.control &= ~CONTROL_ENABLE;
+	nes_cpu_set_irq (NES_CPU_IRQ_MAPPER, 0);
+	schedule ();
+}
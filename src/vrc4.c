@@ -0,0 +1,224 @@
+#include <nes/cpu.h>
+#include <nes/ppu.h>
+#include <nes/mapper.h>
+#include <nes/vrc.h>
+#include <string.h>
+
+/**
+ *  Konami VRC2 and VRC4 (mappers 21, 22, 23 and 25).
+ *  The boards only differ in which CPU address lines are wired to the A0 and A1 register select
+ *  pins of the chip. The iNES mapper numbers each cover several boards so both wirings of a
+ *  mapper are decoded at once, which no game conflicts with. VRC2 is a subset of VRC4 without
+ *  the IRQ counter and the PRG swap mode, so both are handled as VRC4.
+ */
+
+#define N_PRG_BANKS 4
+#define PRG_ROM_BANK_SIZE 0x2000
+static uint8_t* prg;
+static int n_prg_banks;
+
+#define N_CHR_BANKS 8
+#define CHR_BANK_SIZE 0x0400
+static uint8_t* chr;
+static int n_chr_banks;
+
+/* MIRRORING_HEADER flags that the game has not yet set mirroring, so it is as given by the header */
+#define MIRRORING_HEADER 0x80
+
+/* registers */
+static struct
+{
+	uint8_t  prg_banks[2];              // 8KB banks at $8000 (or $C000) and $A000
+	uint8_t  prg_mode;                  // swaps the banks at $8000 and $C000
+	uint8_t  mirroring;
+	uint16_t chr_banks[N_CHR_BANKS];    // 1KB banks
+}
+vrc4;
+
+/* a0 and a1 return the register select lines of the chip from the CPU address */
+static int (*a0) (uint16_t);
+static int (*a1) (uint16_t);
+
+/* chr_shift is applied to CHR bank numbers, VRC2a ignores the lowest bit */
+static int chr_shift;
+
+/* update_prg_banks maps the banks selected by the registers */
+static void update_prg_banks ()
+{
+	int swap = vrc4.prg_mode ? 2 : 0;
+	nes_cpu_map_prg (0 ^ swap, prg + (vrc4.prg_banks[0] % n_prg_banks) * PRG_ROM_BANK_SIZE);
+	nes_cpu_map_prg (1, prg + (vrc4.prg_banks[1] % n_prg_banks) * PRG_ROM_BANK_SIZE);
+	nes_cpu_map_prg (2 ^ swap, prg + (n_prg_banks - 2) * PRG_ROM_BANK_SIZE);
+	nes_cpu_map_prg (3, prg + (n_prg_banks - 1) * PRG_ROM_BANK_SIZE);
+}
+
+/* map_chr_bank maps the bank of a register in its PPU window */
+static void map_chr_bank (int window)
+{
+	int bank = vrc4.chr_banks[window] >> chr_shift;
+	nes_ppu_map_chr (window, chr + (bank % n_chr_banks) * CHR_BANK_SIZE);
+}
+
+static const nes_ppu_mirroring_mode mirrorings[4] =
+{
+	NES_PPU_MIRROR_VERTICAL,
+	NES_PPU_MIRROR_HORIZONTAL,
+	NES_PPU_MIRROR_SINGLE0,
+	NES_PPU_MIRROR_SINGLE1,
+};
+
+static void update_mirroring ()
+{
+	if (vrc4.mirroring != MIRRORING_HEADER)
+		nes_ppu_set_mirroring (mirrorings[vrc4.mirroring & 3]);
+}
+
+/* write_chr_bank writes the lower or upper bits of a CHR bank register */
+static void write_chr_bank (int window, int upper, uint8_t v)
+{
+	if (upper)
+		vrc4.chr_banks[window] = (vrc4.chr_banks[window] & 0x0F) | ((v & 0x1F) << 4);
+	else
+		vrc4.chr_banks[window] = (vrc4.chr_banks[window] & 0x1F0) | (v & 0x0F);
+	map_chr_bank (window);
+}
+
+static uint8_t irq_latch;
+
+static int write (uint16_t address, uint8_t v)
+{
+	if (address < 0x8000)
+		return 0;
+
+	int reg = (a1 (address) << 1) | a0 (address);
+	switch (address >> 12)
+	{
+	case 0x8: // PRG select 0 ($8000-$8003)
+		vrc4.prg_banks[0] = v & 0x1F;
+		update_prg_banks ();
+		break;
+	case 0x9: // mirroring ($9000-$9001) and PRG swap mode ($9002)
+		if (reg < 2)
+		{
+			vrc4.mirroring = v & 3;
+			update_mirroring ();
+		}
+		else if (reg == 2)
+		{
+			vrc4.prg_mode = (v >> 1) & 1;
+			update_prg_banks ();
+		}
+		break;
+	case 0xA: // PRG select 1 ($A000-$A003)
+		vrc4.prg_banks[1] = v & 0x1F;
+		update_prg_banks ();
+		break;
+	case 0xB: case 0xC: case 0xD: case 0xE: // CHR selects ($B000-$E003)
+		write_chr_bank (((address >> 12) - 0xB) * 2 + (reg >> 1), reg & 1, v);
+		break;
+	case 0xF: // IRQ ($F000-$F003)
+		switch (reg)
+		{
+		case 0:
+			irq_latch = (irq_latch & 0xF0) | (v & 0x0F);
+			nes_vrc_irq_write_latch (irq_latch);
+			break;
+		case 1:
+			irq_latch = (irq_latch & 0x0F) | (v << 4);
+			nes_vrc_irq_write_latch (irq_latch);
+			break;
+		case 2:
+			nes_vrc_irq_write_control (v);
+			break;
+		case 3:
+			nes_vrc_irq_acknowledge ();
+			break;
+		}
+		break;
+	}
+	return 1;
+}
+
+/* address line wirings of the boards */
+static int a0_21 (uint16_t a) { return ((a >> 1) | (a >> 6)) & 1; }
+static int a1_21 (uint16_t a) { return ((a >> 2) | (a >> 7)) & 1; }
+static int a0_22 (uint16_t a) { return (a >> 1) & 1; }
+static int a1_22 (uint16_t a) { return a & 1; }
+static int a0_23 (uint16_t a) { return (a | (a >> 2)) & 1; }
+static int a1_23 (uint16_t a) { return ((a >> 1) | (a >> 3)) & 1; }
+static int a0_25 (uint16_t a) { return ((a >> 1) | (a >> 3)) & 1; }
+static int a1_25 (uint16_t a) { return (a | (a >> 2)) & 1; }
+
+static int load (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	n_prg_banks = _n_prg_banks << 1; // n banks passed are in 16KB but the mapper switches 8KB
+	prg         = _prg;
+	n_chr_banks = _n_chr_banks << 3; // n banks passed are in 8KB but the mapper switches 1KB
+	chr         = _chr;
+	chr_shift   = 0;
+	return 0;
+}
+
+static int load_21 (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	a0 = a0_21;
+	a1 = a1_21;
+	return load (_n_prg_banks, _prg, _n_chr_banks, _chr);
+}
+
+static int load_22 (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	a0 = a0_22;
+	a1 = a1_22;
+	int err = load (_n_prg_banks, _prg, _n_chr_banks, _chr);
+	chr_shift = 1;
+	return err;
+}
+
+static int load_23 (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	a0 = a0_23;
+	a1 = a1_23;
+	return load (_n_prg_banks, _prg, _n_chr_banks, _chr);
+}
+
+static int load_25 (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	a0 = a0_25;
+	a1 = a1_25;
+	return load (_n_prg_banks, _prg, _n_chr_banks, _chr);
+}
+
+static void reset ()
+{
+	memset (&vrc4, 0, sizeof (vrc4));
+	vrc4.prg_banks[1] = 1;
+	vrc4.mirroring = MIRRORING_HEADER;
+	for (int i = 0; i < N_CHR_BANKS; i ++)
+	{
+		vrc4.chr_banks[i] = i << chr_shift;
+		map_chr_bank (i);
+	}
+	update_prg_banks ();
+	irq_latch = 0;
+	nes_vrc_irq_reset ();
+}
+
+static void destroy ()
+{
+	prg = chr = NULL;
+}
+
+#define VRC4(_name, _load)          \
+	{                               \
+		.name       = _name,        \
+		.load       = _load,        \
+		.reset      = reset,        \
+		.cpu_write  = write,        \
+		.destroy    = destroy,      \
+	}
+
+const struct nes_mapper nes_vrc4_21 = VRC4 ("VRC4a/VRC4c", load_21);
+const struct nes_mapper nes_vrc2_22 = VRC4 ("VRC2a", load_22);
+const struct nes_mapper nes_vrc4_23 = VRC4 ("VRC2b/VRC4e", load_23);
+const struct nes_mapper nes_vrc4_25 = VRC4 ("VRC4b/VRC4d", load_25);
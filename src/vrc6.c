@@ -0,0 +1,277 @@
+#include <nes/cpu.h>
+#include <nes/ppu.h>
+#include <nes/mapper.h>
+#include <nes/vrc.h>
+#include <string.h>
+
+/**
+ *  Konami VRC6 (mappers 24 and 26, which swap the A0 and A1 register select lines).
+ *  PRG is switched as 16KB at $8000 and 8KB at $C000 with the last 8KB fixed. CHR is switched in
+ *  1KB or 2KB banks depending on the PPU banking mode.
+ */
+
+#define PRG_ROM_BANK_SIZE 0x2000
+static uint8_t* prg;
+static int n_prg_banks;
+
+#define N_CHR_BANKS 8
+#define CHR_BANK_SIZE 0x0400
+static uint8_t* chr;
+static int n_chr_banks;
+
+/**
+ *  Sound
+ *  Two pulse channels with 8 duty cycles and a sawtooth channel, each with 3 registers.
+ */
+struct channel
+{
+	uint8_t regs[3];
+	uint8_t step;
+	uint8_t accumulator; // sawtooth only
+	float   timer;       // CPU cycles until the next clock
+};
+
+#define CHANNEL_ENABLE 0x80
+
+/* SOUND_LEVEL is the output of one step of volume, the same as for the APU pulse channels */
+#define SOUND_LEVEL 0.00752
+
+/* MIRRORING_HEADER flags that the game has not yet set mirroring, so it is as given by the header */
+#define MIRRORING_HEADER 0x80
+
+/* registers */
+static struct
+{
+	uint8_t prg_16k;                  // 16KB bank at $8000
+	uint8_t prg_8k;                   // 8KB bank at $C000
+	uint8_t ppu_mode;                 // $B003
+	uint8_t chr_banks[N_CHR_BANKS];   // R0-R7
+	struct channel channels[3];       // pulse 1, pulse 2 and sawtooth
+}
+vrc6;
+
+/* swap_lines is set for mapper 26 */
+static int swap_lines;
+
+static void update_prg_banks ()
+{
+	int bank = (vrc6.prg_16k & 0x0F) << 1;
+	nes_cpu_map_prg (0, prg + (bank % n_prg_banks) * PRG_ROM_BANK_SIZE);
+	nes_cpu_map_prg (1, prg + ((bank + 1) % n_prg_banks) * PRG_ROM_BANK_SIZE);
+	nes_cpu_map_prg (2, prg + ((vrc6.prg_8k & 0x1F) % n_prg_banks) * PRG_ROM_BANK_SIZE);
+	nes_cpu_map_prg (3, prg + (n_prg_banks - 1) * PRG_ROM_BANK_SIZE);
+}
+
+static void map_chr_bank (int window, int bank)
+{
+	nes_ppu_map_chr (window, chr + (bank % n_chr_banks) * CHR_BANK_SIZE);
+}
+
+/**
+ *  update_chr_banks maps the CHR banks for the banking mode. In the 2KB modes the lowest bit of the
+ *  register is replaced by PPU A10.
+ */
+static void update_chr_banks ()
+{
+	switch (vrc6.ppu_mode & 3)
+	{
+	case 0: // 8 x 1KB
+		for (int i = 0; i < N_CHR_BANKS; i ++)
+			map_chr_bank (i, vrc6.chr_banks[i]);
+		break;
+	case 1: // 4 x 2KB
+		for (int i = 0; i < N_CHR_BANKS; i ++)
+			map_chr_bank (i, (vrc6.chr_banks[i >> 1] & 0xFE) | (i & 1));
+		break;
+	default: // 4 x 1KB, 2 x 2KB
+		for (int i = 0; i < 4; i ++)
+			map_chr_bank (i, vrc6.chr_banks[i]);
+		for (int i = 4; i < N_CHR_BANKS; i ++)
+			map_chr_bank (i, (vrc6.chr_banks[4 + ((i - 4) >> 1)] & 0xFE) | (i & 1));
+		break;
+	}
+}
+
+static const nes_ppu_mirroring_mode mirrorings[4] =
+{
+	NES_PPU_MIRROR_VERTICAL,
+	NES_PPU_MIRROR_HORIZONTAL,
+	NES_PPU_MIRROR_SINGLE0,
+	NES_PPU_MIRROR_SINGLE1,
+};
+
+static void update_mirroring ()
+{
+	if (vrc6.ppu_mode != MIRRORING_HEADER)
+		nes_ppu_set_mirroring (mirrorings[(vrc6.ppu_mode >> 2) & 3]);
+}
+
+static int channel_period (struct channel* ch)
+{
+	return (((ch->regs[2] & 0x0F) << 8) | ch->regs[1]) + 1;
+}
+
+/* pulse_output returns the volume during the high part of the duty cycle */
+static int pulse_output (struct channel* ch)
+{
+	if (!(ch->regs[2] & CHANNEL_ENABLE))
+		return 0;
+	if ((ch->regs[0] & 0x80) || ch->step <= ((ch->regs[0] >> 4) & 7))
+		return ch->regs[0] & 0x0F;
+	return 0;
+}
+
+/**
+ *  saw_clock clocks the sawtooth channel, where the rate is added to the accumulator each second
+ *  clock and it is reset at the 14th.
+ */
+static void saw_clock (struct channel* ch)
+{
+	if (++ ch->step == 14)
+	{
+		ch->step = 0;
+		ch->accumulator = 0;
+	}
+	else if ((ch->step & 1) == 0)
+		ch->accumulator += ch->regs[0] & 0x3F;
+}
+
+static void audio (float* samples, int n, float cycles)
+{
+	struct channel* saw = vrc6.channels + 2;
+	for (int i = 0; i < n; i ++)
+	{
+		for (int c = 0; c < 2; c ++)
+		{
+			struct channel* ch = vrc6.channels + c;
+			if (!(ch->regs[2] & CHANNEL_ENABLE))
+				continue;
+			for (ch->timer -= cycles; ch->timer <= 0; ch->timer += channel_period (ch))
+				ch->step = (ch->step + 1) & 0x0F;
+		}
+		if (saw->regs[2] & CHANNEL_ENABLE)
+			for (saw->timer -= cycles; saw->timer <= 0; saw->timer += channel_period (saw))
+				saw_clock (saw);
+
+		int out = pulse_output (vrc6.channels) + pulse_output (vrc6.channels + 1);
+		if (saw->regs[2] & CHANNEL_ENABLE)
+			out += saw->accumulator >> 3;
+		samples[i] += SOUND_LEVEL * out;
+	}
+}
+
+/* write_channel writes to a sound register, disabling a channel resets it */
+static void write_channel (struct channel* ch, int reg, uint8_t v)
+{
+	nes_apu_expansion_sync ();
+	ch->regs[reg] = v;
+	if (reg == 2 && !(v & CHANNEL_ENABLE))
+		ch->step = ch->accumulator = 0;
+}
+
+static int write (uint16_t address, uint8_t v)
+{
+	if (address < 0x8000)
+		return 0;
+
+	int reg = address & 3;
+	if (swap_lines)
+		reg = ((reg & 1) << 1) | (reg >> 1);
+
+	switch (address >> 12)
+	{
+	case 0x8: // 16KB PRG select ($8000-$8003)
+		vrc6.prg_16k = v;
+		update_prg_banks ();
+		break;
+	case 0x9: case 0xA: // pulse channels ($9000-$9002, $A000-$A002)
+		if (reg < 3)
+			write_channel (vrc6.channels + (address >> 12) - 0x9, reg, v);
+		break;
+	case 0xB: // sawtooth ($B000-$B002) and PPU banking mode ($B003)
+		if (reg < 3)
+			write_channel (vrc6.channels + 2, reg, v);
+		else
+		{
+			vrc6.ppu_mode = v & 0x7F;
+			update_chr_banks ();
+			update_mirroring ();
+		}
+		break;
+	case 0xC: // 8KB PRG select ($C000-$C003)
+		vrc6.prg_8k = v;
+		update_prg_banks ();
+		break;
+	case 0xD: case 0xE: // CHR selects ($D000-$E003)
+		vrc6.chr_banks[((address >> 12) - 0xD) * 4 + reg] = v;
+		update_chr_banks ();
+		break;
+	case 0xF: // IRQ ($F000-$F002)
+		if (reg == 0)
+			nes_vrc_irq_write_latch (v);
+		else if (reg == 1)
+			nes_vrc_irq_write_control (v);
+		else if (reg == 2)
+			nes_vrc_irq_acknowledge ();
+		break;
+	}
+	return 1;
+}
+
+static int load (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	n_prg_banks = _n_prg_banks << 1; // n banks passed are in 16KB but the mapper switches 8KB
+	prg         = _prg;
+	n_chr_banks = _n_chr_banks << 3; // n banks passed are in 8KB but the mapper switches 1KB
+	chr         = _chr;
+	return 0;
+}
+
+static int load_24 (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	swap_lines = 0;
+	return load (_n_prg_banks, _prg, _n_chr_banks, _chr);
+}
+
+static int load_26 (int _n_prg_banks, uint8_t* _prg, int _n_chr_banks, uint8_t* _chr)
+{
+	swap_lines = 1;
+	return load (_n_prg_banks, _prg, _n_chr_banks, _chr);
+}
+
+static void reset ()
+{
+	memset (&vrc6, 0, sizeof (vrc6));
+	vrc6.ppu_mode = MIRRORING_HEADER;
+	for (int i = 0; i < N_CHR_BANKS; i ++)
+		vrc6.chr_banks[i] = i;
+	vrc6.prg_8k = 2;
+	update_prg_banks ();
+	update_chr_banks ();
+	nes_vrc_irq_reset ();
+}
+
+static void destroy ()
+{
+	prg = chr = NULL;
+}
+
+const struct nes_mapper nes_vrc6a =
+{
+	.name       = "VRC6a",
+	.load       = load_24,
+	.reset      = reset,
+	.cpu_write  = write,
+	.audio      = audio,
+	.destroy    = destroy,
+};
+
+const struct nes_mapper nes_vrc6b =
+{
+	.name       = "VRC6b",
+	.load       = load_26,
+	.reset      = reset,
+	.cpu_write  = write,
+	.audio      = audio,
+	.destroy    = destroy,
+};
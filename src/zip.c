@@ -0,0 +1,429 @@
+#include "nes/archive.h"
+#include <stdio.h>
+#include <string.h>
+
+/* iNES file magic number */
+static const uint8_t ines_magic[4] = { 'N', 'E', 'S', 0x1A };
+
+/* read little endian values from zip structures */
+#define LE16(p) ((uint16_t) ((p)[0] | (p)[1] << 8))
+#define LE32(p) ((uint32_t) ((p)[0] | (p)[1] << 8 | (p)[2] << 16 | (uint32_t) (p)[3] << 24))
+
+/*
+ *  INFLATE ---------------------------------------------------------------------------------------
+ */
+
+#define MAX_BITS   15  // longest huffman code
+#define MAX_LCODES 286 // literal/length codes
+#define MAX_DCODES 30  // distance codes
+#define FIX_LCODES 288 // literal/length codes in the fixed table
+
+/* inflate_state is the state of the decompression of one deflate stream */
+struct inflate_state
+{
+	const uint8_t* in;
+	size_t         in_size;
+	size_t         in_pos;
+	uint32_t       bitbuf;  // bit buffer
+	int            bitcnt;  // number of bits in bit buffer
+	uint8_t*       out;
+	size_t         out_size;
+	size_t         out_pos;
+	int            error;
+};
+
+/* huffman is a canonical huffman decoding table */
+struct huffman
+{
+	uint16_t count[MAX_BITS + 1]; // number of codes of each length
+	uint16_t symbol[FIX_LCODES];  // symbols ordered by code
+};
+
+/* bits reads need bits from the stream, LSB first */
+static int bits (struct inflate_state* s, int need)
+{
+	uint32_t val = s->bitbuf;
+	while (s->bitcnt < need)
+	{
+		if (s->in_pos == s->in_size)
+		{
+			s->error = 1;
+			return 0;
+		}
+		val |= (uint32_t) s->in[s->in_pos ++] << s->bitcnt;
+		s->bitcnt += 8;
+	}
+	s->bitbuf = val >> need;
+	s->bitcnt -= need;
+	return val & ((1L << need) - 1);
+}
+
+/* stored copies an uncompressed block to the output */
+static int stored (struct inflate_state* s)
+{
+	// discard leftover bits from the current byte
+	s->bitbuf = 0;
+	s->bitcnt = 0;
+
+	if (s->in_pos + 4 > s->in_size)
+		return 1;
+	unsigned len = LE16 (s->in + s->in_pos);
+	if (LE16 (s->in + s->in_pos + 2) != (~len & 0xFFFF))
+		return 1;
+	s->in_pos += 4;
+
+	if (s->in_pos + len > s->in_size || s->out_pos + len > s->out_size)
+		return 1;
+	memcpy (s->out + s->out_pos, s->in + s->in_pos, len);
+	s->in_pos += len;
+	s->out_pos += len;
+	return 0;
+}
+
+/* decode decodes the next symbol from the stream using the huffman table h */
+static int decode (struct inflate_state* s, const struct huffman* h)
+{
+	int code  = 0; // bits being decoded
+	int first = 0; // first code of length len
+	int index = 0; // index of first code of length len in symbol table
+	for (int len = 1; len <= MAX_BITS; len ++)
+	{
+		code |= bits (s, 1);
+		int count = h->count[len];
+		if (code - count < first)
+			return h->symbol[index + (code - first)];
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	s->error = 1; // ran out of codes
+	return -1;
+}
+
+/* construct builds the huffman table h from the n code lengths in length. */
+static int construct (struct huffman* h, const uint16_t* length, int n)
+{
+	uint16_t offs[MAX_BITS + 1];
+
+	memset (h->count, 0, sizeof (h->count));
+	for (int symbol = 0; symbol < n; symbol ++)
+		h->count[length[symbol]] ++;
+	if (h->count[0] == n) // no codes
+		return 0;
+
+	// check for an over-subscribed set of lengths
+	int left = 1;
+	for (int len = 1; len <= MAX_BITS; len ++)
+	{
+		left <<= 1;
+		left -= h->count[len];
+		if (left < 0)
+			return -1;
+	}
+
+	offs[1] = 0;
+	for (int len = 1; len < MAX_BITS; len ++)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (int symbol = 0; symbol < n; symbol ++)
+		if (length[symbol] != 0)
+			h->symbol[offs[length[symbol]] ++] = symbol;
+
+	return left;
+}
+
+/* length_base and length_extra are the base lengths and extra bits for codes 257..285 */
+static const uint16_t length_base[29] =
+{
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint16_t length_extra[29] =
+{
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+/* dist_base and dist_extra are the base offsets and extra bits for distance codes 0..29 */
+static const uint16_t dist_base[30] =
+{
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint16_t dist_extra[30] =
+{
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* codes decodes literal and length/distance pairs until the end of block code */
+static int codes (struct inflate_state* s, const struct huffman* lencode, const struct huffman* distcode)
+{
+	int symbol;
+	do
+	{
+		symbol = decode (s, lencode);
+		if (s->error || symbol < 0)
+			return 1;
+
+		if (symbol < 256) // literal
+		{
+			if (s->out_pos == s->out_size)
+				return 1;
+			s->out[s->out_pos ++] = symbol;
+		}
+		else if (symbol > 256) // length
+		{
+			symbol -= 257;
+			if (symbol >= 29)
+				return 1;
+			size_t len = length_base[symbol] + bits (s, length_extra[symbol]);
+
+			symbol = decode (s, distcode);
+			if (s->error || symbol < 0 || symbol >= 30)
+				return 1;
+			size_t dist = dist_base[symbol] + bits (s, dist_extra[symbol]);
+			if (s->error || dist > s->out_pos || s->out_pos + len > s->out_size)
+				return 1;
+
+			// copy byte by byte as the source may overlap the destination
+			for (; len; len --, s->out_pos ++)
+				s->out[s->out_pos] = s->out[s->out_pos - dist];
+		}
+	}
+	while (symbol != 256);
+	return 0;
+}
+
+/* fixed decodes a block using the fixed huffman tables */
+static int fixed (struct inflate_state* s)
+{
+	static int built = 0;
+	static struct huffman lencode, distcode;
+
+	if (!built)
+	{
+		uint16_t lengths[FIX_LCODES];
+		int symbol = 0;
+		for (; symbol < 144; symbol ++) lengths[symbol] = 8;
+		for (; symbol < 256; symbol ++) lengths[symbol] = 9;
+		for (; symbol < 280; symbol ++) lengths[symbol] = 7;
+		for (; symbol < FIX_LCODES; symbol ++) lengths[symbol] = 8;
+		construct (&lencode, lengths, FIX_LCODES);
+
+		for (symbol = 0; symbol < MAX_DCODES; symbol ++)
+			lengths[symbol] = 5;
+		construct (&distcode, lengths, MAX_DCODES);
+		built = 1;
+	}
+	return codes (s, &lencode, &distcode);
+}
+
+/* dynamic decodes a block using huffman tables described at the start of the block */
+static int dynamic (struct inflate_state* s)
+{
+	static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+	uint16_t lengths[MAX_LCODES + MAX_DCODES];
+	struct huffman lencode, distcode;
+
+	int nlen  = bits (s, 5) + 257;
+	int ndist = bits (s, 5) + 1;
+	int ncode = bits (s, 4) + 4;
+	if (s->error || nlen > MAX_LCODES || ndist > MAX_DCODES)
+		return 1;
+
+	// code length code lengths
+	int index;
+	for (index = 0; index < ncode; index ++)
+		lengths[order[index]] = bits (s, 3);
+	for (; index < 19; index ++)
+		lengths[order[index]] = 0;
+	if (s->error || construct (&lencode, lengths, 19) != 0)
+		return 1;
+
+	// literal/length and distance code lengths
+	index = 0;
+	while (index < nlen + ndist)
+	{
+		int symbol = decode (s, &lencode);
+		if (s->error || symbol < 0)
+			return 1;
+		if (symbol < 16)
+		{
+			lengths[index ++] = symbol;
+			continue;
+		}
+
+		uint16_t len = 0;
+		int repeat;
+		if (symbol == 16) // repeat last length 3..6 times
+		{
+			if (index == 0)
+				return 1;
+			len = lengths[index - 1];
+			repeat = 3 + bits (s, 2);
+		}
+		else if (symbol == 17) // repeat zero 3..10 times
+			repeat = 3 + bits (s, 3);
+		else // repeat zero 11..138 times
+			repeat = 11 + bits (s, 7);
+
+		if (index + repeat > nlen + ndist)
+			return 1;
+		while (repeat --)
+			lengths[index ++] = len;
+	}
+	if (lengths[256] == 0) // no end of block code
+		return 1;
+
+	// incomplete codes are only allowed for a single length
+	int err = construct (&lencode, lengths, nlen);
+	if (err < 0 || (err > 0 && nlen - lencode.count[0] != 1))
+		return 1;
+	err = construct (&distcode, lengths + nlen, ndist);
+	if (err < 0 || (err > 0 && ndist - distcode.count[0] != 1))
+		return 1;
+
+	return codes (s, &lencode, &distcode);
+}
+
+/* inflate decompresses the raw deflate stream in to out, which is out_size bytes large. */
+static int inflate (const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size)
+{
+	struct inflate_state s = { in, in_size, 0, 0, 0, out, out_size, 0, 0 };
+	int last, err;
+	do
+	{
+		last = bits (&s, 1);
+		switch (bits (&s, 2))
+		{
+		case 0:
+			err = stored (&s);
+			break;
+		case 1:
+			err = fixed (&s);
+			break;
+		case 2:
+			err = dynamic (&s);
+			break;
+		default:
+			err = 1;
+			break;
+		}
+		if (err || s.error)
+			return 1;
+	}
+	while (!last);
+	return s.out_pos != out_size;
+}
+
+/*
+ *  ZIP -------------------------------------------------------------------------------------------
+ */
+
+#define LOCAL_HEADER_SIG    0x04034B50
+#define CENTRAL_HEADER_SIG  0x02014B50
+#define END_OF_CENTRAL_SIG  0x06054B50
+
+#define LOCAL_HEADER_SIZE   30
+#define CENTRAL_HEADER_SIZE 46
+#define END_OF_CENTRAL_SIZE 22
+
+/* compression methods */
+#define METHOD_STORED  0
+#define METHOD_DEFLATE 8
+
+int nes_zip_is_archive (const uint8_t* data, size_t size)
+{
+	return size >= LOCAL_HEADER_SIZE && LE32 (data) == LOCAL_HEADER_SIG;
+}
+
+/* find_end_of_central returns the offset to the end of central directory record */
+static long find_end_of_central (const uint8_t* data, size_t size)
+{
+	if (size < END_OF_CENTRAL_SIZE)
+		return -1;
+	// the record is followed by a comment of at most 64KB
+	long min = size > END_OF_CENTRAL_SIZE + 0xFFFF ? size - END_OF_CENTRAL_SIZE - 0xFFFF : 0;
+	for (long i = size - END_OF_CENTRAL_SIZE; i >= min; i --)
+		if (LE32 (data + i) == END_OF_CENTRAL_SIG)
+			return i;
+	return -1;
+}
+
+/* extract_entry decompresses the entry whose central directory header is at entry. */
+static uint8_t* extract_entry (const uint8_t* data, size_t size, const uint8_t* entry, size_t* out_size)
+{
+	int      method     = LE16 (entry + 10);
+	uint32_t comp_size  = LE32 (entry + 20);
+	uint32_t uncomp_size = LE32 (entry + 24);
+	uint32_t local      = LE32 (entry + 42);
+
+	if (method != METHOD_STORED && method != METHOD_DEFLATE)
+		return NULL;
+	if ((size_t) local + LOCAL_HEADER_SIZE > size || LE32 (data + local) != LOCAL_HEADER_SIG)
+		return NULL;
+
+	// sizes in the local header might be deferred to a data descriptor so use the central ones
+	size_t offset = local + LOCAL_HEADER_SIZE + LE16 (data + local + 26) + LE16 (data + local + 28);
+	if (offset + comp_size > size || uncomp_size > NES_ARCHIVE_MAX_SIZE)
+		return NULL;
+
+	uint8_t* out = malloc (uncomp_size ? uncomp_size : 1);
+	if (!out)
+		return NULL;
+	if (method == METHOD_STORED)
+	{
+		if (comp_size != uncomp_size)
+		{
+			free (out);
+			return NULL;
+		}
+		memcpy (out, data + offset, uncomp_size);
+	}
+	else if (inflate (data + offset, comp_size, out, uncomp_size) != 0)
+	{
+		free (out);
+		return NULL;
+	}
+	*out_size = uncomp_size;
+	return out;
+}
+
+int nes_zip_extract_rom (const uint8_t* data, size_t size, uint8_t** rom, size_t* rom_size)
+{
+	long eocd = find_end_of_central (data, size);
+	if (eocd < 0)
+	{
+		fprintf (stderr, "zip: could not find central directory\n");
+		return 1;
+	}
+
+	int      n_entries = LE16 (data + eocd + 10);
+	uint32_t offset    = LE32 (data + eocd + 16);
+
+	for (int i = 0; i < n_entries; i ++)
+	{
+		if ((size_t) offset + CENTRAL_HEADER_SIZE > size || LE32 (data + offset) != CENTRAL_HEADER_SIG)
+			break;
+		const uint8_t* entry = data + offset;
+		offset += CENTRAL_HEADER_SIZE + LE16 (entry + 28) + LE16 (entry + 30) + LE16 (entry + 32);
+
+		// only bother with entries large enough to hold an iNES header
+		if (LE32 (entry + 24) < sizeof (ines_magic))
+			continue;
+
+		size_t n;
+		uint8_t* out = extract_entry (data, size, entry, &n);
+		if (!out)
+			continue;
+		if (memcmp (out, ines_magic, sizeof (ines_magic)) == 0)
+		{
+			*rom = out;
+			*rom_size = n;
+			return 0;
+		}
+		free (out);
+	}
+
+	fprintf (stderr, "zip: no iNES image found in archive\n");
+	return 1;
+}
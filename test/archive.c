@@ -0,0 +1,498 @@
+/** -------------------------------------------------------------------------------------
+ *  File: archive.c
+ *  Author: ximon
+ *  Description: Feeds truncated, corrupt and crafted zip and 7z archives to the extractors and
+ *               checks that they fail cleanly, without reading past the archive or allocating
+ *               the sizes its headers claim.
+ *
+ *  usage: archive [roms directory]
+ *
+ *  The archives under test/roms are extracted whole, then cut at every length and corrupted
+ *  byte by byte, which must not crash nor hang. The crafted archives each break one of the
+ *  bounds the extractors check, and are built around a copied or LZMA coded 7z folder or a
+ *  stored zip entry that extracts when left intact. The address space is limited so that
+ *  allocating a size claimed by an archive fails the test instead of passing unnoticed.
+ ---------------------------------------------------------------------------------------- */
+#include <nes/archive.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+// the extractors are done with the fixtures well within this
+#define TIMEOUT_SECONDS 120
+
+// far less than the largest sizes claimed below, far more than any archive needs
+#define ADDRESS_SPACE_LIMIT (1ul << 30)
+
+// bytes flipped when corrupting an archive, one in CORRUPT_STRIDE
+#define CORRUPT_STRIDE 3
+
+static const char* fixtures[] =
+{
+	"holydiverbatman-bin-0.01.7z",
+	"scanline/scanline.zip",
+	"tvpassfail/tvpassfail.zip",
+};
+
+/* the image stored in the crafted archives, and its LZMA stream with lc 3, lp 0 and pb 2 */
+static const uint8_t image[32] = { 'N', 'E', 'S', 0x1A, 0x01, 0x01 };
+static const uint8_t image_lzma[] =
+{
+	0x00, 0x27, 0x11, 0x46, 0xA8, 0xC5, 0x71, 0x55, 0x6A, 0x20, 0x48, 0x45, 0x9F, 0xFF, 0xFF, 0xBC,
+	0x66, 0x00, 0x00,
+};
+
+/* extract extracts the iNES image from an archive of either kind, returning non-zero on failure */
+static int extract (const uint8_t* data, size_t size, uint8_t** rom, size_t* rom_size)
+{
+	if (nes_zip_is_archive (data, size))
+		return nes_zip_extract_rom (data, size, rom, rom_size);
+	if (nes_7z_is_archive (data, size))
+		return nes_7z_extract_rom (data, size, rom, rom_size);
+	return 1;
+}
+
+/**
+ *  extract_copy extracts from a copy of data of exactly size bytes, so that reading past the
+ *  end is caught by tools watching the heap.
+ */
+static int extract_copy (const uint8_t* data, size_t size, size_t* rom_size)
+{
+	uint8_t* copy = malloc (size ? size : 1);
+	memcpy (copy, data, size);
+	uint8_t* rom = NULL;
+	int ret = extract (copy, size, &rom, rom_size);
+	free (rom);
+	free (copy);
+	return ret;
+}
+
+static uint8_t* read_file (const char* dir, const char* name, size_t* size)
+{
+	char path[1024];
+	snprintf (path, sizeof (path), "%s/%s", dir, name);
+	FILE* f = fopen (path, "rb");
+	if (f == NULL)
+		return NULL;
+	fseek (f, 0, SEEK_END);
+	*size = ftell (f);
+	fseek (f, 0, SEEK_SET);
+	uint8_t* data = malloc (*size);
+	if (fread (data, 1, *size, f) != *size)
+	{
+		free (data);
+		data = NULL;
+	}
+	fclose (f);
+	return data;
+}
+
+/**
+ *  check_fixture extracts an archive whole, then truncated at every length, which must fail,
+ *  and corrupted, which must not crash. Returns the number of failures.
+ */
+static int check_fixture (const char* dir, const char* name)
+{
+	size_t size, n;
+	uint8_t* data = read_file (dir, name, &size);
+	if (data == NULL)
+	{
+		printf ("archive: could not read %s/%s\n", dir, name);
+		return 1;
+	}
+
+	int failed = 0;
+	if (extract_copy (data, size, &n) != 0)
+	{
+		printf ("archive: %s did not extract\n", name);
+		failed ++;
+	}
+	for (size_t i = 0; i < size; i ++)
+	{
+		if (extract_copy (data, i, &n) == 0)
+		{
+			printf ("archive: %s extracted when cut to %zu bytes\n", name, i);
+			failed ++;
+		}
+	}
+	for (size_t i = 0; i < size; i += CORRUPT_STRIDE)
+	{
+		data[i] ^= 0xFF;
+		if (extract_copy (data, size, &n) == 0 && n > NES_ARCHIVE_MAX_SIZE)
+		{
+			printf ("archive: %s extracted %zu bytes with byte %zu corrupt\n", name, n, i);
+			failed ++;
+		}
+		data[i] ^= 0xFF;
+	}
+	free (data);
+	return failed;
+}
+
+/*
+ *  7z --------------------------------------------------------------------------------------------
+ */
+
+#define SIGNATURE_SIZE         8
+#define SIGNATURE_HEADER_SIZE 32
+
+/* put64 stores v in little endian */
+static void put64 (uint8_t* p, uint64_t v)
+{
+	for (int i = 0; i < 8; i ++)
+		p[i] = v >> (8 * i);
+}
+
+/* number appends v as a 7z number in its longest form, which holds any value */
+static uint8_t* number (uint8_t* p, uint64_t v)
+{
+	*p ++ = 0xFF;
+	put64 (p, v);
+	return p + 8;
+}
+
+/**
+ *  sevenzip describes a 7z archive with a single folder, stored as the packed stream followed by
+ *  a plain header, or one encoded by a copy coder when encoded is set.
+ */
+struct sevenzip
+{
+	const uint8_t* packed;
+	size_t         packed_size;
+	uint64_t       pack_size;
+	uint64_t       unpack_size;
+	int            lzma;         // the folder is LZMA coded instead of copied
+	uint64_t       n_substreams; // listed when not 0
+	uint64_t       substream_size;
+	uint64_t       n_pack_streams;
+	uint64_t       n_props;
+	int            encoded;
+	uint64_t       header_unpack_size; // that of the plain header when 0
+};
+
+/* folder appends the pack and unpack info of a single folder */
+static uint8_t* folder (uint8_t* p, uint64_t pack_pos, uint64_t n_pack_streams, uint64_t pack_size,
+                        int lzma, uint64_t n_props, uint64_t unpack_size)
+{
+	*p ++ = 0x06; // pack info
+	p = number (p, pack_pos);
+	p = number (p, n_pack_streams);
+	*p ++ = 0x09; // size
+	p = number (p, pack_size);
+	*p ++ = 0x00;
+	*p ++ = 0x07; // unpack info
+	*p ++ = 0x0B; // folder
+	p = number (p, 1);
+	*p ++ = 0x00; // not external
+	p = number (p, 1); // coders
+	if (lzma)
+	{
+		static const uint8_t coder[] = { 0x23, 0x03, 0x01, 0x01 };
+		static const uint8_t props[] = { 0x5D, 0x00, 0x00, 0x01, 0x00 };
+		memcpy (p, coder, sizeof (coder));
+		p += sizeof (coder);
+		p = number (p, n_props);
+		for (uint64_t i = 0; i < n_props && i < 16; i ++)
+			*p ++ = props[i % sizeof (props)];
+	}
+	else
+	{
+		*p ++ = 0x01; // method of a single byte, no properties
+		*p ++ = 0x00; // copy
+	}
+	*p ++ = 0x0C; // coders unpack size
+	p = number (p, unpack_size);
+	*p ++ = 0x00;
+	return p;
+}
+
+/* build_7z writes the archive to out and returns its size */
+static size_t build_7z (uint8_t* out, const struct sevenzip* z)
+{
+	static const uint8_t signature[SIGNATURE_SIZE] = { '7', 'z', 0xBC, 0xAF, 0x27, 0x1C, 0x00, 0x04 };
+	memset (out, 0, SIGNATURE_HEADER_SIZE);
+	memcpy (out, signature, sizeof (signature));
+	memcpy (out + SIGNATURE_HEADER_SIZE, z->packed, z->packed_size);
+
+	// the plain header, which is stored after the packed stream when it is encoded
+	uint8_t header[512];
+	uint8_t* p = header;
+	*p ++ = 0x01; // header
+	*p ++ = 0x04; // main streams info
+	p = folder (p, 0, z->n_pack_streams, z->pack_size, z->lzma, z->n_props, z->unpack_size);
+	if (z->n_substreams)
+	{
+		*p ++ = 0x08; // substreams info
+		*p ++ = 0x0D; // number of unpack streams
+		p = number (p, z->n_substreams);
+		*p ++ = 0x09; // size
+		for (uint64_t i = 1; i < z->n_substreams && i < 16; i ++)
+			p = number (p, z->substream_size);
+		*p ++ = 0x00;
+	}
+	*p ++ = 0x00; // end of streams info
+	*p ++ = 0x00; // end of header
+	size_t header_size = p - header;
+
+	uint8_t* next = out + SIGNATURE_HEADER_SIZE + z->packed_size;
+	if (z->encoded)
+	{
+		memcpy (next, header, header_size);
+		uint8_t* q = next + header_size;
+		*q ++ = 0x17; // encoded header
+		uint64_t unpack_size = z->header_unpack_size ? z->header_unpack_size : header_size;
+		q = folder (q, z->packed_size, 1, header_size, 0, 0, unpack_size);
+		*q ++ = 0x00;
+		next += header_size;
+		header_size = q - next;
+	}
+	else
+		memcpy (next, header, header_size);
+
+	put64 (out + 12, next - out - SIGNATURE_HEADER_SIZE);
+	put64 (out + 20, header_size);
+	return next - out + header_size;
+}
+
+/* sevenzip_intact returns the description of an archive holding image that extracts */
+static struct sevenzip sevenzip_intact (int lzma)
+{
+	struct sevenzip z = { image, sizeof (image), sizeof (image), sizeof (image), lzma };
+	if (lzma)
+	{
+		z.packed = image_lzma;
+		z.packed_size = z.pack_size = sizeof (image_lzma);
+	}
+	z.n_pack_streams = 1;
+	z.n_props = 5;
+	return z;
+}
+
+/*
+ *  zip -------------------------------------------------------------------------------------------
+ */
+
+#define LOCAL_HEADER_SIZE   30
+#define CENTRAL_HEADER_SIZE 46
+#define END_OF_CENTRAL_SIZE 22
+
+static void put16 (uint8_t* p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32 (uint8_t* p, uint32_t v)
+{
+	put16 (p, v);
+	put16 (p + 2, v >> 16);
+}
+
+/* zip describes a zip archive with a single entry */
+struct zip
+{
+	const uint8_t* data;
+	size_t         data_size;
+	int            method;
+	uint32_t       comp_size;
+	uint32_t       uncomp_size;
+	uint32_t       local;        // offset of the local header
+	uint32_t       central;      // offset of the central directory, 0 where it is
+};
+
+/* build_zip writes the archive to out and returns its size */
+static size_t build_zip (uint8_t* out, const struct zip* z)
+{
+	memset (out, 0, LOCAL_HEADER_SIZE);
+	put32 (out, 0x04034B50);
+	put16 (out + 8, z->method);
+	memcpy (out + LOCAL_HEADER_SIZE, z->data, z->data_size);
+
+	uint8_t* c = out + LOCAL_HEADER_SIZE + z->data_size;
+	memset (c, 0, CENTRAL_HEADER_SIZE);
+	put32 (c, 0x02014B50);
+	put16 (c + 10, z->method);
+	put32 (c + 20, z->comp_size);
+	put32 (c + 24, z->uncomp_size);
+	put32 (c + 42, z->local);
+
+	uint8_t* e = c + CENTRAL_HEADER_SIZE;
+	memset (e, 0, END_OF_CENTRAL_SIZE);
+	put32 (e, 0x06054B50);
+	put16 (e + 10, 1);
+	put32 (e + 16, z->central ? z->central : c - out);
+	return e + END_OF_CENTRAL_SIZE - out;
+}
+
+/* zip_intact returns the description of an archive holding image stored that extracts */
+static struct zip zip_intact ()
+{
+	struct zip z = { image, sizeof (image), 0, sizeof (image), sizeof (image) };
+	return z;
+}
+
+/* deflate streams with a single stored block, the first claiming more than the image */
+static const uint8_t deflate_long[] = { 0x01, 0x40, 0x00, 0xBF, 0xFF };
+static const uint8_t deflate_cut[] = { 0x01, 0x20, 0x00, 0xDF, 0xFF, 'N', 'E', 'S', 0x1A };
+static const uint8_t deflate_bad_type[] = { 0x07 };
+
+/*
+ *  Crafted archives ------------------------------------------------------------------------------
+ */
+
+static uint8_t archive[4096];
+
+/**
+ *  check extracts the archive of size bytes built in archive, which is broken as described by
+ *  name unless it is expected to extract. Returns 1 if the outcome is not the expected one.
+ */
+static int check (const char* name, int extracts, size_t size)
+{
+	size_t n;
+	int ret = extract_copy (archive, size, &n);
+	if ((ret == 0) == extracts)
+		return 0;
+	printf ("archive: %s %s\n", name, ret ? "did not extract" : "extracted");
+	return 1;
+}
+
+static int check_crafted_7z ()
+{
+	int failed = 0;
+	struct sevenzip z;
+	size_t size;
+
+	z = sevenzip_intact (0);
+	failed += check ("7z intact", 1, build_7z (archive, &z));
+	z = sevenzip_intact (1);
+	failed += check ("7z LZMA intact", 1, build_7z (archive, &z));
+	z = sevenzip_intact (0); z.encoded = 1;
+	failed += check ("7z with an encoded header intact", 1, build_7z (archive, &z));
+
+	z = sevenzip_intact (0);
+	size = build_7z (archive, &z);
+	put64 (archive + 12, size);
+	failed += check ("7z header past the end", 0, size);
+	size = build_7z (archive, &z);
+	put64 (archive + 20, UINT64_MAX - 8);
+	failed += check ("7z header size wrapping around", 0, size);
+	size = build_7z (archive, &z);
+	put64 (archive + 12, UINT64_MAX - 8);
+	failed += check ("7z header offset wrapping around", 0, size);
+	{
+		// the signature alone, past nes_7z_is_archive which turns it away before the extractor
+		uint8_t* cut = malloc (SIGNATURE_SIZE);
+		memcpy (cut, archive, SIGNATURE_SIZE);
+		uint8_t* rom = NULL;
+		if (nes_7z_extract_rom (cut, SIGNATURE_SIZE, &rom, &size) == 0)
+		{
+			printf ("archive: 7z signature alone extracted\n");
+			failed ++;
+		}
+		free (rom);
+		free (cut);
+	}
+
+	z = sevenzip_intact (0); z.pack_size = z.unpack_size = sizeof (archive);
+	failed += check ("7z packed stream past the end", 0, build_7z (archive, &z));
+	z = sevenzip_intact (0); z.unpack_size = 2 * sizeof (image);
+	failed += check ("7z copy with sizes apart", 0, build_7z (archive, &z));
+	z = sevenzip_intact (0); z.n_pack_streams = 257;
+	failed += check ("7z with too many pack streams", 0, build_7z (archive, &z));
+	z = sevenzip_intact (0); z.n_pack_streams = 0;
+	failed += check ("7z with more folders than pack streams", 0, build_7z (archive, &z));
+
+	z = sevenzip_intact (1); z.unpack_size = 2 * sizeof (image);
+	failed += check ("7z LZMA stream shorter than its folder", 0, build_7z (archive, &z));
+	z = sevenzip_intact (1); z.unpack_size = (1u << 31) - 1;
+	failed += check ("7z LZMA folder claiming 2GB", 0, build_7z (archive, &z));
+	z = sevenzip_intact (1); z.unpack_size = UINT64_MAX;
+	failed += check ("7z LZMA folder claiming 2^64 bytes", 0, build_7z (archive, &z));
+	z = sevenzip_intact (1); z.unpack_size = NES_ARCHIVE_MAX_SIZE + 1;
+	failed += check ("7z image larger than the limit", 0, build_7z (archive, &z));
+	z = sevenzip_intact (1); z.n_props = 9;
+	failed += check ("7z coder with too many properties", 0, build_7z (archive, &z));
+	z = sevenzip_intact (1); z.n_props = 4;
+	failed += check ("7z LZMA coder missing properties", 0, build_7z (archive, &z));
+
+	z = sevenzip_intact (0); z.n_substreams = (uint64_t) 1 << 40;
+	failed += check ("7z claiming 2^40 substreams", 0, build_7z (archive, &z));
+	z = sevenzip_intact (0); z.n_substreams = 2; z.substream_size = sizeof (image) + 1;
+	failed += check ("7z substreams larger than the folder", 0, build_7z (archive, &z));
+	z = sevenzip_intact (0); z.n_substreams = 2; z.substream_size = UINT64_MAX;
+	failed += check ("7z substream size wrapping around", 0, build_7z (archive, &z));
+
+	z = sevenzip_intact (0); z.encoded = 1; z.header_unpack_size = NES_ARCHIVE_MAX_SIZE + 1;
+	failed += check ("7z encoded header larger than the limit", 0, build_7z (archive, &z));
+	z = sevenzip_intact (0); z.encoded = 1; z.header_unpack_size = 1;
+	failed += check ("7z encoded header cut short", 0, build_7z (archive, &z));
+	return failed;
+}
+
+static int check_crafted_zip ()
+{
+	int failed = 0;
+	struct zip z;
+
+	z = zip_intact ();
+	failed += check ("zip intact", 1, build_zip (archive, &z));
+	z = zip_intact (); z.uncomp_size = z.comp_size = NES_ARCHIVE_MAX_SIZE + 1;
+	failed += check ("zip entry larger than the limit", 0, build_zip (archive, &z));
+	z = zip_intact (); z.uncomp_size = z.comp_size = UINT32_MAX;
+	failed += check ("zip entry claiming 4GB", 0, build_zip (archive, &z));
+	z = zip_intact (); z.comp_size = sizeof (image) + 0x100;
+	failed += check ("zip entry past the end", 0, build_zip (archive, &z));
+	z = zip_intact (); z.uncomp_size = sizeof (image) - 1;
+	failed += check ("zip stored entry with sizes apart", 0, build_zip (archive, &z));
+	z = zip_intact (); z.local = UINT32_MAX - 8;
+	failed += check ("zip local header past the end", 0, build_zip (archive, &z));
+	z = zip_intact (); z.local = 4;
+	failed += check ("zip local header without its signature", 0, build_zip (archive, &z));
+	z = zip_intact (); z.central = UINT32_MAX - 8;
+	failed += check ("zip central directory past the end", 0, build_zip (archive, &z));
+
+	z = zip_intact (); z.method = 8;
+	z.data = deflate_long; z.data_size = z.comp_size = sizeof (deflate_long);
+	failed += check ("zip deflate block larger than the entry", 0, build_zip (archive, &z));
+	z = zip_intact (); z.method = 8;
+	z.data = deflate_cut; z.data_size = z.comp_size = sizeof (deflate_cut);
+	failed += check ("zip deflate block cut short", 0, build_zip (archive, &z));
+	z = zip_intact (); z.method = 8;
+	z.data = deflate_bad_type; z.data_size = z.comp_size = sizeof (deflate_bad_type);
+	failed += check ("zip deflate block of an invalid type", 0, build_zip (archive, &z));
+	return failed;
+}
+
+static void timeout (int sig)
+{
+	static const char message[] = "archive: an extraction did not finish\n";
+	write (STDOUT_FILENO, message, sizeof (message) - 1);
+	_exit (1);
+}
+
+int main (int argc, char** argv)
+{
+	const char* dir = argc > 1 ? argv[1] : "test/roms";
+
+#ifndef __SANITIZE_ADDRESS__
+	// the address sanitizer reserves more than this up front
+	struct rlimit limit = { ADDRESS_SPACE_LIMIT, ADDRESS_SPACE_LIMIT };
+	setrlimit (RLIMIT_AS, &limit);
+#endif
+	signal (SIGALRM, timeout);
+	alarm (TIMEOUT_SECONDS);
+
+	// the extractors report what they reject, thousands of times over
+	freopen ("/dev/null", "w", stderr);
+
+	int failed = check_crafted_7z () + check_crafted_zip ();
+	for (size_t i = 0; i < sizeof (fixtures) / sizeof (fixtures[0]); i ++)
+		failed += check_fixture (dir, fixtures[i]);
+
+	if (failed == 0)
+		printf ("archive: all crafted, truncated and corrupt archives handled\n");
+	return failed != 0;
+}
@@ -0,0 +1,371 @@
+/** -------------------------------------------------------------------------------------
+ *  File: blargg.c
+ *  Author: ximon
+ *  Description: Runs test ROMs that report their result through PRG RAM at $6000, as blargg's
+ *               test ROMs do, headless and in parallel, and prints the results as JSON or JUnit.
+ *
+ *  usage: blargg [-x] [-j jobs] [-t seconds] rom.nes...
+ *
+ *  Each ROM is run in its own process, at most jobs at a time (one per core by default), for at
+ *  most seconds of emulated time (60 by default). -x prints JUnit XML instead of JSON.
+ *  Exits non-zero if any test did not pass.
+ *
+ *  While a test runs $6001-$6003 hold DE B0 61 and $6000 is $80, or $81 if the reset button
+ *  needs to be pressed. Once done $6000 holds the result, 0 if it passed, and $6004 starts the
+ *  text it printed.
+ ---------------------------------------------------------------------------------------- */
+#include <nes.h>
+#include <nes/cpu.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define STATUS_RUNNING 0x80
+#define STATUS_RESET   0x81
+
+#define FRAMES_PER_SECOND 60
+
+// the reset button is pressed this long after a test asks for it
+#define RESET_DELAY_FRAMES 6
+
+/**
+ *  Outcome of a test.
+ */
+enum outcome
+{
+	PASSED,
+	FAILED,
+	TIMEOUT,
+	ERROR,
+};
+
+static const char* outcome_names[] = { "passed", "failed", "timeout", "error" };
+
+/**
+ *  result of a test as sent from the process running it. It is small enough to be written to a
+ *  pipe in one go.
+ */
+struct result
+{
+	enum outcome outcome;
+	int          status;  // value of $6000, -1 if the test never started
+	int          frames;  // frames run
+	double       time;    // seconds it took to run
+	char         message[1024];
+};
+
+/**
+ *  test is a ROM to run and its result once it is done.
+ */
+struct test
+{
+	const char*   rom;
+	pid_t         pid;
+	int           fd;
+	struct result result;
+};
+
+static double now ()
+{
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* started returns non-zero if the test has written the signature to PRG RAM */
+static int started (const uint8_t* prg_ram)
+{
+	return prg_ram[1] == 0xDE && prg_ram[2] == 0xB0 && prg_ram[3] == 0x61;
+}
+
+/**
+ *  run runs the test ROM for at most frames frames.
+ */
+static void run (const char* rom, int frames, struct result* r)
+{
+	double start = now ();
+	memset (r, 0, sizeof (*r));
+	r->status = -1;
+
+	if (nes_start (rom) != 0)
+	{
+		r->outcome = ERROR;
+		snprintf (r->message, sizeof (r->message), "could not load game");
+		return;
+	}
+	nes_audio_set_enabled (0);
+
+	const uint8_t* prg_ram = nes_cpu_prg_ram ();
+	int reset_at = -1;
+	r->outcome = TIMEOUT;
+	for (r->frames = 0; r->frames < frames; r->frames ++)
+	{
+		nes_step_frame ();
+		if (!started (prg_ram))
+			continue;
+
+		r->status = prg_ram[0];
+		if (r->status == STATUS_RESET)
+		{
+			if (reset_at < 0)
+				reset_at = r->frames + RESET_DELAY_FRAMES;
+			else if (r->frames >= reset_at)
+			{
+				nes_reset ();
+				reset_at = -1;
+			}
+		}
+		else if (r->status < STATUS_RUNNING)
+		{
+			r->outcome = r->status == 0 ? PASSED : FAILED;
+			r->frames ++;
+			break;
+		}
+	}
+
+	// the text printed so far, also when it timed out
+	if (started (prg_ram))
+	{
+		int n = 0;
+		for (int i = 4; i < 0x2000 && prg_ram[i] != 0 && n < sizeof (r->message) - 1; i ++)
+			r->message[n ++] = prg_ram[i];
+		r->message[n] = 0;
+	}
+
+	nes_stop ();
+	r->time = now () - start;
+}
+
+/**
+ *  start forks a process running test t.
+ *  Returns non-zero if the process could not be started.
+ */
+static int start (struct test* t, int frames)
+{
+	int fds[2];
+	if (pipe (fds) != 0)
+	{
+		perror ("pipe");
+		return 1;
+	}
+
+	fflush (stdout);
+	t->pid = fork ();
+	if (t->pid < 0)
+	{
+		perror ("fork");
+		close (fds[0]);
+		close (fds[1]);
+		return 1;
+	}
+	if (t->pid == 0)
+	{
+		// the iNES header is printed when loading, keep it out of the results
+		close (fds[0]);
+		freopen ("/dev/null", "w", stdout);
+		struct result r;
+		run (t->rom, frames, &r);
+		_exit (write (fds[1], &r, sizeof (r)) == sizeof (r) ? 0 : 1);
+	}
+
+	close (fds[1]);
+	t->fd = fds[0];
+	return 0;
+}
+
+/**
+ *  finish collects the result of test t, which process has exited with status.
+ */
+static void finish (struct test* t, int status)
+{
+	if (read (t->fd, &t->result, sizeof (t->result)) != sizeof (t->result))
+	{
+		memset (&t->result, 0, sizeof (t->result));
+		t->result.outcome = ERROR;
+		t->result.status = -1;
+		if (WIFSIGNALED (status))
+			snprintf (t->result.message, sizeof (t->result.message), "crashed with signal %d", WTERMSIG (status));
+		else
+			snprintf (t->result.message, sizeof (t->result.message), "exited without a result");
+	}
+	close (t->fd);
+	t->pid = 0;
+}
+
+/* print_json prints s as a JSON string */
+static void print_json (const char* s)
+{
+	putchar ('"');
+	for (; *s; s ++)
+	{
+		if (*s == '"' || *s == '\\')
+			printf ("\\%c", *s);
+		else if (*s == '\n')
+			printf ("\\n");
+		else if ((unsigned char) *s < 0x20)
+			printf ("\\u%04x", *s);
+		else
+			putchar (*s);
+	}
+	putchar ('"');
+}
+
+/* print_xml prints s escaped for XML */
+static void print_xml (const char* s)
+{
+	for (; *s; s ++)
+	{
+		switch (*s)
+		{
+			case '<':  printf ("&lt;"); break;
+			case '>':  printf ("&gt;"); break;
+			case '&':  printf ("&amp;"); break;
+			case '"':  printf ("&quot;"); break;
+			default:
+				if ((unsigned char) *s >= 0x20 || *s == '\n')
+					putchar (*s);
+		}
+	}
+}
+
+static void print_results_json (const struct test* tests, int n)
+{
+	int passed = 0;
+	printf ("{\n\t\"tests\": [\n");
+	for (int i = 0; i < n; i ++)
+	{
+		const struct result* r = &tests[i].result;
+		passed += r->outcome == PASSED;
+		printf ("\t\t{\"rom\": ");
+		print_json (tests[i].rom);
+		printf (", \"result\": \"%s\", \"status\": %d, \"frames\": %d, \"time\": %.3f, \"message\": ",
+			outcome_names[r->outcome], r->status, r->frames, r->time);
+		print_json (r->message);
+		printf ("}%s\n", i < n - 1 ? "," : "");
+	}
+	printf ("\t],\n\t\"passed\": %d,\n\t\"failed\": %d\n}\n", passed, n - passed);
+}
+
+static void print_results_junit (const struct test* tests, int n)
+{
+	int failures = 0, errors = 0;
+	double time = 0;
+	for (int i = 0; i < n; i ++)
+	{
+		failures += tests[i].result.outcome == FAILED || tests[i].result.outcome == TIMEOUT;
+		errors += tests[i].result.outcome == ERROR;
+		time += tests[i].result.time;
+	}
+
+	printf ("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	printf ("<testsuite name=\"blargg\" tests=\"%d\" failures=\"%d\" errors=\"%d\" time=\"%.3f\">\n",
+		n, failures, errors, time);
+	for (int i = 0; i < n; i ++)
+	{
+		const struct result* r = &tests[i].result;
+		printf ("\t<testcase name=\"");
+		print_xml (tests[i].rom);
+		printf ("\" time=\"%.3f\">\n", r->time);
+		if (r->outcome != PASSED)
+		{
+			printf ("\t\t<%s message=\"%s", r->outcome == ERROR ? "error" : "failure", outcome_names[r->outcome]);
+			if (r->status >= 0)
+				printf (" with status %d", r->status);
+			printf ("\">");
+			print_xml (r->message);
+			printf ("</%s>\n", r->outcome == ERROR ? "error" : "failure");
+		}
+		else if (r->message[0])
+		{
+			printf ("\t\t<system-out>");
+			print_xml (r->message);
+			printf ("</system-out>\n");
+		}
+		printf ("\t</testcase>\n");
+	}
+	printf ("</testsuite>\n");
+}
+
+static void usage ()
+{
+	fprintf (stderr, "usage: blargg [-x] [-j jobs] [-t seconds] rom.nes...\n");
+}
+
+int main (int argc, char** argv)
+{
+	int junit = 0, jobs = sysconf (_SC_NPROCESSORS_ONLN), seconds = 60, c;
+	while ((c = getopt (argc, argv, "xj:t:")) != -1)
+	{
+		switch (c)
+		{
+			case 'x':
+				junit = 1;
+				break;
+
+			case 'j':
+				jobs = atoi (optarg);
+				break;
+
+			case 't':
+				seconds = atoi (optarg);
+				break;
+
+			default:
+				usage ();
+				return 1;
+		}
+	}
+	if (jobs < 1)
+		jobs = 1;
+
+	int n = argc - optind;
+	struct test* tests = calloc (n > 0 ? n : 1, sizeof (struct test));
+	for (int i = 0; i < n; i ++)
+		tests[i].rom = argv[optind + i];
+
+	// keep jobs processes running until all tests are done
+	int next = 0, running = 0;
+	while (next < n || running > 0)
+	{
+		while (next < n && running < jobs)
+		{
+			if (start (&tests[next], seconds * FRAMES_PER_SECOND) != 0)
+			{
+				tests[next].result.outcome = ERROR;
+				tests[next].result.status = -1;
+				snprintf (tests[next].result.message, sizeof (tests[next].result.message), "could not start");
+			}
+			else
+				running ++;
+			next ++;
+		}
+
+		int status;
+		pid_t pid = wait (&status);
+		if (pid < 0)
+			break;
+		for (int i = 0; i < next; i ++)
+		{
+			if (tests[i].pid == pid)
+			{
+				finish (&tests[i], status);
+				running --;
+				break;
+			}
+		}
+	}
+
+	if (junit)
+		print_results_junit (tests, n);
+	else
+		print_results_json (tests, n);
+
+	int ret = 0;
+	for (int i = 0; i < n; i ++)
+		ret |= tests[i].result.outcome != PASSED;
+	free (tests);
+	return ret;
+}
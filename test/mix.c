@@ -0,0 +1,129 @@
+/** -------------------------------------------------------------------------------------
+ *  File: mix.c
+ *  Author: ximon
+ *  Description: Plays the same sound twice headless, mixed once by the scalar mixer and once by
+ *               the AVX2 mixer, and checks that the samples are the same.
+ *
+ *  usage: mix
+ *
+ *  The program is assembled into an NROM image in memory. It sweeps the volumes and periods of
+ *  the pulse channels over a triangle and noise so that the mixer looks up many levels. The test
+ *  passes without comparing when the CPU has no AVX2.
+ ---------------------------------------------------------------------------------------- */
+#include <nes.h>
+#include <nes/apu.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HEADER_SIZE  16
+#define PRG_ROM_SIZE 0x4000
+#define CHR_ROM_SIZE 0x2000
+
+// the 16KB of PRG ROM are mirrored at $8000 and $C000
+#define PRG_ROM_LOCATION 0xC000
+#define RESET_VECTOR     0xFFFC
+
+#define SAMPLE_RATE 44100
+#define FRAMES      60
+
+// a frame is well under a second of samples
+#define MAX_SAMPLES (FRAMES * SAMPLE_RATE)
+
+static const uint8_t program[] =
+{
+	0xA9, 0x0F, 0x8D, 0x15, 0x40, // STA $4015 ; pulses, triangle and noise on
+	0xA9, 0xFF, 0x8D, 0x08, 0x40, // STA $4008 ; triangle linear counter halted
+	0xA9, 0x40, 0x8D, 0x0A, 0x40, // STA $400A
+	0xA9, 0x08, 0x8D, 0x0B, 0x40, // STA $400B
+	0xA9, 0x3F, 0x8D, 0x0C, 0x40, // STA $400C ; noise at volume 15, halted
+	0xA9, 0x05, 0x8D, 0x0E, 0x40, // STA $400E
+	0xA9, 0x08, 0x8D, 0x0F, 0x40, // STA $400F
+	0xA9, 0x08, 0x8D, 0x03, 0x40, // STA $4003
+	0xA9, 0x08, 0x8D, 0x07, 0x40, // STA $4007
+	0xA2, 0x00,                   // LDX #$00
+	0xA0, 0x00,                   // LDY #$00
+	                              // loop at $C031
+	0xE8,                         // INX
+	0x8A,                         // TXA
+	0x29, 0x0F,                   // AND #$0F
+	0x09, 0xB0,                   // ORA #$B0
+	0x8D, 0x00, 0x40,             // STA $4000 ; pulse 1 at volume X & 15, halted
+	0x49, 0x0F,                   // EOR #$0F
+	0x8D, 0x04, 0x40,             // STA $4004 ; pulse 2 at volume 15 - (X & 15)
+	0x8E, 0x02, 0x40,             // STX $4002
+	0x8E, 0x06, 0x40,             // STX $4006
+	0x88,                         // DEY
+	0xD0, 0xFD,                   // BNE DEY
+	0x4C, 0x31, 0xC0,             // JMP loop
+};
+
+static uint8_t rom[HEADER_SIZE + PRG_ROM_SIZE + CHR_ROM_SIZE];
+
+/* play runs the program and returns the number of samples it stored in out */
+static size_t play (float* out)
+{
+	if (nes_start_from_memory (rom, sizeof (rom)) != 0)
+	{
+		fprintf (stderr, "mix: could not load the program\n");
+		exit (1);
+	}
+	nes_audio_set_sample_rate (SAMPLE_RATE);
+
+	size_t n = 0;
+	for (int i = 0; i < FRAMES; i ++)
+	{
+		size_t size = 0;
+		nes_step_frame ();
+		nes_audio_samples (out + n, &size);
+		n += size / sizeof (float);
+	}
+	nes_stop ();
+	return n;
+}
+
+int main (int argc, char** argv)
+{
+	memcpy (rom, "NES\x1A\x01\x01", 6);
+	uint8_t* prg = rom + HEADER_SIZE;
+	memcpy (prg, program, sizeof (program));
+	prg[RESET_VECTOR - PRG_ROM_LOCATION]     = PRG_ROM_LOCATION & 0xFF;
+	prg[RESET_VECTOR - PRG_ROM_LOCATION + 1] = PRG_ROM_LOCATION >> 8;
+
+	if (!nes_apu_set_simd (1))
+	{
+		printf ("mix: the CPU has no AVX2, nothing to compare\n");
+		return 0;
+	}
+
+	float* simd = malloc (MAX_SAMPLES * sizeof (float));
+	float* scalar = malloc (MAX_SAMPLES * sizeof (float));
+	size_t n = play (simd);
+	nes_apu_set_simd (0);
+	size_t n_scalar = play (scalar);
+
+	if (n != n_scalar)
+	{
+		printf ("mix: %zu samples with AVX2 and %zu without\n", n, n_scalar);
+		return 1;
+	}
+	int sound = 0;
+	for (size_t i = 0; i < n; i ++)
+	{
+		if (simd[i] != scalar[i])
+		{
+			printf ("mix: sample %zu is %g with AVX2 and %g without\n", i, simd[i], scalar[i]);
+			return 1;
+		}
+		sound |= simd[i] != 0;
+	}
+	if (!sound)
+	{
+		printf ("mix: the program played no sound\n");
+		return 1;
+	}
+	printf ("mix: %zu samples mixed the same with and without AVX2\n", n);
+	free (simd);
+	free (scalar);
+	return 0;
+}
@@ -0,0 +1,277 @@
+/** -------------------------------------------------------------------------------------
+ *  File: nestest.c
+ *  Author: ximon
+ *  Description: Runs nestest headless in automation mode, starting at $C000, and compares each
+ *               instruction executed against the log of a real NES.
+ *
+ *  usage: nestest [rom.nes] [nestest.log]
+ *
+ *  PC, opcode, A/X/Y/P/SP and the dot and scanline of the PPU are compared line by line until
+ *  the first divergence, which is reported. The PPU does not start at the same position as in the
+ *  log so positions are compared relative to the first instruction, which also checks the number
+ *  of cycles each instruction takes.
+ ---------------------------------------------------------------------------------------- */
+#include <nes.h>
+#include <nes/cpu.h>
+#include <nes/trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_ROM "test/roms/nestest/nestest.nes"
+#define DEFAULT_LOG "test/roms/nestest/nestest.log"
+
+// automation mode starts here instead of at the reset vector
+#define AUTOMATION_START 0xC000
+
+// dots per frame of NTSC, which the log is made on, while rendering is off
+#define DOTS_PER_SCANLINE 341
+#define DOTS_PER_FRAME    (DOTS_PER_SCANLINE * 262)
+
+// the log should be done well before this
+#define MAX_FRAMES 8
+
+/**
+ *  expected is a line of the log.
+ */
+struct expected
+{
+	char line[128];
+	struct nes_trace_entry e;
+};
+
+/**
+ *  read_log reads the log at path into lines.
+ *  Returns the number of lines or -1 if it could not be read.
+ */
+static int read_log (const char* path, struct expected** lines)
+{
+	FILE* f = fopen (path, "r");
+	if (f == NULL)
+	{
+		perror (path);
+		return -1;
+	}
+
+	int n = 0, size = 0;
+	char line[128];
+	*lines = NULL;
+	while (fgets (line, sizeof (line), f) != NULL)
+	{
+		unsigned int pc, opcode, a, x, y, p, sp, dot;
+		int scanline;
+		const char* regs = strstr (line, "A:");
+
+		if (regs == NULL ||
+			sscanf (line, "%4x %2x", &pc, &opcode) != 2 ||
+			sscanf (regs, "A:%2x X:%2x Y:%2x P:%2x SP:%2x CYC:%u SL:%d",
+				&a, &x, &y, &p, &sp, &dot, &scanline) != 7)
+		{
+			fprintf (stderr, "%s:%d: could not parse line\n", path, n + 1);
+			fclose (f);
+			return -1;
+		}
+
+		if (n == size)
+		{
+			size = size ? size * 2 : 1024;
+			*lines = realloc (*lines, size * sizeof (struct expected));
+		}
+		struct expected* l = &(*lines)[n ++];
+		line[strcspn (line, "\r\n")] = 0;
+		strcpy (l->line, line);
+		l->e.pc = pc;
+		l->e.opcode = opcode;
+		l->e.a = a;
+		l->e.x = x;
+		l->e.y = y;
+		l->e.p = p;
+		l->e.sp = sp;
+		l->e.dot = dot;
+		l->e.scanline = scanline;
+	}
+	fclose (f);
+	return n;
+}
+
+/**
+ *  read_rom reads the iNES file at path and points its reset vector at AUTOMATION_START.
+ *  Returns NULL if it could not be read.
+ */
+static uint8_t* read_rom (const char* path, size_t* size)
+{
+	FILE* f = fopen (path, "rb");
+	if (f == NULL)
+	{
+		perror (path);
+		return NULL;
+	}
+	fseek (f, 0, SEEK_END);
+	*size = ftell (f);
+	rewind (f);
+
+	uint8_t* rom = malloc (*size);
+	if (fread (rom, 1, *size, f) != *size || *size < 16 || memcmp (rom, "NES\x1A", 4) != 0)
+	{
+		fprintf (stderr, "%s: not an iNES file\n", path);
+		free (rom);
+		fclose (f);
+		return NULL;
+	}
+	fclose (f);
+
+	// the vectors are at the end of the last bank of PRG ROM, after the trainer if there is one
+	size_t vectors = 16 + (rom[6] & 0x04 ? 512 : 0) + rom[4] * 0x4000 - 6;
+	if (vectors + 6 > *size)
+	{
+		fprintf (stderr, "%s: PRG ROM is truncated\n", path);
+		free (rom);
+		return NULL;
+	}
+	rom[vectors + 2] = AUTOMATION_START & 0xFF;
+	rom[vectors + 3] = AUTOMATION_START >> 8;
+	return rom;
+}
+
+/**
+ *  read_trace reads the trace of the instructions executed so far.
+ *  Returns the number of entries or -1 if it could not be dumped.
+ */
+static int read_trace (struct nes_trace_entry** entries)
+{
+	struct nes_trace_header header;
+	FILE* f = tmpfile ();
+	if (f == NULL || nes_trace_dump (fileno (f)) != 0)
+	{
+		perror ("nes_trace_dump");
+		return -1;
+	}
+	rewind (f);
+	if (fread (&header, sizeof (header), 1, f) != 1)
+	{
+		fclose (f);
+		return -1;
+	}
+	*entries = realloc (*entries, header.entries * sizeof (struct nes_trace_entry));
+	int n = fread (*entries, sizeof (struct nes_trace_entry), header.entries, f);
+	fclose (f);
+	return n;
+}
+
+/* position returns the dot of the frame the PPU is at */
+static int position (const struct nes_trace_entry* e)
+{
+	int scanline = e->scanline < 0 ? 261 : e->scanline;
+	return scanline * DOTS_PER_SCANLINE + e->dot;
+}
+
+/**
+ *  compare compares the trace to the log and reports the first divergence.
+ *  Returns non-zero if they diverge.
+ */
+static int compare (const struct nes_trace_entry* trace, const struct expected* log, int lines)
+{
+	int start = position (&trace[0]), log_start = position (&log[0].e);
+
+	for (int i = 0; i < lines; i ++)
+	{
+		const struct nes_trace_entry* got = &trace[i];
+		const struct nes_trace_entry* want = &log[i].e;
+
+		// move the position of the PPU into the frame of the log
+		int pos = ((position (got) - start + log_start) % DOTS_PER_FRAME + DOTS_PER_FRAME) % DOTS_PER_FRAME;
+		int dot = pos % DOTS_PER_SCANLINE, scanline = pos / DOTS_PER_SCANLINE;
+		if (scanline == 261)
+			scanline = -1;
+
+		const char* field = NULL;
+		if (got->pc != want->pc)
+			field = "PC";
+		else if (got->opcode != want->opcode)
+			field = "opcode";
+		else if (got->a != want->a)
+			field = "A";
+		else if (got->x != want->x)
+			field = "X";
+		else if (got->y != want->y)
+			field = "Y";
+		else if (got->p != want->p)
+			field = "P";
+		else if (got->sp != want->sp)
+			field = "SP";
+		else if (dot != want->dot || scanline != want->scanline)
+			field = "CYC/SL";
+
+		if (field != NULL)
+		{
+			printf ("nestest: %s diverges at line %d\n", field, i + 1);
+			if (i > 0)
+				printf ("  previous: %s\n", log[i - 1].line);
+			printf ("  expected: %s\n", log[i].line);
+			printf ("  got:      %04X  %02X%-29sA:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%3d SL:%d\n",
+				got->pc, got->opcode, "", got->a, got->x, got->y, got->p, got->sp, dot, scanline);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main (int argc, char** argv)
+{
+	const char* rom_path = argc > 1 ? argv[1] : DEFAULT_ROM;
+	const char* log_path = argc > 2 ? argv[2] : DEFAULT_LOG;
+
+	struct expected* log;
+	int lines = read_log (log_path, &log);
+	if (lines <= 0)
+		return 1;
+
+	size_t size;
+	uint8_t* rom = read_rom (rom_path, &size);
+	if (rom == NULL)
+		return 1;
+	if (nes_start_from_memory (rom, size) != 0)
+	{
+		fprintf (stderr, "%s: could not load game\n", rom_path);
+		return 1;
+	}
+
+	// every instruction needs to be executed to be traced
+	nes_cpu_set_idle_skip (0);
+	nes_trace_set_enabled (1);
+
+	struct nes_trace_entry* trace = NULL;
+	int traced = 0;
+	for (int frame = 0; frame < MAX_FRAMES && traced < lines; frame ++)
+	{
+		nes_step_frame ();
+		traced = read_trace (&trace);
+		if (traced < 0)
+			return 1;
+	}
+	if (traced < lines)
+	{
+		printf ("nestest: only %d of %d instructions were executed\n", traced, lines);
+		return 1;
+	}
+
+	int ret = compare (trace, log, lines);
+	if (ret == 0)
+	{
+		// nestest leaves the code of the first failed test at $02 and $03
+		uint8_t official = nes_cpu_read_ram (0x02), unofficial = nes_cpu_read_ram (0x03);
+		if (official != 0 || unofficial != 0)
+		{
+			printf ("nestest: tests failed with codes %02X %02X\n", official, unofficial);
+			ret = 1;
+		}
+		else
+			printf ("nestest: %d instructions match %s\n", lines, log_path);
+	}
+
+	nes_stop ();
+	free (trace);
+	free (log);
+	free (rom);
+	return ret;
+}
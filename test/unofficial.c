@@ -0,0 +1,157 @@
+/** -------------------------------------------------------------------------------------
+ *  File: unofficial.c
+ *  Author: ximon
+ *  Description: Runs the unstable unofficial opcodes and a JAM opcode headless, and checks what
+ *               they stored and that frames still complete while the CPU is jammed.
+ *
+ *  usage: unofficial
+ *
+ *  The program is assembled into an NROM image in memory. Unstable opcodes are checked through
+ *  the values they store, which also checks their sizes as the program falls apart otherwise.
+ *  XAA and LAX #i are run with A = $FF so the results do not depend on the console.
+ ---------------------------------------------------------------------------------------- */
+#include <nes.h>
+#include <nes/cpu.h>
+#include <nes/nes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define HEADER_SIZE  16
+#define PRG_ROM_SIZE 0x4000
+#define CHR_ROM_SIZE 0x2000
+
+// the 16KB of PRG ROM are mirrored at $8000 and $C000
+#define PRG_ROM_LOCATION 0xC000
+#define RESET_VECTOR     0xFFFC
+
+// NTSC CPU cycles per frame, rounded down
+#define CYCLES_PER_FRAME 29780
+#define FRAMES           3
+
+// a frame that does not complete is a failure
+#define TIMEOUT_SECONDS 10
+
+static const uint8_t program[] =
+{
+	0xA9, 0x00,       // LDA #$00
+	0x85, 0x20,       // STA $20
+	0xA9, 0x05,       // LDA #$05
+	0x85, 0x21,       // STA $21     ; ($20) = $0500
+	0xA9, 0xF6,       // LDA #$F6
+	0xA2, 0x3F,       // LDX #$3F
+	0xA0, 0x0D,       // LDY #$0D
+	0x9E, 0x00, 0x06, // SHX $0600,Y ; $060D = $3F & $07
+	0x9C, 0x00, 0x06, // SHY $0600,X ; $063F = $0D & $07
+	0x9F, 0x00, 0x04, // AHX $0400,Y ; $040D = $F6 & $3F & $05
+	0x93, 0x20,       // AHX ($20),Y ; $050D = $F6 & $3F & $06
+	0x9B, 0x00, 0x02, // TAS $0200,Y ; SP = $F6 & $3F, $020D = SP & $03
+	0xBB, 0x00, 0x02, // LAS $0200,Y ; A = X = SP = $020D & SP
+	0x85, 0x30,       // STA $30
+	0xBA,             // TSX
+	0x86, 0x31,       // STX $31
+	0xA9, 0xFF,       // LDA #$FF
+	0xA2, 0x5A,       // LDX #$5A
+	0x8B, 0xF3,       // XAA #$F3    ; A = $5A & $F3
+	0x85, 0x32,       // STA $32
+	0xA9, 0xFF,       // LDA #$FF
+	0xAB, 0xF0,       // LAX #$F0    ; A = X = $F0
+	0x86, 0x33,       // STX $33
+	0xE6, 0x10,       // INC $10     ; counts the runs up to the JAM
+	0x02,             // KIL
+	0xE6, 0x11,       // INC $11     ; never runs
+};
+
+/**
+ *  stored is a value the program leaves in RAM.
+ */
+struct stored
+{
+	uint16_t address;
+	uint8_t  value;
+};
+
+static const struct stored expected[] =
+{
+	{0x060D, 0x07}, {0x063F, 0x05}, {0x040D, 0x04}, {0x050D, 0x06}, {0x020D, 0x02},
+	{0x0030, 0x02}, {0x0031, 0x02}, {0x0032, 0x52}, {0x0033, 0xF0}, {0x0011, 0x00},
+};
+
+static uint8_t rom[HEADER_SIZE + PRG_ROM_SIZE + CHR_ROM_SIZE];
+
+static void timeout (int sig)
+{
+	static const char message[] = "unofficial: a frame did not complete with the CPU jammed\n";
+	write (STDERR_FILENO, message, sizeof (message) - 1);
+	_exit (1);
+}
+
+/* check returns the number of values the program left in RAM that are not as expected */
+static int check (int runs)
+{
+	int failed = 0;
+	for (size_t i = 0; i < sizeof (expected) / sizeof (expected[0]); i ++)
+	{
+		uint8_t value = nes_cpu_read_ram (expected[i].address);
+		if (value != expected[i].value)
+		{
+			printf ("unofficial: $%04X is $%02X instead of $%02X\n", expected[i].address, value, expected[i].value);
+			failed ++;
+		}
+	}
+	if (nes_cpu_read_ram (0x10) != runs)
+	{
+		printf ("unofficial: the program ran to the JAM %d times instead of %d\n", nes_cpu_read_ram (0x10), runs);
+		failed ++;
+	}
+	return failed;
+}
+
+/* run_frames steps count frames and returns the number of CPU cycles they took */
+static uint64_t run_frames (int count)
+{
+	uint64_t start = nes_cycles ();
+	alarm (TIMEOUT_SECONDS);
+	for (int i = 0; i < count; i ++)
+		nes_step_frame ();
+	alarm (0);
+	return nes_cycles () - start;
+}
+
+int main (int argc, char** argv)
+{
+	memcpy (rom, "NES\x1A\x01\x01", 6);
+	uint8_t* prg = rom + HEADER_SIZE;
+	memcpy (prg, program, sizeof (program));
+	prg[RESET_VECTOR - PRG_ROM_LOCATION]     = PRG_ROM_LOCATION & 0xFF;
+	prg[RESET_VECTOR - PRG_ROM_LOCATION + 1] = PRG_ROM_LOCATION >> 8;
+
+	if (nes_start_from_memory (rom, sizeof (rom)) != 0)
+	{
+		fprintf (stderr, "unofficial: could not load the program\n");
+		return 1;
+	}
+	nes_audio_set_enabled (0);
+	signal (SIGALRM, timeout);
+
+	int failed = 0;
+	uint64_t cycles = run_frames (FRAMES);
+	if (cycles < FRAMES * CYCLES_PER_FRAME)
+	{
+		printf ("unofficial: %d frames took %lu cycles with the CPU jammed\n", FRAMES, (unsigned long) cycles);
+		failed ++;
+	}
+	failed += check (1);
+
+	// a reset gets the CPU out of the JAM
+	nes_reset ();
+	run_frames (1);
+	failed += check (2);
+
+	nes_stop ();
+	if (failed == 0)
+		printf ("unofficial: all values stored as expected, %d frames ran jammed\n", FRAMES);
+	return failed != 0;
+}
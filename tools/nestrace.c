@@ -0,0 +1,263 @@
+/** -------------------------------------------------------------------------------------
+ *  File: nestrace.c
+ *  Author: ximon
+ *  Description: Turns a dump of the instruction trace, made by nes_trace_dump, into text in the
+ *               format of nestest.log.
+ *
+ *  usage: nestrace [-p] [-r rom.nes] dump
+ *
+ *  The trace does not hold operands, they are read from the PRG ROM of the iNES file given with
+ *  -r which needs to be mapped without banking (32KB at most). Without it only the opcode is
+ *  printed. -p prints the PPU position and CPU cycle like the newer nestest.log
+ *  ("PPU:  0, 21 CYC:7") instead of the dot and scanline ("CYC: 21 SL:0").
+ ---------------------------------------------------------------------------------------- */
+#include <nes/trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ *  Addressing modes.
+ */
+enum mode
+{
+	IMP, ACC, IMM, ZP, ZPX, ZPY, ABS, ABX, ABY, IND, IZX, IZY, REL
+};
+
+/* operand_sizes are the number of operand bytes of each addressing mode */
+static const int operand_sizes[] = { 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 1, 1, 1 };
+
+/**
+ *  opcode is the mnemonic and addressing mode of an opcode.
+ *  Unofficial opcodes are marked with a '*' like in nestest.log.
+ */
+struct opcode
+{
+	const char* name;
+	enum mode   mode;
+};
+
+static const struct opcode opcodes[256] =
+{
+	// 0x0
+	{"BRK", IMP}, {"ORA", IZX}, {"*KIL", IMP}, {"*SLO", IZX}, {"*NOP", ZP},  {"ORA", ZP},  {"ASL", ZP},  {"*SLO", ZP},
+	{"PHP", IMP}, {"ORA", IMM}, {"ASL", ACC},  {"*ANC", IMM}, {"*NOP", ABS}, {"ORA", ABS}, {"ASL", ABS}, {"*SLO", ABS},
+	// 0x1
+	{"BPL", REL}, {"ORA", IZY}, {"*KIL", IMP}, {"*SLO", IZY}, {"*NOP", ZPX}, {"ORA", ZPX}, {"ASL", ZPX}, {"*SLO", ZPX},
+	{"CLC", IMP}, {"ORA", ABY}, {"*NOP", IMP}, {"*SLO", ABY}, {"*NOP", ABX}, {"ORA", ABX}, {"ASL", ABX}, {"*SLO", ABX},
+	// 0x2
+	{"JSR", ABS}, {"AND", IZX}, {"*KIL", IMP}, {"*RLA", IZX}, {"BIT", ZP},   {"AND", ZP},  {"ROL", ZP},  {"*RLA", ZP},
+	{"PLP", IMP}, {"AND", IMM}, {"ROL", ACC},  {"*ANC", IMM}, {"BIT", ABS},  {"AND", ABS}, {"ROL", ABS}, {"*RLA", ABS},
+	// 0x3
+	{"BMI", REL}, {"AND", IZY}, {"*KIL", IMP}, {"*RLA", IZY}, {"*NOP", ZPX}, {"AND", ZPX}, {"ROL", ZPX}, {"*RLA", ZPX},
+	{"SEC", IMP}, {"AND", ABY}, {"*NOP", IMP}, {"*RLA", ABY}, {"*NOP", ABX}, {"AND", ABX}, {"ROL", ABX}, {"*RLA", ABX},
+	// 0x4
+	{"RTI", IMP}, {"EOR", IZX}, {"*KIL", IMP}, {"*SRE", IZX}, {"*NOP", ZP},  {"EOR", ZP},  {"LSR", ZP},  {"*SRE", ZP},
+	{"PHA", IMP}, {"EOR", IMM}, {"LSR", ACC},  {"*ALR", IMM}, {"JMP", ABS},  {"EOR", ABS}, {"LSR", ABS}, {"*SRE", ABS},
+	// 0x5
+	{"BVC", REL}, {"EOR", IZY}, {"*KIL", IMP}, {"*SRE", IZY}, {"*NOP", ZPX}, {"EOR", ZPX}, {"LSR", ZPX}, {"*SRE", ZPX},
+	{"CLI", IMP}, {"EOR", ABY}, {"*NOP", IMP}, {"*SRE", ABY}, {"*NOP", ABX}, {"EOR", ABX}, {"LSR", ABX}, {"*SRE", ABX},
+	// 0x6
+	{"RTS", IMP}, {"ADC", IZX}, {"*KIL", IMP}, {"*RRA", IZX}, {"*NOP", ZP},  {"ADC", ZP},  {"ROR", ZP},  {"*RRA", ZP},
+	{"PLA", IMP}, {"ADC", IMM}, {"ROR", ACC},  {"*ARR", IMM}, {"JMP", IND},  {"ADC", ABS}, {"ROR", ABS}, {"*RRA", ABS},
+	// 0x7
+	{"BVS", REL}, {"ADC", IZY}, {"*KIL", IMP}, {"*RRA", IZY}, {"*NOP", ZPX}, {"ADC", ZPX}, {"ROR", ZPX}, {"*RRA", ZPX},
+	{"SEI", IMP}, {"ADC", ABY}, {"*NOP", IMP}, {"*RRA", ABY}, {"*NOP", ABX}, {"ADC", ABX}, {"ROR", ABX}, {"*RRA", ABX},
+	// 0x8
+	{"*NOP", IMM}, {"STA", IZX}, {"*NOP", IMM}, {"*SAX", IZX}, {"STY", ZP},  {"STA", ZP},  {"STX", ZP},  {"*SAX", ZP},
+	{"DEY", IMP},  {"*NOP", IMM}, {"TXA", IMP}, {"*XAA", IMM}, {"STY", ABS}, {"STA", ABS}, {"STX", ABS}, {"*SAX", ABS},
+	// 0x9
+	{"BCC", REL}, {"STA", IZY}, {"*KIL", IMP}, {"*AHX", IZY}, {"STY", ZPX},  {"STA", ZPX}, {"STX", ZPY}, {"*SAX", ZPY},
+	{"TYA", IMP}, {"STA", ABY}, {"TXS", IMP},  {"*TAS", ABY}, {"*SHY", ABX}, {"STA", ABX}, {"*SHX", ABY}, {"*AHX", ABY},
+	// 0xa
+	{"LDY", IMM}, {"LDA", IZX}, {"LDX", IMM},  {"*LAX", IZX}, {"LDY", ZP},   {"LDA", ZP},  {"LDX", ZP},  {"*LAX", ZP},
+	{"TAY", IMP}, {"LDA", IMM}, {"TAX", IMP},  {"*LAX", IMM}, {"LDY", ABS},  {"LDA", ABS}, {"LDX", ABS}, {"*LAX", ABS},
+	// 0xb
+	{"BCS", REL}, {"LDA", IZY}, {"*KIL", IMP}, {"*LAX", IZY}, {"LDY", ZPX},  {"LDA", ZPX}, {"LDX", ZPY}, {"*LAX", ZPY},
+	{"CLV", IMP}, {"LDA", ABY}, {"TSX", IMP},  {"*LAS", ABY}, {"LDY", ABX},  {"LDA", ABX}, {"LDX", ABY}, {"*LAX", ABY},
+	// 0xc
+	{"CPY", IMM}, {"CMP", IZX}, {"*NOP", IMM}, {"*DCP", IZX}, {"CPY", ZP},   {"CMP", ZP},  {"DEC", ZP},  {"*DCP", ZP},
+	{"INY", IMP}, {"CMP", IMM}, {"DEX", IMP},  {"*AXS", IMM}, {"CPY", ABS},  {"CMP", ABS}, {"DEC", ABS}, {"*DCP", ABS},
+	// 0xd
+	{"BNE", REL}, {"CMP", IZY}, {"*KIL", IMP}, {"*DCP", IZY}, {"*NOP", ZPX}, {"CMP", ZPX}, {"DEC", ZPX}, {"*DCP", ZPX},
+	{"CLD", IMP}, {"CMP", ABY}, {"*NOP", IMP}, {"*DCP", ABY}, {"*NOP", ABX}, {"CMP", ABX}, {"DEC", ABX}, {"*DCP", ABX},
+	// 0xe
+	{"CPX", IMM}, {"SBC", IZX}, {"*NOP", IMM}, {"*ISB", IZX}, {"CPX", ZP},   {"SBC", ZP},  {"INC", ZP},  {"*ISB", ZP},
+	{"INX", IMP}, {"SBC", IMM}, {"NOP", IMP},  {"*SBC", IMM}, {"CPX", ABS},  {"SBC", ABS}, {"INC", ABS}, {"*ISB", ABS},
+	// 0xf
+	{"BEQ", REL}, {"SBC", IZY}, {"*KIL", IMP}, {"*ISB", IZY}, {"*NOP", ZPX}, {"SBC", ZPX}, {"INC", ZPX}, {"*ISB", ZPX},
+	{"SED", IMP}, {"SBC", ABY}, {"*NOP", IMP}, {"*ISB", ABY}, {"*NOP", ABX}, {"SBC", ABX}, {"INC", ABX}, {"*ISB", ABX},
+};
+
+/* PRG ROM of the game, if one was given */
+static uint8_t* prg_rom;
+static size_t   prg_rom_size;
+
+/**
+ *  load_rom loads the PRG ROM of the iNES file at path.
+ *  Returns non-zero if it could not be read or is larger than 32KB.
+ */
+static int load_rom (const char* path)
+{
+	uint8_t header[16];
+	FILE* f = fopen (path, "rb");
+	if (f == NULL)
+	{
+		perror (path);
+		return 1;
+	}
+	if (fread (header, 1, sizeof (header), f) != sizeof (header) || memcmp (header, "NES\x1A", 4) != 0)
+	{
+		fprintf (stderr, "%s: not an iNES file\n", path);
+		fclose (f);
+		return 1;
+	}
+	prg_rom_size = header[4] * 0x4000;
+	if (prg_rom_size == 0 || prg_rom_size > 0x8000)
+	{
+		fprintf (stderr, "%s: only PRG ROM of 16KB or 32KB is supported\n", path);
+		fclose (f);
+		return 1;
+	}
+	if (header[6] & 0x04)
+		fseek (f, 512, SEEK_CUR); // skip trainer
+
+	prg_rom = malloc (prg_rom_size);
+	if (fread (prg_rom, 1, prg_rom_size, f) != prg_rom_size)
+	{
+		fprintf (stderr, "%s: could not read PRG ROM\n", path);
+		fclose (f);
+		return 1;
+	}
+	fclose (f);
+	return 0;
+}
+
+/**
+ *  operand_bytes sets the operand of the instruction @ pc from PRG ROM.
+ *  Returns non-zero if they are not known.
+ */
+static int operand_bytes (uint16_t pc, int size, uint8_t* bytes)
+{
+	for (int i = 0; i < size; i ++)
+	{
+		uint16_t address = pc + 1 + i;
+		if (prg_rom == NULL || address < 0x8000)
+			return 1;
+		bytes[i] = prg_rom[(address - 0x8000) % prg_rom_size];
+	}
+	return 0;
+}
+
+/**
+ *  disassemble writes the bytes and the instruction of entry e to bytes and instr.
+ */
+static void disassemble (const struct nes_trace_entry* e, char* bytes, char* instr)
+{
+	const struct opcode* op = &opcodes[e->opcode];
+	int size = operand_sizes[op->mode];
+	uint8_t operand[2] = {0};
+	uint16_t word;
+
+	if (operand_bytes (e->pc, size, operand) != 0)
+	{
+		sprintf (bytes, "%02X", e->opcode);
+		sprintf (instr, "%s", op->name);
+		return;
+	}
+
+	if (size == 0)
+		sprintf (bytes, "%02X", e->opcode);
+	else if (size == 1)
+		sprintf (bytes, "%02X %02X", e->opcode, operand[0]);
+	else
+		sprintf (bytes, "%02X %02X %02X", e->opcode, operand[0], operand[1]);
+
+	word = operand[0] | operand[1] << 8;
+	switch (op->mode)
+	{
+		case IMP: sprintf (instr, "%s", op->name); break;
+		case ACC: sprintf (instr, "%s A", op->name); break;
+		case IMM: sprintf (instr, "%s #$%02X", op->name, operand[0]); break;
+		case ZP:  sprintf (instr, "%s $%02X", op->name, operand[0]); break;
+		case ZPX: sprintf (instr, "%s $%02X,X", op->name, operand[0]); break;
+		case ZPY: sprintf (instr, "%s $%02X,Y", op->name, operand[0]); break;
+		case ABS: sprintf (instr, "%s $%04X", op->name, word); break;
+		case ABX: sprintf (instr, "%s $%04X,X", op->name, word); break;
+		case ABY: sprintf (instr, "%s $%04X,Y", op->name, word); break;
+		case IND: sprintf (instr, "%s ($%04X)", op->name, word); break;
+		case IZX: sprintf (instr, "%s ($%02X,X)", op->name, operand[0]); break;
+		case IZY: sprintf (instr, "%s ($%02X),Y", op->name, operand[0]); break;
+		case REL: sprintf (instr, "%s $%04X", op->name, (uint16_t) (e->pc + 2 + (int8_t) operand[0])); break;
+	}
+}
+
+static void usage ()
+{
+	fprintf (stderr, "usage: nestrace [-p] [-r rom.nes] dump\n");
+}
+
+int main (int argc, char** argv)
+{
+	int ppu_format = 0, c;
+	while ((c = getopt (argc, argv, "pr:")) != -1)
+	{
+		switch (c)
+		{
+			case 'p':
+				ppu_format = 1;
+				break;
+
+			case 'r':
+				if (load_rom (optarg) != 0)
+					return 1;
+				break;
+
+			default:
+				usage ();
+				return 1;
+		}
+	}
+	if (optind != argc - 1)
+	{
+		usage ();
+		return 1;
+	}
+
+	FILE* f = fopen (argv[optind], "rb");
+	if (f == NULL)
+	{
+		perror (argv[optind]);
+		return 1;
+	}
+
+	struct nes_trace_header header;
+	if (fread (&header, sizeof (header), 1, f) != 1 ||
+		memcmp (header.magic, NES_TRACE_MAGIC, sizeof (header.magic)) != 0 ||
+		header.version != NES_TRACE_VERSION)
+	{
+		fprintf (stderr, "%s: not a trace dump\n", argv[optind]);
+		fclose (f);
+		return 1;
+	}
+
+	struct nes_trace_entry e;
+	char bytes[16], instr[64];
+	for (uint32_t i = 0; i < header.entries && fread (&e, sizeof (e), 1, f) == 1; i ++)
+	{
+		disassemble (&e, bytes, instr);
+		// unofficial opcodes have their '*' in the column before the instruction
+		printf ("%04X  %-8s %c%-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X ",
+			e.pc, bytes, instr[0] == '*' ? '*' : ' ', instr + (instr[0] == '*'),
+			e.a, e.x, e.y, e.p, e.sp);
+		if (ppu_format)
+			printf ("PPU:%3d,%3d CYC:%u\n", e.scanline, e.dot, e.cycle);
+		else
+			printf ("CYC:%3d SL:%d\n", e.dot, e.scanline);
+	}
+
+	fclose (f);
+	free (prg_rom);
+	return 0;
+}